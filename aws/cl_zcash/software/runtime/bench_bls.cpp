@@ -0,0 +1,237 @@
+//
+//  ZCash FPGA BLS signature batch verification benchmark.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <memory>
+#include <vector>
+#include <time.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <fpga_pci.h>
+#include <fpga_mgmt.h>
+#include <utils/lcd.h>
+#include <utils/sh_dpi_tasks.h>
+
+#include <openssl/rand.h>
+
+#include "zcash_bls12_381_cpu.hpp"
+#include "zcash_fpga.hpp"
+#include "zcash_fpga_bls12_381.hpp"
+#include "zcash_fpga_bls_batch.hpp"
+#include "zcash_fpga_pairing.hpp"
+#include "zcash_fpga_programs.hpp"
+#include "zcash_fpga_sim.hpp"
+
+#define DEFAULT_ITER 32
+
+// Data slots of the per signature pairing check, the batch routine goes after them
+#define PAIRING_SLOT 0
+#define BATCH_SLOT 64
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Random non zero scalar below the group order (the top bits stay clear)
+static int rand_scalar(bls12_381_scalar_t& k) {
+    memset(k.dat, 0, sizeof(k.dat));
+    if (RAND_bytes(k.dat[0], 31) != 1) return 1;
+    k.dat[0][0] |= 1;
+    return 0;
+}
+
+/*
+ * Signatures sk * H(m) under their own keys, with H(m) a random multiple of the G2
+ * generator standing in for a hash to G2
+ */
+static int make_fixtures(const zcash_bls12_381_cpu& cpu, unsigned int n, std::vector<zcash_fpga_bls_batch::sig_t>& sigs) {
+    sigs.resize(n);
+    for (unsigned int i = 0; i < n; i++) {
+        bls12_381_scalar_t sk, h;
+        if (rand_scalar(sk) != 0 || rand_scalar(h) != 0) {
+            printf("ERROR: Unable to make the signatures\n");
+            return 1;
+        }
+        cpu.point_mult(sk, zcash_bls12_381_cpu::g1_generator(), sigs[i].pk);
+        cpu.point_mult(h, zcash_bls12_381_cpu::g2_generator(), sigs[i].hm);
+        cpu.point_mult(sk, sigs[i].hm, sigs[i].sig);
+    }
+    return 0;
+}
+
+/*
+ * The CPU baseline: e(pk, H(m)) * e(-g1, sig) == 1 with two Miller loops and one final
+ * exponentiation per signature
+ */
+static bool cpu_verify(const zcash_bls12_381_cpu& cpu, const bls12_381_g1_af_t& neg_g1,
+                       const zcash_fpga_bls_batch::sig_t& s) {
+    bls12_381_fe12_t f, m;
+    cpu.miller_loop(s.pk, s.hm, f);
+    cpu.miller_loop(neg_g1, s.sig, m);
+    cpu.fe12_mul(f, m, f);
+    cpu.final_exp(f, f);
+    return zcash_bls12_381_cpu::fe12_is_one(f);
+}
+
+static void report(const char* name, unsigned int n, uint64_t ns) {
+    printf("INFO: %-10s %u signatures in %.3f ms, %.1f signatures/s\n", name, n, ns / 1e6, n * 1e9 / ns);
+}
+
+// Signatures per second on the CPU, 0 if a valid signature failed or the bad one passed
+static double run_cpu(const zcash_bls12_381_cpu& cpu, const std::vector<zcash_fpga_bls_batch::sig_t>& sigs,
+                      const zcash_fpga_bls_batch::sig_t& bad) {
+    bls12_381_g1_af_t neg_g1 = zcash_bls12_381_cpu::g1_generator();
+    zcash_bls12_381_cpu::g1_neg(neg_g1);
+
+    uint64_t t0 = now_ns();
+    for (unsigned int i = 0; i < sigs.size(); i++) {
+        if (!cpu_verify(cpu, neg_g1, sigs[i])) {
+            printf("ERROR: cpu rejected valid signature %u\n", i);
+            return 0;
+        }
+    }
+    uint64_t ns = now_ns() - t0;
+    if (cpu_verify(cpu, neg_g1, bad)) {
+        printf("ERROR: cpu accepted the signature under the wrong key\n");
+        return 0;
+    }
+    report("cpu", sigs.size(), ns);
+    return sigs.size() * 1e9 / ns;
+}
+
+// Signatures per second with one two pair pairing_check per signature on the FPGA
+static double run_single(zcash_fpga_pairing& mp, const std::vector<zcash_fpga_bls_batch::sig_t>& sigs) {
+    bls12_381_g1_af_t p[2];
+    bls12_381_g2_af_t q[2];
+    p[1] = zcash_bls12_381_cpu::g1_generator();
+    zcash_bls12_381_cpu::g1_neg(p[1]);
+
+    uint64_t t0 = now_ns();
+    for (unsigned int i = 0; i < sigs.size(); i++) {
+        bool one;
+        p[0] = sigs[i].pk;
+        q[0] = sigs[i].hm;
+        q[1] = sigs[i].sig;
+        if (mp.pairing_check(p, q, 2, one) != 0 || !one) {
+            printf("ERROR: pairing check of signature %u failed\n", i);
+            return 0;
+        }
+    }
+    uint64_t ns = now_ns() - t0;
+    report("single", sigs.size(), ns);
+    return sigs.size() * 1e9 / ns;
+}
+
+// Signatures per second checking the signatures in batches of batch, 0 if a batch failed
+static double run(zcash_fpga_bls_batch& bls, const std::vector<zcash_fpga_bls_batch::sig_t>& sigs,
+                  unsigned int batch, const char* name) {
+    uint64_t t0 = now_ns();
+    for (unsigned int i = 0; i < sigs.size(); i += batch) {
+        bool ok;
+        unsigned int n = sigs.size() - i < batch ? sigs.size() - i : batch;
+        if (bls.check(&sigs[i], n, ok) != 0 || !ok) {
+            printf("ERROR: %s check of signatures %u to %u failed\n", name, i, i + n - 1);
+            return 0;
+        }
+    }
+    uint64_t ns = now_ns() - t0;
+    report(name, sigs.size(), ns);
+    return sigs.size() * 1e9 / ns;
+}
+
+// verify() has to find exactly the signature that was changed
+static int run_bisect(zcash_fpga_bls_batch& bls, std::vector<zcash_fpga_bls_batch::sig_t> sigs,
+                      const zcash_fpga_bls_batch::sig_t& bad, unsigned int bad_index) {
+    std::vector<bool> valid;
+    sigs[bad_index] = bad;
+    if (bls.verify(sigs.data(), sigs.size(), valid) != 0) {
+        printf("ERROR: verify failed\n");
+        return 1;
+    }
+    for (unsigned int i = 0; i < sigs.size(); i++) {
+        if (valid[i] != (i != bad_index)) {
+            printf("ERROR: verify marked signature %u %s\n", i, valid[i] ? "valid" : "invalid");
+            return 1;
+        }
+    }
+    printf("INFO: verify found the changed signature %u of %lu\n", bad_index, (unsigned long)sigs.size());
+    return 0;
+}
+
+int main(int argc, char **argv) {
+
+    unsigned int iter = DEFAULT_ITER;
+    if ((argc > 1 && (sscanf(argv[1], "%u", &iter) != 1 || iter < 2)) ||
+        (argc > 2 && strcmp(argv[2], "sim") != 0 && strcmp(argv[2], "fpga") != 0)) {
+        printf("usage: %s [signatures >= 2] [sim | fpga]\n", argv[0]);
+        return 1;
+    }
+
+    std::unique_ptr<zcash_fpga> sim;
+    if (argc > 2 && strcmp(argv[2], "sim") == 0)
+        sim.reset(new zcash_fpga(new zcash_fpga_sim(zcash_fpga::ENB_BLS12_381)));
+    zcash_fpga& zfpga = sim ? *sim : zcash_fpga::get_instance();
+
+    if ((zfpga.m_command_cap & zcash_fpga::ENB_BLS12_381) == 0) {
+        printf("ERROR: FPGA was not built with ENB_BLS12_381\n");
+        return 1;
+    }
+
+    // Valid signatures, and one signed with the key of its neighbour
+    zcash_bls12_381_cpu cpu;
+    std::vector<zcash_fpga_bls_batch::sig_t> sigs;
+    if (make_fixtures(cpu, iter, sigs) != 0) return 1;
+    zcash_fpga_bls_batch::sig_t bad = sigs[iter / 2];
+    bad.sig = sigs[iter / 2 - 1].sig;
+
+    double base = run_cpu(cpu, sigs, bad);
+    if (base == 0) return 1;
+
+    // The two pair routine first, the batch routine takes the rest of the instruction memory
+    zcash_fpga_programs progs(zfpga);
+    zcash_fpga_pairing mp(zfpga, progs, PAIRING_SLOT, BATCH_SLOT, 2);
+    zcash_fpga_bls_batch bls(zfpga, progs, BATCH_SLOT);
+    if (mp.get_max_pairs() != 2 || bls.get_max_items() == 0) return 1;
+    printf("INFO: %u signatures per chunk\n", bls.get_max_items());
+
+    double single = run_single(mp, sigs);
+    double batch = run(bls, sigs, bls.get_max_items(), "chunk");
+    double all = run(bls, sigs, iter, "batch");
+    if (single == 0 || batch == 0 || all == 0) return 1;
+    if (run_bisect(bls, sigs, bad, iter / 2) != 0) return 1;
+
+    if (sim)
+        printf("INFO: the simulator computes each instruction on the CPU, only an FPGA measures the ratios\n");
+    printf("INFO: batch is %.2fx per signature pairing checks on the FPGA\n", all / single);
+    printf("INFO: batch is %.2fx the CPU reference (zcash_bls12_381_cpu) at %.1f signatures/s\n", all / base, base);
+
+    zcash_fpga_bls_batch::stats_t stats = bls.get_stats();
+    printf("INFO: %lu checks, %lu signatures weighted on the FPGA\n", (unsigned long)stats.checks,
+           (unsigned long)stats.items);
+    return 0;
+}
@@ -0,0 +1,254 @@
+//
+//  ZCash FPGA Equihash benchmark, CPU against FPGA.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <memory>
+#include <vector>
+#include <time.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <fpga_pci.h>
+#include <fpga_mgmt.h>
+#include <utils/lcd.h>
+#include <utils/sh_dpi_tasks.h>
+
+#include "zcash_fpga.hpp"
+#include "zcash_equihash_cpu.hpp"
+#include "zcash_equihash_stream.hpp"
+#include "zcash_fpga_loopback.hpp"
+#include "zcash_fpga_sim.hpp"
+
+#define DEFAULT_ITER 1000
+
+// The makefile passes the absolute path, the third argument overrides it
+#ifndef EQUIHASH_DATA_DIR
+#define EQUIHASH_DATA_DIR "../../../../zcash_fpga/src/data/"
+#endif
+
+typedef zcash_equihash_cpu<200,9> equihash_200_9;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool read_block(const char* dir, const char* name, zcash_fpga::cblockheader_sol_t& block) {
+    std::string path = std::string(dir) + "/" + name;
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == NULL) {
+        printf("ERROR: Unable to open %s\n", path.c_str());
+        return false;
+    }
+    size_t len = fread(&block, 1, sizeof(block), fp);
+    fclose(fp);
+    if (len != sizeof(block)) {
+        printf("ERROR: %s is only %lu bytes\n", path.c_str(), (unsigned long)len);
+        return false;
+    }
+    return true;
+}
+
+static void report(const char* name, unsigned int iter, uint64_t ns) {
+    printf("INFO: %-10s %u headers in %.3f ms, %.0f headers/s, %.2f us/header\n", name, iter, ns / 1e6,
+           iter * 1e9 / ns, ns / 1e3 / iter);
+}
+
+// blocks alternates a valid and an invalid header, expect[] is their mask
+static int check(const char* name, const uint8_t* bm, unsigned int iter, const uint8_t expect[2]) {
+    for (unsigned int i = 0; i < iter; i++) {
+        if (bm[i] != expect[i & 1]) {
+            printf("ERROR: %s header %u bm = 0x%x, expected 0x%x\n", name, i, bm[i], expect[i & 1]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int run_cpu(const std::vector<zcash_fpga::cblockheader_sol_t>& blocks, const uint8_t expect[2]) {
+    equihash_200_9 equihash(1);
+    unsigned int iter = blocks.size();
+    std::vector<uint8_t> bm(iter);
+
+    uint64_t t0 = now_ns();
+    for (unsigned int i = 0; i < iter; i++)
+        bm[i] = equihash.verify((const uint8_t*)&blocks[i]);
+    report("cpu", iter, now_ns() - t0);
+    return check("cpu", bm.data(), iter, expect);
+}
+
+static int run_cpu_batch(const std::vector<zcash_fpga::cblockheader_sol_t>& blocks, const uint8_t expect[2]) {
+    equihash_200_9 equihash;
+    unsigned int iter = blocks.size();
+    std::vector<uint8_t> bm(iter);
+
+    uint64_t t0 = now_ns();
+    equihash.verify_batch((const uint8_t*)blocks.data(), iter, sizeof(zcash_fpga::cblockheader_sol_t), bm.data());
+    report("cpu batch", iter, now_ns() - t0);
+    return check("cpu batch", bm.data(), iter, expect);
+}
+
+static int run_fpga(zcash_fpga& zfpga, const std::vector<zcash_fpga::cblockheader_sol_t>& blocks,
+                    const uint8_t expect[2], bool check_bm) {
+    unsigned int iter = blocks.size();
+    std::vector<uint8_t> bm(iter);
+
+    uint64_t t0 = now_ns();
+    int rc = zfpga.verify_equihash_batch(blocks.data(), iter, 0, bm.data());
+    uint64_t ns = now_ns() - t0;
+    if (rc != (int)iter) {
+        printf("ERROR: verify_equihash_batch() returned %d of %u replies\n", rc, iter);
+        return 1;
+    }
+    report("fpga batch", iter, ns);
+    return check_bm ? check("fpga batch", bm.data(), iter, expect) : 0;
+}
+
+typedef struct {
+    uint64_t next;
+    const uint8_t* expect;
+    bool check_bm;
+    bool failed;
+} stream_ctx_t;
+
+static void stream_commit(void* ctx, uint64_t index, const zcash_fpga::cblockheader_sol_t& block, uint8_t bm) {
+    stream_ctx_t* s = (stream_ctx_t*)ctx;
+    (void)block;
+    if (index != s->next++ || (s->check_bm && bm != s->expect[index & 1])) {
+        if (!s->failed) printf("ERROR: header %lu committed out of order or with bm = 0x%x\n", (unsigned long)index, bm);
+        s->failed = true;
+    }
+}
+
+// Writes the headers as a block file of verify_equihash_t commands, 8 byte aligned
+static bool write_block_file(const char* path, const std::vector<zcash_fpga::cblockheader_sol_t>& blocks) {
+    zcash_fpga::verify_equihash_t cmd;
+    uint8_t pad[8] = {0};
+    unsigned int pad_len = ((sizeof(cmd) + 7) & ~7U) - sizeof(cmd);
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        printf("ERROR: Unable to create %s\n", path);
+        return false;
+    }
+    cmd.hdr.cmd = zcash_fpga::VERIFY_EQUIHASH;
+    cmd.hdr.len = sizeof(cmd);
+    for (unsigned int i = 0; i < blocks.size(); i++) {
+        cmd.index = i;
+        cmd.cblockheader_sol = blocks[i];
+        if (fwrite(&cmd, sizeof(cmd), 1, fp) != 1 || fwrite(pad, 1, pad_len, fp) != pad_len) {
+            printf("ERROR: Unable to write %s\n", path);
+            fclose(fp);
+            return false;
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+static int run_stream(zcash_fpga* zfpga, int cpu_threads, const char* path, const uint8_t expect[2], bool check_bm,
+                      const char* name) {
+    zcash_equihash_stream stream(zfpga, cpu_threads);
+    stream_ctx_t ctx = {0, expect, check_bm, false};
+
+    if (stream.add_file(path) != 0) return 1;
+    if (stream.run(stream_commit, &ctx) != 0 || ctx.failed || ctx.next != stream.size()) {
+        printf("ERROR: %s committed %lu of %lu headers\n", name, (unsigned long)ctx.next, (unsigned long)stream.size());
+        return 1;
+    }
+
+    zcash_equihash_stream::stats_t stats = stream.get_stats();
+    report(name, stats.headers, stats.ns);
+    printf("INFO: %-10s %lu on the FPGA, %lu on the CPU, %lu invalid\n", name, (unsigned long)stats.fpga_headers,
+           (unsigned long)stats.cpu_headers, (unsigned long)stats.invalid);
+    if (stats.fpga_failed)
+        printf("WARNING: %-10s the FPGA failed, the remaining headers ran on the CPU\n", name);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+
+    unsigned int iter = DEFAULT_ITER;
+    if ((argc > 1 && (sscanf(argv[1], "%u", &iter) != 1 || iter == 0)) ||
+        (argc > 2 && strcmp(argv[2], "loopback") != 0 && strcmp(argv[2], "sim") != 0 && strcmp(argv[2], "cpu") != 0)) {
+        printf("usage: %s [iterations] [loopback | sim | cpu] [equihash-data-dir]\n", argv[0]);
+        return 1;
+    }
+
+    const char* data_dir = argc > 3 ? argv[3] : EQUIHASH_DATA_DIR;
+    zcash_fpga::cblockheader_sol_t block[2];
+    if (!read_block(data_dir, "block_346.bin", block[0]) || !read_block(data_dir, "block_346_errors.bin", block[1]))
+        return 1;
+
+    std::vector<zcash_fpga::cblockheader_sol_t> blocks(iter);
+    for (unsigned int i = 0; i < iter; i++)
+        blocks[i] = block[i & 1];
+
+    equihash_200_9 equihash(1);
+    uint8_t expect[2];
+    expect[0] = equihash.verify((const uint8_t*)&block[0]);
+    expect[1] = equihash.verify((const uint8_t*)&block[1]);
+    printf("INFO: kernel %s, block_346.bin bm = 0x%x, block_346_errors.bin bm = 0x%x\n",
+           equihash_200_9::kernel_name(), expect[0], expect[1]);
+    if (expect[0] != 0 || expect[1] == 0) {
+        printf("ERROR: CPU Equihash verifier does not match the FPGA testbench\n");
+        return 1;
+    }
+
+    char path[] = "/tmp/bench_equihash_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || (close(fd), !write_block_file(path, blocks))) {
+        printf("ERROR: Unable to write a block file\n");
+        return 1;
+    }
+
+    bool check_bm = !(argc > 2 && strcmp(argv[2], "loopback") == 0);
+    int rc = run_cpu(blocks, expect) != 0 || run_cpu_batch(blocks, expect) != 0 ||
+             run_stream(nullptr, -1, path, expect, true, "cpu stream") != 0;
+    if (rc != 0 || (argc > 2 && strcmp(argv[2], "cpu") == 0)) {
+        unlink(path);
+        return rc;
+    }
+
+    // The loopback transport passes every header so only the host side is measured
+    std::unique_ptr<zcash_fpga> local;
+    if (argc > 2 && strcmp(argv[2], "loopback") == 0)
+        local.reset(new zcash_fpga(new zcash_fpga_loopback(zcash_fpga::ENB_VERIFY_EQUIHASH_200_9)));
+    else if (argc > 2)
+        local.reset(new zcash_fpga(new zcash_fpga_sim(zcash_fpga::ENB_VERIFY_EQUIHASH_200_9)));
+    zcash_fpga& zfpga = local ? *local : zcash_fpga::get_instance();
+
+    if ((zfpga.m_command_cap & zcash_fpga::ENB_VERIFY_EQUIHASH_200_9) == 0) {
+        printf("ERROR: FPGA was not built with ENB_VERIFY_EQUIHASH_200_9\n");
+        rc = 1;
+    }
+    if (rc == 0)
+        rc = run_fpga(zfpga, blocks, expect, check_bm) != 0 ||
+             run_stream(&zfpga, 0, path, expect, check_bm, "fpga stream") != 0 ||
+             run_stream(&zfpga, -1, path, expect, check_bm, "stream") != 0;
+
+    unlink(path);
+    return rc;
+}
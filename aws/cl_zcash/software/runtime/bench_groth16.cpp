@@ -0,0 +1,273 @@
+//
+//  ZCash FPGA Groth16 batch verification benchmark.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <memory>
+#include <vector>
+#include <time.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <fpga_pci.h>
+#include <fpga_mgmt.h>
+#include <utils/lcd.h>
+#include <utils/sh_dpi_tasks.h>
+
+#include <openssl/bn.h>
+
+#include "zcash_bls12_381_cpu.hpp"
+#include "zcash_fpga.hpp"
+#include "zcash_fpga_bls12_381.hpp"
+#include "zcash_fpga_groth16.hpp"
+#include "zcash_fpga_programs.hpp"
+#include "zcash_fpga_sim.hpp"
+
+#define DEFAULT_ITER 32
+#define SAPLING_SPEND_INPUTS 7
+
+static const char* s_order = "73eda753299d7d483339d80809a1d80553bda402fffe5bfeffffffff00000001";
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void to_scalar(const BIGNUM* bn, bls12_381_scalar_t& s) {
+    memset(s.dat, 0, sizeof(s.dat));
+    BN_bn2lebinpad(bn, s.dat[0], 48);
+}
+
+/*
+ * A key and valid proofs without a circuit: with alpha = a * G1, beta = b * G2,
+ * gamma = g * G2, delta = d * G2 and IC_i = s_i * G1, the proof A = x * G1, B = y * G2,
+ * C = c * G1 verifies for c = (x * y - a * b - l * g) / d, l = s_0 + sum_i x_i * s_i.
+ */
+static int make_fixtures(const zcash_bls12_381_cpu& cpu, unsigned int n, zcash_fpga_groth16::vk_t& vk,
+                         std::vector<zcash_fpga_groth16::proof_t>& proofs) {
+    int rc = 1;
+    BN_CTX* ctx = BN_CTX_new();
+    BIGNUM *order = NULL, *a = BN_new(), *b = BN_new(), *g = BN_new(), *d = BN_new(), *d_inv = NULL;
+    BIGNUM *ab = BN_new(), *x = BN_new(), *y = BN_new(), *l = BN_new(), *t = BN_new();
+    std::vector<BIGNUM*> s(SAPLING_SPEND_INPUTS + 1);
+    bls12_381_scalar_t k;
+
+    for (unsigned int i = 0; i < s.size(); i++) s[i] = BN_new();
+    if (ctx == NULL || BN_hex2bn(&order, s_order) == 0) goto out;
+    // Random non zero scalars
+    for (BIGNUM* v : {a, b, g, d}) {
+        do { BN_rand_range(v, order); } while (BN_is_zero(v));
+    }
+    for (unsigned int i = 0; i < s.size(); i++) {
+        do { BN_rand_range(s[i], order); } while (BN_is_zero(s[i]));
+    }
+    d_inv = BN_mod_inverse(NULL, d, order, ctx);
+    if (d_inv == NULL || BN_mod_mul(ab, a, b, order, ctx) != 1) goto out;
+
+    to_scalar(a, k);
+    cpu.point_mult(k, zcash_bls12_381_cpu::g1_generator(), vk.alpha);
+    to_scalar(b, k);
+    cpu.point_mult(k, zcash_bls12_381_cpu::g2_generator(), vk.beta);
+    to_scalar(g, k);
+    cpu.point_mult(k, zcash_bls12_381_cpu::g2_generator(), vk.gamma);
+    to_scalar(d, k);
+    cpu.point_mult(k, zcash_bls12_381_cpu::g2_generator(), vk.delta);
+    vk.ic.resize(s.size());
+    for (unsigned int i = 0; i < s.size(); i++) {
+        to_scalar(s[i], k);
+        cpu.point_mult(k, zcash_bls12_381_cpu::g1_generator(), vk.ic[i]);
+    }
+
+    proofs.resize(n);
+    for (unsigned int j = 0; j < n; j++) {
+        zcash_fpga_groth16::proof_t& p = proofs[j];
+        p.inputs.resize(SAPLING_SPEND_INPUTS);
+        BN_copy(l, s[0]);
+        for (unsigned int i = 0; i < SAPLING_SPEND_INPUTS; i++) {
+            BN_rand_range(x, order);
+            to_scalar(x, p.inputs[i]);
+            BN_mod_mul(t, x, s[i + 1], order, ctx);
+            BN_mod_add(l, l, t, order, ctx);
+        }
+        do { BN_rand_range(x, order); } while (BN_is_zero(x));
+        do { BN_rand_range(y, order); } while (BN_is_zero(y));
+        to_scalar(x, k);
+        cpu.point_mult(k, zcash_bls12_381_cpu::g1_generator(), p.a);
+        to_scalar(y, k);
+        cpu.point_mult(k, zcash_bls12_381_cpu::g2_generator(), p.b);
+
+        BN_mod_mul(t, x, y, order, ctx);
+        BN_mod_sub(t, t, ab, order, ctx);
+        BN_mod_mul(l, l, g, order, ctx);
+        BN_mod_sub(t, t, l, order, ctx);
+        BN_mod_mul(t, t, d_inv, order, ctx);
+        to_scalar(t, k);
+        if (cpu.point_mult(k, zcash_bls12_381_cpu::g1_generator(), p.c) != 0) goto out;
+    }
+    rc = 0;
+
+  out:
+    if (rc != 0) printf("ERROR: Unable to make the proofs\n");
+    for (unsigned int i = 0; i < s.size(); i++) BN_free(s[i]);
+    for (BIGNUM* v : {order, a, b, g, d, d_inv, ab, x, y, l, t}) BN_free(v);
+    BN_CTX_free(ctx);
+    return rc;
+}
+
+/*
+ * The CPU baseline: e(A, B) * e(alpha, -beta) * e(L, -gamma) * e(C, -delta) == 1 with
+ * four Miller loops and one final exponentiation. neg_vk has beta, gamma and delta
+ * negated, as a verifier would prepare them once per key.
+ */
+static bool cpu_verify(const zcash_bls12_381_cpu& cpu, const zcash_fpga_groth16::vk_t& neg_vk,
+                       const zcash_fpga_groth16::proof_t& p) {
+    bls12_381_g1_af_t l = neg_vk.ic[0], t;
+    bls12_381_fe12_t f, m;
+    for (unsigned int i = 0; i < p.inputs.size(); i++) {
+        cpu.point_mult(p.inputs[i], neg_vk.ic[i + 1], t);
+        cpu.point_add(l, t, l);
+    }
+    cpu.miller_loop(p.a, p.b, f);
+    cpu.miller_loop(neg_vk.alpha, neg_vk.beta, m);
+    cpu.fe12_mul(f, m, f);
+    cpu.miller_loop(l, neg_vk.gamma, m);
+    cpu.fe12_mul(f, m, f);
+    cpu.miller_loop(p.c, neg_vk.delta, m);
+    cpu.fe12_mul(f, m, f);
+    cpu.final_exp(f, f);
+    return zcash_bls12_381_cpu::fe12_is_one(f);
+}
+
+// Proofs per second on the CPU, 0 if a valid proof failed or the bad one passed
+static double run_cpu(const zcash_bls12_381_cpu& cpu, const zcash_fpga_groth16::vk_t& vk,
+                      const std::vector<zcash_fpga_groth16::proof_t>& proofs, const zcash_fpga_groth16::proof_t& bad) {
+    zcash_fpga_groth16::vk_t neg_vk = vk;
+    zcash_bls12_381_cpu::g2_neg(neg_vk.beta);
+    zcash_bls12_381_cpu::g2_neg(neg_vk.gamma);
+    zcash_bls12_381_cpu::g2_neg(neg_vk.delta);
+
+    uint64_t t0 = now_ns();
+    for (unsigned int j = 0; j < proofs.size(); j++) {
+        if (!cpu_verify(cpu, neg_vk, proofs[j])) {
+            printf("ERROR: cpu rejected valid proof %u\n", j);
+            return 0;
+        }
+    }
+    uint64_t ns = now_ns() - t0;
+    if (cpu_verify(cpu, neg_vk, bad)) {
+        printf("ERROR: cpu accepted the proof with a changed input\n");
+        return 0;
+    }
+    printf("INFO: %-10s %lu proofs in %.3f ms, %.1f proofs/s\n", "cpu", (unsigned long)proofs.size(), ns / 1e6,
+           proofs.size() * 1e9 / ns);
+    return proofs.size() * 1e9 / ns;
+}
+
+// Proofs per second checking the proofs in batches of batch, 0 if a batch failed
+static double run(zcash_fpga_groth16& groth16, const std::vector<zcash_fpga_groth16::proof_t>& proofs,
+                  unsigned int batch, const char* name) {
+    uint64_t t0 = now_ns();
+    for (unsigned int i = 0; i < proofs.size(); i += batch) {
+        bool ok;
+        unsigned int n = proofs.size() - i < batch ? proofs.size() - i : batch;
+        if (groth16.check(&proofs[i], n, ok) != 0 || !ok) {
+            printf("ERROR: %s check of proofs %u to %u failed\n", name, i, i + n - 1);
+            return 0;
+        }
+    }
+    uint64_t ns = now_ns() - t0;
+    printf("INFO: %-10s %lu proofs in %.3f ms, %.1f proofs/s\n", name, (unsigned long)proofs.size(), ns / 1e6,
+           proofs.size() * 1e9 / ns);
+    return proofs.size() * 1e9 / ns;
+}
+
+// verify() has to find exactly the proof that was changed
+static int run_bisect(zcash_fpga_groth16& groth16, std::vector<zcash_fpga_groth16::proof_t> proofs,
+                      const zcash_fpga_groth16::proof_t& bad, unsigned int bad_index) {
+    std::vector<bool> valid;
+    proofs[bad_index] = bad;
+    if (groth16.verify(proofs.data(), proofs.size(), valid) != 0) {
+        printf("ERROR: verify failed\n");
+        return 1;
+    }
+    for (unsigned int j = 0; j < proofs.size(); j++) {
+        if (valid[j] != (j != bad_index)) {
+            printf("ERROR: verify marked proof %u %s\n", j, valid[j] ? "valid" : "invalid");
+            return 1;
+        }
+    }
+    printf("INFO: verify found the changed proof %u of %lu\n", bad_index, (unsigned long)proofs.size());
+    return 0;
+}
+
+int main(int argc, char **argv) {
+
+    unsigned int iter = DEFAULT_ITER;
+    if ((argc > 1 && (sscanf(argv[1], "%u", &iter) != 1 || iter == 0)) ||
+        (argc > 2 && strcmp(argv[2], "sim") != 0 && strcmp(argv[2], "fpga") != 0)) {
+        printf("usage: %s [proofs] [sim | fpga]\n", argv[0]);
+        return 1;
+    }
+
+    std::unique_ptr<zcash_fpga> sim;
+    if (argc > 2 && strcmp(argv[2], "sim") == 0)
+        sim.reset(new zcash_fpga(new zcash_fpga_sim(zcash_fpga::ENB_BLS12_381)));
+    zcash_fpga& zfpga = sim ? *sim : zcash_fpga::get_instance();
+
+    if ((zfpga.m_command_cap & zcash_fpga::ENB_BLS12_381) == 0) {
+        printf("ERROR: FPGA was not built with ENB_BLS12_381\n");
+        return 1;
+    }
+
+    // A key and proofs shaped like Sapling spend proofs, and one proof for other inputs
+    zcash_bls12_381_cpu cpu;
+    zcash_fpga_groth16::vk_t vk;
+    std::vector<zcash_fpga_groth16::proof_t> proofs;
+    if (make_fixtures(cpu, iter, vk, proofs) != 0) return 1;
+    zcash_fpga_groth16::proof_t bad = proofs[iter / 2];
+    bad.inputs[0].dat[0][0] ^= 1;
+
+    double base = run_cpu(cpu, vk, proofs, bad);
+    if (base == 0) return 1;
+
+    zcash_fpga_programs progs(zfpga);
+    zcash_fpga_groth16 groth16(zfpga, progs, vk);
+    if (groth16.get_max_proofs() == 0) return 1;
+    printf("INFO: %u public inputs, %u proofs per chunk\n", SAPLING_SPEND_INPUTS, groth16.get_max_proofs());
+
+    double single = run(groth16, proofs, 1, "single");
+    double batch = run(groth16, proofs, groth16.get_max_proofs(), "chunk");
+    double all = run(groth16, proofs, iter, "batch");
+    if (single == 0 || batch == 0 || all == 0) return 1;
+    if (run_bisect(groth16, proofs, bad, iter / 2) != 0) return 1;
+
+    printf("INFO: batch is %.2fx single proofs\n", all / single);
+    printf("INFO: batch is %.2fx the CPU reference (zcash_bls12_381_cpu) at %.1f proofs/s\n", all / base, base);
+
+    zcash_fpga_groth16::stats_t stats = groth16.get_stats();
+    printf("INFO: %lu checks, verifying key written %lu times\n", (unsigned long)stats.checks,
+           (unsigned long)stats.vk_uploads);
+    return 0;
+}
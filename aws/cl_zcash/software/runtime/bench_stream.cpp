@@ -0,0 +1,343 @@
+//
+//  ZCash FPGA stream benchmark.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <time.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <fpga_pci.h>
+#include <fpga_mgmt.h>
+#include <utils/lcd.h>
+#include <utils/sh_dpi_tasks.h>
+
+#include "zcash_fpga.hpp"
+#include "zcash_fpga_async.hpp"
+#include "zcash_fpga_dispatch.hpp"
+#include "zcash_fpga_loopback.hpp"
+#include "zcash_fpga_sim.hpp"
+
+#define DEFAULT_ITER 1000
+
+bool string_to_hex(const std::string &inStr, unsigned char *outStr) {
+    size_t len = inStr.length();
+    for (ssize_t i = len-2; i >= 0; i -= 2) {
+        sscanf(inStr.c_str() + i, "%2hhx", outStr);
+        ++outStr;
+    }
+    return true;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Only the write call is timed, the reply is drained afterwards so the FIFO never fills
+static int run(zcash_fpga& zfpga, zcash_fpga::verify_secp256k1_sig_t& sig, unsigned int iter, bool burst, const char* name) {
+    uint8_t reply[256];
+    uint64_t write_ns = 0;
+    int rc;
+
+    for (unsigned int i = 0; i < iter; i++) {
+        sig.index = i;
+        uint64_t start = now_ns();
+        if (burst)
+          rc = zfpga.write_stream_burst((uint8_t*)&sig, sizeof(sig));
+        else
+          rc = zfpga.write_stream((uint8_t*)&sig, sizeof(sig));
+        write_ns += now_ns() - start;
+        if (rc != 0) {
+            printf("ERROR: %s write failed on iteration %d\n", name, i);
+            return 1;
+        }
+
+        if (zfpga.read_stream_wait(reply, 256, zcash_fpga::VERIFY_SECP256K1_SIG) <= 0) {
+            printf("ERROR: No reply received, timeout\n");
+            return 1;
+        }
+    }
+
+    double secs = write_ns / 1e9;
+    printf("RESULT: %-12s %8d commands, %10.1f ns/command, %12.1f commands/s, %8.2f MB/s\n",
+           name, iter, (double)write_ns / iter, iter / secs, (double)iter * sizeof(sig) / secs / 1e6);
+    return 0;
+}
+
+// One command at a time, the reply waited for with the default polling policy or, with
+// notify, blocking on the reply eventfd the loopback / simulator transport posts. Reports
+// the round trip and the CPU time of the waiting thread.
+static int run_wait(zcash_fpga& zfpga, zcash_fpga::verify_secp256k1_sig_t& sig, unsigned int iter, bool notify,
+                    const char* name) {
+    zcash_fpga::wait_policy_t policy = zfpga.get_wait_policy(zcash_fpga::VERIFY_SECP256K1_SIG);
+    zcash_fpga::wait_policy_t block = policy;
+    struct rusage ru[2];
+    uint8_t reply[256];
+    uint64_t start, cpu_us;
+    int rc = 0;
+
+    if (notify) {
+        if (zfpga.enable_reply_notify(zcash_fpga::NOTIFY_EVENTFD) != 0) return 1;
+        block.spin_us = 0;
+        zfpga.set_wait_policy(zcash_fpga::VERIFY_SECP256K1_SIG, block);
+    }
+
+    getrusage(RUSAGE_THREAD, &ru[0]);
+    start = now_ns();
+    for (unsigned int i = 0; i < iter && rc == 0; i++) {
+        sig.index = i;
+        if (zfpga.write_stream_burst((uint8_t*)&sig, sizeof(sig)) != 0 ||
+            zfpga.read_stream_wait(reply, sizeof(reply), zcash_fpga::VERIFY_SECP256K1_SIG) <= 0) {
+            printf("ERROR: %s round trip failed on iteration %d\n", name, i);
+            rc = 1;
+        }
+    }
+    double secs = (now_ns() - start) / 1e9;
+    getrusage(RUSAGE_THREAD, &ru[1]);
+
+    if (notify) {
+        zfpga.set_wait_policy(zcash_fpga::VERIFY_SECP256K1_SIG, policy);
+        zfpga.enable_reply_notify(zcash_fpga::NOTIFY_POLL);
+    }
+    if (rc != 0) return 1;
+
+    cpu_us = (ru[1].ru_utime.tv_sec - ru[0].ru_utime.tv_sec + ru[1].ru_stime.tv_sec - ru[0].ru_stime.tv_sec) * 1000000ULL +
+             ru[1].ru_utime.tv_usec - ru[0].ru_utime.tv_usec + ru[1].ru_stime.tv_usec - ru[0].ru_stime.tv_usec;
+    printf("RESULT: %-12s %8d commands, %10.1f us/round trip, %10.1f CPU us/round trip\n", name, iter,
+           secs * 1e6 / iter, (double)cpu_us / iter);
+    return 0;
+}
+
+static void count_reply(void* ctx, int rc, const uint8_t* rpl, unsigned int len) {
+    (void)rpl;
+    (void)len;
+    if (rc == 0) ((std::atomic<unsigned int>*)ctx)->fetch_add(1);
+}
+
+// Keeps up to window commands in flight, timed from first write to last reply. With
+// coalesce > 0 the I/O thread writes up to that many commands per batch.
+static int run_async(zcash_fpga& zfpga, zcash_fpga::verify_secp256k1_sig_t& sig, unsigned int iter, unsigned int window,
+                     unsigned int coalesce, const char* name) {
+    zcash_fpga_async async(zfpga);
+    std::atomic<unsigned int> done(0);
+    unsigned int sent = 0, last_done = 0;
+    uint64_t start = now_ns();
+    uint64_t last_progress = start;
+
+    if (coalesce > 0) {
+        async.set_coalescing(coalesce, 20);
+        async.start_io_thread();
+    }
+
+    while (done.load() < iter) {
+        while (sent < iter && async.in_flight() < window) {
+            // Without the I/O thread submit() writes straight to the FIFO, stop at a full FIFO
+            unsigned int space;
+            if (coalesce == 0 && (zfpga.get_tx_space(space, sizeof(sig)) != 0 || space < sizeof(sig))) break;
+            sig.index = sent;
+            if (async.submit((uint8_t*)&sig, sizeof(sig), count_reply, &done) != 0) break;
+            sent++;
+        }
+        if (async.poll() < 0) {
+            printf("ERROR: async poll failed\n");
+            return 1;
+        }
+        if (done.load() != last_done) {
+            last_done = done.load();
+            last_progress = now_ns();
+        } else {
+            sched_yield();  // Leave the CPU to the I/O thread or the simulated device
+        }
+        if (now_ns() - last_progress > 1000000000ULL) {
+            printf("ERROR: No reply received, timeout (%d of %d done)\n", last_done, iter);
+            return 1;
+        }
+    }
+
+    double secs = (now_ns() - start) / 1e9;
+    printf("RESULT: %-12s %8d commands, %10.1f ns/command, %12.1f commands/s, %8.2f MB/s (window %d, incl. replies)\n",
+           name, iter, secs * 1e9 / iter, iter / secs, (double)iter * sizeof(sig) / secs / 1e6, window);
+    if (coalesce > 0) {
+        zcash_fpga_async::batch_stats_t stats = async.get_batch_stats();
+        printf("RESULT: %-12s %8lu batches, %10.2f commands/batch, max %d\n", name, (unsigned long)stats.batches,
+               stats.batches ? (double)stats.cmds / stats.batches : 0.0, stats.max_batch);
+    }
+    return 0;
+}
+
+typedef struct {
+    std::atomic<unsigned int> done;
+    std::atomic<unsigned int> failed;   // Reply with a non-zero result bitmap
+} dispatch_count_t;
+
+static void count_verify(void* ctx, int rc, uint64_t index, uint8_t bm, zcash_fpga_dispatch::path_t path) {
+    dispatch_count_t* count = (dispatch_count_t*)ctx;
+    (void)index;
+    (void)path;
+    if (rc != 0 || bm != 0) count->failed.fetch_add(1);
+    count->done.fetch_add(1);
+}
+
+// Keeps up to window verifications in flight through the CPU/FPGA dispatcher
+static int run_dispatch(zcash_fpga& zfpga, zcash_fpga::verify_secp256k1_sig_t& sig, unsigned int iter, unsigned int window,
+                        const char* name) {
+    zcash_fpga_async async(zfpga);
+    dispatch_count_t count;
+    count.done = 0;
+    count.failed = 0;
+    unsigned int sent = 0, last_done = 0;
+
+    async.start_io_thread();
+    zcash_fpga_dispatch dispatch(zfpga, async);
+
+    uint64_t start = now_ns();
+    uint64_t last_progress = start;
+    while (count.done.load() < iter) {
+        while (sent < iter && dispatch.in_flight() < window) {
+            sig.index = sent;
+            if (dispatch.verify(sig, count_verify, &count) != 0) break;
+            sent++;
+        }
+        if (count.done.load() != last_done) {
+            last_done = count.done.load();
+            last_progress = now_ns();
+        } else {
+            sched_yield();
+        }
+        if (now_ns() - last_progress > 1000000000ULL) {
+            printf("ERROR: No reply received, timeout (%d of %d done)\n", last_done, iter);
+            return 1;
+        }
+    }
+
+    double secs = (now_ns() - start) / 1e9;
+    zcash_fpga_dispatch::stats_t stats = dispatch.get_stats();
+    printf("RESULT: %-12s %8d commands, %10.1f ns/command, %12.1f commands/s (window %d, incl. replies)\n",
+           name, iter, secs * 1e9 / iter, iter / secs, window);
+    printf("RESULT: %-12s %8lu FPGA, %lu CPU, %lu hedged (%lu won by CPU), %lu failed over, %d bad results\n", name,
+           (unsigned long)stats.fpga_jobs, (unsigned long)stats.cpu_jobs, (unsigned long)stats.hedged,
+           (unsigned long)stats.hedge_wins, (unsigned long)stats.fpga_failed, count.failed.load());
+    printf("RESULT: %-12s FPGA %.1f us idle latency, %.1f us/reply busy, CPU %.1f us/verify, hedge after %.1f us\n", name,
+           stats.fpga_base_ns / 1e3, stats.fpga_interval_ns / 1e3, stats.cpu_verify_ns / 1e3, stats.hedge_ns / 1e3);
+    return 0;
+}
+
+// Sends several tables' worth of jobs with the CPU threads never idle. Jobs that finished
+// must give their table entry back even though the threads never look for jobs to hedge.
+static int run_dispatch_full(zcash_fpga& zfpga, zcash_fpga::verify_secp256k1_sig_t& sig, const char* name) {
+    zcash_fpga_async async(zfpga);
+    dispatch_count_t count;
+    count.done = 0;
+    count.failed = 0;
+    const unsigned int iter = 3 * zcash_fpga_dispatch::s_max_jobs, window = zcash_fpga_dispatch::s_max_jobs / 32;
+    unsigned int sent = 0, last_done = 0;
+
+    async.start_io_thread();
+    zcash_fpga_dispatch dispatch(zfpga, async, 1);
+
+    uint64_t last_progress = now_ns();
+    while (count.done.load() < iter) {
+        while (sent < iter && dispatch.in_flight() < window) {
+            sig.index = sent;
+            if (dispatch.verify(sig, count_verify, &count) != 0) {
+                printf("ERROR: %s job table full with %d of %d jobs in flight\n", name, dispatch.in_flight(),
+                       zcash_fpga_dispatch::s_max_jobs);
+                return 1;
+            }
+            sent++;
+        }
+        if (count.done.load() != last_done) {
+            last_done = count.done.load();
+            last_progress = now_ns();
+        } else {
+            sched_yield();
+        }
+        if (now_ns() - last_progress > 1000000000ULL) {
+            printf("ERROR: No reply received, timeout (%d of %d done)\n", last_done, iter);
+            return 1;
+        }
+    }
+
+    zcash_fpga_dispatch::stats_t stats = dispatch.get_stats();
+    printf("RESULT: %-12s %8d commands, %lu FPGA, %lu CPU, %d bad results\n", name, iter,
+           (unsigned long)stats.fpga_jobs, (unsigned long)stats.cpu_jobs, count.failed.load());
+    return 0;
+}
+
+int main(int argc, char **argv) {
+
+    unsigned int iter = DEFAULT_ITER;
+    if ((argc > 1 && sscanf(argv[1], "%u", &iter) != 1) ||
+        (argc > 2 && strcmp(argv[2], "loopback") != 0 && strcmp(argv[2], "sim") != 0)) {
+        printf("usage: %s [iterations] [loopback | sim]\n", argv[0]);
+        return 1;
+    }
+
+    // The loopback transport measures the host side only, the simulator adds the modelled
+    // MMIO and engine times. Neither needs an FPGA.
+    std::unique_ptr<zcash_fpga> loopback;
+    if (argc > 2 && strcmp(argv[2], "loopback") == 0)
+        loopback.reset(new zcash_fpga(new zcash_fpga_loopback(zcash_fpga::ENB_VERIFY_SECP256K1_SIG)));
+    else if (argc > 2)
+        loopback.reset(new zcash_fpga(new zcash_fpga_sim(zcash_fpga::ENB_VERIFY_SECP256K1_SIG)));
+    zcash_fpga& zfpga = loopback ? *loopback : zcash_fpga::get_instance();
+
+    if ((zfpga.m_command_cap & zcash_fpga::ENB_VERIFY_SECP256K1_SIG) == 0) {
+        printf("ERROR: FPGA was not built with ENB_VERIFY_SECP256K1_SIG\n");
+        return 1;
+    }
+
+    zcash_fpga::verify_secp256k1_sig_t verify_secp256k1_sig;
+    memset(&verify_secp256k1_sig, 0, sizeof(zcash_fpga::verify_secp256k1_sig_t));
+    verify_secp256k1_sig.hdr.cmd = zcash_fpga::VERIFY_SECP256K1_SIG;
+    verify_secp256k1_sig.hdr.len = sizeof(zcash_fpga::verify_secp256k1_sig_t);
+    string_to_hex("4c7dbc46486ad9569442d69b558db99a2612c4f003e6631b593942f531e67fd4", (unsigned char *)verify_secp256k1_sig.hash);
+    string_to_hex("01375af664ef2b74079687956fd9042e4e547d57c4438f1fc439cbfcb4c9ba8b", (unsigned char *)verify_secp256k1_sig.r);
+    string_to_hex("de0f72e442f7b5e8e7d53274bf8f97f0674f4f63af582554dbecbb4aa9d5cbcb", (unsigned char *)verify_secp256k1_sig.s);
+    string_to_hex("808a2c66c5b90fa1477d7820fc57a8b7574cdcb8bd829bdfcf98aa9c41fde3b4", (unsigned char *)verify_secp256k1_sig.Qx);
+    string_to_hex("eed249ffde6e46d784cb53b4df8c9662313c1ce8012da56cb061f12e55a32249", (unsigned char *)verify_secp256k1_sig.Qy);
+
+    if (run(zfpga, verify_secp256k1_sig, iter, false, "per-word") != 0) return 1;
+    if (run(zfpga, verify_secp256k1_sig, iter, true, "burst") != 0) return 1;
+    if (loopback)
+        printf("INFO: burst ran without the write-combined BAR4 mapping, only an FPGA measures it\n");
+    if (run_async(zfpga, verify_secp256k1_sig, iter, 16, 0, "async") != 0) return 1;
+    if (run_async(zfpga, verify_secp256k1_sig, iter, 64, 32, "coalesced") != 0) return 1;
+    if (run_dispatch(zfpga, verify_secp256k1_sig, iter, 64, "dispatch") != 0) return 1;
+    if (run_dispatch_full(zfpga, verify_secp256k1_sig, "dispatch-full") != 0) return 1;
+
+    // Without an FPGA nothing stands in for the receive complete interrupt but the transport
+    if (loopback) {
+        if (run_wait(zfpga, verify_secp256k1_sig, iter, false, "poll-wait") != 0) return 1;
+        if (run_wait(zfpga, verify_secp256k1_sig, iter, true, "eventfd-wait") != 0) return 1;
+    }
+
+    return 0;
+}
@@ -53,8 +53,7 @@ int main(int argc, char *argv[]) {
     //unsigned int slot_id = 0;
     int rc;
     //uint32_t value = 0;
-    unsigned int timeout = 0;
-    unsigned int read_len = 0;
+    int read_len = 0;
     uint8_t reply[640];
     uint32_t failed = 0;
     bool verb=false;
@@ -130,17 +129,11 @@ int main(int argc, char *argv[]) {
       rc = zfpga.write_stream((uint8_t*)&verify_secp256k1_sig, sizeof(zcash_fpga::verify_secp256k1_sig_t));
       fail_on(rc, out, "ERROR: Unable to send verify_secp256k1_sig to FPGA!");
 
-     timeout = 0;
-      read_len = 0;
       memset(reply, 0, 512);
-      while ((read_len = zfpga.read_stream(reply, 256)) == 0) {
-        usleep(1);
-        timeout++;
-        if (timeout > 1000) {
-          printf("ERROR: No reply received, timeout\n");
-          failed = true;
-          break;
-        }
+      read_len = zfpga.read_stream_wait(reply, 256, zcash_fpga::VERIFY_SECP256K1_SIG);
+      if (read_len <= 0) {
+        printf("ERROR: No reply received, timeout\n");
+        failed = true;
       }
 
       zcash_fpga::verify_secp256k1_sig_rpl_t verify_secp256k1_sig_rpl;
@@ -25,17 +25,47 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <string.h>
+#include <atomic>
+#include <memory>
 #include <string>
 
+#include <poll.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdlib.h>
 
+#include <openssl/bn.h>
+
 #include <fpga_pci.h>
 #include <fpga_mgmt.h>
 #include <utils/lcd.h>
 #include <utils/sh_dpi_tasks.h>
 
+#include "zcash_bls12_381_cpu.hpp"
+#include "zcash_equihash_cpu.hpp"
 #include "zcash_fpga.hpp"
+#include "zcash_fpga_async.hpp"
+#include "zcash_fpga_bls12_381.hpp"
+#include "zcash_fpga_bls_batch.hpp"
+#include "zcash_fpga_dispatch.hpp"
+#include "zcash_fpga_expr.hpp"
+#include "zcash_fpga_groth16.hpp"
+#include "zcash_fpga_log.hpp"
+#include "zcash_fpga_msm.hpp"
+#include "zcash_fpga_pairing.hpp"
+#include "zcash_fpga_pool.hpp"
+#include "zcash_fpga_programs.hpp"
+#include "zcash_fpga_results.hpp"
+#include "zcash_fpga_sched.hpp"
+#include "zcash_fpga_sim.hpp"
+
+// Equihash test vectors shared with the RTL testbenches, the makefile passes the absolute
+// path and --data overrides it
+#ifndef EQUIHASH_DATA_DIR
+#define EQUIHASH_DATA_DIR "../../../../zcash_fpga/src/data/"
+#endif
+
+static std::string s_data_dir = EQUIHASH_DATA_DIR;
 
 /* use the stdout logger for printing debug information  */
 
@@ -47,7 +77,7 @@ const struct logger *logger = &logger_stdout;
 
 
 void usage(char* program_name) {
-    printf("usage: %s [--slot <slot-id>][<poke-value>]\n", program_name);
+    printf("usage: %s [--slot <slot-id>][--sim][--data <equihash-data-dir>][<poke-value>]\n", program_name);
 }
 
 // uint32_t byte_swap(uint32_t value);
@@ -70,15 +100,1065 @@ bool string_to_hex(const std::string &inStr, unsigned char *outStr) {
     return true;
 }
 
+// The secp256k1 test vector, a valid signature
+static void make_sig(zcash_fpga::verify_secp256k1_sig_t& sig, uint64_t index) {
+    memset(&sig, 0, sizeof(sig));
+    sig.hdr.cmd = zcash_fpga::VERIFY_SECP256K1_SIG;
+    sig.hdr.len = sizeof(sig);
+    sig.index = index;
+    string_to_hex("4c7dbc46486ad9569442d69b558db99a2612c4f003e6631b593942f531e67fd4", (unsigned char *)sig.hash);
+    string_to_hex("01375af664ef2b74079687956fd9042e4e547d57c4438f1fc439cbfcb4c9ba8b", (unsigned char *)sig.r);
+    string_to_hex("de0f72e442f7b5e8e7d53274bf8f97f0674f4f63af582554dbecbb4aa9d5cbcb", (unsigned char *)sig.s);
+    string_to_hex("808a2c66c5b90fa1477d7820fc57a8b7574cdcb8bd829bdfcf98aa9c41fde3b4", (unsigned char *)sig.Qx);
+    string_to_hex("eed249ffde6e46d784cb53b4df8c9662313c1ce8012da56cb061f12e55a32249", (unsigned char *)sig.Qy);
+}
+
+// Reads the first sizeof(block) bytes of a test vector file
+static bool read_block(const char* name, zcash_fpga::cblockheader_sol_t& block) {
+    std::string path = s_data_dir + "/" + name;
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == NULL) {
+        zlog_error("Unable to open %s\n", path.c_str());
+        return false;
+    }
+    size_t len = fread(&block, 1, sizeof(block), fp);
+    fclose(fp);
+    if (len != sizeof(block)) {
+        zlog_error("%s is only %lu bytes\n", path.c_str(), (unsigned long)len);
+        return false;
+    }
+    return true;
+}
+
+// Waits for the next BLS12_381 interrupt, returns its index or -1 on a timeout
+static int read_interrupt(zcash_fpga& zfpga, uint8_t* reply, unsigned int size) {
+    if (zfpga.read_stream_wait(reply, size, zcash_fpga::BLS12_381_INTERRUPT_RPL) <= 0) return -1;
+    return ((zcash_fpga::bls12_381_interrupt_rpl_t*)reply)->index;
+}
+
+// Routines go one after the other with their jumps relocated, and are only uploaded again after a reset
+static bool test_programs(zcash_fpga& zfpga) {
+    zcash_fpga_programs progs(zfpga, 192);
+    std::vector<zcash_fpga::bls12_381_inst_t> pad(3), jump(4);
+    zcash_fpga::bls12_381_inst_t inst;
+    bls12_381_scalar_t value;
+    uint8_t reply[128];
+    unsigned int entry, want;
+    bool ok = true;
+
+    memset(pad.data(), 0, pad.size() * sizeof(zcash_fpga::bls12_381_inst_t));
+    memset(jump.data(), 0, jump.size() * sizeof(zcash_fpga::bls12_381_inst_t));
+    jump[0].code = zcash_fpga::JUMP;
+    jump[0].a = 2;
+    jump[1].code = zcash_fpga::SEND_INTERRUPT;
+    jump[1].a = 200;
+    jump[1].b = 1;
+    jump[2].code = zcash_fpga::SEND_INTERRUPT;
+    jump[2].a = 200;
+    jump[2].b = 2;
+    value.dat[0][0] = 0x5a;
+    if (progs.add("pad", pad) != 0 || progs.add("jump", jump) != 0 || value.store(zfpga, 200) != 0 ||
+        progs.load("jump", entry) != 0 || zfpga.bls12_381_get_inst_slot(entry, inst) != 0) {
+        zlog_error("Unable to set up the program registry test!\n");
+        return false;
+    }
+
+    // Each routine is preceded by its tag
+    want = 192 + 1 + pad.size() + 1;
+    if (entry != want || inst.code != zcash_fpga::JUMP || inst.a != want + 2) {
+        zlog_error("Routine at %u jumps to %u, expected %u jumping to %u!\n", entry, inst.a, want, want + 2);
+        ok = false;
+    }
+    if (progs.launch("jump") != 0 || read_interrupt(zfpga, reply, sizeof(reply)) != 2 ||
+        reply[sizeof(zcash_fpga::bls12_381_interrupt_rpl_t)] != 0x5a) {
+        zlog_error("Relocated jump did not skip to the second interrupt!\n");
+        ok = false;
+    }
+    if (progs.get_stats().uploads != 1) {
+        zlog_error("Resident routine was uploaded %lu times!\n", (unsigned long)progs.get_stats().uploads);
+        ok = false;
+    }
+    zfpga.bls12_381_reset_memory(true, false);
+    if (progs.load("jump", entry) != 0 || progs.get_stats().uploads != 2) {
+        zlog_error("Routine was not uploaded again after a reset!\n");
+        ok = false;
+    }
+    return ok;
+}
+
+// a + b * c and a - c over Fp compiled by zcash_fpga_expr, checked with OpenSSL
+static bool test_expr(zcash_fpga& zfpga) {
+    zcash_fpga_programs progs(zfpga, 128, 192);
+    zcash_fpga_expr e;
+    zcash_fpga_expr::program_t prog;
+    zcash_fpga_expr::value_t a, b, c, none;
+    std::vector<std::vector<uint8_t> > results;
+    BN_CTX* ctx = BN_CTX_new();
+    BIGNUM *p = NULL, *v[3] = {NULL, NULL, NULL}, *r = BN_new();
+    uint8_t dat[3][48], want[2][48];
+    bool ok = true;
+
+    // p - 1 and the coordinates of the G1 generator, so both results wrap
+    BN_hex2bn(&p, "1a0111ea397fe69a4b1ba7b6434bacd764774b84f38512bf6730d2a0f6b0f6241eabfffeb153ffffb9feffffffffaaab");
+    BN_hex2bn(&v[0], "1a0111ea397fe69a4b1ba7b6434bacd764774b84f38512bf6730d2a0f6b0f6241eabfffeb153ffffb9feffffffffaaaa");
+    BN_hex2bn(&v[1], "17f1d3a73197d7942695638c4fa9ac0fc3688c4f9774b905a14e3a3f171bac586c55e83ff97a1aeffb3af00adb22c6bb");
+    BN_hex2bn(&v[2], "08b3f481e3aaa0f1a09e30ed741d8ae4fcf5e095d5d00af600db18cb2c04b3edd03cc744a2888ae40caa232946c5e7e1");
+    for (int i = 0; i < 3; i++) BN_bn2lebinpad(v[i], dat[i], 48);
+    BN_mod_mul(r, v[1], v[2], p, ctx);
+    BN_mod_add(r, r, v[0], p, ctx);
+    BN_bn2lebinpad(r, want[0], 48);
+    BN_mod_sub(r, v[0], v[2], p, ctx);
+    BN_bn2lebinpad(r, want[1], 48);
+
+    a = e.constant(zcash_fpga::FE, dat[0]);
+    b = e.constant(zcash_fpga::FE, dat[1]);
+    c = e.constant(zcash_fpga::FE, dat[2]);
+    e.output(a + b * c);
+    e.output(a - c);
+    if (e.compile(prog, 128, 160) != 0 || zcash_fpga_expr::run(zfpga, progs, prog, results) != 0) {
+        zlog_error("Unable to run the expression!\n");
+        ok = false;
+    } else {
+        for (int i = 0; i < 2; i++) {
+            if (results[i].size() < 48 || memcmp(results[i].data(), want[i], 48) != 0) {
+                zlog_error("Expression output %d was wrong!\n", i);
+                ok = false;
+            }
+        }
+    }
+
+    // A default value has no expression, using it must fail compile() rather than crash
+    zlog_info("Expecting three zcash_fpga_expr errors...\n");
+    if ((none + none).valid() || (a * none).valid() || e.compile(prog, 128, 160) == 0) {
+        zlog_error("Expression accepted a default value!\n");
+        ok = false;
+    }
+
+    for (int i = 0; i < 3; i++) BN_free(v[i]);
+    BN_free(p);
+    BN_free(r);
+    BN_CTX_free(ctx);
+    return ok;
+}
+
+// e(-7 G1, 11 G2) * e(77 G1, G2) is one, in one chunk and one pair per chunk, and one more pair breaks it
+static bool test_pairing(zcash_fpga& zfpga) {
+    zcash_bls12_381_cpu cpu;
+    bls12_381_scalar_t k[3];
+    bls12_381_g1_af_t p[3];
+    bls12_381_g2_af_t q[3];
+    bool ok = true, one[3] = {false, false, true};
+
+    k[0].dat[0][0] = 7;
+    k[1].dat[0][0] = 11;
+    k[2].dat[0][0] = 77;
+    cpu.point_mult(k[0], cpu.g1_generator(), p[0]);
+    cpu.g1_neg(p[0]);
+    cpu.point_mult(k[1], cpu.g2_generator(), q[0]);
+    cpu.point_mult(k[2], cpu.g1_generator(), p[1]);
+    q[1] = cpu.g2_generator();
+    p[2] = cpu.g1_generator();
+    q[2] = cpu.g2_generator();
+
+    {
+        zcash_fpga_programs progs(zfpga, 128, 192);
+        zcash_fpga_pairing pairing(zfpga, progs, 128, 200);
+        if (pairing.get_max_pairs() < 3 || pairing.pairing_check(p, q, 2, one[0]) != 0 ||
+            pairing.pairing_check(p, q, 3, one[2]) != 0) {
+            zlog_error("Unable to run the multi pairing!\n");
+            ok = false;
+        }
+    }
+    {
+        zcash_fpga_programs progs(zfpga, 128, 192);
+        zcash_fpga_pairing pairing(zfpga, progs, 128, 200, 1);
+        if (pairing.pairing_check(p, q, 2, one[1]) != 0) {
+            zlog_error("Unable to run the multi pairing in chunks!\n");
+            ok = false;
+        }
+    }
+    if (!one[0] || !one[1] || one[2]) {
+        zlog_error("Pairing checks were %d %d %d, expected 1 1 0!\n", one[0], one[1], one[2]);
+        ok = false;
+    }
+
+    // Six instruction slots leave no room for a pair
+    zlog_info("Expecting a zcash_fpga_pairing error...\n");
+    {
+        zcash_fpga_programs progs(zfpga, 128, 134);
+        zcash_fpga_pairing pairing(zfpga, progs, 128, 200);
+        if (pairing.get_max_pairs() != 0 || pairing.pairing_check(p, q, 2, one[0]) == 0) {
+            zlog_error("Multi pairing ran without room for its routine!\n");
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/*
+ * zcash_bls12_381_cpu on its own. 2 G1 and 2 G2 were computed with affine doubling in
+ * Python, (r - 1) P is -P and r P the point at infinity. Its FE12 values differ from
+ * other libraries, so the pairing is checked through bilinearity and e(P, Q) e(-P, Q) = 1.
+ */
+static bool test_bls12_381_cpu() {
+    static const char* s_g1_dbl[2] = {
+        "0572cbea904d67468808c8eb50a9450c9721db309128012543902d0ac358a62ae28f75bb8f1c7c42c39a8c5529bf0f4e",
+        "166a9d8cabc673a322fda673779d8e3822ba3ecb8670e461f73bb9021d5fd76a4c56d9d4cd16bd1bba86881979749d28"};
+    static const char* s_g2_dbl[4] = {
+        "1638533957d540a9d2370f17cc7ed5863bc0b995b8825e0ee1ea1e1e4d00dbae81f14b0bf3611b78c952aacab827a053",
+        "0a4edef9c1ed7f729f520e47730a124fd70662a904ba1074728114d1031e1572c6c886f6b57ec72a6178288c47c33577",
+        "0468fb440d82b0630aeb8dca2b5256789a66da69bf91009cbfe6bd221e47aa8ae88dece9764bf3bd999d95d71e4c9899",
+        "0f6d4552fa65dd2638b361543f887136a43253d9c66c411697003f7a13c308f5422e1aa0a59c8967acdefd8b6e36ccf3"};
+    static const char* s_order = "73eda753299d7d483339d80809a1d80553bda402fffe5bfeffffffff00000001";
+    static const char* s_order_m1 = "73eda753299d7d483339d80809a1d80553bda402fffe5bfeffffffff00000000";
+    zcash_bls12_381_cpu cpu;
+    bls12_381_g1_af_t g1 = cpu.g1_generator(), p1, p2, want1, neg1;
+    bls12_381_g2_af_t g2 = cpu.g2_generator(), q1, q2, want2, neg2;
+    bls12_381_g1_jb_t jb;
+    bls12_381_scalar_t two, order, order_m1;
+    bls12_381_fe12_t f, h, one;
+    bool ok = true;
+
+    two.dat[0][0] = 2;
+    order.set_hex(0, s_order);
+    order_m1.set_hex(0, s_order_m1);
+    for (unsigned int i = 0; i < 2; i++) want1.set_hex(i, s_g1_dbl[i]);
+    for (unsigned int i = 0; i < 4; i++) want2.set_hex(i, s_g2_dbl[i]);
+    neg1 = g1;
+    cpu.g1_neg(neg1);
+    neg2 = g2;
+    cpu.g2_neg(neg2);
+
+    if (cpu.point_mult(two, g1, p1) != 0 || memcmp(p1.dat, want1.dat, sizeof(p1.dat)) != 0 ||
+        cpu.point_add(g1, g1, p2) != 0 || memcmp(p2.dat, want1.dat, sizeof(p2.dat)) != 0) {
+        zlog_error("BLS12_381 CPU 2 G1 was wrong!\n");
+        ok = false;
+    }
+    if (cpu.point_mult(two, g2, q1) != 0 || memcmp(q1.dat, want2.dat, sizeof(q1.dat)) != 0) {
+        zlog_error("BLS12_381 CPU 2 G2 was wrong!\n");
+        ok = false;
+    }
+    if (cpu.point_mult(order_m1, g1, p2) != 0 || memcmp(p2.dat, neg1.dat, sizeof(p2.dat)) != 0 ||
+        cpu.point_mult(order_m1, g2, q2) != 0 || memcmp(q2.dat, neg2.dat, sizeof(q2.dat)) != 0) {
+        zlog_error("BLS12_381 CPU (r - 1) P was not -P!\n");
+        ok = false;
+    }
+    if (cpu.point_mult(order, g1, p2) != 1 || cpu.point_mult(order, g2, q2) != 1 || cpu.point_add(g1, neg1, p2) != 1) {
+        zlog_error("BLS12_381 CPU r P or P - P was not the point at infinity!\n");
+        ok = false;
+    }
+
+    // G1 as (4 x, 8 y, 2), i.e. (x Z^2, y Z^3, Z) with Z = 2, and with Z = 0
+    {
+        BN_CTX* ctx = BN_CTX_new();
+        BIGNUM *p = NULL, *v = BN_new();
+        BN_hex2bn(&p, "1a0111ea397fe69a4b1ba7b6434bacd764774b84f38512bf6730d2a0f6b0f6241eabfffeb153ffffb9feffffffffaaab");
+        for (unsigned int i = 0; i < 2; i++) {
+            BN_lebin2bn(g1.dat[i], 48, v);
+            BN_mod_lshift(v, v, 2 + i, p, ctx);
+            BN_bn2lebinpad(v, jb.dat[i], 48);
+        }
+        memset(jb.dat[2], 0, 48);
+        jb.dat[2][0] = 2;
+        if (cpu.to_affine(jb, p2) != 0 || memcmp(p2.dat, g1.dat, sizeof(g1.dat)) != 0) {
+            zlog_error("BLS12_381 CPU to_affine with Z = 2 was wrong!\n");
+            ok = false;
+        }
+        jb.dat[2][0] = 0;
+        if (cpu.to_affine(jb, p2) != 1) {
+            zlog_error("BLS12_381 CPU to_affine with Z = 0 did not fail!\n");
+            ok = false;
+        }
+        BN_free(p);
+        BN_free(v);
+        BN_CTX_free(ctx);
+    }
+
+    // e(2 G1, G2) == e(G1, 2 G2) != 1, e(G1, G2) e(-G1, G2) == 1
+    cpu.ate_pairing(p1, g2, f);
+    cpu.ate_pairing(g1, q1, h);
+    if (memcmp(f.dat, h.dat, sizeof(f.dat)) != 0 || zcash_bls12_381_cpu::fe12_is_one(f)) {
+        zlog_error("BLS12_381 CPU pairing is not bilinear!\n");
+        ok = false;
+    }
+    cpu.miller_loop(g1, g2, f);
+    cpu.miller_loop(neg1, g2, h);
+    cpu.fe12_mul(f, h, f);
+    cpu.final_exp(f, f);
+    one.dat[0][0] = 1;
+    if (!zcash_bls12_381_cpu::fe12_is_one(f) || memcmp(f.dat, one.dat, sizeof(f.dat)) != 0) {
+        zlog_error("BLS12_381 CPU e(P, Q) e(-P, Q) was not one!\n");
+        ok = false;
+    }
+    return ok;
+}
+
+/*
+ * zcash_equihash_cpu<144,5> against a header solved for this test (version 4, nBits
+ * 0x207fffff, the rest zero but time and the first nonce byte) with an independent
+ * Wagner solver. Changing an index, swapping two subtrees or repeating an index has to
+ * set the matching equihash_bm_t bits.
+ */
+static bool test_equihash_144_5() {
+    static const char* s_block =
+        "040000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+        "000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+        "0000000000afa75dffff7f20000000000000000000000000000000000000000000000000000000000000000064038d60"
+        "d6ba12e1a7fcb8be9d854d77bea78b55aaf8d1774aed04db63121eeec950ca9b634573fcdb036b5fc2c1b9d37406bc1c"
+        "abdfb2636b1c90ce6eae4445f381bc582782b9c77d6c1f355186c8d85809a6c7c83d84fd9a91436fec77ceecf89be0dd"
+        "cd";
+    typedef zcash_equihash_cpu<144,5> equihash_144_5;
+    equihash_144_5 equihash(1);
+    uint8_t block[equihash_144_5::s_block_bytes], bad[equihash_144_5::s_block_bytes];
+    uint8_t* sol = block + sizeof(zcash_fpga::cblockheader_t) + equihash_144_5::s_sol_enc;
+    uint8_t bm;
+    bool ok = true;
+
+    for (unsigned int i = 0; i < sizeof(block); i++)
+        sscanf(s_block + 2*i, "%2hhx", &block[i]);
+    if ((bm = equihash.verify(block)) != 0) {
+        zlog_error("Equihash (144,5) solution failed with bm = 0x%x!\n", bm);
+        ok = false;
+    }
+
+    // The last bit of index 31 belongs to no other index
+    memcpy(bad, block, sizeof(block));
+    bad[sizeof(bad) - 1] ^= 1;
+    if (((bm = equihash.verify(bad)) & zcash_fpga::XOR_NON_ZERO) == 0) {
+        zlog_error("Equihash (144,5) changed index gave bm = 0x%x!\n", bm);
+        ok = false;
+    }
+
+    // Indices 0 and 1 are 25 bit each, swapping them breaks the order but not the XORs
+    {
+        uint32_t i0 = 0, i1 = 0;
+        uint8_t* s = bad + (sol - block);
+        memcpy(bad, block, sizeof(block));
+        for (unsigned int b = 0; b < 25; b++) {
+            i0 = (i0 << 1) | ((sol[b / 8] >> (7 - b % 8)) & 1);
+            i1 = (i1 << 1) | ((sol[(b + 25) / 8] >> (7 - (b + 25) % 8)) & 1);
+        }
+        for (unsigned int b = 0; b < 25; b++) {
+            s[b / 8] &= ~(0x80 >> (b % 8));
+            s[b / 8] |= ((i1 >> (24 - b)) & 1) << (7 - b % 8);
+            s[(b + 25) / 8] &= ~(0x80 >> ((b + 25) % 8));
+            s[(b + 25) / 8] |= ((i0 >> (24 - b)) & 1) << (7 - (b + 25) % 8);
+        }
+        bm = equihash.verify(bad);
+        if ((bm & zcash_fpga::BAD_IDX_ORDER) == 0 || (bm & zcash_fpga::XOR_NON_ZERO) != 0) {
+            zlog_error("Equihash (144,5) swapped indices gave bm = 0x%x!\n", bm);
+            ok = false;
+        }
+    }
+
+    // Index 1 set to index 0
+    {
+        uint8_t* s = bad + (sol - block);
+        memcpy(bad, block, sizeof(block));
+        for (unsigned int b = 0; b < 25; b++) {
+            unsigned int bit = (sol[b / 8] >> (7 - b % 8)) & 1;
+            s[(b + 25) / 8] &= ~(0x80 >> ((b + 25) % 8));
+            s[(b + 25) / 8] |= bit << (7 - (b + 25) % 8);
+        }
+        if (((bm = equihash.verify(bad)) & zcash_fpga::DUPLICATE_FND) == 0) {
+            zlog_error("Equihash (144,5) repeated index gave bm = 0x%x!\n", bm);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Six signatures sk * H(m) in chunks of four, the fifth one signed with the wrong key
+static bool test_bls_batch(zcash_fpga& zfpga) {
+    zcash_bls12_381_cpu cpu;
+    zcash_fpga_bls_batch::sig_t sigs[6];
+    std::vector<bool> valid;
+    bool ok = true;
+
+    for (unsigned int i = 0; i < 6; i++) {
+        bls12_381_scalar_t sk, h;
+        sk.dat[0][0] = 3 + i;
+        sk.dat[0][5] = 7;
+        h.dat[0][0] = 11 + 2*i;
+        cpu.point_mult(sk, cpu.g1_generator(), sigs[i].pk);
+        cpu.point_mult(h, cpu.g2_generator(), sigs[i].hm);
+        cpu.point_mult(sk, sigs[i].hm, sigs[i].sig);
+    }
+    sigs[4].sig = sigs[3].sig;
+
+    {
+        zcash_fpga_programs progs(zfpga);
+        zcash_fpga_bls_batch batch(zfpga, progs, 128, 0, 4);
+        if (batch.get_max_items() != 4 || batch.verify(sigs, 6, valid) != 0 || valid.size() != 6) {
+            zlog_error("Unable to verify the BLS signature batch!\n");
+            ok = false;
+        } else {
+            for (unsigned int i = 0; i < 6; i++) {
+                if (valid[i] != (i != 4)) {
+                    zlog_error("BLS signature %u was %s!\n", i, valid[i] ? "valid" : "invalid");
+                    ok = false;
+                }
+            }
+        }
+    }
+
+    // Twelve instruction slots leave no room for a signature
+    zlog_info("Expecting a zcash_fpga_bls_batch error...\n");
+    {
+        zcash_fpga_programs progs(zfpga, 128, 140);
+        zcash_fpga_bls_batch batch(zfpga, progs, 128);
+        if (batch.get_max_items() != 0 || batch.verify(sigs, 6, valid) == 0) {
+            zlog_error("BLS signature batch ran without room for its routine!\n");
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static void to_scalar(const BIGNUM* bn, bls12_381_scalar_t& k) {
+    memset(k.dat, 0, sizeof(k.dat));
+    BN_bn2lebinpad(bn, k.dat[0], 48);
+}
+
+/*
+ * A one input key from known discrete logs (alpha = 5 G1, beta = 7 G2, gamma = 11 G2,
+ * delta = 13 G2, IC = 17 G1, 19 G1) and proofs A = x G1, B = y G2 with
+ * C = (x y - 35 - 11 l) / 13 G1, l = 17 + 19 x_1. The proof with index 1 gets a changed
+ * input. A second key has alpha = 6 G1 and the same delta, the resident key has to be
+ * rewritten between the two.
+ */
+static bool test_groth16(zcash_fpga& zfpga) {
+    zcash_bls12_381_cpu cpu;
+    zcash_fpga_groth16::vk_t vk, vk2;
+    zcash_fpga_groth16::proof_t proofs[3];
+    bls12_381_scalar_t k;
+    std::vector<bool> valid;
+    BN_CTX* ctx = BN_CTX_new();
+    BIGNUM *r = NULL, *d_inv = BN_new(), *t = BN_new(), *l = BN_new();
+    bool ok = true, one;
+
+    BN_hex2bn(&r, "73eda753299d7d483339d80809a1d80553bda402fffe5bfeffffffff00000001");
+    BN_set_word(t, 13);
+    BN_mod_inverse(d_inv, t, r, ctx);
+    const unsigned int g1s[4] = {5, 6, 17, 19}, g2s[3] = {7, 11, 13};
+    bls12_381_g1_af_t* g1p[4] = {&vk.alpha, &vk2.alpha, NULL, NULL};
+    bls12_381_g2_af_t* g2p[3] = {&vk.beta, &vk.gamma, &vk.delta};
+    vk.ic.resize(2);
+    g1p[2] = &vk.ic[0];
+    g1p[3] = &vk.ic[1];
+    for (unsigned int i = 0; i < 4; i++) {
+        BN_set_word(t, g1s[i]);
+        to_scalar(t, k);
+        cpu.point_mult(k, cpu.g1_generator(), *g1p[i]);
+    }
+    for (unsigned int i = 0; i < 3; i++) {
+        BN_set_word(t, g2s[i]);
+        to_scalar(t, k);
+        cpu.point_mult(k, cpu.g2_generator(), *g2p[i]);
+    }
+    vk2.beta = vk.beta;
+    vk2.gamma = vk.gamma;
+    vk2.delta = vk.delta;
+    vk2.ic = vk.ic;
+
+    for (unsigned int j = 0; j < 3; j++) {
+        proofs[j].inputs.resize(1);
+        BN_set_word(t, 31 + j);
+        to_scalar(t, proofs[j].inputs[0]);
+        BN_set_word(l, 17 + 19*(31 + j));
+        BN_set_word(t, 23 + j);
+        to_scalar(t, k);
+        cpu.point_mult(k, cpu.g1_generator(), proofs[j].a);
+        BN_set_word(t, 29 + j);
+        to_scalar(t, k);
+        cpu.point_mult(k, cpu.g2_generator(), proofs[j].b);
+        BN_set_word(t, (23 + j)*(29 + j));
+        BN_sub_word(t, 35);
+        BN_mul_word(l, 11);
+        BN_mod_sub(t, t, l, r, ctx);
+        BN_mod_mul(t, t, d_inv, r, ctx);
+        to_scalar(t, k);
+        cpu.point_mult(k, cpu.g1_generator(), proofs[j].c);
+    }
+    proofs[1].inputs[0].dat[0][0] ^= 1;
+
+    {
+        zcash_fpga_programs progs(zfpga);
+        zcash_fpga_groth16 groth16(zfpga, progs, vk, 128, 0, 2);
+        zcash_fpga_groth16 other(zfpga, progs, vk2, 128, 0, 2);
+        if (groth16.verify(proofs, 3, valid) != 0 || valid.size() != 3 || !valid[0] || valid[1] || !valid[2]) {
+            zlog_error("Groth16 verify did not find the changed proof!\n");
+            ok = false;
+        }
+        if (groth16.check(proofs, 1, one) != 0 || !one || groth16.get_stats().vk_uploads != 1) {
+            zlog_error("Groth16 key was not kept resident!\n");
+            ok = false;
+        }
+        // Same delta, other alpha: the resident key must not be taken for this one
+        if (other.check(proofs, 1, one) != 0 || one || other.get_stats().vk_uploads != 1) {
+            zlog_error("Groth16 proof passed under a key differing only in alpha!\n");
+            ok = false;
+        }
+        if (groth16.check(proofs, 1, one) != 0 || !one || groth16.get_stats().vk_uploads != 2) {
+            zlog_error("Groth16 key was not rewritten after another key!\n");
+            ok = false;
+        }
+    }
+
+    BN_free(r);
+    BN_free(d_inv);
+    BN_free(t);
+    BN_free(l);
+    BN_CTX_free(ctx);
+    return ok;
+}
+
+// sum k_i * (a_i * G) with each strategy against one POINT_MULT of G by sum k_i * a_i
+template <class AF, class JB>
+static bool check_msm(zcash_fpga_msm& msm, const AF& g, unsigned int n, const char* name) {
+    static const zcash_fpga_msm::strategy_t s_strategies[2] = {zcash_fpga_msm::PER_POINT, zcash_fpga_msm::PIPPENGER};
+    zcash_bls12_381_cpu cpu;
+    std::vector<AF> p(n);
+    std::vector<bls12_381_scalar_t> k(n);
+    bls12_381_scalar_t sum;
+    AF want, got;
+    JB res;
+    BN_CTX* ctx = BN_CTX_new();
+    BIGNUM *r = NULL, *a = BN_new(), *x = BN_new(), *s = BN_new(), *e = BN_new();
+    bool ok = true;
+
+    BN_hex2bn(&r, "73eda753299d7d483339d80809a1d80553bda402fffe5bfeffffffff00000001");
+    BN_zero(s);
+    BN_set_word(e, 5);
+    for (unsigned int i = 0; i < n; i++) {
+        bls12_381_scalar_t ai;
+        BN_set_word(a, 2 + 3*i);
+        BN_bn2lebinpad(a, ai.dat[0], 48);
+        cpu.point_mult(ai, g, p[i]);
+        // Full width scalars, the last one zero so it is skipped
+        BN_set_word(x, 0x9e3779b97f4a7c15ULL + i);
+        BN_mod_exp(x, x, e, r, ctx);
+        if (i == n - 1) BN_zero(x);
+        BN_bn2lebinpad(x, k[i].dat[0], 48);
+        BN_mod_mul(x, x, a, r, ctx);
+        BN_mod_add(s, s, x, r, ctx);
+    }
+    BN_bn2lebinpad(s, sum.dat[0], 48);
+    cpu.point_mult(sum, g, want);
+
+    for (int j = 0; j < 2; j++) {
+        if (msm.msm(p.data(), k.data(), n, res, s_strategies[j]) != 0 || cpu.to_affine(res, got) != 0 ||
+            memcmp(got.dat, want.dat, sizeof(want.dat)) != 0) {
+            zlog_error("%s multi scalar multiplication with strategy %d was wrong!\n", name, s_strategies[j]);
+            ok = false;
+        }
+    }
+
+    BN_free(r);
+    BN_free(a);
+    BN_free(x);
+    BN_free(s);
+    BN_free(e);
+    BN_CTX_free(ctx);
+    return ok;
+}
+
+static bool test_msm(zcash_fpga& zfpga) {
+    zcash_bls12_381_cpu cpu;
+    bool ok = true;
+    {
+        zcash_fpga_programs progs(zfpga);
+        zcash_fpga_msm msm(zfpga, progs, 128, 0, 0, zcash_fpga_msm::G1);
+        if (msm.get_max_points(false) == 0 ||
+            !check_msm<bls12_381_g1_af_t, bls12_381_g1_jb_t>(msm, cpu.g1_generator(), 6, "G1"))
+            ok = false;
+    }
+    {
+        zcash_fpga_programs progs(zfpga);
+        zcash_fpga_msm msm(zfpga, progs, 128, 0, 0, zcash_fpga_msm::G2);
+        if (msm.get_max_points(true) == 0 ||
+            !check_msm<bls12_381_g2_af_t, bls12_381_g2_jb_t>(msm, cpu.g2_generator(), 3, "G2"))
+            ok = false;
+    }
+    if (!ok) zlog_error("Multi scalar multiplication failed!\n");
+    return ok;
+}
+
+// Five jobs through two regions, job i squares i + 2 eight times in a loop run four times
+static bool test_sched(zcash_fpga& zfpga) {
+    zcash_fpga_sched sched(zfpga, 2, 128, 0, 128, 0);
+    zcash_fpga_sched::job_t jobs[5];
+    zcash_fpga::bls12_381_inst_t inst;
+    std::vector<std::vector<uint8_t> > results;
+    BN_CTX* ctx = BN_CTX_new();
+    BIGNUM *p = NULL, *x = BN_new(), *e = BN_new();
+    uint8_t want[48];
+    bool ok = true;
+
+    memset(&inst, 0, sizeof(inst));
+    for (unsigned int i = 0; i < 5; i++) {
+        zcash_fpga_sched::input_t in;
+        in.slot = 3;
+        in.pt = zcash_fpga::FE;
+        in.dat.assign(2*48, 0);
+        in.dat[0] = i + 2;
+        in.dat[48] = 3;
+        jobs[i].inputs.push_back(in);
+        inst.code = zcash_fpga::MUL_ELEMENT;
+        inst.a = inst.b = inst.c = 3;
+        jobs[i].code.assign(8, inst);
+        inst.code = zcash_fpga::JUMP_NONZERO_SUB;
+        inst.a = 0;
+        inst.b = 4;
+        inst.c = 0;
+        jobs[i].code.push_back(inst);
+        jobs[i].result_slot = 3;
+    }
+
+    BN_hex2bn(&p, "1a0111ea397fe69a4b1ba7b6434bacd764774b84f38512bf6730d2a0f6b0f6241eabfffeb153ffffb9feffffffffaaab");
+    BN_one(e);
+    BN_lshift(e, e, 32);
+    if (sched.run(jobs, 5, results) != 0 || results.size() != 5 || sched.get_stats().jobs != 5) {
+        zlog_error("Unable to run the scheduled jobs!\n");
+        ok = false;
+    } else {
+        for (unsigned int i = 0; i < 5; i++) {
+            BN_set_word(x, i + 2);
+            BN_mod_exp(x, x, e, p, ctx);
+            BN_bn2lebinpad(x, want, 48);
+            if (results[i].size() < 48 || memcmp(results[i].data(), want, 48) != 0) {
+                zlog_error("Scheduled job %u result was wrong!\n", i);
+                ok = false;
+            }
+        }
+    }
+
+    // An interrupt of its own would be read as the job's result
+    inst.code = zcash_fpga::SEND_INTERRUPT;
+    inst.a = 3;
+    inst.b = 0;
+    jobs[0].code.insert(jobs[0].code.begin(), inst);
+    zlog_info("Expecting a zcash_fpga_sched error...\n");
+    if (sched.run(jobs, 1, results) == 0) {
+        zlog_error("Scheduler ran a job with a SEND_INTERRUPT!\n");
+        ok = false;
+    }
+
+    BN_free(p);
+    BN_free(x);
+    BN_free(e);
+    BN_CTX_free(ctx);
+    return ok;
+}
+
+static void count_result(void* ctx, zcash_fpga_results::result_t& r) {
+    (void)r;
+    (*(unsigned int*)ctx)++;
+}
+
+// FE, FE2 and FE12 payloads routed to their buffers, an FE12 sent where an FE is expected
+// and one interrupt nobody expects
+static bool test_results(zcash_fpga& zfpga) {
+    zcash_fpga_results res(zfpga, 4);
+    zcash_fpga_programs progs(zfpga, 128);
+    zcash_fpga_results::result_t *fe, *fe2, *small, *fe12;
+    std::vector<zcash_fpga::bls12_381_inst_t> code(6);
+    uint8_t dat[12*48];
+    unsigned int calls = 0;
+    bool ok = true;
+
+    for (unsigned int i = 0; i < sizeof(dat); i++) dat[i] = (i % 48) == 47 ? 0 : (i * 7 + 1) % 251;
+    memset(code.data(), 0, code.size() * sizeof(zcash_fpga::bls12_381_inst_t));
+    for (unsigned int i = 0; i < 5; i++) code[i].code = zcash_fpga::SEND_INTERRUPT;
+    code[0].a = 200;
+    code[0].b = 5;
+    code[1].a = 202;
+    code[1].b = 6;
+    code[2].a = 210;
+    code[2].b = 7;
+    code[3].a = 210;
+    code[3].b = 44;
+    code[4].a = 210;
+    code[4].b = 8;
+    if (zfpga.bls12_381_set_data_slots(200, dat, 1, zcash_fpga::FE) != 0 ||
+        zfpga.bls12_381_set_data_slots(202, dat, 2, zcash_fpga::FE2) != 0 ||
+        zfpga.bls12_381_set_data_slots(210, dat, 12, zcash_fpga::FE12) != 0 || progs.add("results", code) != 0) {
+        zlog_error("Unable to set up the result router test!\n");
+        return false;
+    }
+
+    zlog_info("Expecting three zcash_fpga_results errors...\n");
+    fe = res.expect(5, zcash_fpga::FE, count_result, &calls);
+    fe2 = res.expect(6, zcash_fpga::FE2, count_result, &calls);
+    small = res.expect(7, zcash_fpga::FE, count_result, &calls);
+    fe12 = res.expect(8, zcash_fpga::FE12);
+    if (fe == nullptr || fe2 == nullptr || small == nullptr || fe12 == nullptr ||
+        res.expect(5 + zcash_fpga_results::s_max_pending, zcash_fpga::FE) != nullptr) {
+        zlog_error("Result router handed out the wrong buffers!\n");
+        return false;
+    }
+    if ((uintptr_t)fe->dat % zcash_fpga_results::s_line_bytes != 0 ||
+        (uintptr_t)fe12->dat % zcash_fpga_results::s_line_bytes != 0) {
+        zlog_error("Result buffers are not cache line aligned!\n");
+        ok = false;
+    }
+
+    if (progs.launch("results") != 0 || res.wait(*fe12) != 0) {
+        zlog_error("Routed results did not arrive!\n");
+        ok = false;
+    } else {
+        if (!fe->ready || fe->len != 48 || memcmp(fe->dat, dat, 48) != 0 || !fe2->ready || fe2->len != 96 ||
+            memcmp(fe2->dat, dat, 96) != 0 || fe12->len != 12*48 || memcmp(fe12->dat, dat, 12*48) != 0) {
+            zlog_error("Routed payloads were wrong!\n");
+            ok = false;
+        }
+        // Too large for its buffer, so dropped but still completed
+        if (!small->ready || small->rc != 1) {
+            zlog_error("Oversized payload was not reported!\n");
+            ok = false;
+        }
+        if (calls != 3 || res.get_stats().routed != 4 || res.get_stats().dropped != 1) {
+            zlog_error("Result router made %u callbacks, routed %lu and dropped %lu!\n", calls,
+                   (unsigned long)res.get_stats().routed, (unsigned long)res.get_stats().dropped);
+            ok = false;
+        }
+    }
+
+    res.release(fe);
+    res.release(fe2);
+    res.release(small);
+    res.release(fe12);
+    if (res.available(zcash_fpga::FE) != 4 || res.available(zcash_fpga::FE12) != 4) {
+        zlog_error("Released result buffers were not returned!\n");
+        ok = false;
+    }
+    return ok;
+}
+
+// A second request for a pending (cmd, index) is refused as its reply could not be told
+// apart, and an entry released by a timed out future can be claimed again
+static bool test_async(zcash_fpga& zfpga) {
+    zcash_fpga::wait_policy_t policy = zfpga.get_wait_policy(zcash_fpga::VERIFY_SECP256K1_SIG);
+    zcash_fpga::wait_policy_t hurry = {0, 0, 0, 1};
+    zcash_fpga::verify_secp256k1_sig_t sig;
+    zcash_fpga_async async(zfpga);
+    zcash_fpga_async::future fut[2];
+    uint8_t reply[256];
+    bool ok = true;
+
+    make_sig(sig, 0x70);
+    if (async.submit((uint8_t*)&sig, sizeof(sig), fut[0]) != 0) {
+        zlog_error("Unable to submit to zcash_fpga_async!\n");
+        return false;
+    }
+    zlog_info("Expecting a zcash_fpga_async error...\n");
+    if (async.submit((uint8_t*)&sig, sizeof(sig), fut[1]) == 0) {
+        zlog_error("zcash_fpga_async took a duplicate of a pending request!\n");
+        ok = false;
+    }
+    if (fut[0].get(reply, sizeof(reply)) <= 0 || ((zcash_fpga::verify_secp256k1_sig_rpl_t*)reply)->index != 0x70) {
+        zlog_error("No zcash_fpga_async reply for index 0x70!\n");
+        ok = false;
+    }
+
+    // Time out before the reply, the late reply then goes to the next request with the index
+    zlog_info("Expecting a zcash_fpga_async timeout...\n");
+    zfpga.set_wait_policy(zcash_fpga::VERIFY_SECP256K1_SIG, hurry);
+    if (async.submit((uint8_t*)&sig, sizeof(sig), fut[0]) != 0 || fut[0].get(reply, sizeof(reply)) != 0) {
+        zlog_error("zcash_fpga_async future did not time out!\n");
+        ok = false;
+    }
+    zfpga.set_wait_policy(zcash_fpga::VERIFY_SECP256K1_SIG, policy);
+    if (async.submit((uint8_t*)&sig, sizeof(sig), fut[1]) != 0 || fut[1].get(reply, sizeof(reply)) <= 0) {
+        zlog_error("zcash_fpga_async entry was not released by the timeout!\n");
+        ok = false;
+    }
+    // Drop the second reply
+    usleep(100000);
+    async.poll();
+    if (async.in_flight() != 0) {
+        zlog_error("zcash_fpga_async has %d requests left in flight!\n", async.in_flight());
+        ok = false;
+    }
+    return ok;
+}
+
+// The simulator posts the NOTIFY_EVENTFD eventfd as a reply is queued, so read_stream_wait()
+// blocking on it wakes up with the reply rather than at its timeout
+static bool test_reply_eventfd(zcash_fpga& zfpga) {
+    zcash_fpga::wait_policy_t policy = zfpga.get_wait_policy(zcash_fpga::FPGA_STATUS);
+    zcash_fpga::wait_policy_t block = {0, 0, 0, 2000000};
+    zcash_fpga::header_t hdr;
+    struct pollfd pfd;
+    uint8_t reply[64];
+    uint64_t wait_ns = 0;
+    bool ok = true;
+
+    hdr.len = sizeof(hdr);
+    hdr.cmd = zcash_fpga::FPGA_STATUS;
+    if (zfpga.enable_reply_notify(zcash_fpga::NOTIFY_EVENTFD) != 0 || zfpga.get_reply_fd() < 0) {
+        zlog_error("Unable to enable the reply eventfd!\n");
+        return false;
+    }
+    pfd.fd = zfpga.get_reply_fd();
+    pfd.events = POLLIN;
+
+    if (zfpga.write_stream((uint8_t*)&hdr, sizeof(hdr)) != 0 || poll(&pfd, 1, 1000) != 1 ||
+        zfpga.read_stream_wait(reply, sizeof(reply), zcash_fpga::FPGA_STATUS) <= 0 ||
+        ((zcash_fpga::header_t*)reply)->cmd != zcash_fpga::FPGA_STATUS_RPL) {
+        zlog_error("Reply eventfd was not posted!\n");
+        ok = false;
+    }
+
+    zfpga.ack_reply_fd();
+    zfpga.set_wait_policy(zcash_fpga::FPGA_STATUS, block);
+    if (zfpga.write_stream((uint8_t*)&hdr, sizeof(hdr)) != 0 ||
+        zfpga.read_stream_wait(reply, sizeof(reply), zcash_fpga::FPGA_STATUS, &wait_ns) <= 0 ||
+        wait_ns >= block.timeout_us * 1000ULL / 2) {
+        zlog_error("Blocking read_stream_wait() took %lu us!\n", (unsigned long)(wait_ns / 1000));
+        ok = false;
+    } else {
+        zlog_info("Blocking FPGA_STATUS reply took %lu us\n", (unsigned long)(wait_ns / 1000));
+    }
+
+    zfpga.set_wait_policy(zcash_fpga::FPGA_STATUS, policy);
+    zfpga.enable_reply_notify(zcash_fpga::NOTIFY_POLL);
+
+    // The simulator has no slot, so there is no interrupt device to open
+    zlog_info("Expecting a NOTIFY_IRQ error...\n");
+    if (zfpga.enable_reply_notify(zcash_fpga::NOTIFY_IRQ) == 0 || zfpga.get_reply_fd() >= 0) {
+        zlog_error("NOTIFY_IRQ was enabled without an FPGA slot!\n");
+        ok = false;
+    }
+    return ok;
+}
+
+typedef struct {
+    zcash_fpga*               zfpga;
+    std::atomic<unsigned int> replies;
+    unsigned int              failed;
+    unsigned int              max_space;
+} coalesce_ctx_t;
+
+// Runs on the I/O thread, which owns zfpga, so the cached credit can be read here
+static void coalesce_reply(void* ctx, int rc, const uint8_t* rpl, unsigned int len) {
+    coalesce_ctx_t* c = (coalesce_ctx_t*)ctx;
+    unsigned int space;
+    (void)rpl;
+    if (rc != 0 || len == 0) c->failed++;
+    if (c->zfpga->get_tx_space(space) == 0 && space > c->max_space) c->max_space = space;
+    c->replies.fetch_add(1, std::memory_order_release);
+}
+
+// Commands queued faster than the simulator takes them are written in batches of at most
+// max_cmds. The transmit credit never wraps below zero: it stays within the FIFO depth and
+// no write overflows the simulated FIFO (which fails the command).
+static bool test_coalescing() {
+    const unsigned int n = 64, max_cmds = 4;
+    zcash_fpga zfpga(new zcash_fpga_sim(zcash_fpga::ENB_VERIFY_SECP256K1_SIG));
+    zcash_fpga_async async(zfpga);
+    zcash_fpga::verify_secp256k1_sig_t sig;
+    coalesce_ctx_t ctx;
+    bool ok = true;
+
+    ctx.zfpga = &zfpga;
+    ctx.replies = 0;
+    ctx.failed = 0;
+    ctx.max_space = 0;
+    async.set_coalescing(max_cmds, 1000);
+    async.start_io_thread();
+    for (unsigned int i = 0; i < n; i++) {
+        make_sig(sig, 0x100 + i);
+        if (async.submit((uint8_t*)&sig, sizeof(sig), coalesce_reply, &ctx) != 0) {
+            zlog_error("Unable to submit command %d to zcash_fpga_async!\n", i);
+            ctx.replies.fetch_add(1);
+            ok = false;
+        }
+    }
+    for (unsigned int t = 0; t < 5000 && ctx.replies.load(std::memory_order_acquire) < n; t++)
+        usleep(1000);
+    async.stop_io_thread();
+
+    zcash_fpga_async::batch_stats_t stats = async.get_batch_stats();
+    if (ctx.replies.load() != n || ctx.failed != 0) {
+        zlog_error("Coalesced commands got %d replies, %d failed!\n", ctx.replies.load(), ctx.failed);
+        ok = false;
+    }
+    if (stats.max_batch > max_cmds || stats.max_batch < 2 || stats.cmds != n) {
+        zlog_error("Coalesced %lu commands in %lu batches of up to %lu, limit %d!\n", (unsigned long)stats.cmds,
+                   (unsigned long)stats.batches, (unsigned long)stats.max_batch, max_cmds);
+        ok = false;
+    }
+    if (ctx.max_space > zcash_fpga_sim::default_model().tx_fifo_words * 4) {
+        zlog_error("Transmit credit reached %d bytes, more than the FIFO holds!\n", ctx.max_space);
+        ok = false;
+    }
+    return ok;
+}
+
+typedef struct {
+    std::atomic<unsigned int> done;
+    std::atomic<unsigned int> failed;
+} failover_ctx_t;
+
+static void failover_reply(void* ctx, int rc, uint64_t index, uint8_t bm, zcash_fpga_dispatch::path_t path) {
+    failover_ctx_t* c = (failover_ctx_t*)ctx;
+    (void)index;
+    if (rc != 0 || bm != 0 || path != zcash_fpga_dispatch::PATH_CPU) c->failed.fetch_add(1);
+    c->done.fetch_add(1, std::memory_order_release);
+}
+
+// A transmit FIFO too small for a command makes every FPGA job time out in the I/O thread,
+// the dispatcher has to run them on the CPU instead
+static bool test_dispatch_failover() {
+    const unsigned int n = 8;
+    zlog_info("Expecting a TDFV warning and zcash_fpga_async transmit FIFO errors...\n");
+    zcash_fpga_sim::model_t model = zcash_fpga_sim::default_model();
+    model.tx_fifo_words = sizeof(zcash_fpga::verify_secp256k1_sig_t) / 8;
+    zcash_fpga zfpga(new zcash_fpga_sim(zcash_fpga::ENB_VERIFY_SECP256K1_SIG, model));
+    zcash_fpga::wait_policy_t hurry = {0, 0, 0, 1000};
+    zcash_fpga_async async(zfpga);
+    zcash_fpga_dispatch::stats_t stats;
+    zcash_fpga::verify_secp256k1_sig_t sig;
+    failover_ctx_t ctx;
+    bool ok = true;
+
+    ctx.done = 0;
+    ctx.failed = 0;
+    zfpga.set_wait_policy(zcash_fpga::VERIFY_SECP256K1_SIG, hurry);
+    async.start_io_thread();
+    {
+        zcash_fpga_dispatch dispatch(zfpga, async, 1);
+        for (unsigned int i = 0; i < n; i++) {
+            make_sig(sig, 0x200 + i);
+            if (dispatch.verify(sig, failover_reply, &ctx) != 0) {
+                zlog_error("Unable to queue job %d on zcash_fpga_dispatch!\n", i);
+                ctx.done.fetch_add(1);
+                ok = false;
+            }
+        }
+        for (unsigned int t = 0; t < 5000 && ctx.done.load(std::memory_order_acquire) < n; t++)
+            usleep(1000);
+        stats = dispatch.get_stats();
+    }
+    async.stop_io_thread();
+
+    if (ctx.done.load() != n || ctx.failed.load() != 0) {
+        zlog_error("Failed over jobs got %d results, %d not from the CPU or wrong!\n", ctx.done.load(),
+                   ctx.failed.load());
+        ok = false;
+    }
+    if (stats.fpga_jobs == 0 || stats.fpga_failed != stats.fpga_jobs) {
+        zlog_error("%lu of %lu FPGA jobs were failed over to the CPU!\n", (unsigned long)stats.fpga_failed,
+                   (unsigned long)stats.fpga_jobs);
+        ok = false;
+    }
+    return ok;
+}
+
+static int io_thread_cpu(zcash_fpga& zfpga, void* ctx) {
+    (void)zfpga;
+    *(int*)ctx = sched_getcpu();
+    return 0;
+}
+
+// Three simulated slots: 0 with secp256k1 and BLS12_381, 1 with secp256k1, 2 with (200,9)
+// Equihash. Commands go to a slot with the capability, the least loaded one among those,
+// and the I/O threads of slots on a NUMA node run on a CPU of the node.
+static bool test_pool() {
+    zcash_fpga_pool pool;
+    zcash_fpga_async::future fut;
+    zcash_fpga::verify_secp256k1_sig_t sig;
+    zcash_fpga::header_t hdr;
+    uint8_t reply[256];
+    bool ok = true;
+
+    if (pool.add(new zcash_fpga(new zcash_fpga_sim(zcash_fpga::ENB_VERIFY_SECP256K1_SIG | zcash_fpga::ENB_BLS12_381)), 0) != 0 ||
+        pool.add(new zcash_fpga(new zcash_fpga_sim(zcash_fpga::ENB_VERIFY_SECP256K1_SIG)), 0) != 1 ||
+        pool.add(new zcash_fpga(new zcash_fpga_sim(zcash_fpga::ENB_VERIFY_EQUIHASH_200_9)), -1) != 2) {
+        zlog_error("Unable to add simulated slots to the pool!\n");
+        return false;
+    }
+    if (pool.get_command_cap() != (zcash_fpga::ENB_VERIFY_SECP256K1_SIG | zcash_fpga::ENB_BLS12_381 |
+                                   zcash_fpga::ENB_VERIFY_EQUIHASH_200_9)) {
+        zlog_error("Pool cmd_cap was 0x%lx!\n", (unsigned long)pool.get_command_cap());
+        ok = false;
+    }
+
+    // Asked twice so the rotating start cannot hide a wrong pick
+    for (int i = 0; i < 2; i++) {
+        if (pool.pick(zcash_fpga::ENB_BLS12_381) != 0 || pool.pick(zcash_fpga::ENB_VERIFY_EQUIHASH_200_9) != 2 ||
+            pool.pick(zcash_fpga::ENB_VERIFY_EQUIHASH_144_5) != -1) {
+            zlog_error("Pool did not pick the slot with the capability!\n");
+            ok = false;
+        }
+    }
+
+    // Interrupts nobody sends keep requests in flight
+    pool.async(0).expect_interrupt(0, nullptr, nullptr);
+    for (int i = 0; i < 2; i++) {
+        if (pool.pick(zcash_fpga::ENB_VERIFY_SECP256K1_SIG) != 1) {
+            zlog_error("Pool did not pick the least loaded slot 1!\n");
+            ok = false;
+        }
+    }
+    pool.async(1).expect_interrupt(0, nullptr, nullptr);
+    pool.async(1).expect_interrupt(1, nullptr, nullptr);
+    for (int i = 0; i < 2; i++) {
+        if (pool.pick(zcash_fpga::ENB_VERIFY_SECP256K1_SIG) != 0) {
+            zlog_error("Pool did not pick the least loaded slot 0!\n");
+            ok = false;
+        }
+    }
+
+    make_sig(sig, 0x71);
+    if (pool.submit((uint8_t*)&sig, sizeof(sig), fut) != 0 || fut.get(reply, sizeof(reply)) <= 0 ||
+        ((zcash_fpga::verify_secp256k1_sig_rpl_t*)reply)->index != 0x71) {
+        zlog_error("No pool reply for index 0x71!\n");
+        ok = false;
+    }
+    // A (144,5) header is shorter than a verify_equihash_t
+    hdr.cmd = zcash_fpga::VERIFY_EQUIHASH;
+    hdr.len = sizeof(zcash_fpga::verify_equihash_t) - 32;
+    zlog_info("Expecting a zcash_fpga_pool error...\n");
+    if (pool.submit((uint8_t*)&hdr, hdr.len, fut) == 0) {
+        zlog_error("Pool took a command no slot supports!\n");
+        ok = false;
+    }
+
+    // Slots 0 and 1 share node 0, the I/O threads take its CPUs from the last one down
+    if (pool.numa_node(0) != 0 || pool.numa_node(2) != -1 || pool.io_cpu(2) != -1) {
+        zlog_error("Pool slots were on NUMA nodes %d %d %d, CPUs %d %d %d!\n", pool.numa_node(0),
+                   pool.numa_node(1), pool.numa_node(2), pool.io_cpu(0), pool.io_cpu(1), pool.io_cpu(2));
+        ok = false;
+    }
+    if (pool.io_cpu(0) < 0) {
+        zlog_info("No CPU list for NUMA node 0, skipping the pinning check\n");
+        return ok;
+    }
+    if (pool.io_cpu(1) > pool.io_cpu(0)) {
+        zlog_error("Pool slot 1 was pinned above slot 0, to CPU %d!\n", pool.io_cpu(1));
+        ok = false;
+    }
+    for (unsigned int i = 0; i < 2; i++) {
+        int cpu = -1;
+        if (pool.async(i).call(io_thread_cpu, &cpu) != 0 || cpu != pool.io_cpu(i)) {
+            zlog_error("Pool slot %d I/O thread ran on CPU %d, pinned to %d!\n", i, cpu, pool.io_cpu(i));
+            ok = false;
+        }
+    }
+    return ok;
+}
+
 int main(int argc, char **argv) {
 
     unsigned int slot_id = 0;
     int rc;
     uint32_t value = 0;
-    unsigned int timeout = 0;
-    unsigned int read_len = 0;
+    int read_len = 0;
     uint8_t reply[640];
     bool failed = 0;
+    bool sim = false;
     // Process command line args
     {
         int i;
@@ -92,6 +1172,16 @@ int main(int argc, char **argv) {
                     return 1;
                 }
                 sscanf(argv[i], "%d", &slot_id);
+            } else if (!strcmp(argv[i], "--sim")) {
+                sim = true;
+            } else if (!strcmp(argv[i], "--data")) {
+                i++;
+                if (i >= argc) {
+                    printf("error: missing equihash-data-dir\n");
+                    usage(argv[0]);
+                    return 1;
+                }
+                s_data_dir = argv[i];
             } else if (!value_set) {
                 sscanf(argv[i], "%x", &value);
                 value_set = 1;
@@ -103,11 +1193,17 @@ int main(int argc, char **argv) {
         }
     }
 
-    zcash_fpga& zfpga = zcash_fpga::get_instance();
+    // --sim runs every test against the software model instead of the FPGA in slot 0
+    std::unique_ptr<zcash_fpga> sim_fpga;
+    if (sim)
+        sim_fpga.reset(new zcash_fpga(new zcash_fpga_sim(zcash_fpga::ENB_VERIFY_SECP256K1_SIG |
+                                                         zcash_fpga::ENB_VERIFY_EQUIHASH_200_9 |
+                                                         zcash_fpga::ENB_BLS12_381)));
+    zcash_fpga& zfpga = sim_fpga ? *sim_fpga : zcash_fpga::get_instance();
 
     // Test the secp256k1 core
     if ((zfpga.m_command_cap & zcash_fpga::ENB_VERIFY_SECP256K1_SIG) != 0) {
-      printf("INFO: Testing secp256k1 core...\n");
+      zlog_info("Testing secp256k1 core...\n");
 
       zcash_fpga::verify_secp256k1_sig_t verify_secp256k1_sig;
       memset(&verify_secp256k1_sig, 0, sizeof(zcash_fpga::verify_secp256k1_sig_t));
@@ -123,43 +1219,81 @@ int main(int argc, char **argv) {
       rc = zfpga.write_stream((uint8_t*)&verify_secp256k1_sig, sizeof(zcash_fpga::verify_secp256k1_sig_t));
       fail_on(rc, out, "ERROR: Unable to send verify_secp256k1_sig to FPGA!");
 
-      timeout = 0;
-      read_len = 0;
       memset(reply, 0, 512);
-      while ((read_len = zfpga.read_stream(reply, 256)) == 0) {
-        usleep(1);
-        timeout++;
-        if (timeout > 1000) {
-          printf("ERROR: No reply received, timeout\n");
-          failed = true;
-          break;
-        }
+      uint64_t wait_ns;
+      read_len = zfpga.read_stream_wait(reply, 256, zcash_fpga::VERIFY_SECP256K1_SIG, &wait_ns);
+      if (read_len <= 0) {
+        zlog_error("No reply received, timeout\n");
+        failed = true;
+      } else {
+        zlog_info("verify_secp256k1_sig reply took %lu us\n", (unsigned long)(wait_ns / 1000));
       }
 
       zcash_fpga::verify_secp256k1_sig_rpl_t verify_secp256k1_sig_rpl;
       verify_secp256k1_sig_rpl = *(zcash_fpga::verify_secp256k1_sig_rpl_t*)reply;
-      printf("INFO: verify_secp256k1_sig_rpl.hdr.cmd = 0x%x\n", verify_secp256k1_sig_rpl.hdr.cmd);
-      printf("INFO: verify_secp256k1_sig_rpl.bm = 0x%x\n", verify_secp256k1_sig_rpl.bm);
-      printf("INFO: verify_secp256k1_sig_rpl.index = 0x%lx\n", verify_secp256k1_sig_rpl.index);
-      printf("INFO: verify_secp256k1_sig_rpl.cycle_cnt = 0x%x\n", verify_secp256k1_sig_rpl.cycle_cnt);
+      zlog_info("verify_secp256k1_sig_rpl.hdr.cmd = 0x%x\n", verify_secp256k1_sig_rpl.hdr.cmd);
+      zlog_info("verify_secp256k1_sig_rpl.bm = 0x%x\n", verify_secp256k1_sig_rpl.bm);
+      zlog_info("verify_secp256k1_sig_rpl.index = 0x%lx\n", verify_secp256k1_sig_rpl.index);
+      zlog_info("verify_secp256k1_sig_rpl.cycle_cnt = 0x%x\n", verify_secp256k1_sig_rpl.cycle_cnt);
 
       if (verify_secp256k1_sig_rpl.hdr.cmd != zcash_fpga::VERIFY_SECP256K1_SIG_RPL) {
-          printf("ERROR: Header type was wrong!\n");
+          zlog_error("Header type was wrong!\n");
           failed = true;
       }
       if (verify_secp256k1_sig_rpl.bm != 0) {
-          printf("ERROR: Signature verification failed!\n");
+          zlog_error("Signature verification failed!\n");
           failed = true;
       }
 
       if (verify_secp256k1_sig_rpl.index != 0xa) {
-        printf("ERROR: Index was wrong!\n");
+        zlog_error("Index was wrong!\n");
         failed = true;
       }
     }
 
+    // Test the equihash core with block 346, as is and with deliberate errors
+    if ((zfpga.m_command_cap & zcash_fpga::ENB_VERIFY_EQUIHASH_200_9) != 0) {
+      zlog_info("Testing equihash core...\n");
+
+      zcash_fpga::cblockheader_sol_t blocks[2];
+      uint8_t bm[8];
+      if (!read_block("block_346.bin", blocks[0]) || !read_block("block_346_errors.bin", blocks[1])) {
+        failed = true;
+      } else {
+        rc = zfpga.verify_equihash(blocks[0], 0xb, bm[0]);
+        fail_on(rc, out, "ERROR: Unable to verify block 346!");
+        zlog_info("verify_equihash block_346.bin bm = 0x%x\n", bm[0]);
+        if (bm[0] != 0) {
+          zlog_error("Equihash verification failed!\n");
+          failed = true;
+        }
+
+        rc = zfpga.verify_equihash(blocks[1], 0xc, bm[0]);
+        fail_on(rc, out, "ERROR: Unable to verify block 346 with errors!");
+        zlog_info("verify_equihash block_346_errors.bin bm = 0x%x\n", bm[0]);
+        if (bm[0] == 0) {
+          zlog_error("Equihash verification passed a bad solution!\n");
+          failed = true;
+        }
+
+        // Batch of both vectors alternating, the results must come back in index order
+        zcash_fpga::cblockheader_sol_t batch[8];
+        for (int i = 0; i < 8; i++) batch[i] = blocks[i % 2];
+        if (zfpga.verify_equihash_batch(batch, 8, 0x100, bm) != 8) {
+          zlog_error("Missing verify_equihash_batch replies!\n");
+          failed = true;
+        }
+        for (int i = 0; i < 8; i++) {
+          if ((bm[i] == 0) != (i % 2 == 0)) {
+            zlog_error("verify_equihash_batch result %d was 0x%x!\n", i, bm[i]);
+            failed = true;
+          }
+        }
+      }
+    }
+
     if ((zfpga.m_command_cap & zcash_fpga::ENB_BLS12_381) != 0) {
-      printf("INFO: Testing bls12_381 coprocessor...\n");
+      zlog_info("Testing bls12_381 coprocessor...\n");
 
       zfpga.bls12_381_reset_memory(true, true);
       zfpga.bls12_381_set_curr_inst_slot(0);
@@ -263,17 +1397,11 @@ int main(int argc, char **argv) {
       // Wait for interrupts
       // Try read reply - should be our scalar value - not using right now, could be used for point multiplication
 
-      timeout = 0;
-      read_len = 0;
       memset(reply, 0, 512);
-      while ((read_len = zfpga.read_stream(reply, 256)) == 0) {
-        usleep(1);
-        timeout++;
-        if (timeout > 1000) {
-          printf("ERROR: No reply received, timeout\n");
-          failed = true;
-          break;
-        }
+      read_len = zfpga.read_stream_wait(reply, 256, zcash_fpga::BLS12_381_INTERRUPT_RPL);
+      if (read_len <= 0) {
+        zlog_error("No reply received, timeout\n");
+        failed = true;
       }
 
 
@@ -281,39 +1409,33 @@ int main(int argc, char **argv) {
       // Check it matches the expected values
       bls12_381_interrupt_rpl = *(zcash_fpga::bls12_381_interrupt_rpl_t*)reply;
       if (bls12_381_interrupt_rpl.data_type != zcash_fpga::SCALAR) {
-        printf("ERROR: Interrupt data type was wrong, expected SCALAR, was [%d]\n", bls12_381_interrupt_rpl.data_type);
+        zlog_error("Interrupt data type was wrong, expected SCALAR, was [%d]\n", bls12_381_interrupt_rpl.data_type);
         failed = true;
       }
       if (bls12_381_interrupt_rpl.index != 123) {
-        printf("ERROR: Interrupt index was wrong, expected 123, was [%d]\n", bls12_381_interrupt_rpl.index);
+        zlog_error("Interrupt index was wrong, expected 123, was [%d]\n", bls12_381_interrupt_rpl.index);
         failed = true;
       }
       if (reply[sizeof(zcash_fpga::bls12_381_interrupt_rpl_t)] != 10) {
-        printf("ERROR: Interrupt data was wrong, expected 10, was [%d]\n", reply[sizeof(zcash_fpga::bls12_381_interrupt_rpl_t)]);
+        zlog_error("Interrupt data was wrong, expected 10, was [%d]\n", reply[sizeof(zcash_fpga::bls12_381_interrupt_rpl_t)]);
         failed = true;
       }
 
       // Try read second reply - should be point value - 12 slots = 576 bytes
       memset(reply, 0, 640);
-      timeout = 0;
-      read_len = 0;
-      while ((read_len = zfpga.read_stream(reply, 640)) == 0) {
-        usleep(1);
-        timeout++;
-        if (timeout > 1000) {
-          printf("ERROR: No reply received, timeout\n");
-          failed = true;
-          break;
-        }
+      read_len = zfpga.read_stream_wait(reply, 640, zcash_fpga::BLS12_381_INTERRUPT_RPL);
+      if (read_len <= 0) {
+        zlog_error("No reply received, timeout\n");
+        failed = true;
       }
      // Check it matches the expected values
       bls12_381_interrupt_rpl = *(zcash_fpga::bls12_381_interrupt_rpl_t*)reply;
       if (bls12_381_interrupt_rpl.data_type != zcash_fpga::FE12) {
-        printf("ERROR: Interrupt data type was wrong, expected FE12, was [%d]\n", bls12_381_interrupt_rpl.data_type);
+        zlog_error("Interrupt data type was wrong, expected FE12, was [%d]\n", bls12_381_interrupt_rpl.data_type);
         failed = true;
       }
       if (bls12_381_interrupt_rpl.index != 456) {
-        printf("ERROR: Interrupt index was wrong, expected 456, was [%d]\n", bls12_381_interrupt_rpl.index);
+        zlog_error("Interrupt index was wrong, expected 456, was [%d]\n", bls12_381_interrupt_rpl.index);
         failed = true;
       }
 
@@ -334,7 +1456,7 @@ int main(int argc, char **argv) {
       string_to_hex("079ab7b345eb23c944c957a36a6b74c37537163d4cbf73bad9751de1dd9c68ef72cb21447e259880f72a871c3eda1b0c", (unsigned char *)&exp_res[11*48]);
 
       if (memcmp((void*)&(reply[sizeof(zcash_fpga::bls12_381_interrupt_rpl_t)]), (void*)exp_res, 12*48) != 0) {
-        printf("ERROR: Interrupt data was wrong (check data slot 1-13)!\n");
+        zlog_error("Interrupt data was wrong (check data slot 1-13)!\n");
         failed = true;
       }
 
@@ -343,23 +1465,60 @@ int main(int argc, char **argv) {
       rc = zfpga.bls12_381_get_curr_inst_slot(slot_id);
       fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
 
-      printf("INFO: Data slot is now %d\n", slot_id);
+      zlog_info("Data slot is now %d\n", slot_id);
 
       // Print out data slots
+      zcash_fpga::bls12_381_data_t slots[13];
+      rc = zfpga.bls12_381_get_data_slots(0, slots, 13);
+      fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
       for(int i = 0; i < 13; i++) {
-        zfpga.bls12_381_get_data_slot(i, data);
-        printf("slot %d, pt: %d, data:0x", i, data.point_type);
-        for(int j = 47; j >= 0; j--) printf("%02x", data.dat[j]);
-        printf("\n");
+        char hex[2*48 + 1];
+        for(int j = 47; j >= 0; j--) sprintf(&hex[2*(47 - j)], "%02x", slots[i].dat[j]);
+        zlog_info("slot %d, pt: %d, data:0x%s\n", i, slots[i].point_type, hex);
       }
     }
+
+    if ((zfpga.m_command_cap & zcash_fpga::ENB_VERIFY_SECP256K1_SIG) != 0) {
+      zlog_info("Testing async request routing...\n");
+      if (!test_async(zfpga)) failed = true;
+    }
+
+    // Over PCIe only the interrupt device posts a reply fd, which needs an AFI routing it
+    if (sim) {
+      zlog_info("Testing reply notification...\n");
+      if (!test_reply_eventfd(zfpga)) failed = true;
+      zlog_info("Testing the FPGA pool...\n");
+      if (!test_pool()) failed = true;
+      zlog_info("Testing command coalescing and dispatch failover...\n");
+      if (!test_coalescing()) failed = true;
+      if (!test_dispatch_failover()) failed = true;
+    }
+
+    zlog_info("Testing the BLS12_381 CPU reference...\n");
+    if (!test_bls12_381_cpu()) failed = true;
+    zlog_info("Testing the Equihash (144,5) CPU verifier...\n");
+    if (!test_equihash_144_5()) failed = true;
+
+    // Host side BLS12_381 routines
+    if ((zfpga.m_command_cap & zcash_fpga::ENB_BLS12_381) != 0) {
+      zlog_info("Testing bls12_381 routines...\n");
+      if (!test_programs(zfpga)) failed = true;
+      if (!test_expr(zfpga)) failed = true;
+      if (!test_pairing(zfpga)) failed = true;
+      if (!test_bls_batch(zfpga)) failed = true;
+      if (!test_groth16(zfpga)) failed = true;
+      if (!test_msm(zfpga)) failed = true;
+      if (!test_sched(zfpga)) failed = true;
+      if (!test_results(zfpga)) failed = true;
+    }
+
     if (!failed) {
-      printf("INFO: All tests passed!\n");
+      zlog_info("All tests passed!\n");
     } else {
-      printf("ERROR: Tests did not pass!\n");
+      zlog_error("Tests did not pass!\n");
     }
 
-    return rc;
+    return failed ? 1 : rc;
 out:
     return 1;
 }
@@ -0,0 +1,863 @@
+#include "zcash_bls12_381_cpu.hpp"
+
+#include <string.h>
+
+typedef unsigned __int128 u128;
+
+// Fp in Montgomery form with R = 2^384, little endian limbs
+typedef struct { uint64_t l[6]; } fp_t;
+typedef struct { fp_t c[2]; } fp2_t;
+typedef struct { fp2_t c[3]; } fp6_t;
+typedef struct { fp6_t c[2]; } fp12_t;
+
+// Jacobian point on E'(Fp2), G1 points use c[1] = 0 and z = 0 is the point at infinity
+typedef struct { fp2_t x, y, z; } jb_t;
+
+static const uint64_t s_p[6] = {
+  0xb9feffffffffaaabULL, 0x1eabfffeb153ffffULL, 0x6730d2a0f6b0f624ULL,
+  0x64774b84f38512bfULL, 0x4b1ba7b6434bacd7ULL, 0x1a0111ea397fe69aULL
+};
+static const uint64_t s_inv = 0x89f3fffcfffcfffdULL;  // -p^-1 mod 2^64
+static const uint64_t s_r2[6] = {                     // R^2 mod p
+  0xf4df1f341c341746ULL, 0x0a76e6a609d104f1ULL, 0x8de5476c4c95b6d5ULL,
+  0x67eb88a9939d83c0ULL, 0x9a793e85b519952dULL, 0x11988fe592cae3aaULL
+};
+static const uint64_t s_one[6] = {                    // R mod p
+  0x760900000002fffdULL, 0xebf4000bc40c0002ULL, 0x5f48985753c758baULL,
+  0x77ce585370525745ULL, 0x5c071a97a256ec6dULL, 0x15f65ec3fa80e493ULL
+};
+
+// ATE_X and ATE_X_START in bls12_381_pkg.sv
+static const uint64_t s_ate_x = 0xd201000000010000ULL;
+static const int s_ate_x_start = 63;
+
+// FROBENIUS_COEFF_* in bls12_381_pkg.sv as (c0, c1) per power, only powers 0 to 3 are used
+static const char* s_frob_hex[4][4][2] = {
+  // FQ2_C1
+  {{"1", "0"},
+   {"1a0111ea397fe69a4b1ba7b6434bacd764774b84f38512bf6730d2a0f6b0f6241eabfffeb153ffffb9feffffffffaaaa", "0"},
+   {"1", "0"},
+   {"1a0111ea397fe69a4b1ba7b6434bacd764774b84f38512bf6730d2a0f6b0f6241eabfffeb153ffffb9feffffffffaaaa", "0"}},
+  // FQ6_C1
+  {{"1", "0"},
+   {"0", "1a0111ea397fe699ec02408663d4de85aa0d857d89759ad4897d29650fb85f9b409427eb4f49fffd8bfd00000000aaac"},
+   {"00000000000000005f19672fdf76ce51ba69c6076a0f77eaddb3a93be6f89688de17d813620a00022e01fffffffefffe", "0"},
+   {"0", "1"}},
+  // FQ6_C2
+  {{"1", "0"},
+   {"1a0111ea397fe699ec02408663d4de85aa0d857d89759ad4897d29650fb85f9b409427eb4f49fffd8bfd00000000aaad", "0"},
+   {"1a0111ea397fe699ec02408663d4de85aa0d857d89759ad4897d29650fb85f9b409427eb4f49fffd8bfd00000000aaac", "0"},
+   {"1a0111ea397fe69a4b1ba7b6434bacd764774b84f38512bf6730d2a0f6b0f6241eabfffeb153ffffb9feffffffffaaaa", "0"}},
+  // FQ12_C1
+  {{"1", "0"},
+   {"1904d3bf02bb0667c231beb4202c0d1f0fd603fd3cbd5f4f7b2443d784bab9c4f67ea53d63e7813d8d0775ed92235fb8",
+    "00fc3e2b36c4e03288e9e902231f9fb854a14787b6c7b36fec0c8ec971f63c5f282d5ac14d6c7ec22cf78a126ddc4af3"},
+   {"00000000000000005f19672fdf76ce51ba69c6076a0f77eaddb3a93be6f89688de17d813620a00022e01fffffffeffff", "0"},
+   {"135203e60180a68ee2e9c448d77a2cd91c3dedd930b1cf60ef396489f61eb45e304466cf3e67fa0af1ee7b04121bdea2",
+    "06af0e0437ff400b6831e36d6bd17ffe48395dabc2d3435e77f76e17009241c5ee67992f72ec05f4c81084fbede3cc09"}}
+};
+
+enum { FROB_FQ2_C1 = 0, FROB_FQ6_C1 = 1, FROB_FQ6_C2 = 2, FROB_FQ12_C1 = 3 };
+
+/*
+ * Fp
+ */
+static bool fp_is_zero(const fp_t& a) {
+  return (a.l[0] | a.l[1] | a.l[2] | a.l[3] | a.l[4] | a.l[5]) == 0;
+}
+
+static bool fp_geq_p(const uint64_t* a) {
+  for (int i = 5; i >= 0; i--)
+    if (a[i] != s_p[i]) return a[i] > s_p[i];
+  return true;
+}
+
+static void fp_sub_p(uint64_t* a) {
+  uint64_t borrow = 0;
+  for (int i = 0; i < 6; i++) {
+    u128 d = (u128)a[i] - s_p[i] - borrow;
+    a[i] = (uint64_t)d;
+    borrow = (uint64_t)(d >> 64) & 1;
+  }
+}
+
+static void fp_add(fp_t& r, const fp_t& a, const fp_t& b) {
+  u128 c = 0;
+  for (int i = 0; i < 6; i++) {
+    c += (u128)a.l[i] + b.l[i];
+    r.l[i] = (uint64_t)c;
+    c >>= 64;
+  }
+  if (fp_geq_p(r.l)) fp_sub_p(r.l);
+}
+
+static void fp_sub(fp_t& r, const fp_t& a, const fp_t& b) {
+  uint64_t borrow = 0;
+  for (int i = 0; i < 6; i++) {
+    u128 d = (u128)a.l[i] - b.l[i] - borrow;
+    r.l[i] = (uint64_t)d;
+    borrow = (uint64_t)(d >> 64) & 1;
+  }
+  if (borrow) {
+    u128 c = 0;
+    for (int i = 0; i < 6; i++) {
+      c += (u128)r.l[i] + s_p[i];
+      r.l[i] = (uint64_t)c;
+      c >>= 64;
+    }
+  }
+}
+
+static void fp_neg(fp_t& r, const fp_t& a) {
+  fp_t zero;
+  memset(&zero, 0, sizeof(zero));
+  fp_sub(r, zero, a);
+}
+
+// Montgomery multiplication (CIOS), r may alias a or b
+static void fp_mul(fp_t& r, const fp_t& a, const fp_t& b) {
+  uint64_t t[8] = {0};
+  for (int i = 0; i < 6; i++) {
+    u128 c = 0;
+    for (int j = 0; j < 6; j++) {
+      c += (u128)a.l[j] * b.l[i] + t[j];
+      t[j] = (uint64_t)c;
+      c >>= 64;
+    }
+    c += t[6];
+    t[6] = (uint64_t)c;
+    t[7] = (uint64_t)(c >> 64);
+
+    uint64_t m = t[0] * s_inv;
+    c = ((u128)m * s_p[0] + t[0]) >> 64;
+    for (int j = 1; j < 6; j++) {
+      c += (u128)m * s_p[j] + t[j];
+      t[j - 1] = (uint64_t)c;
+      c >>= 64;
+    }
+    c += t[6];
+    t[5] = (uint64_t)c;
+    t[6] = t[7] + (uint64_t)(c >> 64);
+  }
+  memcpy(r.l, t, sizeof(r.l));
+  if (t[6] != 0 || fp_geq_p(r.l)) fp_sub_p(r.l);
+}
+
+// a^(p - 2)
+static void fp_inv(fp_t& r, const fp_t& a) {
+  fp_t x;
+  uint64_t e[6];
+  memcpy(e, s_p, sizeof(e));
+  e[0] -= 2;
+  memcpy(x.l, s_one, sizeof(x.l));
+  for (int i = 380; i >= 0; i--) {
+    fp_mul(x, x, x);
+    if ((e[i / 64] >> (i % 64)) & 1) fp_mul(x, x, a);
+  }
+  r = x;
+}
+
+static void fp_one(fp_t& r) {
+  memcpy(r.l, s_one, sizeof(r.l));
+}
+
+static void fp_load(fp_t& r, const uint8_t* dat) {
+  fp_t raw, r2;
+  for (int i = 0; i < 6; i++) {
+    raw.l[i] = 0;
+    for (int j = 7; j >= 0; j--) raw.l[i] = (raw.l[i] << 8) | dat[8*i + j];
+  }
+  memcpy(r2.l, s_r2, sizeof(r2.l));
+  fp_mul(r, raw, r2);
+}
+
+static void fp_store(const fp_t& a, uint8_t* dat) {
+  fp_t one, x;
+  memset(&one, 0, sizeof(one));
+  one.l[0] = 1;
+  fp_mul(x, a, one);
+  for (int i = 0; i < 6; i++)
+    for (int j = 0; j < 8; j++) dat[8*i + j] = x.l[i] >> (8*j);
+}
+
+/*
+ * Fp2 = Fp[u]/(u^2 + 1)
+ */
+static void fp2_zero(fp2_t& r) {
+  memset(&r, 0, sizeof(r));
+}
+
+static void fp2_one(fp2_t& r) {
+  fp_one(r.c[0]);
+  memset(&r.c[1], 0, sizeof(r.c[1]));
+}
+
+static bool fp2_is_zero(const fp2_t& a) {
+  return fp_is_zero(a.c[0]) && fp_is_zero(a.c[1]);
+}
+
+static bool fp2_eq(const fp2_t& a, const fp2_t& b) {
+  return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+static void fp2_add(fp2_t& r, const fp2_t& a, const fp2_t& b) {
+  fp_add(r.c[0], a.c[0], b.c[0]);
+  fp_add(r.c[1], a.c[1], b.c[1]);
+}
+
+static void fp2_sub(fp2_t& r, const fp2_t& a, const fp2_t& b) {
+  fp_sub(r.c[0], a.c[0], b.c[0]);
+  fp_sub(r.c[1], a.c[1], b.c[1]);
+}
+
+static void fp2_neg(fp2_t& r, const fp2_t& a) {
+  fp_neg(r.c[0], a.c[0]);
+  fp_neg(r.c[1], a.c[1]);
+}
+
+static void fp2_mul(fp2_t& r, const fp2_t& a, const fp2_t& b) {
+  fp_t t0, t1, t2, t3;
+  fp_mul(t0, a.c[0], b.c[0]);
+  fp_mul(t1, a.c[1], b.c[1]);
+  fp_mul(t2, a.c[0], b.c[1]);
+  fp_mul(t3, a.c[1], b.c[0]);
+  fp_sub(r.c[0], t0, t1);
+  fp_add(r.c[1], t2, t3);
+}
+
+static void fp2_mul_fp(fp2_t& r, const fp2_t& a, const fp_t& b) {
+  fp_mul(r.c[0], a.c[0], b);
+  fp_mul(r.c[1], a.c[1], b);
+}
+
+// Multiplies by u + 1
+static void fp2_mul_nr(fp2_t& r, const fp2_t& a) {
+  fp_t t;
+  fp_sub(t, a.c[0], a.c[1]);
+  fp_add(r.c[1], a.c[0], a.c[1]);
+  r.c[0] = t;
+}
+
+static void fp2_inv(fp2_t& r, const fp2_t& a) {
+  fp_t t0, t1;
+  fp_mul(t0, a.c[0], a.c[0]);
+  fp_mul(t1, a.c[1], a.c[1]);
+  fp_add(t0, t0, t1);
+  fp_inv(t0, t0);
+  fp_mul(r.c[0], a.c[0], t0);
+  fp_neg(t1, a.c[1]);
+  fp_mul(r.c[1], t1, t0);
+}
+
+/*
+ * Fp6 = Fp2[v]/(v^3 - (u + 1))
+ */
+static void fp6_add(fp6_t& r, const fp6_t& a, const fp6_t& b) {
+  for (int i = 0; i < 3; i++) fp2_add(r.c[i], a.c[i], b.c[i]);
+}
+
+static void fp6_sub(fp6_t& r, const fp6_t& a, const fp6_t& b) {
+  for (int i = 0; i < 3; i++) fp2_sub(r.c[i], a.c[i], b.c[i]);
+}
+
+static void fp6_neg(fp6_t& r, const fp6_t& a) {
+  for (int i = 0; i < 3; i++) fp2_neg(r.c[i], a.c[i]);
+}
+
+static void fp6_mul_nr(fp6_t& r, const fp6_t& a) {
+  fp2_t t;
+  fp2_mul_nr(t, a.c[2]);
+  r.c[2] = a.c[1];
+  r.c[1] = a.c[0];
+  r.c[0] = t;
+}
+
+static void fp6_mul(fp6_t& r, const fp6_t& a, const fp6_t& b) {
+  fp2_t aa, bb, cc, t, s;
+  fp6_t x;
+  fp2_mul(aa, a.c[0], b.c[0]);
+  fp2_mul(bb, a.c[1], b.c[1]);
+  fp2_mul(cc, a.c[2], b.c[2]);
+
+  fp2_add(s, a.c[1], a.c[2]);
+  fp2_add(t, b.c[1], b.c[2]);
+  fp2_mul(s, s, t);
+  fp2_sub(s, s, bb);
+  fp2_sub(s, s, cc);
+  fp2_mul_nr(s, s);
+  fp2_add(x.c[0], s, aa);
+
+  fp2_add(s, b.c[0], b.c[2]);
+  fp2_add(t, a.c[0], a.c[2]);
+  fp2_mul(s, s, t);
+  fp2_sub(s, s, aa);
+  fp2_add(s, s, bb);
+  fp2_sub(x.c[2], s, cc);
+
+  fp2_add(s, b.c[0], b.c[1]);
+  fp2_add(t, a.c[0], a.c[1]);
+  fp2_mul(s, s, t);
+  fp2_sub(s, s, aa);
+  fp2_sub(s, s, bb);
+  fp2_mul_nr(cc, cc);
+  fp2_add(x.c[1], cc, s);
+  r = x;
+}
+
+static void fp6_inv(fp6_t& r, const fp6_t& a) {
+  fp2_t t0, t1, t2, t3, t4, t5;
+  fp2_mul_nr(t3, a.c[2]);
+  fp2_mul(t3, t3, a.c[1]);
+  fp2_neg(t3, t3);
+  fp2_mul(t0, a.c[0], a.c[0]);
+  fp2_add(t3, t0, t3);
+  fp2_mul(t4, a.c[2], a.c[2]);
+  fp2_mul_nr(t4, t4);
+  fp2_mul(t2, a.c[0], a.c[1]);
+  fp2_sub(t4, t4, t2);
+  fp2_mul(t5, a.c[1], a.c[1]);
+  fp2_mul(t2, a.c[2], a.c[0]);
+  fp2_sub(t5, t5, t2);
+  fp2_mul(t0, a.c[2], t4);
+  fp2_mul(t1, a.c[1], t5);
+  fp2_add(t1, t0, t1);
+  fp2_mul_nr(t1, t1);
+  fp2_mul(t0, a.c[0], t3);
+  fp2_add(t1, t1, t0);
+  fp2_inv(t1, t1);
+  fp2_mul(r.c[0], t3, t1);
+  fp2_mul(r.c[1], t4, t1);
+  fp2_mul(r.c[2], t5, t1);
+}
+
+/*
+ * Fp12 = Fp6[w]/(w^2 - v)
+ */
+static void fp12_one(fp12_t& r) {
+  memset(&r, 0, sizeof(r));
+  fp2_one(r.c[0].c[0]);
+}
+
+static void fp12_conj(fp12_t& r, const fp12_t& a) {
+  r.c[0] = a.c[0];
+  fp6_neg(r.c[1], a.c[1]);
+}
+
+static void fp12_mul(fp12_t& r, const fp12_t& a, const fp12_t& b) {
+  fp6_t aa, bb, s, t;
+  fp6_mul(aa, a.c[0], b.c[0]);
+  fp6_mul(bb, a.c[1], b.c[1]);
+  fp6_add(s, a.c[1], a.c[0]);
+  fp6_add(t, b.c[0], b.c[1]);
+  fp6_mul(s, s, t);
+  fp6_sub(s, s, aa);
+  fp6_sub(r.c[1], s, bb);
+  fp6_mul_nr(bb, bb);
+  fp6_add(r.c[0], bb, aa);
+}
+
+static void fp12_sqr(fp12_t& r, const fp12_t& a) {
+  fp6_t ab, c0c1, s;
+  fp6_mul(ab, a.c[0], a.c[1]);
+  fp6_add(c0c1, a.c[0], a.c[1]);
+  fp6_mul_nr(s, a.c[1]);
+  fp6_add(s, s, a.c[0]);
+  fp6_mul(s, s, c0c1);
+  fp6_sub(s, s, ab);
+  fp6_add(r.c[1], ab, ab);
+  fp6_mul_nr(ab, ab);
+  fp6_sub(r.c[0], s, ab);
+}
+
+static void fp12_inv(fp12_t& r, const fp12_t& a) {
+  fp6_t t0, t1;
+  fp6_mul(t0, a.c[0], a.c[0]);
+  fp6_mul(t1, a.c[1], a.c[1]);
+  fp6_mul_nr(t1, t1);
+  fp6_sub(t0, t0, t1);
+  fp6_inv(t0, t0);
+  fp6_mul(t1, a.c[1], t0);
+  fp6_mul(r.c[0], a.c[0], t0);
+  fp6_neg(r.c[1], t1);
+}
+
+static void fp12_fmap(fp12_t& r, const fp12_t& a, unsigned int pow, const uint64_t frob[4][4][2][6]) {
+  const fp2_t* c2 = (const fp2_t*)frob[FROB_FQ2_C1];
+  const fp2_t* c6_1 = (const fp2_t*)frob[FROB_FQ6_C1];
+  const fp2_t* c6_2 = (const fp2_t*)frob[FROB_FQ6_C2];
+  const fp2_t* c12 = (const fp2_t*)frob[FROB_FQ12_C1];
+  for (int k = 0; k < 2; k++) {
+    for (int i = 0; i < 3; i++) {
+      r.c[k].c[i].c[0] = a.c[k].c[i].c[0];
+      fp_mul(r.c[k].c[i].c[1], a.c[k].c[i].c[1], c2[pow % 2].c[0]);
+    }
+    fp2_mul(r.c[k].c[1], r.c[k].c[1], c6_1[pow % 6]);
+    fp2_mul(r.c[k].c[2], r.c[k].c[2], c6_2[pow % 6]);
+  }
+  for (int i = 0; i < 3; i++) fp2_mul(r.c[1].c[i], r.c[1].c[i], c12[pow % 12]);
+}
+
+// a^e conjugated, as fe12_pow() since ATE_X is the absolute value of the negative x
+static void fp12_pow(fp12_t& r, const fp12_t& a, uint64_t e) {
+  fp12_t x = a, y;
+  fp12_one(y);
+  while (e != 0) {
+    if (e & 1) fp12_mul(y, y, x);
+    fp12_sqr(x, x);
+    e >>= 1;
+  }
+  fp12_conj(r, y);
+}
+
+static void fp12_load(fp12_t& r, const bls12_381_fe12_t& a) {
+  for (int k = 0; k < 2; k++)
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 2; j++) fp_load(r.c[k].c[i].c[j], a.dat[6*k + 2*i + j]);
+}
+
+static void fp12_store(const fp12_t& a, bls12_381_fe12_t& r) {
+  for (int k = 0; k < 2; k++)
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 2; j++) fp_store(a.c[k].c[i].c[j], r.dat[6*k + 2*i + j]);
+}
+
+/*
+ * Points, the formulas of add_fp2_jb_point() and dbl_fp2_jb_point()
+ */
+static void point_dbl(jb_t& r, const jb_t& p) {
+  fp2_t a, b, c, d, t;
+  if (fp2_is_zero(p.z)) {
+    r = p;
+    return;
+  }
+  fp2_mul(a, p.y, p.y);
+  fp2_mul(b, p.x, a);
+  fp2_add(b, b, b);
+  fp2_add(b, b, b);
+  fp2_mul(c, a, a);
+  fp2_add(c, c, c);
+  fp2_add(c, c, c);
+  fp2_add(c, c, c);
+  fp2_mul(d, p.x, p.x);
+  fp2_add(t, d, d);
+  fp2_add(d, t, d);
+  fp2_mul(r.z, p.y, p.z);
+  fp2_add(r.z, r.z, r.z);
+  fp2_mul(t, d, d);
+  fp2_sub(t, t, b);
+  fp2_sub(r.x, t, b);
+  fp2_sub(t, b, r.x);
+  fp2_mul(t, d, t);
+  fp2_sub(r.y, t, c);
+}
+
+static void point_add(jb_t& r, const jb_t& p1, const jb_t& p2) {
+  fp2_t u1, u2, s1, s2, h, h2, h3, rr, t;
+  if (fp2_is_zero(p1.z)) {
+    r = p2;
+    return;
+  }
+  if (fp2_is_zero(p2.z)) {
+    r = p1;
+    return;
+  }
+  if (fp2_eq(p1.x, p2.x) && fp2_eq(p1.y, p2.y)) {
+    point_dbl(r, p1);
+    return;
+  }
+  fp2_mul(t, p2.z, p2.z);
+  fp2_mul(u1, p1.x, t);
+  fp2_mul(t, t, p2.z);
+  fp2_mul(s1, p1.y, t);
+  fp2_mul(t, p1.z, p1.z);
+  fp2_mul(u2, p2.x, t);
+  fp2_mul(t, t, p1.z);
+  fp2_mul(s2, p2.y, t);
+  fp2_sub(h, u2, u1);
+  fp2_sub(rr, s2, s1);
+  fp2_mul(h2, h, h);
+  fp2_mul(h3, h2, h);
+  fp2_mul(u1, u1, h2);
+
+  fp2_mul(r.z, p1.z, p2.z);
+  fp2_mul(r.z, r.z, h);
+  fp2_mul(t, rr, rr);
+  fp2_sub(t, t, h3);
+  fp2_sub(t, t, u1);
+  fp2_sub(r.x, t, u1);
+  fp2_sub(t, u1, r.x);
+  fp2_mul(t, t, rr);
+  fp2_mul(s1, s1, h3);
+  fp2_sub(r.y, t, s1);
+}
+
+// Returns 1 for the point at infinity
+static int point_affine(const jb_t& p, fp2_t& x, fp2_t& y) {
+  fp2_t z;
+  if (fp2_is_zero(p.z)) {
+    fp2_zero(x);
+    fp2_zero(y);
+    return 1;
+  }
+  fp2_inv(z, p.z);
+  fp2_mul(y, z, z);
+  fp2_mul(x, p.x, y);
+  fp2_mul(y, y, z);
+  fp2_mul(y, p.y, y);
+  return 0;
+}
+
+static void point_mult(jb_t& r, const uint8_t* k, const jb_t& p) {
+  jb_t addend = p;
+  memset(&r, 0, sizeof(r));
+  for (int i = 0; i < 384; i++) {
+    if ((k[i / 8] >> (i % 8)) & 1) point_add(r, r, addend);
+    point_dbl(addend, addend);
+  }
+}
+
+static void g1_load(jb_t& r, const bls12_381_g1_af_t& p) {
+  memset(&r, 0, sizeof(r));
+  fp_load(r.x.c[0], p.dat[0]);
+  fp_load(r.y.c[0], p.dat[1]);
+  fp2_one(r.z);
+}
+
+static void g2_load(jb_t& r, const bls12_381_g2_af_t& q) {
+  for (int i = 0; i < 2; i++) {
+    fp_load(r.x.c[i], q.dat[i]);
+    fp_load(r.y.c[i], q.dat[2 + i]);
+  }
+  fp2_one(r.z);
+}
+
+/*
+ * Miller loop steps of bls12_381_pkg.sv, each returns the sparse line value in f
+ */
+static void miller_dbl(jb_t& r, const fp_t& px, const fp_t& py, fp12_t& f) {
+  fp2_t t0, t1, t2, t3, t4, t5, t6, zsq;
+  fp2_mul(zsq, r.z, r.z);
+  fp2_mul(t0, r.x, r.x);
+  fp2_add(t4, t0, t0);
+  fp2_add(t4, t4, t0);
+
+  fp2_mul(t1, r.y, r.y);
+  fp2_mul(t2, t1, t1);
+  fp2_add(t3, r.x, t1);
+  fp2_mul(t3, t3, t3);
+  fp2_sub(t3, t3, t0);
+  fp2_sub(t3, t3, t2);
+  fp2_add(t3, t3, t3);
+  fp2_add(t6, r.x, t4);
+  fp2_mul(t5, t4, t4);
+
+  fp2_sub(r.x, t5, t3);
+  fp2_sub(r.x, r.x, t3);
+
+  fp2_add(r.z, r.z, r.y);
+  fp2_mul(r.z, r.z, r.z);
+  fp2_sub(r.z, r.z, t1);
+  fp2_sub(r.z, r.z, zsq);
+
+  fp2_sub(r.y, t3, r.x);
+  fp2_mul(r.y, r.y, t4);
+  fp2_add(t2, t2, t2);
+  fp2_add(t2, t2, t2);
+  fp2_add(t2, t2, t2);
+  fp2_sub(r.y, r.y, t2);
+
+  fp2_mul(t3, t4, zsq);
+  fp2_add(t3, t3, t3);
+  fp2_neg(t3, t3);
+
+  fp2_mul(t6, t6, t6);
+  fp2_sub(t6, t6, t0);
+  fp2_sub(t6, t6, t5);
+  fp2_add(t1, t1, t1);
+  fp2_add(t1, t1, t1);
+  fp2_sub(t6, t6, t1);
+
+  fp2_mul(t0, r.z, zsq);
+  fp2_add(t0, t0, t0);
+  fp2_mul_fp(t0, t0, py);
+  fp2_mul_fp(t3, t3, px);
+
+  memset(&f, 0, sizeof(f));
+  f.c[1].c[1] = t0;
+  f.c[0].c[1] = t3;
+  f.c[0].c[0] = t6;
+}
+
+static void miller_add(jb_t& r, const jb_t& q, const fp_t& px, const fp_t& py, fp12_t& f) {
+  fp2_t zsq, ysq, t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10;
+  fp2_mul(zsq, r.z, r.z);
+  fp2_mul(ysq, q.y, q.y);
+  fp2_mul(t0, zsq, q.x);
+
+  fp2_add(t1, r.z, q.y);
+  fp2_mul(t1, t1, t1);
+  fp2_sub(t1, t1, ysq);
+  fp2_sub(t1, t1, zsq);
+  fp2_mul(t1, t1, zsq);
+
+  fp2_sub(t2, t0, r.x);
+  fp2_mul(t3, t2, t2);
+  fp2_add(t4, t3, t3);
+  fp2_add(t4, t4, t4);
+  fp2_mul(t5, t4, t2);
+
+  fp2_sub(t6, t1, r.y);
+  fp2_sub(t6, t6, r.y);
+  fp2_mul(t9, t6, q.x);
+  fp2_mul(t7, t4, r.x);
+
+  fp2_mul(r.x, t6, t6);
+  fp2_sub(r.x, r.x, t5);
+  fp2_sub(r.x, r.x, t7);
+  fp2_sub(r.x, r.x, t7);
+
+  fp2_add(r.z, r.z, t2);
+  fp2_mul(r.z, r.z, r.z);
+  fp2_sub(r.z, r.z, zsq);
+  fp2_sub(r.z, r.z, t3);
+
+  fp2_mul(zsq, r.z, r.z);
+
+  fp2_add(t10, q.y, r.z);
+  fp2_sub(t8, t7, r.x);
+  fp2_mul(t8, t8, t6);
+
+  fp2_mul(t0, r.y, t5);
+  fp2_add(t0, t0, t0);
+  fp2_sub(r.y, t8, t0);
+
+  fp2_mul(t10, t10, t10);
+  fp2_sub(t10, t10, ysq);
+  fp2_sub(t10, t10, zsq);
+
+  fp2_add(t9, t9, t9);
+  fp2_sub(t9, t9, t10);
+
+  fp2_add(t10, r.z, r.z);
+  fp2_neg(t6, t6);
+  fp2_add(t1, t6, t6);
+
+  fp2_mul_fp(t10, t10, py);
+  fp2_mul_fp(t1, t1, px);
+
+  memset(&f, 0, sizeof(f));
+  f.c[1].c[1] = t10;
+  f.c[0].c[1] = t1;
+  f.c[0].c[0] = t9;
+}
+
+zcash_bls12_381_cpu::zcash_bls12_381_cpu() {
+  for (int t = 0; t < 4; t++)
+    for (int pow = 0; pow < 4; pow++)
+      for (int c = 0; c < 2; c++) {
+        bls12_381_fe_t v;
+        fp_t x;
+        v.set_hex(0, s_frob_hex[t][pow][c]);
+        fp_load(x, v.dat[0]);
+        memcpy(m_frob[t][pow][c], x.l, sizeof(x.l));
+      }
+}
+
+void zcash_bls12_381_cpu::fe12_mul(const bls12_381_fe12_t& a, const bls12_381_fe12_t& b, bls12_381_fe12_t& r) const {
+  fp12_t x, y;
+  fp12_load(x, a);
+  fp12_load(y, b);
+  fp12_mul(x, x, y);
+  fp12_store(x, r);
+}
+
+void zcash_bls12_381_cpu::miller_loop(const bls12_381_g1_af_t& p, const bls12_381_g2_af_t& q,
+                                      bls12_381_fe12_t& f) const {
+  fp_t px, py;
+  jb_t r, qj;
+  fp12_t acc, l;
+
+  fp_load(px, p.dat[0]);
+  fp_load(py, p.dat[1]);
+  g2_load(qj, q);
+  r = qj;
+  fp12_one(acc);
+  for (int i = s_ate_x_start - 1; i >= 0; i--) {
+    fp12_sqr(acc, acc);
+    miller_dbl(r, px, py, l);
+    fp12_mul(acc, acc, l);
+    if ((s_ate_x >> i) & 1) {
+      miller_add(r, qj, px, py, l);
+      fp12_mul(acc, acc, l);
+    }
+  }
+  fp12_store(acc, f);
+}
+
+void zcash_bls12_381_cpu::final_exp(const bls12_381_fe12_t& f, bls12_381_fe12_t& r) const {
+  fp12_t t0, t1, t2, t3, t4;
+
+  fp12_load(t0, f);
+  fp12_conj(t4, t0);
+  fp12_inv(t3, t4);
+  fp12_mul(t4, t0, t3);
+  fp12_fmap(t2, t4, 2, m_frob);
+  fp12_mul(t4, t2, t4);
+  fp12_mul(t0, t4, t4);
+  fp12_pow(t1, t0, s_ate_x);
+
+  fp12_pow(t2, t1, s_ate_x >> 1);
+  fp12_conj(t3, t4);
+  fp12_mul(t1, t1, t3);
+  fp12_conj(t1, t1);
+
+  fp12_mul(t1, t1, t2);
+  fp12_pow(t2, t1, s_ate_x);
+  fp12_pow(t3, t2, s_ate_x);
+
+  fp12_conj(t1, t1);
+  fp12_mul(t3, t3, t1);
+
+  fp12_conj(t1, t1);
+  fp12_fmap(t1, t1, 3, m_frob);
+  fp12_fmap(t2, t2, 2, m_frob);
+
+  fp12_mul(t1, t1, t2);
+  fp12_pow(t2, t3, s_ate_x);
+
+  fp12_mul(t2, t2, t0);
+  fp12_mul(t2, t2, t4);
+  fp12_mul(t1, t1, t2);
+
+  fp12_fmap(t2, t3, 1, m_frob);
+  fp12_mul(t1, t1, t2);
+  fp12_store(t1, r);
+}
+
+void zcash_bls12_381_cpu::ate_pairing(const bls12_381_g1_af_t& p, const bls12_381_g2_af_t& q,
+                                      bls12_381_fe12_t& f) const {
+  miller_loop(p, q, f);
+  final_exp(f, f);
+}
+
+bool zcash_bls12_381_cpu::fe12_is_one(const bls12_381_fe12_t& f) {
+  bls12_381_fe12_t one;
+  one.dat[0][0] = 1;
+  return memcmp(f.dat, one.dat, sizeof(f.dat)) == 0;
+}
+
+int zcash_bls12_381_cpu::point_mult(const bls12_381_scalar_t& k, const bls12_381_g1_af_t& p,
+                                    bls12_381_g1_af_t& r) const {
+  jb_t a, b;
+  fp2_t x, y;
+  int inf;
+  g1_load(a, p);
+  ::point_mult(b, k.dat[0], a);
+  inf = point_affine(b, x, y);
+  fp_store(x.c[0], r.dat[0]);
+  fp_store(y.c[0], r.dat[1]);
+  return inf;
+}
+
+int zcash_bls12_381_cpu::point_mult(const bls12_381_scalar_t& k, const bls12_381_g2_af_t& p,
+                                    bls12_381_g2_af_t& r) const {
+  jb_t a, b;
+  fp2_t x, y;
+  int inf;
+  g2_load(a, p);
+  ::point_mult(b, k.dat[0], a);
+  inf = point_affine(b, x, y);
+  for (int i = 0; i < 2; i++) {
+    fp_store(x.c[i], r.dat[i]);
+    fp_store(y.c[i], r.dat[2 + i]);
+  }
+  return inf;
+}
+
+int zcash_bls12_381_cpu::point_add(const bls12_381_g1_af_t& a, const bls12_381_g1_af_t& b,
+                                   bls12_381_g1_af_t& r) const {
+  jb_t x, y;
+  fp2_t rx, ry;
+  int inf;
+  g1_load(x, a);
+  g1_load(y, b);
+  // add_jb_point() doubles equal points but P + -P has H = 0 and so Z = 0
+  ::point_add(x, x, y);
+  inf = point_affine(x, rx, ry);
+  fp_store(rx.c[0], r.dat[0]);
+  fp_store(ry.c[0], r.dat[1]);
+  return inf;
+}
+
+int zcash_bls12_381_cpu::to_affine(const bls12_381_g1_jb_t& p, bls12_381_g1_af_t& r) const {
+  jb_t a;
+  fp2_t x, y;
+  int inf;
+  memset(&a, 0, sizeof(a));
+  fp_load(a.x.c[0], p.dat[0]);
+  fp_load(a.y.c[0], p.dat[1]);
+  fp_load(a.z.c[0], p.dat[2]);
+  inf = point_affine(a, x, y);
+  fp_store(x.c[0], r.dat[0]);
+  fp_store(y.c[0], r.dat[1]);
+  return inf;
+}
+
+int zcash_bls12_381_cpu::to_affine(const bls12_381_g2_jb_t& p, bls12_381_g2_af_t& r) const {
+  jb_t a;
+  fp2_t x, y;
+  int inf;
+  for (int i = 0; i < 2; i++) {
+    fp_load(a.x.c[i], p.dat[i]);
+    fp_load(a.y.c[i], p.dat[2 + i]);
+    fp_load(a.z.c[i], p.dat[4 + i]);
+  }
+  inf = point_affine(a, x, y);
+  for (int i = 0; i < 2; i++) {
+    fp_store(x.c[i], r.dat[i]);
+    fp_store(y.c[i], r.dat[2 + i]);
+  }
+  return inf;
+}
+
+void zcash_bls12_381_cpu::g1_neg(bls12_381_g1_af_t& p) {
+  fp_t y;
+  fp_load(y, p.dat[1]);
+  fp_neg(y, y);
+  fp_store(y, p.dat[1]);
+}
+
+void zcash_bls12_381_cpu::g2_neg(bls12_381_g2_af_t& q) {
+  for (int i = 2; i < 4; i++) {
+    fp_t y;
+    fp_load(y, q.dat[i]);
+    fp_neg(y, y);
+    fp_store(y, q.dat[i]);
+  }
+}
+
+static bls12_381_g1_af_t make_g1_generator() {
+  bls12_381_g1_af_t g;
+  g.set_hex(0, "17f1d3a73197d7942695638c4fa9ac0fc3688c4f9774b905a14e3a3f171bac586c55e83ff97a1aeffb3af00adb22c6bb");
+  g.set_hex(1, "08b3f481e3aaa0f1a09e30ed741d8ae4fcf5e095d5d00af600db18cb2c04b3edd03cc744a2888ae40caa232946c5e7e1");
+  return g;
+}
+
+static bls12_381_g2_af_t make_g2_generator() {
+  bls12_381_g2_af_t g;
+  g.set_hex(0, "024aa2b2f08f0a91260805272dc51051c6e47ad4fa403b02b4510b647ae3d1770bac0326a805bbefd48056c8c121bdb8");
+  g.set_hex(1, "13e02b6052719f607dacd3a088274f65596bd0d09920b61ab5da61bbdc7f5049334cf11213945d57e5ac7d055d042b7e");
+  g.set_hex(2, "0ce5d527727d6e118cc9cdc6da2e351aadfd9baa8cbdd3a76d429a695160d12c923ac9cc3baca289e193548608b82801");
+  g.set_hex(3, "0606c4a02ea734cc32acd2b02bc28b99cb3e287e85a763af267492ab572e99ab3f370d275cec1da1aaa9075ff05f79be");
+  return g;
+}
+
+const bls12_381_g1_af_t& zcash_bls12_381_cpu::g1_generator() {
+  static const bls12_381_g1_af_t g = make_g1_generator();
+  return g;
+}
+
+const bls12_381_g2_af_t& zcash_bls12_381_cpu::g2_generator() {
+  static const bls12_381_g2_af_t g = make_g2_generator();
+  return g;
+}
@@ -0,0 +1,78 @@
+//
+//  ZCash FPGA library BLS12_381 CPU reference.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_BLS12_381_CPU_H_   /* Include guard */
+#define ZCASH_BLS12_381_CPU_H_
+
+#include <stdint.h>
+
+#include "zcash_fpga_bls12_381.hpp"
+
+/*
+ * Computes the BLS12_381 pairing instructions the same way as bls12_381_pkg.sv, so an
+ * FE12 from here matches the one the coprocessor writes to its data slots: the tower
+ * Fp2 = Fp[u]/(u^2 + 1), Fp6 = Fp2[v]/(v^3 - (u + 1)), Fp12 = Fp6[w]/(w^2 - v), the
+ * Miller loop over ATE_X with the RTL's line scaling and the same final exponentiation.
+ * FE12 slot 6k + 2i + j is coefficient j of the Fp2 i of the Fp6 k.
+ *
+ * The results are only meaningful as products: e(P, Q) * e(-P, Q) finishes as one, but
+ * the values differ from other libraries. Fp uses 6 x 64 bit limbs in Montgomery form.
+ * zcash_fpga_sim computes MILLER_LOOP, FINAL_EXP, ATE_PAIRING and FE12 MUL_ELEMENT
+ * with it, bench_groth16 uses it as the CPU baseline. Thread safe, there is no state
+ * after construction.
+ */
+class zcash_bls12_381_cpu {
+
+  public:
+    zcash_bls12_381_cpu();
+
+    void fe12_mul(const bls12_381_fe12_t& a, const bls12_381_fe12_t& b, bls12_381_fe12_t& r) const;
+    void miller_loop(const bls12_381_g1_af_t& p, const bls12_381_g2_af_t& q, bls12_381_fe12_t& f) const;
+    void final_exp(const bls12_381_fe12_t& f, bls12_381_fe12_t& r) const;
+    void ate_pairing(const bls12_381_g1_af_t& p, const bls12_381_g2_af_t& q, bls12_381_fe12_t& f) const;
+    static bool fe12_is_one(const bls12_381_fe12_t& f);
+
+    /*
+     * r = k * p (or a + b) in affine coordinates. Return 1 when r is the point at
+     * infinity, r is then all zero.
+     */
+    int point_mult(const bls12_381_scalar_t& k, const bls12_381_g1_af_t& p, bls12_381_g1_af_t& r) const;
+    int point_mult(const bls12_381_scalar_t& k, const bls12_381_g2_af_t& p, bls12_381_g2_af_t& r) const;
+    int point_add(const bls12_381_g1_af_t& a, const bls12_381_g1_af_t& b, bls12_381_g1_af_t& r) const;
+
+    /*
+     * Affine form of a jacobian point as the FPGA writes it (x = X / Z^2, y = Y / Z^3),
+     * returns 1 when Z = 0.
+     */
+    int to_affine(const bls12_381_g1_jb_t& p, bls12_381_g1_af_t& r) const;
+    int to_affine(const bls12_381_g2_jb_t& p, bls12_381_g2_af_t& r) const;
+
+    static void g1_neg(bls12_381_g1_af_t& p);
+    static void g2_neg(bls12_381_g2_af_t& q);
+
+    static const bls12_381_g1_af_t& g1_generator();
+    static const bls12_381_g2_af_t& g2_generator();
+
+  private:
+    // Frobenius map coefficients in Montgomery form, [table][power][Fp2 coefficient][limb]
+    uint64_t m_frob[4][4][2][6];
+
+}; // zcash_bls12_381_cpu
+
+#endif // ZCASH_BLS12_381_CPU_H_
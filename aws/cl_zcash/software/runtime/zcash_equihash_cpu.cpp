@@ -0,0 +1,326 @@
+#include "zcash_equihash_cpu.hpp"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <openssl/sha.h>
+
+// Leaf hashes are computed this many at a time (the widest kernel), arrays are padded to it
+#define LEAF_LANES 8
+
+// Header bytes in the first BLAKE2b block, the rest of the header and the le32 leaf
+// index make up the final block
+#define B2B_BLOCK_BYTES 128
+#define B2B_INPUT_BYTES (sizeof(zcash_fpga::cblockheader_t) + 4)
+
+#define ROTR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+#define B2B_G(a, b, c, d, x, y)          \
+  do {                                   \
+    a = a + b + (x); d = ROTR64(d ^ a, 32); \
+    c = c + d;       b = ROTR64(b ^ c, 24); \
+    a = a + b + (y); d = ROTR64(d ^ a, 16); \
+    c = c + d;       b = ROTR64(b ^ c, 63); \
+  } while (0)
+
+#define B2B_ROUND(v, m, s)                                  \
+  do {                                                      \
+    B2B_G(v[0], v[4], v[8],  v[12], m[s[0]],  m[s[1]]);     \
+    B2B_G(v[1], v[5], v[9],  v[13], m[s[2]],  m[s[3]]);     \
+    B2B_G(v[2], v[6], v[10], v[14], m[s[4]],  m[s[5]]);     \
+    B2B_G(v[3], v[7], v[11], v[15], m[s[6]],  m[s[7]]);     \
+    B2B_G(v[0], v[5], v[10], v[15], m[s[8]],  m[s[9]]);     \
+    B2B_G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);    \
+    B2B_G(v[2], v[7], v[8],  v[13], m[s[12]], m[s[13]]);    \
+    B2B_G(v[3], v[4], v[9],  v[14], m[s[14]], m[s[15]]);    \
+  } while (0)
+
+static const uint64_t blake2b_iv[8] = {
+  0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+  0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint8_t blake2b_sigma[12][16] = {
+  { 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15},
+  {14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3},
+  {11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4},
+  { 7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8},
+  { 9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13},
+  { 2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9},
+  {12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11},
+  {13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10},
+  { 6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5},
+  {10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0},
+  { 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15},
+  {14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3}
+};
+
+static inline uint64_t load_le64(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t load_le32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Compresses one full block that is not the last, used for the header midstate
+static void blake2b_compress(uint64_t h[8], const uint8_t* block, uint64_t t) {
+  uint64_t v[16], m[16];
+  for (int i = 0; i < 16; i++) m[i] = load_le64(block + 8*i);
+  for (int i = 0; i < 8; i++) {
+    v[i] = h[i];
+    v[i + 8] = blake2b_iv[i];
+  }
+  v[12] ^= t;
+  for (int r = 0; r < 12; r++) B2B_ROUND(v, m, blake2b_sigma[r]);
+  for (int i = 0; i < 8; i++) h[i] ^= v[i] ^ v[i + 8];
+}
+
+/*
+ * Final compression of L leaves at once, one per vector lane. Only message words 0 and
+ * 1 are non-zero: m0 and m1 are the last 12 header bytes and m1 takes the leaf index g
+ * in its top half.
+ */
+template <typename V, unsigned int L>
+static inline __attribute__((always_inline))
+void blake2b_last_block(const uint64_t h[8], uint64_t m0, uint64_t m1, const uint32_t* g, uint64_t (*out)[8]) {
+  V v[16], m[16];
+  V zero = {};
+
+  for (int i = 0; i < 8; i++) {
+    v[i] = zero + h[i];
+    v[i + 8] = zero + blake2b_iv[i];
+  }
+  v[12] ^= zero + (uint64_t)B2B_INPUT_BYTES;
+  v[14] = ~v[14];
+
+  for (int i = 0; i < 16; i++) m[i] = zero;
+  m[0] = zero + m0;
+  for (unsigned int l = 0; l < L; l++) m[1][l] = m1 | ((uint64_t)g[l] << 32);
+
+  for (int r = 0; r < 12; r++) B2B_ROUND(v, m, blake2b_sigma[r]);
+
+  for (unsigned int l = 0; l < L; l++)
+    for (int i = 0; i < 8; i++)
+      out[l][i] = h[i] ^ v[i][l] ^ v[i + 8][l];
+}
+
+typedef void (*leaves_fn_t)(const uint64_t h[8], uint64_t m0, uint64_t m1, const uint32_t* g, unsigned int n,
+                            uint64_t (*out)[8]);
+
+typedef uint64_t v2u64_t __attribute__((vector_size(16)));
+
+static void leaves_generic(const uint64_t h[8], uint64_t m0, uint64_t m1, const uint32_t* g, unsigned int n,
+                           uint64_t (*out)[8]) {
+  for (unsigned int i = 0; i < n; i += 2)
+    blake2b_last_block<v2u64_t, 2>(h, m0, m1, g + i, out + i);
+}
+
+#if defined(__x86_64__)
+typedef uint64_t v4u64_t __attribute__((vector_size(32)));
+typedef uint64_t v8u64_t __attribute__((vector_size(64)));
+
+__attribute__((target("avx2")))
+static void leaves_avx2(const uint64_t h[8], uint64_t m0, uint64_t m1, const uint32_t* g, unsigned int n,
+                        uint64_t (*out)[8]) {
+  for (unsigned int i = 0; i < n; i += 4)
+    blake2b_last_block<v4u64_t, 4>(h, m0, m1, g + i, out + i);
+}
+
+__attribute__((target("avx512f")))
+static void leaves_avx512(const uint64_t h[8], uint64_t m0, uint64_t m1, const uint32_t* g, unsigned int n,
+                          uint64_t (*out)[8]) {
+  for (unsigned int i = 0; i < n; i += 8)
+    blake2b_last_block<v8u64_t, 8>(h, m0, m1, g + i, out + i);
+}
+#endif
+
+typedef struct {
+  leaves_fn_t fn;
+  const char* name;
+} leaves_kernel_t;
+
+// Widest kernel the CPU runs, ZCASH_EQUIHASH_KERNEL=avx2 / generic forces a narrower one
+static leaves_kernel_t select_leaves() {
+  const char* force = getenv("ZCASH_EQUIHASH_KERNEL");
+  if (force != NULL && *force == 0) force = NULL;
+  leaves_kernel_t k = {leaves_generic, "generic"};
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && (force == NULL || strcmp(force, "generic") != 0)) {
+    k.fn = leaves_avx2;
+    k.name = "avx2";
+  }
+  if (__builtin_cpu_supports("avx512f") && force == NULL) {
+    k.fn = leaves_avx512;
+    k.name = "avx512";
+  }
+#endif
+  return k;
+}
+
+static const leaves_kernel_t& leaves_kernel() {
+  static const leaves_kernel_t kernel = select_leaves();
+  return kernel;
+}
+
+// Fails when the double SHA256 of the block is above the nBits target, as
+// equihash_verif_difficulty.sv but with the consensus SetCompact()
+static bool difficulty_fail(const uint8_t* block, unsigned int len) {
+  uint8_t hash[SHA256_DIGEST_LENGTH];
+  uint8_t target[32] = {0};
+  uint32_t bits = load_le32(block + offsetof(zcash_fpga::cblockheader_t, bits));
+  uint32_t size = bits >> 24;
+  uint32_t word = bits & 0x007fffff;
+
+  if (word == 0 || (bits & 0x00800000) != 0 ||
+      size > 34 || (word > 0xff && size > 33) || (word > 0xffff && size > 32))
+    return true;
+
+  if (size <= 3) {
+    word >>= 8 * (3 - size);
+    size = 3;
+  }
+  for (unsigned int i = 0; i < 3; i++)
+    if (size - 3 + i < sizeof(target)) target[size - 3 + i] = word >> (8*i);
+
+  SHA256(block, len, hash);
+  SHA256(hash, sizeof(hash), hash);
+
+  // Both are little endian 256 bit integers
+  for (int i = 31; i >= 0; i--)
+    if (hash[i] != target[i]) return hash[i] > target[i];
+  return false;
+}
+
+// N bit strings, most significant (first) bit at the top of word 0
+typedef uint64_t node_t __attribute__((vector_size(32)));
+
+static inline bool node_nonzero(const node_t& n) {
+  return (n[0] | n[1] | n[2] | n[3]) != 0;
+}
+
+template <unsigned int N, unsigned int K>
+struct equihash_masks_t {
+  node_t seg[K + 2];  // seg[L] is the L-th collision segment, counted from 1
+
+  equihash_masks_t() {
+    const unsigned int bits = N / (K + 1);
+    memset(seg, 0, sizeof(seg));
+    for (unsigned int L = 1; L <= K + 1; L++)
+      for (unsigned int b = (L - 1) * bits; b < L * bits; b++)
+        seg[L][b / 64] |= 1ULL << (63 - b % 64);
+  }
+};
+
+template <unsigned int N, unsigned int K>
+zcash_equihash_cpu<N, K>::zcash_equihash_cpu(unsigned int threads) : m_threads(threads) {
+  if (m_threads == 0) m_threads = std::thread::hardware_concurrency();
+  if (m_threads == 0) m_threads = 1;
+}
+
+template <unsigned int N, unsigned int K>
+const char* zcash_equihash_cpu<N, K>::kernel_name() {
+  return leaves_kernel().name;
+}
+
+template <unsigned int N, unsigned int K>
+uint8_t zcash_equihash_cpu<N, K>::verify(const uint8_t* block) const {
+  static const equihash_masks_t<N, K> masks;
+  const unsigned int leaves = (s_sol_len + LEAF_LANES - 1) / LEAF_LANES * LEAF_LANES;
+  uint8_t sol[s_sol_bytes + 8];
+  uint32_t idx[s_sol_len];
+  uint32_t sorted[s_sol_len];
+  uint32_t g[leaves];
+  uint64_t digest[leaves][8];
+  node_t node[s_sol_len];
+  uint64_t h[8];
+  uint8_t bm = 0;
+
+  // Unpack the big endian s_sol_bits indices, the CompactSize is skipped as by the RTL
+  memcpy(sol, block + sizeof(zcash_fpga::cblockheader_t) + s_sol_enc, s_sol_bytes);
+  memset(sol + s_sol_bytes, 0, 8);
+  for (unsigned int i = 0; i < s_sol_len; i++) {
+    unsigned int pos = i * s_sol_bits;
+    uint64_t w = __builtin_bswap64(load_le64(sol + pos / 8));
+    idx[i] = (w << (pos % 8)) >> (64 - s_sol_bits);
+  }
+
+  memcpy(sorted, idx, sizeof(sorted));
+  std::sort(sorted, sorted + s_sol_len);
+  for (unsigned int i = 1; i < s_sol_len; i++)
+    if (sorted[i] == sorted[i - 1]) bm |= zcash_fpga::DUPLICATE_FND;
+
+  // The first index of each right subtree must be above that of its left subtree
+  for (unsigned int size = 1; size < s_sol_len; size <<= 1)
+    for (unsigned int j = 0; j < s_sol_len; j += 2*size)
+      if (idx[j + size] <= idx[j]) bm |= zcash_fpga::BAD_IDX_ORDER;
+
+  // BLAKE2b personalized with "ZcashPoW" || le32(N) || le32(K), the first block of the
+  // header is the same for every leaf
+  for (int i = 0; i < 8; i++) h[i] = blake2b_iv[i];
+  h[0] ^= 0x01010000ULL ^ s_digest_bytes;
+  h[6] ^= load_le64((const uint8_t*)"ZcashPoW");
+  h[7] ^= (uint64_t)N | ((uint64_t)K << 32);
+  blake2b_compress(h, block, B2B_BLOCK_BYTES);
+
+  for (unsigned int i = 0; i < leaves; i++)
+    g[i] = i < s_sol_len ? idx[i] / s_indices_per_hash : 0;
+  leaves_kernel().fn(h, load_le64(block + B2B_BLOCK_BYTES), load_le32(block + B2B_BLOCK_BYTES + 8), g, leaves, digest);
+
+  for (unsigned int i = 0; i < s_sol_len; i++) {
+    uint8_t str[32] = {0};
+    memcpy(str, (const uint8_t*)digest[i] + (idx[i] % s_indices_per_hash) * (N/8), N/8);
+    for (int w = 0; w < 4; w++) node[i][w] = __builtin_bswap64(load_le64(str + 8*w));
+  }
+
+  // Pairs on each level are independent, each XOR is one 256 bit vector operation. As
+  // the RTL checks running XORs, a subtree ending at the last leaf only shows up in the
+  // final XOR_NON_ZERO check.
+  for (unsigned int L = 1; L <= K; L++) {
+    unsigned int count = s_sol_len >> L;
+    for (unsigned int j = 0; j < count; j++) {
+      node[j] = node[2*j] ^ node[2*j + 1];
+      if (j != count - 1 && node_nonzero(node[j] & masks.seg[L])) bm |= zcash_fpga::BAD_ZERO_ORDER;
+    }
+  }
+  if (node_nonzero(node[0])) bm |= zcash_fpga::XOR_NON_ZERO;
+
+  if (difficulty_fail(block, s_block_bytes)) bm |= zcash_fpga::DIFFICULTY_FAIL;
+
+  return bm;
+}
+
+template <unsigned int N, unsigned int K>
+int zcash_equihash_cpu<N, K>::verify_batch(const uint8_t* blocks, unsigned int count, unsigned int stride,
+                                           uint8_t* bm) const {
+  unsigned int threads = m_threads < count ? m_threads : count;
+  std::atomic<unsigned int> next(0);
+  std::vector<std::thread> pool;
+
+  // Each thread takes the next unverified block
+  auto work = [&]() {
+    for (unsigned int i = next.fetch_add(1); i < count; i = next.fetch_add(1))
+      bm[i] = verify(blocks + (size_t)i * stride);
+  };
+
+  for (unsigned int t = 1; t < threads; t++)
+    pool.push_back(std::thread(work));
+  work();
+  for (size_t t = 0; t < pool.size(); t++)
+    pool[t].join();
+  return 0;
+}
+
+template class zcash_equihash_cpu<200, 9>;
+template class zcash_equihash_cpu<144, 5>;
@@ -0,0 +1,80 @@
+//
+//  ZCash FPGA library CPU Equihash verifier.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_EQUIHASH_CPU_H_   /* Include guard */
+#define ZCASH_EQUIHASH_CPU_H_
+
+#include <stdint.h>
+
+#include "zcash_fpga.hpp"
+
+/*
+ * Checks an Equihash solution the same way as equihash_verif_top.sv and returns the
+ * equihash_bm_t mask the FPGA would reply with, 0 when the solution is valid. N and K
+ * are fixed at compile time as in equihash_pkg.sv, (200,9) and (144,5) are built.
+ *
+ * The input is a serialized block header with its solution (CompactSize length and
+ * the minimal encoding of the 2^K indices), for (200,9) that is a cblockheader_sol_t.
+ * The header is hashed once up to the last BLAKE2b block, the 2^K leaf hashes then only
+ * need the final compression, run 8 (AVX-512), 4 (AVX2) or 2 leaves at a time. The
+ * kernel is picked for the CPU at run time.
+ *
+ * Unlike the RTL (which leaves it out of the hash) hashFinalSaplingRoot is hashed as in
+ * the Zcash spec, the two only differ for headers where it is non-zero. The difficulty
+ * target also uses the consensus SetCompact().
+ */
+template <unsigned int N, unsigned int K>
+class zcash_equihash_cpu {
+
+  public:
+    static const unsigned int s_indices_per_hash = 512 / N;
+    static const unsigned int s_collision_bits = N / (K + 1);
+    static const unsigned int s_sol_bits = s_collision_bits + 1;
+    static const unsigned int s_sol_len = 1 << K;
+    static const unsigned int s_digest_bytes = s_indices_per_hash * N / 8;
+    static const unsigned int s_sol_bytes = s_sol_len * s_sol_bits / 8;
+    static const unsigned int s_sol_enc = s_sol_bytes < 0xFD ? 1 : 3;  // CompactSize bytes
+    static const unsigned int s_block_bytes = sizeof(zcash_fpga::cblockheader_t) + s_sol_enc + s_sol_bytes;
+
+    /*
+     * threads is the number of threads verify_batch() uses, 0 for one per CPU
+     */
+    explicit zcash_equihash_cpu(unsigned int threads = 0);
+
+    /*
+     * block is s_block_bytes long, returns a mask of equihash_bm_t
+     */
+    uint8_t verify(const uint8_t* block) const;
+
+    /*
+     * Verifies count blocks, stride bytes apart, into bm[]. Returns 0.
+     */
+    int verify_batch(const uint8_t* blocks, unsigned int count, unsigned int stride, uint8_t* bm) const;
+
+    /*
+     * Leaf hash kernel in use: "avx512", "avx2" or "generic"
+     */
+    static const char* kernel_name();
+
+  private:
+    unsigned int m_threads;
+
+}; // zcash_equihash_cpu
+
+#endif // ZCASH_EQUIHASH_CPU_H_
@@ -0,0 +1,306 @@
+#include "zcash_equihash_stream.hpp"
+#include "zcash_fpga_log.hpp"
+
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <thread>
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Bytes of verify_equihash_t before the block
+typedef struct __attribute__((__packed__)) {
+  zcash_fpga::header_t hdr;
+  uint64_t             index;
+} equihash_cmd_head_t;
+
+zcash_equihash_stream::zcash_equihash_stream(zcash_fpga* zfpga, int cpu_threads, unsigned int window) :
+  m_zfpga(zfpga),
+  m_window(window == 0 ? 1 : window),
+  m_equihash(1),
+  m_next(0),
+  m_committed(0),
+  m_stop(false) {
+
+  if (cpu_threads < 0) {
+    cpu_threads = std::thread::hardware_concurrency();
+    if (cpu_threads == 0) cpu_threads = 1;
+    if (zfpga != nullptr) cpu_threads--;
+  }
+  m_cpu_threads = cpu_threads;
+  m_bm.reset(new uint8_t[m_window]);
+  m_ready.reset(new bool[m_window]);
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+zcash_equihash_stream::~zcash_equihash_stream() {
+  for (unsigned int i = 0; i < m_maps.size(); i++)
+    munmap(m_maps[i].addr, m_maps[i].len);
+}
+
+int zcash_equihash_stream::add_file(const char* path) {
+  struct stat st;
+  void* addr;
+  const uint8_t* data;
+  size_t offset = 0, first = m_blocks.size();
+  const zcash_fpga::header_t* hdr;
+  mapping_t map;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    zlog_error("zcash_equihash_stream: unable to open %s\n", path);
+    return 1;
+  }
+  if (fstat(fd, &st) != 0) {
+    zlog_error("zcash_equihash_stream: unable to stat %s\n", path);
+    close(fd);
+    return 1;
+  }
+  if (st.st_size == 0) {
+    zlog_warn("zcash_equihash_stream: %s is empty\n", path);
+    close(fd);
+    return 0;
+  }
+
+  addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    zlog_error("zcash_equihash_stream: unable to mmap %s\n", path);
+    return 1;
+  }
+  // Headers are read once, front to back
+  madvise(addr, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+  data = (const uint8_t*)addr;
+  while (offset + sizeof(zcash_fpga::header_t) <= (size_t)st.st_size) {
+    hdr = (const zcash_fpga::header_t*)&data[offset];
+    if (hdr->cmd != zcash_fpga::VERIFY_EQUIHASH || hdr->len != sizeof(zcash_fpga::verify_equihash_t) ||
+        offset + hdr->len > (size_t)st.st_size) {
+      zlog_error("zcash_equihash_stream: %s has a bad record (cmd 0x%x, len %d) at offset %lu\n", path,
+                 hdr->cmd, hdr->len, (unsigned long)offset);
+      m_blocks.resize(first);
+      munmap(addr, st.st_size);
+      return 1;
+    }
+    m_blocks.push_back((const zcash_fpga::cblockheader_sol_t*)&data[offset + sizeof(equihash_cmd_head_t)]);
+    offset += (hdr->len + 7) & ~7U;
+  }
+  if (offset < (size_t)st.st_size)
+    zlog_warn("zcash_equihash_stream: ignoring %lu bytes at the end of %s\n", (unsigned long)(st.st_size - offset), path);
+
+  map.addr = addr;
+  map.len = st.st_size;
+  m_maps.push_back(map);
+  zlog_info("zcash_equihash_stream: %s has %lu headers\n", path, (unsigned long)(m_blocks.size() - first));
+  return 0;
+}
+
+// m_lock is held
+bool zcash_equihash_stream::claim(uint64_t& index) {
+  if (!m_retry.empty()) {
+    index = m_retry.front();
+    m_retry.pop_front();
+    return true;
+  }
+  if (m_next >= m_blocks.size() || m_next >= m_committed + m_window) return false;
+  index = m_next++;
+  return true;
+}
+
+// m_lock is held
+void zcash_equihash_stream::complete(uint64_t index, uint8_t bm) {
+  m_bm[index % m_window] = bm;
+  m_ready[index % m_window] = true;
+  if (index == m_committed) m_done_cv.notify_one();
+}
+
+void zcash_equihash_stream::cpu_thread() {
+  uint64_t index;
+  uint8_t bm;
+  std::unique_lock<std::mutex> lk(m_lock);
+
+  while (!m_stop) {
+    if (!claim(index)) {
+      m_work_cv.wait(lk);
+      continue;
+    }
+    lk.unlock();
+    bm = m_equihash.verify((const uint8_t*)m_blocks[index]);
+    lk.lock();
+    m_stats.cpu_headers++;
+    complete(index, bm);
+  }
+}
+
+/*
+ * Fills the transmit FIFO and routes one reply. Returns 0 when nothing is in flight on
+ * the FPGA, on an error the headers in flight are queued for the CPU and fpga_ok cleared.
+ */
+int zcash_equihash_stream::run_fpga(std::vector<uint64_t>& in_flight, bool& fpga_ok) {
+  int rc, read_len;
+  bool claimed;
+  unsigned int space;
+  uint64_t index;
+  uint8_t reply[STREAM_MAX_RPL_BYTES];
+  equihash_cmd_head_t cmd;
+  zcash_fpga::verify_equihash_rpl_t* rpl = (zcash_fpga::verify_equihash_rpl_t*)reply;
+  std::vector<uint64_t>::iterator it;
+
+  cmd.hdr.cmd = zcash_fpga::VERIFY_EQUIHASH;
+  cmd.hdr.len = sizeof(zcash_fpga::verify_equihash_t);
+
+  while (true) {
+    rc = m_zfpga->get_tx_space(space, sizeof(zcash_fpga::verify_equihash_t));
+    fail_on(rc, out, "ERROR: Unable to read from FPGA!");
+    if (space < sizeof(zcash_fpga::verify_equihash_t)) {
+      if (in_flight.empty()) {
+        zlog_error("zcash_equihash_stream: transmit FIFO is full with nothing in flight\n");
+        goto out;
+      }
+      break;
+    }
+    {
+      std::lock_guard<std::mutex> lk(m_lock);
+      claimed = claim(index);
+    }
+    if (!claimed) break;
+
+    in_flight.push_back(index);
+    cmd.index = index;
+    rc = m_zfpga->write_stream_burst((const uint8_t*)&cmd, sizeof(cmd), (const uint8_t*)m_blocks[index],
+                                     sizeof(zcash_fpga::cblockheader_sol_t));
+    fail_on(rc, out, "ERROR: Unable to send verify_equihash to FPGA!");
+  }
+
+  if (in_flight.empty()) return 0;
+
+  read_len = m_zfpga->read_stream_wait(reply, sizeof(reply), zcash_fpga::VERIFY_EQUIHASH);
+  if (read_len <= 0) {
+    zlog_error("zcash_equihash_stream: no reply from the FPGA (%lu headers in flight)\n", (unsigned long)in_flight.size());
+    goto out;
+  }
+  if (rpl->hdr.cmd != zcash_fpga::VERIFY_EQUIHASH_RPL || (unsigned int)read_len < sizeof(zcash_fpga::verify_equihash_rpl_t)) {
+    zlog_warn("zcash_equihash_stream: dropping reply 0x%x\n", rpl->hdr.cmd);
+    return 1;
+  }
+  it = std::find(in_flight.begin(), in_flight.end(), rpl->index);
+  if (it == in_flight.end()) {
+    zlog_warn("zcash_equihash_stream: dropping reply with unexpected index 0x%lx\n", (unsigned long)rpl->index);
+    return 1;
+  }
+  in_flight.erase(it);
+
+  {
+    std::lock_guard<std::mutex> lk(m_lock);
+    m_stats.fpga_headers++;
+    complete(rpl->index, rpl->bm);
+  }
+  return 1;
+
+  out:
+    zlog_warn("zcash_equihash_stream: FPGA failed, running the remaining headers on the CPU\n");
+    fpga_ok = false;
+    {
+      std::lock_guard<std::mutex> lk(m_lock);
+      m_retry.insert(m_retry.end(), in_flight.begin(), in_flight.end());
+    }
+    in_flight.clear();
+    m_work_cv.notify_all();
+    return 1;
+}
+
+int zcash_equihash_stream::run(commit_t cb, void* ctx) {
+  uint64_t t0, count = m_blocks.size(), index;
+  uint8_t bm;
+  bool claimed, fpga_ok;
+  std::vector<uint64_t> in_flight;
+  std::vector<uint8_t> done;
+  std::vector<std::thread> threads;
+
+  if (cb == nullptr) {
+    zlog_error("zcash_equihash_stream: run() needs a commit callback\n");
+    return 1;
+  }
+
+  fpga_ok = m_zfpga != nullptr && (m_zfpga->m_command_cap & zcash_fpga::ENB_VERIFY_EQUIHASH_200_9) != 0;
+  if (m_zfpga != nullptr && !fpga_ok)
+    zlog_warn("zcash_equihash_stream: FPGA was not built with ENB_VERIFY_EQUIHASH_200_9, using the CPU\n");
+
+  m_next = 0;
+  m_committed = 0;
+  m_retry.clear();
+  m_stop = false;
+  memset(m_ready.get(), 0, m_window * sizeof(bool));
+  memset(&m_stats, 0, sizeof(m_stats));
+  done.reserve(m_window);
+
+  t0 = now_ns();
+  for (unsigned int i = 0; i < m_cpu_threads; i++)
+    threads.push_back(std::thread(&zcash_equihash_stream::cpu_thread, this));
+
+  while (true) {
+    // Commit outside the lock so the callback does not hold up the CPU threads
+    {
+      std::lock_guard<std::mutex> lk(m_lock);
+      index = m_committed;
+      while (m_committed < count && m_ready[m_committed % m_window]) {
+        m_ready[m_committed % m_window] = false;
+        done.push_back(m_bm[m_committed % m_window]);
+        m_committed++;
+      }
+    }
+    if (!done.empty()) {
+      m_work_cv.notify_all();
+      for (unsigned int i = 0; i < done.size(); i++) {
+        if (done[i] != 0) m_stats.invalid++;
+        cb(ctx, index + i, *m_blocks[index + i], done[i]);
+      }
+      done.clear();
+    }
+    if (m_committed == count) break;
+
+    if (fpga_ok && run_fpga(in_flight, fpga_ok) != 0) continue;
+
+    // Without CPU threads the headers the FPGA gave back are run here
+    if (!fpga_ok && m_cpu_threads == 0) {
+      {
+        std::lock_guard<std::mutex> lk(m_lock);
+        claimed = claim(index);
+      }
+      if (claimed) {
+        bm = m_equihash.verify((const uint8_t*)m_blocks[index]);
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_stats.cpu_headers++;
+        complete(index, bm);
+        continue;
+      }
+    }
+
+    std::unique_lock<std::mutex> lk(m_lock);
+    m_done_cv.wait(lk, [&]{ return m_ready[m_committed % m_window]; });
+  }
+
+  {
+    std::lock_guard<std::mutex> lk(m_lock);
+    m_stop = true;
+  }
+  m_work_cv.notify_all();
+  for (unsigned int i = 0; i < threads.size(); i++)
+    threads[i].join();
+
+  m_stats.headers = m_committed;
+  m_stats.fpga_failed = m_zfpga != nullptr && !fpga_ok &&
+                        (m_zfpga->m_command_cap & zcash_fpga::ENB_VERIFY_EQUIHASH_200_9) != 0;
+  m_stats.ns = now_ns() - t0;
+  m_stats.headers_per_s = m_stats.ns == 0 ? 0 : m_stats.headers * 1e9 / m_stats.ns;
+  return 0;
+}
@@ -0,0 +1,134 @@
+//
+//  ZCash FPGA library Equihash block file pipeline.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_EQUIHASH_STREAM_H_   /* Include guard */
+#define ZCASH_EQUIHASH_STREAM_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "zcash_fpga.hpp"
+#include "zcash_equihash_cpu.hpp"
+
+/*
+ * Verifies the Equihash solutions of block files for initial block download, on the
+ * FPGA and / or CPU threads, and hands the results back in chain order.
+ *
+ * A block file holds verify_equihash_t commands back to back, each starting 8 byte
+ * aligned (block_346_with_header.bin is one, write_stream_batch() takes the same
+ * layout). Files are mmapped and the headers used in place, the FPGA gets the 16 byte
+ * command header from the stack followed by the block straight from the mapping. The
+ * index stored in the file is ignored, each header is numbered by its position over
+ * all files in the order they were added.
+ *
+ * run() keeps at most window headers between the oldest one not yet committed and the
+ * newest one started. The calling thread feeds the FPGA and reads its replies, CPU
+ * threads (zcash_equihash_cpu<200,9>) take headers from the same sequence, and
+ * completed results are committed in order on the calling thread. When the FPGA
+ * fails or times out, its headers in flight are run on the CPU and it is not used
+ * for the rest of the run.
+ *
+ * Nothing else may use the zcash_fpga while run() is active.
+ */
+class zcash_equihash_stream {
+
+  public:
+    /*
+     * Called in chain order on the run() thread. block points into the mapping, bm is
+     * the equihash_bm_t mask (0 when the solution is valid).
+     */
+    typedef void (*commit_t)(void* ctx, uint64_t index, const zcash_fpga::cblockheader_sol_t& block, uint8_t bm);
+
+    typedef struct {
+      uint64_t headers;       // Committed
+      uint64_t fpga_headers;  // Verified on the FPGA
+      uint64_t cpu_headers;   // Verified on the CPU
+      uint64_t invalid;       // Committed with a non-zero bm
+      uint64_t fpga_failed;   // 1 when the FPGA failed and the rest ran on the CPU
+      uint64_t ns;            // Time run() took
+      double   headers_per_s;
+    } stats_t;
+
+    /*
+     * zfpga may be null for CPU only. cpu_threads of -1 uses all CPUs, but one when there
+     * is an FPGA, 0 runs everything on the FPGA.
+     */
+    zcash_equihash_stream(zcash_fpga* zfpga, int cpu_threads = -1, unsigned int window = 256);
+    ~zcash_equihash_stream();
+    zcash_equihash_stream(zcash_equihash_stream const&) = delete;
+    void operator=(zcash_equihash_stream const&) = delete;
+
+    /*
+     * Maps a block file and indexes its headers. Returns 0 on success or 1 if the file
+     * cannot be mapped or has a record that is not a VERIFY_EQUIHASH command.
+     */
+    int add_file(const char* path);
+
+    uint64_t size() const { return m_blocks.size(); }
+
+    /*
+     * Verifies every header added so far. Returns 0 when all of them were committed or 1
+     * if cb is null. Mapping and record errors are reported by add_file(), an FPGA error
+     * does not fail the run: the headers are finished on the CPU and get_stats() has
+     * fpga_failed set.
+     */
+    int run(commit_t cb, void* ctx);
+
+    stats_t get_stats() const { return m_stats; }
+
+  private:
+    typedef struct {
+      void*  addr;
+      size_t len;
+    } mapping_t;
+
+    zcash_fpga*  m_zfpga;
+    unsigned int m_cpu_threads;
+    unsigned int m_window;
+
+    std::vector<mapping_t> m_maps;
+    std::vector<const zcash_fpga::cblockheader_sol_t*> m_blocks;
+    zcash_equihash_cpu<200,9> m_equihash;
+
+    // Pipeline state, under m_lock while run() is active
+    std::mutex m_lock;
+    std::condition_variable m_work_cv;   // CPU threads: a header can be started
+    std::condition_variable m_done_cv;   // run(): the oldest header has a result
+    uint64_t m_next;                     // Next header to start
+    uint64_t m_committed;                // Headers committed
+    std::deque<uint64_t> m_retry;        // FPGA headers to run on the CPU
+    std::unique_ptr<uint8_t[]> m_bm;     // Results by index % m_window
+    std::unique_ptr<bool[]> m_ready;
+    bool m_stop;
+
+    stats_t m_stats;
+
+    bool claim(uint64_t& index);
+    void complete(uint64_t index, uint8_t bm);
+    void cpu_thread();
+    int run_fpga(std::vector<uint64_t>& in_flight, bool& fpga_ok);
+
+}; // zcash_equihash_stream
+
+#endif // ZCASH_EQUIHASH_STREAM_H_
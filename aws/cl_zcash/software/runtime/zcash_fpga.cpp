@@ -1,26 +1,42 @@
 #include "zcash_fpga.hpp"
+#include "zcash_fpga_log.hpp"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/eventfd.h>
 
 #include <fpga_pci.h>
 
 zcash_fpga::zcash_fpga() {
   if (init_fpga() != 0)
-    printf("ERROR: Unable to initialize to FPGA!\n");
+    zlog_error("Unable to initialize to FPGA!\n");
 }
 
-zcash_fpga::~zcash_fpga() {
-  int rc;
-  /* clean up */
-  if (m_pci_bar_handle_bar0 >= 0) {
-    rc = fpga_pci_detach(m_pci_bar_handle_bar0);
-    if (rc) printf("ERROR: Failure while detaching bar0 from the fpga.\n");
+zcash_fpga::zcash_fpga(int slot_id) {
+  if (init_fpga(slot_id) != 0)
+    zlog_error("Unable to initialize to FPGA in slot %d!\n", slot_id);
+}
+
+zcash_fpga::zcash_fpga(zcash_fpga_transport* transport) : m_transport(transport) {
+  m_slot_id = -1;
+  if (init_stream() != 0) {
+    zlog_error("Unable to initialize to FPGA over transport!\n");
+    m_transport.reset();
   }
-  if (m_pci_bar_handle_bar4 >= 0) {
-    rc = fpga_pci_detach(m_pci_bar_handle_bar4);
-    if (rc) printf("ERROR: Failure while detaching bar4 from the fpga.\n");
+}
+
+zcash_fpga::~zcash_fpga() {
+  /* clean up, the transport detaches from the FPGA */
+  if (m_reply_fd >= 0) {
+    if (m_transport) m_transport->set_reply_fd(-1);
+    close(m_reply_fd);
   }
 }
 
@@ -32,64 +48,76 @@ zcash_fpga& zcash_fpga::get_instance() {
 int zcash_fpga::init_fpga(int slot_id) {
   // Initialize the FPGA
   if (m_initialized) {
-    printf("INFO: FPGA already m_initialized, skipping initialization\n");
+    zlog_info("FPGA already m_initialized, skipping initialization\n");
     return 0;
   }
 
   int rc;
-  uint32_t rdata;
 
   /* initialize the fpga_pci library so we could have access to FPGA PCIe from this applications */
   rc = fpga_pci_init();
   fail_on(rc, out, "ERROR: Unable to initialize the fpga_pci library");
 
+  m_slot_id = slot_id;
   rc = check_afi_ready(slot_id);
   fail_on(rc, out, "ERROR: AFI not ready");
 
-  // We need to attach to the FPGA BAR0 (OCL) and BAR4 (PCIS)
-  rc = fpga_pci_attach(slot_id, FPGA_APP_PF, APP_PF_BAR0, 0, &m_pci_bar_handle_bar0);
-  fail_on(rc, out, "ERROR: Unable to attach to the AFI BAR0 on slot id %d", slot_id);
+  m_transport.reset(zcash_fpga_transport::open_pci(slot_id));
+  if (m_transport == nullptr) {
+    rc = 1;
+    fail_on(rc, out, "ERROR: Unable to attach to the AFI on slot id %d", slot_id);
+  }
+
+  rc = init_stream();
+  fail_on(rc, out, "ERROR: Unable to initialize FPGA stream interface");
 
-  rc = fpga_pci_attach(slot_id, FPGA_APP_PF, APP_PF_BAR4, BURST_CAPABLE, &m_pci_bar_handle_bar4);
-  fail_on(rc, out, "ERROR: Unable to attach to the AFI BAR4 on slot id %d", slot_id);
+  return rc;
+  out:
+    m_initialized = false;
+    m_transport.reset();
+    return 1;
+}
+
+int zcash_fpga::init_stream() {
+  int rc;
+  uint32_t rdata;
 
   // Now setup the streaming interface
 
-  rc = fpga_pci_peek(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET, &rdata); //ISR
+  rc = m_transport->peek(AXI_FIFO_OFFSET, &rdata); //ISR
   fail_on(rc, out, "ERROR: Unable to read from FPGA!");
-  printf("INFO: Read 0x%x from ISR register.\n", rdata);
+  zlog_info("Read 0x%x from ISR register.\n", rdata);
   if (rdata != 0x01D00000) {
-    printf("WARNING: Expected 0x01D00000.\n");
+    zlog_warn("Expected 0x01D00000.\n");
   }
 
-  rc = fpga_pci_poke(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET, 0xFFFFFFFF); // Reset ISR
+  rc = m_transport->poke(AXI_FIFO_OFFSET, 0xFFFFFFFF); // Reset ISR
   fail_on(rc, out, "Unable to write to FPGA!");
 
-  rc = fpga_pci_peek(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET+0xCULL, &rdata); //TDFV
+  rc = m_transport->peek(AXI_FIFO_OFFSET+0xCULL, &rdata); //TDFV
   fail_on(rc, out, "Unable to read from FPGA!");
-  printf("INFO: Read 0x%x from TDFV register.\n", rdata);
+  zlog_info("Read 0x%x from TDFV register.\n", rdata);
   if (rdata != 0x000001FC) {
-    printf("WARNING: Expected 0x000001FC.\n");
+    zlog_warn("Expected 0x000001FC.\n");
   }
+  m_tx_credit = rdata;
 
-  rc = fpga_pci_peek(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET+0x1CULL, &rdata); //RDFO
+  rc = m_transport->peek(AXI_FIFO_OFFSET+0x1CULL, &rdata); //RDFO
   fail_on(rc, out, "ERROR: Unable to read from FPGA!");
-  printf("INFO: Read 0x%x from RDFO register.\n", rdata);
+  zlog_info("Read 0x%x from RDFO register.\n", rdata);
   if (rdata != 0x00000000) {
-    printf("WARNING: Expected 0x00000000.\n");
+    zlog_warn("Expected 0x00000000.\n");
   }
 
-  rc = fpga_pci_poke(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET+0x4ULL, 0x0C000000); // Clear IER
+  rc = m_transport->poke(AXI_FIFO_OFFSET+0x4ULL, 0x0C000000); // Clear IER
   fail_on(rc, out, "ERROR: Unable to write to FPGA!");
 
-  // Check if we have AXI4 mode enabled or not
-  rc = fpga_pci_peek(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET+0x44ULL, &rdata); //RDFO
-  fail_on(rc, out, "ERROR: Unable to write to FPGA!");
-  m_axi4_enabled = (1 << 31) & rdata;
+  // The transport was specialized for the AXI4 mode bit when it attached
+  m_axi4_enabled = m_transport->axi4();
   if (m_axi4_enabled)
-    printf("INFO: AXI4 mode is set ENABLED\n");
+    zlog_info("AXI4 mode is set ENABLED\n");
   else
-    printf("INFO: AXI4 mode is set DISABLED\n");
+    zlog_info("AXI4 mode is set DISABLED\n");
 
   m_initialized = true;
 
@@ -100,8 +128,8 @@ int zcash_fpga::init_fpga(int slot_id) {
 
   m_command_cap = *(command_cap_e*)&status_rpl.cmd_cap;
 
-  printf("INFO: FPGA version: 0x%x, built on 0x%lx\n", status_rpl.version, status_rpl.build_date);
-  printf("INFO: FPGA capability register: 0x%lx [ENB_VERIFY_EQUIHASH_200_9: %d, ENB_VERIFY_EQUIHASH_144_5 %d, ENB_VERIFY_SECP256K1_SIG %d, ENB_BLS12_381 %d]\n",
+  zlog_info("FPGA version: 0x%x, built on 0x%lx\n", status_rpl.version, status_rpl.build_date);
+  zlog_info("FPGA capability register: 0x%lx [ENB_VERIFY_EQUIHASH_200_9: %d, ENB_VERIFY_EQUIHASH_144_5 %d, ENB_VERIFY_SECP256K1_SIG %d, ENB_BLS12_381 %d]\n",
       status_rpl.cmd_cap,
       (status_rpl.cmd_cap & ENB_VERIFY_EQUIHASH_200_9) != 0,
       (status_rpl.cmd_cap & ENB_VERIFY_EQUIHASH_144_5) != 0,
@@ -109,41 +137,54 @@ int zcash_fpga::init_fpga(int slot_id) {
       (status_rpl.cmd_cap & ENB_BLS12_381) != 0);
 
   if ((status_rpl.cmd_cap & ENB_BLS12_381) != 0) {
-    rc = fpga_pci_peek(m_pci_bar_handle_bar0, BLS12_381_OFFSET + 0, &rdata);
+    rc = m_transport->peek(BLS12_381_OFFSET + 0, &rdata);
     fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
     m_bls12_381_inst_axil_offset = rdata;
 
-    rc = fpga_pci_peek(m_pci_bar_handle_bar0, BLS12_381_OFFSET + 1*4, &rdata);
+    rc = m_transport->peek(BLS12_381_OFFSET + 1*4, &rdata);
     fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
     m_bls12_381_data_axil_offset = rdata;
 
-    rc = fpga_pci_peek(m_pci_bar_handle_bar0, BLS12_381_OFFSET + 2*4, &rdata);
+    rc = m_transport->peek(BLS12_381_OFFSET + 2*4, &rdata);
     fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
     m_bls12_381_data_size = 1 << rdata;
 
-    rc = fpga_pci_peek(m_pci_bar_handle_bar0, BLS12_381_OFFSET + 3*4, &rdata);
+    rc = m_transport->peek(BLS12_381_OFFSET + 3*4, &rdata);
     fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
     m_bls12_381_inst_size = 1 << rdata;
   }
 
-  printf("INFO: Finished initializing FPGA.\n");
-
+  zlog_info("Finished initializing FPGA.\n");
 
   return rc;
   out:
     m_initialized = false;
-    /* clean up */
-    if (m_pci_bar_handle_bar0 >= 0) {
-      rc = fpga_pci_detach(m_pci_bar_handle_bar0);
-      if (rc) printf("ERROR: Failure while detaching bar0 from the fpga.\n");
-    }
-    if (m_pci_bar_handle_bar4 >= 0) {
-      rc = fpga_pci_detach(m_pci_bar_handle_bar4);
-      if (rc) printf("ERROR: Failure while detaching bar4 from the fpga.\n");
-    }
     return 1;
 }
 
+int zcash_fpga::get_numa_node() {
+  struct fpga_slot_spec spec;
+  char path[128];
+  int node = -1;
+  FILE* fp;
+
+  if (m_slot_id < 0) return -1;
+
+  if (fpga_pci_get_slot_spec(m_slot_id, &spec) != 0) {
+    zlog_warn("Unable to get PCI address of slot %d\n", m_slot_id);
+    return -1;
+  }
+
+  snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.%x/numa_node",
+           spec.map[FPGA_APP_PF].domain, spec.map[FPGA_APP_PF].bus,
+           spec.map[FPGA_APP_PF].dev, spec.map[FPGA_APP_PF].func);
+  fp = fopen(path, "r");
+  if (fp == NULL) return -1;
+  if (fscanf(fp, "%d", &node) != 1) node = -1;
+  fclose(fp);
+  return node;
+}
+
 int zcash_fpga::check_afi_ready(int slot_id) {
   struct fpga_mgmt_image_info info = {0};
   int rc;
@@ -162,14 +203,14 @@ int zcash_fpga::check_afi_ready(int slot_id) {
     fail_on(rc, out, "ERROR: AFI in Slot %d is not in READY state !", slot_id);
   }
 
-  printf("INFO: AFI PCI  Vendor ID: 0x%x, Device ID 0x%x\n",
+  zlog_info("AFI PCI  Vendor ID: 0x%x, Device ID 0x%x\n",
          info.spec.map[FPGA_APP_PF].vendor_id,
          info.spec.map[FPGA_APP_PF].device_id);
 
   /* confirm that the AFI that we expect is in fact loaded */
   if (info.spec.map[FPGA_APP_PF].vendor_id != s_pci_vendor_id ||
       info.spec.map[FPGA_APP_PF].device_id != s_pci_device_id) {
-    printf("INFO: AFI does not show expected PCI vendor id and device ID. If the AFI "
+    zlog_info("AFI does not show expected PCI vendor id and device ID. If the AFI "
            "was just loaded, it might need a rescan. Rescanning now.\n");
 
     rc = fpga_pci_rescan_slot_app_pfs(slot_id);
@@ -178,7 +219,7 @@ int zcash_fpga::check_afi_ready(int slot_id) {
     rc = fpga_mgmt_describe_local_image(slot_id, &info,0);
     fail_on(rc, out, "ERROR: Unable to get AFI information from slot %d",slot_id);
 
-    printf("INFO: AFI PCI  Vendor ID: 0x%x, Device ID 0x%x\n",
+    zlog_info("AFI PCI  Vendor ID: 0x%x, Device ID 0x%x\n",
            info.spec.map[FPGA_APP_PF].vendor_id,
            info.spec.map[FPGA_APP_PF].device_id);
 
@@ -199,11 +240,10 @@ int zcash_fpga::check_afi_ready(int slot_id) {
 int zcash_fpga::get_status(fpga_status_rpl_t& status_rpl) {
   // Test: send status message
   int rc;
-  unsigned int timeout = 0;
-  unsigned int read_len = 0;
+  int read_len = 0;
 
   if (!m_initialized) {
-    printf("ERROR: FPGA not m_initialized!\n");
+    zlog_error("FPGA not m_initialized!\n");
     goto out;
   }
 
@@ -213,16 +253,17 @@ int zcash_fpga::get_status(fpga_status_rpl_t& status_rpl) {
   rc = write_stream((uint8_t*)&hdr, sizeof(hdr));
   fail_on(rc, out, "ERROR: Unable to read from FPGA!");
 
-  // Try read reply
+  // Try read reply, replies to other commands still in flight are dropped
   uint8_t reply[256];
-  while ((read_len = read_stream(reply, 256)) == 0) {
-    usleep(1);
-    timeout++;
-    if (timeout > 1000) {
-      printf("ERROR: No reply received, timeout\n");
+  for (;;) {
+    read_len = read_stream_wait(reply, 256, FPGA_STATUS);
+    if (read_len <= 0) {
+      zlog_error("No reply received, timeout\n");
       rc = 1;
       goto out;
     }
+    if (((header_t*)reply)->cmd == FPGA_STATUS_RPL) break;
+    zlog_warn("Dropping reply 0x%x while waiting for status\n", ((header_t*)reply)->cmd);
   }
 
   status_rpl = *(fpga_status_rpl_t*)reply;
@@ -234,50 +275,161 @@ out:
 
 int zcash_fpga::write_stream(uint8_t* data, unsigned int len) {
   int rc;
-  uint32_t rdata;
-  unsigned int len_send = 0;
 
   if (!m_initialized) {
-    printf("ERROR: FPGA not m_initialized!\n");
+    zlog_error("FPGA not m_initialized!\n");
     goto out;
   }
 
+  rc = tx_reserve(len);
+  if (rc != 0) {
+    zlog_error("write_stream does not have enough space to write %d bytes! (%d words free)\n", len, m_tx_credit);
+    goto out;
+  }
 
-  rc = fpga_pci_peek(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET + 0xCULL, &rdata);
-  fail_on(rc, out, "ERROR: Unable to read from FPGA!");
-  if (len > rdata) {
-    printf("ERROR: write_stream does not have enough space to write %d bytes! (%d free)\n", len, rdata);
+  rc = m_transport->write_data(data, len);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!");
+
+  rc = m_transport->poke(AXI_FIFO_OFFSET+0x14ULL, len); // TLR
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!");
+
+  zlog_debug("write_stream: Wrote %d bytes of data\n", len);
+
+  return rc;
+  out:
+    return 1;
+}
+
+int zcash_fpga::write_stream_burst(uint8_t* data, unsigned int len) {
+  int rc;
+
+  if (!m_initialized) {
+    zlog_error("FPGA not m_initialized!\n");
     goto out;
   }
 
+  rc = tx_reserve(len);
+  if (rc != 0) {
+    zlog_error("write_stream_burst does not have enough space to write %d bytes! (%d words free)\n", len, m_tx_credit);
+    goto out;
+  }
 
-  while(len_send < len) {
-    if (m_axi4_enabled) {
-      fpga_pci_poke64(m_pci_bar_handle_bar4, 0, *(uint64_t*)(&data[len_send]));
-      len_send += 8;
-    } else {
-      rc = fpga_pci_poke(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET+0x10ULL, *(uint32_t*)(&data[len_send])); // Reset ISR
-      fail_on(rc, out, "ERROR: Unable to write to FPGA!");
-      len_send += 4;
-    }
+  rc = m_transport->write_data_burst(data, len);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!");
+
+  rc = m_transport->poke(AXI_FIFO_OFFSET+0x14ULL, len); // TLR
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!");
+
+  return rc;
+  out:
+    return 1;
+}
+
+int zcash_fpga::write_stream_burst(const uint8_t* head, unsigned int head_len, const uint8_t* body, unsigned int body_len) {
+  int rc;
+
+  if (!m_initialized) {
+    zlog_error("FPGA not m_initialized!\n");
+    goto out;
   }
+  if ((head_len & 7) != 0) {
+    zlog_error("write_stream_burst head of %d bytes is not a multiple of 8\n", head_len);
+    goto out;
+  }
+
+  rc = tx_reserve(head_len + body_len);
+  if (rc != 0) {
+    zlog_error("write_stream_burst does not have enough space to write %d bytes! (%d words free)\n", head_len + body_len, m_tx_credit);
+    goto out;
+  }
+
+  rc = m_transport->write_data_burst(head, head_len);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!");
 
-  rc = fpga_pci_poke(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET+0x14ULL, len); // Reset ISR
+  rc = m_transport->write_data_burst(body, body_len);
   fail_on(rc, out, "ERROR: Unable to write to FPGA!");
 
+  rc = m_transport->poke(AXI_FIFO_OFFSET+0x14ULL, head_len + body_len); // TLR
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!");
 
-  printf("INFO: write_stream::Wrote %d bytes of data\n", len);
-  usleep(1); 
+  return rc;
+  out:
+    return 1;
+}
 
-  // Check transmit complete bit and reset it
-  rc = fpga_pci_peek(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET, &rdata);
-  fail_on(rc, out, "ERROR: Unable to read from FPGA!");
-  if ((rdata & (1 << 27)) == 0) {
-    printf("WARNING: write_stream transmit bit not set, register returned 0x%x\n", rdata);
+int zcash_fpga::write_stream_batch(uint8_t* data, unsigned int len) {
+  int rc;
+  unsigned int offset = 0;
+  unsigned int cmd_len;
+
+  if (!m_initialized) {
+    zlog_error("FPGA not m_initialized!\n");
+    goto out;
   }
 
-  rc = fpga_pci_poke(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET, 0x08000000); // Reset ISR
-  fail_on(rc, out, "Unable to write to FPGA!");
+  rc = tx_reserve(len);
+  if (rc != 0) {
+    zlog_error("write_stream_batch does not have enough space to write %d bytes! (%d words free)\n", len, m_tx_credit);
+    goto out;
+  }
+
+  while (offset < len) {
+    cmd_len = ((header_t*)&data[offset])->len;
+    if (cmd_len < sizeof(header_t) || offset + cmd_len > len) {
+      zlog_error("write_stream_batch has a bad command length %d at offset %d\n", cmd_len, offset);
+      goto out;
+    }
+
+    rc = m_transport->write_data_burst(&data[offset], cmd_len);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!");
+
+    rc = m_transport->poke(AXI_FIFO_OFFSET+0x14ULL, cmd_len); // TLR
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!");
+
+    offset += (cmd_len + 7) & ~7U;
+  }
+
+  zlog_debug("write_stream_batch: Wrote %d bytes of data\n", len);
+
+  return rc;
+  out:
+    return 1;
+}
+
+// FIFO words used by a packet of len bytes, the AXI4 path always writes 64-bit words
+unsigned int zcash_fpga::tx_words(unsigned int len) {
+  if (m_axi4_enabled) return ((len + 7) / 8) * 2;
+  return (len + 3) / 4;
+}
+
+// Takes the credit for a packet, re-reading TDFV only if the cached credit is too low
+int zcash_fpga::tx_reserve(unsigned int len) {
+  unsigned int words = tx_words(len);
+  unsigned int space;
+
+  if (words > m_tx_credit) {
+    if (get_tx_space(space, len) != 0) return 1;
+    if (words > m_tx_credit) return 1;
+  }
+  m_tx_credit -= words;
+  return 0;
+}
+
+int zcash_fpga::get_tx_space(unsigned int& space, unsigned int need) {
+  int rc = 0;
+  uint32_t rdata;
+
+  if (!m_initialized) {
+    zlog_error("FPGA not m_initialized!\n");
+    goto out;
+  }
+
+  if (tx_words(need) > m_tx_credit) {
+    rc = m_transport->peek(AXI_FIFO_OFFSET + 0xCULL, &rdata); // TDFV
+    fail_on(rc, out, "ERROR: Unable to read from FPGA!");
+    m_tx_credit = rdata;
+  }
+  space = m_tx_credit * 4;
 
   return rc;
   out:
@@ -291,226 +443,526 @@ int zcash_fpga::read_stream(uint8_t* data, unsigned int size) {
   int rc;
 
   if (!m_initialized) {
-    printf("ERROR: FPGA not m_initialized!\n");
+    zlog_error("FPGA not m_initialized!\n");
     goto out;
   }
 
 
-  rc = fpga_pci_peek(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET, &rdata);
+  rc = m_transport->peek(AXI_FIFO_OFFSET, &rdata);
   fail_on(rc, out, "ERROR: Unable to read from FPGA!");
   if ((rdata & (1 << 26)) == 0) return 0;  // Nothing to read
 
-  rc = fpga_pci_peek(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET + 0x1CULL, &rdata);  //RDFO should be non-zero (slots used in FIFO)
+  rc = m_transport->peek(AXI_FIFO_OFFSET + 0x1CULL, &rdata);  //RDFO should be non-zero (slots used in FIFO)
   fail_on(rc, out, "ERROR: Unable to read from FPGA!");
   if (rdata == 0) {
-    printf("WARNING: Read FIFO shows data but length was 0!\n");
+    zlog_warn("Read FIFO shows data but length was 0!\n");
     goto out;
   }
 
-  rc = fpga_pci_peek(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET + 0x24ULL, &rdata);  //RLR - length of packet in bytes
+  rc = m_transport->peek(AXI_FIFO_OFFSET + 0x24ULL, &rdata);  //RLR - length of packet in bytes
   fail_on(rc, out, "Unable to read from FPGA!");
-  printf("INFO: Read FIFO shows %d bytes waiting to be read from FPGA\n", rdata);
+  zlog_debug("Read FIFO shows %d bytes waiting to be read from FPGA\n", rdata);
 
   if (size < rdata) {
-    printf("ERROR: Size of buffer (%d bytes) not big enough to read data!\n", size);
+    zlog_error("Size of buffer (%d bytes) not big enough to read data!\n", size);
     goto out;
   }
 
-  while(read_len < rdata) {
-    if (m_axi4_enabled) {
-      rc = fpga_pci_peek(m_pci_bar_handle_bar4, 0x1000, (uint32_t*)(&data[read_len]));
-      fail_on(rc, out, "ERROR: Unable to read from FPGA PCIS!");
-      read_len += 8;
-    } else {
-      rc = fpga_pci_peek(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET + 0x20ULL, (uint32_t*)(&data[read_len]));
-      fail_on(rc, out, "ERROR: Unable to read from FPGA!");
-      read_len += 4;
-    }
-  }
+  rc = m_transport->read_data(data, rdata);
+  fail_on(rc, out, "ERROR: Unable to read from FPGA!");
+  read_len = rdata;
 
-  printf("INFO: Read %d bytes from read_stream()\n", read_len);
+  zlog_debug("Read %d bytes from read_stream()\n", read_len);
 
   // Check if there is still data to be read - if there isn't we can clear the ISR
-  rc = fpga_pci_peek(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET + 0x1CULL, &rdata);  //RDFO
+  rc = m_transport->peek(AXI_FIFO_OFFSET + 0x1CULL, &rdata);  //RDFO
+  fail_on(rc, out, "ERROR: Unable to read from FPGA!");
+  if (rdata == 0) {
+    rc = m_transport->poke(AXI_FIFO_OFFSET, 0x04000000); // clear ISR
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!");
+  }
+
+  return read_len;
+  out:
+    return -1;
+}
+
+int zcash_fpga::read_stream_routed(uint8_t* head, unsigned int head_len, stream_route_t route, void* ctx) {
+
+  uint32_t rdata;
+  unsigned int len;
+  uint8_t discard[STREAM_MAX_RPL_BYTES];
+  uint8_t* body;
+  int rc;
+
+  if (!m_initialized) {
+    zlog_error("FPGA not m_initialized!\n");
+    goto out;
+  }
+
+  rc = m_transport->peek(AXI_FIFO_OFFSET, &rdata);
+  fail_on(rc, out, "ERROR: Unable to read from FPGA!");
+  if ((rdata & (1 << 26)) == 0) return 0;  // Nothing to read
+
+  rc = m_transport->peek(AXI_FIFO_OFFSET + 0x1CULL, &rdata);  //RDFO
+  fail_on(rc, out, "ERROR: Unable to read from FPGA!");
+  if (rdata == 0) {
+    zlog_warn("Read FIFO shows data but length was 0!\n");
+    goto out;
+  }
+
+  rc = m_transport->peek(AXI_FIFO_OFFSET + 0x24ULL, &rdata);  //RLR - length of packet in bytes
+  fail_on(rc, out, "Unable to read from FPGA!");
+  if (rdata == 0 || rdata > STREAM_MAX_RPL_BYTES) {
+    zlog_error("read_stream_routed got invalid packet length %d!\n", rdata);
+    goto out;
+  }
+  len = rdata;
+
+  // The head is whole FIFO words so the rest starts on a word boundary
+  rc = m_transport->read_data(head, len < head_len ? len : head_len);
+  fail_on(rc, out, "ERROR: Unable to read from FPGA!");
+  if (len > head_len) {
+    body = route(ctx, head, len);
+    rc = m_transport->read_data(body != nullptr ? body : discard, len - head_len);
+    fail_on(rc, out, "ERROR: Unable to read from FPGA!");
+  }
+
+  rc = m_transport->peek(AXI_FIFO_OFFSET + 0x1CULL, &rdata);  //RDFO
   fail_on(rc, out, "ERROR: Unable to read from FPGA!");
   if (rdata == 0) {
-    rc = fpga_pci_poke(m_pci_bar_handle_bar0, AXI_FIFO_OFFSET, 0x04000000); // clear ISR
+    rc = m_transport->poke(AXI_FIFO_OFFSET, 0x04000000); // clear ISR
     fail_on(rc, out, "ERROR: Unable to write to FPGA!");
   }
 
+  return len;
+  out:
+    return -1;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned int zcash_fpga::wait_policy_idx(command_t cmd) {
+  switch (cmd) {
+    case VERIFY_EQUIHASH:
+    case VERIFY_EQUIHASH_RPL:
+      return 1;
+    case VERIFY_SECP256K1_SIG:
+    case VERIFY_SECP256K1_SIG_RPL:
+      return 2;
+    case BLS12_381_INTERRUPT_RPL:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+void zcash_fpga::set_wait_policy(command_t cmd, wait_policy_t policy) {
+  m_wait_policy[wait_policy_idx(cmd)] = policy;
+}
+
+zcash_fpga::wait_policy_t zcash_fpga::get_wait_policy(command_t cmd) {
+  return m_wait_policy[wait_policy_idx(cmd)];
+}
+
+int zcash_fpga::read_stream_wait(uint8_t* data, unsigned int size, command_t cmd, uint64_t* wait_ns) {
+  const wait_policy_t& policy = m_wait_policy[wait_policy_idx(cmd)];
+  uint64_t start = now_ns();
+  uint64_t elapsed_us;
+  int read_len;
+
+  for (;;) {
+    read_len = read_stream(data, size);
+    if (read_len != 0) break;
+
+    elapsed_us = (now_ns() - start) / 1000;
+    if (elapsed_us >= policy.timeout_us) break;
+    if (m_reply_fd >= 0 && elapsed_us >= policy.spin_us) {
+      // Block until notified, the pending event is kept if the reply arrived before the poll
+      struct pollfd pfd = {m_reply_fd, POLLIN, 0};
+      poll(&pfd, 1, (policy.timeout_us - elapsed_us + 999) / 1000);
+      ack_reply_fd();
+    } else if (elapsed_us >= policy.yield_us)
+      usleep(policy.sleep_us);
+    else if (elapsed_us >= policy.spin_us)
+      sched_yield();
+  }
+
+  if (wait_ns != nullptr) *wait_ns = now_ns() - start;
   return read_len;
+}
+
+int zcash_fpga::enable_reply_notify(notify_mode_t mode, unsigned int irq_vector) {
+  int rc;
+  char path[64];
+
+  if (!m_initialized) {
+    zlog_error("FPGA not m_initialized!\n");
+    goto out;
+  }
+
+  if (m_reply_fd >= 0) {
+    m_transport->set_reply_fd(-1);
+    close(m_reply_fd);
+    m_reply_fd = -1;
+  }
+
+  switch (mode) {
+    case NOTIFY_IRQ:
+      if (m_slot_id < 0) {
+        zlog_error("NOTIFY_IRQ needs an FPGA slot, the transport has none!\n");
+        goto out;
+      }
+      snprintf(path, sizeof(path), "/dev/xdma%d_events_%d", m_slot_id, irq_vector);
+      m_reply_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+      if (m_reply_fd < 0) {
+        zlog_error("Unable to open user interrupt device %s!\n", path);
+        goto out;
+      }
+      rc = m_transport->poke(AXI_FIFO_OFFSET+0x4ULL, 0x04000000); // IER: receive complete only
+      fail_on(rc, out, "ERROR: Unable to write to FPGA!");
+      break;
+    case NOTIFY_EVENTFD:
+      m_reply_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (m_reply_fd < 0) {
+        zlog_error("Unable to create eventfd!\n");
+        goto out;
+      }
+      // Without a transport posting it every wait past spin_us would run to its timeout
+      if (m_transport->set_reply_fd(m_reply_fd) != 0) {
+        zlog_error("The transport cannot post a reply eventfd, use NOTIFY_IRQ or NOTIFY_POLL!\n");
+        goto out;
+      }
+      break;
+    default:
+      rc = m_transport->poke(AXI_FIFO_OFFSET+0x4ULL, 0x0C000000); // IER as set by init_fpga()
+      fail_on(rc, out, "ERROR: Unable to write to FPGA!");
+      break;
+  }
+
+  m_notify_mode = mode;
+  zlog_info("Reply notification mode set to %d\n", mode);
+  return 0;
+  out:
+    if (m_reply_fd >= 0) {
+      if (m_transport) m_transport->set_reply_fd(-1);
+      close(m_reply_fd);
+    }
+    m_reply_fd = -1;
+    m_notify_mode = NOTIFY_POLL;
+    return 1;
+}
+
+int zcash_fpga::get_reply_fd() {
+  return m_reply_fd;
+}
+
+int zcash_fpga::ack_reply_fd() {
+  uint64_t events;
+  if (m_reply_fd < 0) return 1;
+  // eventfd reads 8 bytes, the interrupt device returns a 4 byte event count
+  if (read(m_reply_fd, &events, m_notify_mode == NOTIFY_EVENTFD ? 8 : 4) < 0 && errno != EAGAIN)
+    return 1;
+  return 0;
+}
+
+int zcash_fpga::signal_reply_fd() {
+  uint64_t one = 1;
+  if (m_notify_mode != NOTIFY_EVENTFD) return 1;
+  return write(m_reply_fd, &one, sizeof(one)) == sizeof(one) ? 0 : 1;
+}
+
+int zcash_fpga::read_stream_drain(stream_ring_t& ring) {
+  uint32_t rdfo, rlr, words;
+  unsigned int rec_len, free_len;
+  int packets = 0;
+  int rc;
+
+  if (!m_initialized) {
+    zlog_error("FPGA not m_initialized!\n");
+    goto out;
+  }
+
+  rc = m_transport->peek(AXI_FIFO_OFFSET + 0x1CULL, &rdfo);  //RDFO - data words in FIFO, 64 bit on AXI4
+  fail_on(rc, out, "ERROR: Unable to read from FPGA!");
+
+  while (rdfo != 0) {
+    while (rdfo != 0) {
+      // Only start a packet when any reply will fit, RLR cannot be un-read
+      if (ring.head + STREAM_MAX_RPL_BYTES + 2*sizeof(stream_ring_rec_t) > ring.size && ring.head >= ring.tail) {
+        if (ring.tail == 0) return packets;
+        ((stream_ring_rec_t*)&ring.buf[ring.head])->len = 0;
+        ring.head = 0;
+      }
+      free_len = ring.head >= ring.tail ? ring.size - ring.head : ring.tail - ring.head;
+      if (free_len <= STREAM_MAX_RPL_BYTES + sizeof(stream_ring_rec_t)) return packets;
+
+      rc = m_transport->peek(AXI_FIFO_OFFSET + 0x24ULL, &rlr);  //RLR - length of packet in bytes
+      fail_on(rc, out, "ERROR: Unable to read from FPGA!");
+      if (rlr == 0 || rlr > STREAM_MAX_RPL_BYTES) {
+        zlog_error("read_stream_drain got invalid packet length %d!\n", rlr);
+        goto out;
+      }
+
+      rc = m_transport->read_data(&ring.buf[ring.head + sizeof(stream_ring_rec_t)], rlr);
+      fail_on(rc, out, "ERROR: Unable to read from FPGA!");
+
+      ((stream_ring_rec_t*)&ring.buf[ring.head])->len = rlr;
+      rec_len = sizeof(stream_ring_rec_t) + ((rlr + 7) & ~7U);
+      ring.head += rec_len;
+      if (ring.head == ring.size) ring.head = 0;
+
+      words = m_transport->axi4() ? (rlr + 7)/8 : (rlr + 3)/4;
+      rdfo = rdfo > words ? rdfo - words : 0;
+      packets++;
+    }
+
+    // Check if more arrived while draining - if there isn't we can clear the ISR
+    rc = m_transport->peek(AXI_FIFO_OFFSET + 0x1CULL, &rdfo);  //RDFO
+    fail_on(rc, out, "ERROR: Unable to read from FPGA!");
+    if (rdfo == 0) {
+      rc = m_transport->poke(AXI_FIFO_OFFSET, 0x04000000); // clear ISR
+      fail_on(rc, out, "ERROR: Unable to write to FPGA!");
+    }
+  }
+
+  return packets;
   out:
     return -1;
 }
 
+uint8_t* zcash_fpga::stream_ring_front(stream_ring_t& ring, unsigned int& len) {
+  if (ring.tail == ring.head) return nullptr;
+  if (((stream_ring_rec_t*)&ring.buf[ring.tail])->len == 0) {
+    ring.tail = 0;
+    if (ring.tail == ring.head) return nullptr;
+  }
+  len = ((stream_ring_rec_t*)&ring.buf[ring.tail])->len;
+  return &ring.buf[ring.tail + sizeof(stream_ring_rec_t)];
+}
+
+void zcash_fpga::stream_ring_pop(stream_ring_t& ring) {
+  unsigned int len;
+  if (stream_ring_front(ring, len) == nullptr) return;
+  ring.tail += sizeof(stream_ring_rec_t) + ((len + 7) & ~7U);
+  if (ring.tail == ring.size) ring.tail = 0;
+}
+
 int zcash_fpga::bls12_381_set_data_slot(unsigned int id, bls12_381_data_t slot_data) {
-  uint8_t data[48];
+  return bls12_381_set_data_slots(id, &slot_data, 1);
+}
+
+int zcash_fpga::bls12_381_get_data_slot(unsigned int id, bls12_381_data_t& slot_data) {
+  return bls12_381_get_data_slots(id, &slot_data, 1);
+}
+
+int zcash_fpga::bls12_381_set_data_slots(unsigned int first, const bls12_381_data_t* slots, unsigned int count) {
+  int rc = 0;
+  for (unsigned int i = 0; i < count && rc == 0; i++)
+    rc = bls12_381_set_data_slots(first + i, slots[i].dat, 1, slots[i].point_type);
+  return rc;
+}
+
+int zcash_fpga::bls12_381_get_data_slots(unsigned int first, bls12_381_data_t* slots, unsigned int count) {
+  int rc = 0;
+  for (unsigned int i = 0; i < count && rc == 0; i++)
+    rc = bls12_381_get_data_slots(first + i, slots[i].dat, 1, slots[i].point_type);
+  return rc;
+}
+
+int zcash_fpga::bls12_381_set_data_slots(unsigned int first, const uint8_t* dat, unsigned int count, point_type_t pt) {
+  uint32_t words[12];
   int rc = 0;
   if (!m_initialized) {
-    printf("ERROR: FPGA not m_initialized!\n");
+    zlog_error("FPGA not m_initialized!\n");
     goto out;
   }
-  if (id >= m_bls12_381_data_size) {
-    printf("ERROR: Data slot id (%d) is greater than number of slots on FPGA (%d)!\n", id, m_bls12_381_data_size);
+  if (first >= m_bls12_381_data_size || count > m_bls12_381_data_size - first) {
+    zlog_error("Data slots %d to %d are past the number of slots on FPGA (%d)!\n", first, first + count - 1, m_bls12_381_data_size);
     goto out;
   }
 
-  *(bls12_381_data_t*)data = slot_data;
-  // Set the top 3 bits to the point type
-  data[47] &= 0x1F;
-  data[47] |= (slot_data.point_type << 5);
+  for (unsigned int i = 0; i < count; i++) {
+    memcpy(words, &dat[i*48], sizeof(words));
+    // Set the top 3 bits to the point type
+    ((uint8_t*)words)[47] &= 0x1F;
+    ((uint8_t*)words)[47] |= (pt << 5);
 
-  for(int i = 0; i < 48; i=i+4) {
-    rc = fpga_pci_poke(m_pci_bar_handle_bar0, BLS12_381_OFFSET + m_bls12_381_data_axil_offset + id*64 + i, *((uint32_t*)&data[i]));
+    rc = m_transport->write_regs(BLS12_381_OFFSET + m_bls12_381_data_axil_offset + (first + i)*64, words, 12);
     fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
   }
   return 0;
   out:
-    return rc;
+    return 1;
 }
 
-int zcash_fpga::bls12_381_get_data_slot(unsigned int id, bls12_381_data_t& slot_data) {
+int zcash_fpga::bls12_381_get_data_slots(unsigned int first, uint8_t* dat, unsigned int count, point_type_t& pt) {
+  uint32_t words[12];
   int rc = 0;
   if (!m_initialized) {
-    printf("ERROR: FPGA not m_initialized!\n");
+    zlog_error("FPGA not m_initialized!\n");
     goto out;
   }
-  if (id >= m_bls12_381_data_size) {
-    printf("ERROR: Data slot id (%d) is greater than number of slots on FPGA (%d)!\n", id, m_bls12_381_data_size);
+  if (first >= m_bls12_381_data_size || count > m_bls12_381_data_size - first) {
+    zlog_error("Data slots %d to %d are past the number of slots on FPGA (%d)!\n", first, first + count - 1, m_bls12_381_data_size);
     goto out;
   }
 
-  for(int i = 0; i < 48; i=i+4) {
-    rc = fpga_pci_peek(m_pci_bar_handle_bar0, BLS12_381_OFFSET + m_bls12_381_data_axil_offset + id*64 + i, (uint32_t*)(((uint8_t*)&slot_data + i)));
+  for (unsigned int i = 0; i < count; i++) {
+    rc = m_transport->read_regs(BLS12_381_OFFSET + m_bls12_381_data_axil_offset + (first + i)*64, words, 12);
     fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
-  }
-
-  slot_data.point_type = (point_type_t)(*((uint8_t*)&slot_data + 47) >> 5);
-  // Clear top 3 bits
-  *((uint8_t*)&slot_data + 47) &= 0x1F;
 
+    if (i == 0) pt = (point_type_t)(((uint8_t*)words)[47] >> 5);
+    // Clear top 3 bits
+    ((uint8_t*)words)[47] &= 0x1F;
+    memcpy(&dat[i*48], words, sizeof(words));
+  }
   return 0;
   out:
-    return rc;
+    return 1;
 }
 
 int zcash_fpga::bls12_381_set_inst_slot(unsigned int id, bls12_381_inst_t inst_data) {
+  return bls12_381_set_inst_slots(id, &inst_data, 1);
+}
+
+int zcash_fpga::bls12_381_get_inst_slot(unsigned int id, bls12_381_inst_t& inst_data) {
+  return bls12_381_get_inst_slots(id, &inst_data, 1);
+}
+
+int zcash_fpga::bls12_381_set_inst_slots(unsigned int first, const bls12_381_inst_t* insts, unsigned int count) {
+  uint32_t words[128];  // The 7 byte instructions padded to the 8 byte slot, 64 at a time
+  unsigned int n;
   int rc = 0;
   if (!m_initialized) {
-    printf("ERROR: FPGA not m_initialized!\n");
+    zlog_error("FPGA not m_initialized!\n");
     goto out;
   }
-  if (id >= m_bls12_381_inst_size) {
-    printf("ERROR: Instance slot id (%d) is greater than number of slots on FPGA (%d)!\n", id, m_bls12_381_inst_size);
+  if (first >= m_bls12_381_inst_size || count > m_bls12_381_inst_size - first) {
+    zlog_error("Instruction slots %d to %d are past the number of slots on FPGA (%d)!\n", first, first + count - 1, m_bls12_381_inst_size);
     goto out;
   }
 
-  for(int i = 0; i < 8; i=i+4) {
-    rc = fpga_pci_poke(m_pci_bar_handle_bar0, BLS12_381_OFFSET + m_bls12_381_inst_axil_offset + id*8 + i, *(uint32_t*)((uint8_t*)&inst_data + i));
+  for (unsigned int i = 0; i < count; i += n) {
+    n = count - i < 64 ? count - i : 64;
+    memset(words, 0, n * 8);
+    for (unsigned int j = 0; j < n; j++)
+      memcpy(&words[2*j], &insts[i + j], sizeof(bls12_381_inst_t));
+    rc = m_transport->write_regs(BLS12_381_OFFSET + m_bls12_381_inst_axil_offset + (first + i)*8, words, 2*n);
     fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
   }
   return 0;
   out:
-    return rc;
+    return 1;
 }
 
-int zcash_fpga::bls12_381_get_inst_slot(unsigned int id, bls12_381_inst_t& inst_data) {
+int zcash_fpga::bls12_381_get_inst_slots(unsigned int first, bls12_381_inst_t* insts, unsigned int count) {
+  uint32_t words[128];
+  unsigned int n;
   int rc = 0;
   if (!m_initialized) {
-    printf("ERROR: FPGA not m_initialized!\n");
+    zlog_error("FPGA not m_initialized!\n");
     goto out;
   }
-  if (id >= m_bls12_381_inst_size) {
-    printf("ERROR: Instance slot id (%d) is greater than number of slots on FPGA (%d)!\n", id, m_bls12_381_inst_size);
+  if (first >= m_bls12_381_inst_size || count > m_bls12_381_inst_size - first) {
+    zlog_error("Instruction slots %d to %d are past the number of slots on FPGA (%d)!\n", first, first + count - 1, m_bls12_381_inst_size);
     goto out;
   }
 
-  for(int i = 0; i < 8; i=i+4) {
-    rc = fpga_pci_peek(m_pci_bar_handle_bar0, BLS12_381_OFFSET + m_bls12_381_inst_axil_offset + id*8 + i, (uint32_t*)(((uint8_t*)&inst_data + i)));
+  for (unsigned int i = 0; i < count; i += n) {
+    n = count - i < 64 ? count - i : 64;
+    rc = m_transport->read_regs(BLS12_381_OFFSET + m_bls12_381_inst_axil_offset + (first + i)*8, words, 2*n);
     fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
+    for (unsigned int j = 0; j < n; j++)
+      memcpy(&insts[i + j], &words[2*j], sizeof(bls12_381_inst_t));
   }
-
   return 0;
   out:
-    return rc;
+    return 1;
 }
 
 int zcash_fpga::bls12_381_set_curr_inst_slot(unsigned int id) {
   int rc = 0;
   unsigned int prev_id;
   uint32_t rdata;
+  bls12_381_inst_t prev_inst;
   if (!m_initialized) {
-    printf("ERROR: FPGA not m_initialized!\n");
+    zlog_error("FPGA not m_initialized!\n");
     goto out;
   }
   if (id >= m_bls12_381_inst_size) {
-    printf("ERROR: Instance slot id (%d) is greater than number of slots on FPGA (%d)!\n", id, m_bls12_381_inst_size);
+    zlog_error("Instance slot id (%d) is greater than number of slots on FPGA (%d)!\n", id, m_bls12_381_inst_size);
     goto out;
   }
 
-  rc = fpga_pci_peek(m_pci_bar_handle_bar0, BLS12_381_OFFSET + 0x10, &rdata);
+  rc = m_transport->peek(BLS12_381_OFFSET + 0x10, &rdata);
   fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
   prev_id = rdata;
 
-  rc = fpga_pci_poke(m_pci_bar_handle_bar0, BLS12_381_OFFSET + 0x10, id);
+  rc = bls12_381_get_inst_slot(prev_id, prev_inst);
+  fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
+
+  rc = m_transport->poke(BLS12_381_OFFSET + 0x10, id);
   fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
 
-  rc = fpga_pci_peek(m_pci_bar_handle_bar0, BLS12_381_OFFSET + 0x10, &rdata);
+  rc = m_transport->peek(BLS12_381_OFFSET + 0x10, &rdata);
   fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
 
-  if (rdata != id) {
-    printf("ERROR: Unable to set BLS12_381 current instruction slot!\n");
+  // A program starting with fast instructions can have moved on by the time it is read
+  // back. That only proves the write when the PC was parked on a NOOP_WAIT before it.
+  if (rdata != id && (prev_inst.code != NOOP_WAIT || rdata == prev_id)) {
+    zlog_error("Unable to set BLS12_381 current instruction slot!\n");
     goto out;
   }
 
-  printf("INFO: Set BLS12_381 current instruction slot to %d (was %d)\n", id, prev_id);
+  zlog_debug("Set BLS12_381 current instruction slot to %d (was %d)\n", id, prev_id);
 
   return 0;
   out:
-    return rc;
+    return 1;
 }
 
 int zcash_fpga::bls12_381_get_curr_inst_slot(unsigned int& id) {
   int rc = 0;
 
   if (!m_initialized) {
-    printf("ERROR: FPGA not m_initialized!\n");
-    goto out;
-  }
-  if (id >= m_bls12_381_inst_size) {
-    printf("ERROR: Instance slot id (%d) is greater than number of slots on FPGA (%d)!\n", id, m_bls12_381_inst_size);
+    zlog_error("FPGA not m_initialized!\n");
     goto out;
   }
 
-  rc = fpga_pci_peek(m_pci_bar_handle_bar0, BLS12_381_OFFSET + 0x10, &id);
+  rc = m_transport->peek(BLS12_381_OFFSET + 0x10, &id);
   fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
 
-  printf("INFO: BLS12_381 current instruction slot is %d\n", id);
+  zlog_debug("BLS12_381 current instruction slot is %d\n", id);
 
   return 0;
   out:
-    return rc;
+    return 1;
 }
 
 int zcash_fpga::bls12_381_reset_memory(bool inst_memory, bool data_memory) {
   int rc = 0;
   uint32_t data = 0;
   if (!m_initialized) {
-    printf("ERROR: FPGA not m_initialized!\n");
+    zlog_error("FPGA not m_initialized!\n");
     goto out;
   }
 
   if (inst_memory) {
     data |= 1;
-    printf("INFO: Resetting instruction memory\n");
+    zlog_debug("Resetting instruction memory\n");
   }
 
   if (data_memory) {
     data |= 1 << 1;
-    printf("INFO: Resetting data memory reset\n");
+    zlog_debug("Resetting data memory reset\n");
   }
 
-  rc = fpga_pci_poke(m_pci_bar_handle_bar0, BLS12_381_OFFSET, data);
+  rc = m_transport->poke(BLS12_381_OFFSET, data);
   fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
 
   // Add a small delay
@@ -521,14 +973,83 @@ int zcash_fpga::bls12_381_reset_memory(bool inst_memory, bool data_memory) {
     return rc;
 }
 
+int zcash_fpga::verify_equihash(const cblockheader_sol_t& block, uint64_t index, uint8_t& bm) {
+  return verify_equihash_batch(&block, 1, index, &bm) == 1 ? 0 : 1;
+}
+
+int zcash_fpga::verify_equihash_batch(const cblockheader_sol_t* blocks, unsigned int count, uint64_t first_index, uint8_t* bm) {
+  int rc = 0;
+  int read_len;
+  unsigned int sent = 0, done = 0, space;
+  uint64_t slot;
+  uint8_t reply[STREAM_MAX_RPL_BYTES];
+  struct __attribute__((__packed__)) {
+    header_t hdr;
+    uint64_t index;
+  } cmd;  // Prefix of verify_equihash_t, the block is sent from blocks[] as is
+  verify_equihash_rpl_t* rpl = (verify_equihash_rpl_t*)reply;
+
+  if (!m_initialized) {
+    zlog_error("FPGA not m_initialized!\n");
+    goto out;
+  }
+  if ((m_command_cap & ENB_VERIFY_EQUIHASH_200_9) == 0) {
+    zlog_error("FPGA was not built with ENB_VERIFY_EQUIHASH_200_9\n");
+    goto out;
+  }
+
+  for (unsigned int i = 0; i < count; i++)
+    bm[i] = EQUIHASH_NO_RPL;
+
+  cmd.hdr.cmd = VERIFY_EQUIHASH;
+  cmd.hdr.len = sizeof(verify_equihash_t);
+
+  while (done < count) {
+    // Queue as many commands as fit (one at a time for the default FIFO depth), the FPGA
+    // starts on the next one as soon as it has replied to the previous
+    while (sent < count) {
+      rc = get_tx_space(space, sizeof(verify_equihash_t));
+      fail_on(rc, out, "ERROR: Unable to read from FPGA!");
+      if (space < sizeof(verify_equihash_t)) break;
+      cmd.index = first_index + sent;
+      rc = write_stream_burst((const uint8_t*)&cmd, sizeof(cmd), (const uint8_t*)&blocks[sent], sizeof(blocks[sent]));
+      fail_on(rc, out, "ERROR: Unable to send verify_equihash to FPGA!");
+      sent++;
+    }
+
+    read_len = read_stream_wait(reply, sizeof(reply), VERIFY_EQUIHASH);
+    if (read_len < 0) goto out;
+    if (read_len == 0) {
+      zlog_error("No reply received, timeout (%d of %d equihash replies)\n", done, count);
+      return done;
+    }
+    if (rpl->hdr.cmd != VERIFY_EQUIHASH_RPL || (unsigned int)read_len < sizeof(verify_equihash_rpl_t)) {
+      zlog_warn("Dropping reply 0x%x while waiting for verify_equihash\n", rpl->hdr.cmd);
+      continue;
+    }
+
+    slot = rpl->index - first_index;
+    if (slot >= sent || bm[slot] != EQUIHASH_NO_RPL) {
+      zlog_warn("Dropping verify_equihash reply with unexpected index 0x%lx\n", (unsigned long)rpl->index);
+      continue;
+    }
+    bm[slot] = rpl->bm;
+    done++;
+  }
+
+  return done;
+  out:
+    return -1;
+}
+
 int zcash_fpga::bls12_381_get_last_cycle_cnt(unsigned int& cnt) {
   int rc = 0;
   if (!m_initialized) {
-    printf("ERROR: FPGA not m_initialized!\n");
+    zlog_error("FPGA not m_initialized!\n");
     goto out;
   }
 
-  rc = fpga_pci_peek(m_pci_bar_handle_bar0, BLS12_381_OFFSET + 0x14, &cnt);
+  rc = m_transport->peek(BLS12_381_OFFSET + 0x14, &cnt);
   fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
 
   return 0;
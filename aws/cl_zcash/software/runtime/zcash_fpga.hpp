@@ -27,10 +27,19 @@
 #include <utils/lcd.h>
 #include <utils/sh_dpi_tasks.h>
 
+#include <memory>
+
+#include "zcash_fpga_transport.hpp"
 
-#define AXI_FIFO_OFFSET       UINT64_C(0x0)
 #define BLS12_381_OFFSET      UINT64_C(0x1000)
 
+// Largest reply packet the FPGA sends (BLS12_381_INTERRUPT_RPL with a FE12 payload)
+#define STREAM_MAX_RPL_BYTES  640
+
+// Equihash (200,9) solution as serialized after the block header: 3 byte CompactSize
+// (0xFD 0x40 0x05) followed by 512 21-bit indices
+#define EQUIHASH_200_9_SOL_BYTES  1347
+
 // These match the structs and commands defined in zcash_fpga_pkg.sv
 class zcash_fpga {
 
@@ -166,18 +175,116 @@ class zcash_fpga {
       uint16_t        cycle_cnt;
     } verify_secp256k1_sig_rpl_t;
 
+    // Bits of equihash_bm_t in equihash_pkg.sv, set for each check the solution failed
+    typedef enum : uint8_t {
+      DIFFICULTY_FAIL = 1 << 0,
+      XOR_NON_ZERO    = 1 << 1,
+      BAD_IDX_ORDER   = 1 << 2,
+      BAD_ZERO_ORDER  = 1 << 3,
+      DUPLICATE_FND   = 1 << 4,
+
+      EQUIHASH_NO_RPL = 0xFF   // Not from the FPGA, no reply was received
+    } equihash_bm_t;
+
+    // CBlockHeader without the solution, fields are little endian as serialized
+    typedef struct __attribute__((__packed__)) {
+      uint32_t version;
+      uint8_t  hash_prev_block[32];
+      uint8_t  hash_merkle_root[32];
+      uint8_t  hash_final_sapling_root[32];
+      uint32_t time;
+      uint32_t bits;
+      uint8_t  nonce[32];
+    } cblockheader_t;
+
+    // Serialized block header with its Equihash (200,9) solution, e.g. block_346.bin
+    typedef struct __attribute__((__packed__)) {
+      cblockheader_t cblockheader;
+      uint8_t        equihash_sol[EQUIHASH_200_9_SOL_BYTES];
+    } cblockheader_sol_t;
+
+    typedef struct __attribute__((__packed__)) {
+      header_t           hdr;
+      uint64_t           index;
+      cblockheader_sol_t cblockheader_sol;
+    } verify_equihash_t;
+
+    typedef struct __attribute__((__packed__)) {
+      header_t      hdr;
+      uint64_t      index;
+      equihash_bm_t bm;
+    } verify_equihash_rpl_t;
+
+    /*
+     * Ring buffer supplied by the caller of read_stream_drain(). Each packet is stored
+     * as a stream_ring_rec_t followed by the packet data padded to 8 bytes, a record with
+     * len == 0 marks the unused space at the end of the buffer. The ring is empty when
+     * head == tail, read_stream_drain() only moves head and the consumer only moves tail.
+     */
+    typedef struct __attribute__((__packed__)) {
+      uint32_t len;       // Packet length in bytes as read from RLR
+      uint32_t padding;
+    } stream_ring_rec_t;
+
+    typedef struct {
+      uint8_t*     buf;   // 8 byte aligned storage
+      unsigned int size;  // Multiple of 8 bytes
+      unsigned int head;
+      unsigned int tail;
+    } stream_ring_t;
+
+    /*
+     * Called by read_stream_routed() with the first bytes of a packet and the packet
+     * length, returns where the rest of the packet goes (nullptr to discard it)
+     */
+    typedef uint8_t* (*stream_route_t)(void* ctx, const uint8_t* head, unsigned int len);
+
+    /*
+     * How read_stream_wait() waits for a reply. Measured from the start of the wait it
+     * busy polls until spin_us, polls with sched_yield() until yield_us, then sleeps
+     * sleep_us between polls until timeout_us.
+     */
+    typedef struct {
+      unsigned int spin_us;
+      unsigned int yield_us;
+      unsigned int sleep_us;
+      unsigned int timeout_us;
+    } wait_policy_t;
+
+    typedef enum {
+      NOTIFY_POLL    = 0,  // Default, replies are found by polling the ISR over PCIe
+      NOTIFY_IRQ     = 1,  // Receive complete interrupt, read from the user interrupt device file
+      NOTIFY_EVENTFD = 2   // eventfd posted by the loopback / simulator transport or signal_reply_fd()
+    } notify_mode_t;
+
   private:
     static const uint16_t s_pci_vendor_id = 0x1D0F; /* Amazon PCI Vendor ID */
     static const uint16_t s_pci_device_id = 0xF000; /* PCI Device ID preassigned by Amazon for F1 applications */
 
-    pci_bar_handle_t m_pci_bar_handle_bar0 = PCI_BAR_HANDLE_INIT;
-    pci_bar_handle_t m_pci_bar_handle_bar4 = PCI_BAR_HANDLE_INIT;
+    // All MMIO goes through here, the PCI transport or e.g. zcash_fpga_loopback
+    std::unique_ptr<zcash_fpga_transport> m_transport;
 
     unsigned int m_bls12_381_inst_axil_offset;
     unsigned int m_bls12_381_data_axil_offset;
     unsigned int m_bls12_381_inst_size;
     unsigned int m_bls12_381_data_size;
 
+    // Wait policies indexed by wait_policy_idx()
+    wait_policy_t m_wait_policy[4] = {
+      {20, 200, 10, 100000},    // FPGA_STATUS, RESET_FPGA
+      {50, 500, 20, 1000000},   // VERIFY_EQUIHASH
+      {50, 500, 20, 1000000},   // VERIFY_SECP256K1_SIG
+      {10, 100, 50, 5000000}    // BLS12_381_INTERRUPT_RPL
+    };
+
+    // Free transmit FIFO words we know of, seeded from TDFV at init and only re-read
+    // from TDFV when a write needs more (the FPGA can only have freed more since)
+    unsigned int m_tx_credit = 0;
+
+    notify_mode_t m_notify_mode = NOTIFY_POLL;
+    int m_reply_fd = -1;
+    int m_slot_id = 0;
+
     bool m_axi4_enabled = false;
     bool m_initialized = false;
 
@@ -186,6 +293,28 @@ class zcash_fpga {
     zcash_fpga(zcash_fpga const&) = delete;
     void operator=(zcash_fpga const&) = delete;
 
+    /*
+     * Connects to the FPGA in slot_id. get_instance() is slot 0, use zcash_fpga_pool to
+     * attach every loaded slot.
+     */
+    explicit zcash_fpga(int slot_id);
+    ~zcash_fpga();
+
+    /*
+     * Runs the runtime over another transport (takes ownership), e.g. zcash_fpga_loopback
+     * to build and test the protocol logic on a machine without an FPGA.
+     */
+    explicit zcash_fpga(zcash_fpga_transport* transport);
+
+    bool is_initialized() const { return m_initialized; }
+    int get_slot_id() const { return m_slot_id; }
+
+    /*
+     * NUMA node of the slot's application PF as reported by sysfs, -1 if unknown or not
+     * a PCI transport
+     */
+    int get_numa_node();
+
     /*
      * This sends a status request to the FPGA and waits for the reply,
      * checking for any errors.
@@ -198,9 +327,45 @@ class zcash_fpga {
     int bls12_381_set_data_slot(unsigned int id, bls12_381_data_t slot_data);
     int bls12_381_get_data_slot(unsigned int id, bls12_381_data_t& slot_data);
 
+    /*
+     * Write / read count consecutive data slots from first, one register range per slot
+     * so a FE12 is 12 transport calls instead of 144. The second pair takes the 48 byte
+     * values back to back (the layout of a BLS12_381_INTERRUPT_RPL payload) and packs
+     * pt into every slot, the get returns the point type of the first slot.
+     */
+    int bls12_381_set_data_slots(unsigned int first, const bls12_381_data_t* slots, unsigned int count);
+    int bls12_381_get_data_slots(unsigned int first, bls12_381_data_t* slots, unsigned int count);
+    int bls12_381_set_data_slots(unsigned int first, const uint8_t* dat, unsigned int count, point_type_t pt);
+    int bls12_381_get_data_slots(unsigned int first, uint8_t* dat, unsigned int count, point_type_t& pt);
+
+    /*
+     * Number of data slots a value of type pt takes, get_point_type_size() in bls12_381_pkg.sv
+     */
+    static constexpr unsigned int bls12_381_point_type_size(point_type_t pt) {
+      return pt == FE12 ? 12 : pt == FP2_JB ? 6 : pt == FP2_AF ? 4 : pt == FP_JB ? 3 :
+             (pt == FE2 || pt == FP_AF) ? 2 : 1;
+    }
+
     int bls12_381_set_inst_slot(unsigned int id, bls12_381_inst_t inst_data);
     int bls12_381_get_inst_slot(unsigned int id, bls12_381_inst_t& inst_data);
 
+    /*
+     * Write / read count consecutive instruction slots from first in one register range
+     */
+    int bls12_381_set_inst_slots(unsigned int first, const bls12_381_inst_t* insts, unsigned int count);
+    int bls12_381_get_inst_slots(unsigned int first, bls12_381_inst_t* insts, unsigned int count);
+
+    /*
+     * Number of instruction / data slots of the coprocessor, 0 before initialization
+     */
+    unsigned int bls12_381_get_inst_size() const { return m_bls12_381_inst_size; }
+    unsigned int bls12_381_get_data_size() const { return m_bls12_381_data_size; }
+
+    /*
+     * Moves the coprocessor PC to id and reads it back. Returns 1 if the write did not
+     * take: the PC reads back neither as id nor (when it was parked on a NOOP_WAIT)
+     * somewhere other than where it was parked.
+     */
     int bls12_381_set_curr_inst_slot(unsigned int id);
     int bls12_381_get_curr_inst_slot(unsigned int& id);
 
@@ -215,15 +380,115 @@ class zcash_fpga {
     int bls12_381_reset_memory(bool inst_memory, bool data_memory);
 
     /*
-     * These can be used to send data / read data directly from the FPGAs stream interface
+     * Verifies the Equihash (200,9) solution of a block header and waits for the result,
+     * bm is a mask of equihash_bm_t, 0 if the solution is valid. Returns 0 on success.
+     */
+    int verify_equihash(const cblockheader_sol_t& block, uint64_t index, uint8_t& bm);
+
+    /*
+     * Verifies count block headers with indexes first_index, first_index + 1, ... keeping
+     * the transmit FIFO full while the FPGA works so the next command is already queued
+     * when a check finishes. Replies are matched by index into bm[], entries still
+     * EQUIHASH_NO_RPL were not answered before the timeout. Returns the number of replies
+     * received or -1 on error. Replies to other commands are dropped, so do not mix with
+     * zcash_fpga_async (submit VERIFY_EQUIHASH commands there instead).
+     */
+    int verify_equihash_batch(const cblockheader_sol_t* blocks, unsigned int count, uint64_t first_index, uint8_t* bm);
+
+    /*
+     * These can be used to send data / read data directly from the FPGAs stream interface.
+     * Writes are checked against a cached count of free transmit FIFO words so normally
+     * no register is read on the write path.
+     * None of the stream or register functions are thread safe, use zcash_fpga_async with
+     * its I/O thread to share the FPGA between threads.
      */
     int read_stream(uint8_t* data, unsigned int size);
     int write_stream(uint8_t* data, unsigned int len);
 
+    /*
+     * Same as write_stream() but the whole packet is copied into the write-combined
+     * BAR4 window with wide non-temporal stores, fenced after each 64 byte line so the
+     * FIFO gets the data in order, then committed with one TLR write. Same as
+     * write_stream() when the transport has no burst path.
+     */
+    int write_stream_burst(uint8_t* data, unsigned int len);
+
+    /*
+     * write_stream_burst() for a packet in two parts, e.g. a command header built on the
+     * stack and a payload left in the caller's (mmapped) buffer. head_len must be a
+     * multiple of 8 bytes.
+     */
+    int write_stream_burst(const uint8_t* head, unsigned int head_len, const uint8_t* body, unsigned int body_len);
+
+    /*
+     * Writes several commands stored back to back in data, each starting 8 byte aligned
+     * with its length taken from its header_t, taking the transmit credit for the whole batch at once.
+     * Each command is still its own AXI-Stream packet (one TLR write each) as the FPGA
+     * frames commands by packet, but there is no per-command TDFV read, sleep or ISR update.
+     */
+    int write_stream_batch(uint8_t* data, unsigned int len);
+
+    /*
+     * Free space in bytes in the transmit FIFO from the cached credit count, a packet of
+     * len bytes can be written without error when len <= space. TDFV is only read when
+     * the cached space is less than need bytes.
+     */
+    int get_tx_space(unsigned int& space, unsigned int need = 0);
+
+    /*
+     * Reads every complete packet waiting in the receive FIFO into ring, using 64-bit
+     * reads in AXI4 mode. RDFO is only re-read once the previous value has been consumed
+     * and the ISR is only cleared once the FIFO is empty. Stops early (leaving the ISR set)
+     * when the ring has less than STREAM_MAX_RPL_BYTES free. Returns the number of packets
+     * added to the ring, or -1 on error.
+     */
+    int read_stream_drain(stream_ring_t& ring);
+
+    /*
+     * Consumer side of stream_ring_t. stream_ring_front() returns the oldest packet
+     * (nullptr when empty) and its length, stream_ring_pop() releases it.
+     */
+    static uint8_t* stream_ring_front(stream_ring_t& ring, unsigned int& len);
+    static void stream_ring_pop(stream_ring_t& ring);
+
+    /*
+     * Reads the next packet in two parts without an intermediate buffer: the first
+     * head_len bytes (a multiple of 8) into head, then the rest to the buffer returned by
+     * route. Returns the packet length, 0 if there was nothing to read or -1 on error.
+     */
+    int read_stream_routed(uint8_t* head, unsigned int head_len, stream_route_t route, void* ctx);
+
+    /*
+     * Waits for the next reply with the policy for cmd (either the command sent or the
+     * reply expected, use BLS12_381_INTERRUPT_RPL for coprocessor interrupts). Returns the
+     * number of bytes read, 0 on timeout or -1 on error. If wait_ns is not null it is set
+     * to how long the wait took.
+     */
+    int read_stream_wait(uint8_t* data, unsigned int size, command_t cmd, uint64_t* wait_ns = nullptr);
+
+    void set_wait_policy(command_t cmd, wait_policy_t policy);
+    wait_policy_t get_wait_policy(command_t cmd);
+
+    /*
+     * Opt-in reply notification. NOTIFY_IRQ enables the receive complete interrupt (IER)
+     * and opens the user interrupt device for irq_vector (requires an AFI that routes the
+     * AXI FIFO interrupt to the apppf irq, and an FPGA slot), NOTIFY_EVENTFD creates an
+     * eventfd that the loopback and simulator transports post as each reply is queued and
+     * fails on a transport that cannot (PCIe), signal_reply_fd() posts it as well, e.g. to
+     * wake a waiter early. Returns 0 on success or 1 with NOTIFY_POLL left in place.
+     * get_reply_fd() returns the fd to poll/epoll for POLLIN
+     * (-1 in NOTIFY_POLL), ack_reply_fd() consumes a pending notification. When an fd is
+     * active read_stream_wait() blocks on it after the spin phase instead of yielding/sleeping.
+     */
+    int enable_reply_notify(notify_mode_t mode, unsigned int irq_vector = 0);
+    int get_reply_fd();
+    int ack_reply_fd();
+    int signal_reply_fd();
+
     /*
      * This can be read to check command capability register on the FPGA
      */
-    command_cap_e m_command_cap;
+    command_cap_e m_command_cap = (command_cap_e)0;
 
   private:
     /*
@@ -232,9 +497,14 @@ class zcash_fpga {
     int init_fpga(int slot_id = 0);
 
     zcash_fpga();
-    ~zcash_fpga();
 
     int check_afi_ready(int slot_id);
+    int init_stream();
+
+    unsigned int tx_words(unsigned int len);
+    int tx_reserve(unsigned int len);
+
+    static unsigned int wait_policy_idx(command_t cmd);
 
 }; // zcash_fpga
 
@@ -0,0 +1,573 @@
+#include "zcash_fpga_async.hpp"
+#include "zcash_fpga_log.hpp"
+
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+zcash_fpga_async::zcash_fpga_async(zcash_fpga& zfpga) :
+  m_zfpga(zfpga),
+  m_table(new entry_t[s_max_pending]),
+  m_ring_buf(new uint8_t[s_ring_bytes]),
+  m_seq(0),
+  m_in_flight(0),
+  m_sq(new sq_slot_t[s_sq_size]),
+  m_sq_enqueue_pos(0),
+  m_sq_dequeue_pos(0),
+  m_io_running(false),
+  m_io_stop(false),
+  m_batch(new uint8_t[s_batch_bytes]),
+  m_coalesce_cmds(1),
+  m_coalesce_us(0),
+  m_stat_batches(0),
+  m_stat_cmds(0),
+  m_stat_max_batch(0) {
+  for (unsigned int i = 0; i < s_max_pending; i++)
+    m_table[i].state.store(ENTRY_FREE, std::memory_order_relaxed);
+  for (unsigned int i = 0; i < s_sq_size; i++)
+    m_sq[i].seq.store(i, std::memory_order_relaxed);
+  m_ring.buf = m_ring_buf.get();
+  m_ring.size = s_ring_bytes;
+  m_ring.head = 0;
+  m_ring.tail = 0;
+}
+
+zcash_fpga_async::~zcash_fpga_async() {
+  stop_io_thread();
+}
+
+unsigned int zcash_fpga_async::hash(zcash_fpga::command_t rpl_cmd, uint64_t index) {
+  uint64_t h = (index ^ ((uint64_t)rpl_cmd << 32)) * UINT64_C(0x9E3779B97F4A7C15);
+  return (unsigned int)(h >> 32) & (s_max_pending - 1);
+}
+
+int zcash_fpga_async::expected_reply(const uint8_t* cmd, zcash_fpga::command_t& rpl_cmd, uint64_t& index) {
+  const zcash_fpga::header_t* hdr = (const zcash_fpga::header_t*)cmd;
+  index = 0;
+  switch (hdr->cmd) {
+    case zcash_fpga::RESET_FPGA:
+      rpl_cmd = zcash_fpga::RESET_FPGA_RPL;
+      break;
+    case zcash_fpga::FPGA_STATUS:
+      rpl_cmd = zcash_fpga::FPGA_STATUS_RPL;
+      break;
+    case zcash_fpga::VERIFY_EQUIHASH:
+      rpl_cmd = zcash_fpga::VERIFY_EQUIHASH_RPL;
+      memcpy(&index, cmd + sizeof(zcash_fpga::header_t), sizeof(index));
+      break;
+    case zcash_fpga::VERIFY_SECP256K1_SIG:
+      rpl_cmd = zcash_fpga::VERIFY_SECP256K1_SIG_RPL;
+      memcpy(&index, cmd + sizeof(zcash_fpga::header_t), sizeof(index));
+      break;
+    default:
+      zlog_error("zcash_fpga_async: unknown command 0x%x\n", hdr->cmd);
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Only claim() takes free entries or writes rpl_cmd / index, and it is serialized, so
+ * the keys read here are stable and a pending duplicate of the request is always found.
+ */
+zcash_fpga_async::entry_t* zcash_fpga_async::claim(zcash_fpga::command_t rpl_cmd, uint64_t index, callback_t cb, void* ctx) {
+  unsigned int slot = hash(rpl_cmd, index);
+  entry_t* entry = nullptr;
+  std::lock_guard<std::mutex> lock(m_claim_lock);
+
+  for (unsigned int i = 0; i < s_max_probe; i++) {
+    entry_t* probe = &m_table[(slot + i) & (s_max_pending - 1)];
+    entry_state_t state = state_of(probe->state.load(std::memory_order_acquire));
+    if (state == ENTRY_FREE) {
+      if (entry == nullptr) entry = probe;
+    } else if (state == ENTRY_PENDING && probe->rpl_cmd == rpl_cmd && probe->index == index) {
+      zlog_error("zcash_fpga_async: cmd 0x%x index 0x%lx is already pending\n", rpl_cmd, (unsigned long)index);
+      return nullptr;
+    }
+  }
+  if (entry == nullptr) {
+    zlog_warn("zcash_fpga_async: pending table full for cmd 0x%x index 0x%lx\n", rpl_cmd, (unsigned long)index);
+    return nullptr;
+  }
+
+  entry->rpl_cmd = rpl_cmd;
+  entry->index = index;
+  entry->seq = m_seq.fetch_add(1, std::memory_order_relaxed);
+  entry->cb = cb;
+  entry->ctx = ctx;
+  entry->rc = 0;
+  entry->len = 0;
+  m_in_flight.fetch_add(1, std::memory_order_relaxed);
+  entry->state.store(tag(entry->seq, ENTRY_PENDING), std::memory_order_release);
+  return entry;
+}
+
+void zcash_fpga_async::release(entry_t* entry) {
+  m_in_flight.fetch_sub(1, std::memory_order_relaxed);
+  entry->state.store(ENTRY_FREE, std::memory_order_release);
+}
+
+// Frees the entry if request seq is still waiting for its reply
+bool zcash_fpga_async::cancel(entry_t* entry, uint64_t seq) {
+  uint64_t expected = tag(seq, ENTRY_PENDING);
+  if (!entry->state.compare_exchange_strong(expected, tag(seq, ENTRY_CLAIMED), std::memory_order_acquire))
+    return false;
+  release(entry);
+  return true;
+}
+
+int zcash_fpga_async::send(entry_t* entry, uint8_t* cmd, unsigned int len) {
+  int rc;
+
+  if (m_io_running.load(std::memory_order_acquire)) {
+    sq_slot_t* slot = nullptr;
+    if (len > s_sq_cmd_bytes) {
+      zlog_error("zcash_fpga_async: command of %d bytes is too large to queue\n", len);
+    } else if ((slot = sq_reserve()) == nullptr) {
+      zlog_warn("zcash_fpga_async: submission ring full\n");
+    }
+    if (slot == nullptr) {
+      cancel(entry, entry->seq);
+      return 1;
+    }
+    slot->entry = entry;
+    slot->entry_seq = entry->seq;
+    slot->call = nullptr;
+    slot->len = len;
+    slot->t_us = now_us();
+    memcpy(slot->cmd, cmd, len);
+    sq_commit(slot);
+    return 0;
+  }
+
+  rc = m_zfpga.write_stream_burst(cmd, len);
+  if (rc != 0) cancel(entry, entry->seq);
+  return rc;
+}
+
+int zcash_fpga_async::submit(uint8_t* cmd, unsigned int len, callback_t cb, void* ctx) {
+  zcash_fpga::command_t rpl_cmd;
+  uint64_t index;
+  entry_t* entry;
+
+  if (expected_reply(cmd, rpl_cmd, index) != 0) return 1;
+  entry = claim(rpl_cmd, index, cb, ctx);
+  if (entry == nullptr) return 1;
+  return send(entry, cmd, len);
+}
+
+int zcash_fpga_async::submit(uint8_t* cmd, unsigned int len, future& fut) {
+  zcash_fpga::command_t rpl_cmd;
+  uint64_t index;
+  entry_t* entry;
+
+  if (expected_reply(cmd, rpl_cmd, index) != 0) return 1;
+  entry = claim(rpl_cmd, index, nullptr, nullptr);
+  if (entry == nullptr) return 1;
+  fut.m_async = this;
+  fut.m_entry = entry;
+  if (send(entry, cmd, len) != 0) {
+    fut.m_entry = nullptr;
+    return 1;
+  }
+  return 0;
+}
+
+int zcash_fpga_async::expect_interrupt(uint32_t index, callback_t cb, void* ctx) {
+  return claim(zcash_fpga::BLS12_381_INTERRUPT_RPL, index, cb, ctx) == nullptr ? 1 : 0;
+}
+
+int zcash_fpga_async::expect_interrupt(uint32_t index, future& fut) {
+  entry_t* entry = claim(zcash_fpga::BLS12_381_INTERRUPT_RPL, index, nullptr, nullptr);
+  if (entry == nullptr) return 1;
+  fut.m_async = this;
+  fut.m_entry = entry;
+  return 0;
+}
+
+/*
+ * Returns the pending entry for the reply and the seq of its request. The keys are only
+ * trusted when the state word did not change while they were read, complete() then
+ * fails if the entry was cancelled and reused since.
+ */
+zcash_fpga_async::entry_t* zcash_fpga_async::find(zcash_fpga::command_t rpl_cmd, uint64_t index, uint64_t& seq) {
+  unsigned int slot = hash(rpl_cmd, index);
+  for (unsigned int i = 0; i < s_max_probe; i++) {
+    entry_t* entry = &m_table[(slot + i) & (s_max_pending - 1)];
+    uint64_t state = entry->state.load(std::memory_order_acquire);
+    if (state_of(state) == ENTRY_PENDING && entry->rpl_cmd == rpl_cmd && entry->index == index &&
+        entry->state.load(std::memory_order_acquire) == state) {
+      seq = state >> 2;
+      return entry;
+    }
+  }
+  return nullptr;
+}
+
+// Only used for FPGA_IGNORE_RPL, which does not carry the index of the command
+zcash_fpga_async::entry_t* zcash_fpga_async::find_oldest(zcash_fpga::command_t rpl_cmd, uint64_t& seq) {
+  entry_t* oldest = nullptr;
+  for (unsigned int i = 0; i < s_max_pending; i++) {
+    entry_t* entry = &m_table[i];
+    uint64_t state = entry->state.load(std::memory_order_acquire);
+    if (state_of(state) == ENTRY_PENDING && entry->rpl_cmd == rpl_cmd &&
+        entry->state.load(std::memory_order_acquire) == state && (oldest == nullptr || (state >> 2) < seq)) {
+      oldest = entry;
+      seq = state >> 2;
+    }
+  }
+  return oldest;
+}
+
+void zcash_fpga_async::complete(entry_t* entry, uint64_t seq, int rc, const uint8_t* rpl, unsigned int len) {
+  uint64_t expected = tag(seq, ENTRY_PENDING);
+  // Lose the race against a future that timed out and cancelled, maybe with the entry
+  // since claimed by another request
+  if (!entry->state.compare_exchange_strong(expected, tag(seq, ENTRY_CLAIMED), std::memory_order_acquire))
+    return;
+
+  if (entry->cb != nullptr) {
+    entry->cb(entry->ctx, rc, rpl, len);
+    release(entry);
+  } else {
+    entry->rc = rc;
+    entry->len = len < STREAM_MAX_RPL_BYTES ? len : STREAM_MAX_RPL_BYTES;
+    memcpy(entry->rpl, rpl, entry->len);
+    entry->state.store(tag(seq, ENTRY_DONE), std::memory_order_release);
+  }
+}
+
+void zcash_fpga_async::route(const uint8_t* rpl, unsigned int len) {
+  const zcash_fpga::header_t* hdr = (const zcash_fpga::header_t*)rpl;
+  zcash_fpga::command_t rpl_cmd = hdr->cmd;
+  uint64_t index = 0, seq;
+  entry_t* entry;
+
+  switch (hdr->cmd) {
+    case zcash_fpga::VERIFY_EQUIHASH_RPL:
+    case zcash_fpga::VERIFY_SECP256K1_SIG_RPL:
+      memcpy(&index, rpl + sizeof(zcash_fpga::header_t), sizeof(index));
+      break;
+    case zcash_fpga::BLS12_381_INTERRUPT_RPL:
+      index = ((const zcash_fpga::bls12_381_interrupt_rpl_t*)rpl)->index;
+      break;
+    case zcash_fpga::FPGA_IGNORE_RPL: {
+      // Fail the oldest request of the ignored command type
+      // Only the header of the ignored command is returned, so the index reads as 0
+      uint8_t ignored[sizeof(zcash_fpga::header_t) + sizeof(uint64_t)] = {0};
+      memcpy(ignored, &((const zcash_fpga::fpga_ignore_rpl_t*)rpl)->ignore_hdr, sizeof(zcash_fpga::header_t));
+      zlog_warn("zcash_fpga_async: FPGA ignored command 0x%x\n", ((zcash_fpga::header_t*)ignored)->cmd);
+      if (expected_reply(ignored, rpl_cmd, index) == 0 &&
+          (entry = find_oldest(rpl_cmd, seq)) != nullptr)
+        complete(entry, seq, 1, rpl, len);
+      return;
+    }
+    default:
+      break;
+  }
+
+  entry = find(rpl_cmd, index, seq);
+  if (entry == nullptr) {
+    zlog_warn("zcash_fpga_async: dropping unexpected reply cmd 0x%x index 0x%lx\n", rpl_cmd, (unsigned long)index);
+    return;
+  }
+  complete(entry, seq, 0, rpl, len);
+}
+
+int zcash_fpga_async::poll() {
+  if (m_io_running.load(std::memory_order_acquire)) return 0;
+  return drain();
+}
+
+int zcash_fpga_async::drain() {
+  unsigned int len;
+  uint8_t* rpl;
+  int routed = 0;
+
+  if (m_zfpga.read_stream_drain(m_ring) < 0) return -1;
+
+  while ((rpl = zcash_fpga::stream_ring_front(m_ring, len)) != nullptr) {
+    route(rpl, len);
+    zcash_fpga::stream_ring_pop(m_ring);
+    routed++;
+  }
+  return routed;
+}
+
+zcash_fpga_async::sq_slot_t* zcash_fpga_async::sq_reserve() {
+  sq_slot_t* slot;
+  size_t pos = m_sq_enqueue_pos.load(std::memory_order_relaxed);
+
+  for (;;) {
+    slot = &m_sq[pos & (s_sq_size - 1)];
+    size_t seq = slot->seq.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (m_sq_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        return slot;
+    } else if (diff < 0) {
+      return nullptr;
+    } else {
+      pos = m_sq_enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+// Only the producer that reserved the slot touches it until now, so seq is still pos
+void zcash_fpga_async::sq_commit(sq_slot_t* slot) {
+  slot->seq.store(slot->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+zcash_fpga_async::sq_slot_t* zcash_fpga_async::sq_front() {
+  sq_slot_t* slot = &m_sq[m_sq_dequeue_pos & (s_sq_size - 1)];
+  if (slot->seq.load(std::memory_order_acquire) != m_sq_dequeue_pos + 1)
+    return nullptr;
+  return slot;
+}
+
+void zcash_fpga_async::sq_pop() {
+  sq_slot_t* slot = &m_sq[m_sq_dequeue_pos & (s_sq_size - 1)];
+  slot->seq.store(m_sq_dequeue_pos + s_sq_size, std::memory_order_release);
+  m_sq_dequeue_pos++;
+}
+
+zcash_fpga_async::sq_slot_t* zcash_fpga_async::sq_peek(unsigned int i) {
+  sq_slot_t* slot = &m_sq[(m_sq_dequeue_pos + i) & (s_sq_size - 1)];
+  if (slot->seq.load(std::memory_order_acquire) != m_sq_dequeue_pos + i + 1)
+    return nullptr;
+  return slot;
+}
+
+// The entry may have timed out and been reused while the command was queued
+void zcash_fpga_async::fail_queued(sq_slot_t* slot) {
+  complete(slot->entry, slot->entry_seq, 1, slot->cmd, 0);
+}
+
+/*
+ * Runs the call or writes the commands at the front of the ring, coalescing up to
+ * m_coalesce_cmds commands into one write_stream_batch(). Returns the number of slots
+ * consumed, or 0 when the commands stay queued: the transmit FIFO is full (until there
+ * is space or the front command has waited longer than its timeout) or fewer than
+ * m_coalesce_cmds are queued and the coalescing window has not expired.
+ */
+unsigned int zcash_fpga_async::io_submit(bool flush, uint64_t& stall_start) {
+  sq_slot_t* slot = sq_front();
+  unsigned int max_cmds = m_coalesce_cmds.load(std::memory_order_relaxed);
+  unsigned int n = 0, bytes = 0, space;
+  bool more;
+  int rc;
+
+  if (slot->entry == nullptr) {
+    slot->call->rc = slot->call->fn(m_zfpga, slot->call->ctx);
+    slot->call->done.store(true, std::memory_order_release);
+    sq_pop();
+    return 1;
+  }
+
+  // Only reads TDFV when the cached credit can't take the front command
+  rc = m_zfpga.get_tx_space(space, (slot->len + 7) & ~7U);
+  if (rc != 0) {
+    fail_queued(slot);
+    sq_pop();
+    return 1;
+  }
+
+  // Commands are padded to 8 bytes in the batch as the AXI4 path writes whole words
+  while (n < max_cmds && (slot = sq_peek(n)) != nullptr && slot->entry != nullptr) {
+    unsigned int padded = (slot->len + 7) & ~7U;
+    if (bytes + padded > space || bytes + padded > s_batch_bytes) break;
+    bytes += padded;
+    n++;
+  }
+  more = slot != nullptr;  // Stopped by a limit or a call, not by an empty ring
+  slot = sq_front();
+
+  if (n == 0) {
+    if (stall_start == 0) stall_start = now_us();
+    if (now_us() - stall_start < m_zfpga.get_wait_policy(slot->entry->rpl_cmd).timeout_us)
+      return 0;
+    zlog_error("zcash_fpga_async: transmit FIFO full, failing cmd 0x%x index 0x%lx\n",
+               slot->entry->rpl_cmd, (unsigned long)slot->entry->index);
+    fail_queued(slot);
+    sq_pop();
+    stall_start = 0;
+    return 1;
+  }
+  stall_start = 0;
+
+  // Wait for more commands to arrive if the batch could still grow
+  if (!more && !flush && n < max_cmds &&
+      now_us() - slot->t_us < m_coalesce_us.load(std::memory_order_relaxed))
+    return 0;
+
+  bytes = 0;
+  for (unsigned int i = 0; i < n; i++) {
+    slot = sq_peek(i);
+    memcpy(&m_batch[bytes], slot->cmd, slot->len);
+    bytes += (slot->len + 7) & ~7U;
+  }
+
+  rc = m_zfpga.write_stream_batch(m_batch.get(), bytes);
+  for (unsigned int i = 0; i < n; i++) {
+    if (rc != 0) fail_queued(sq_front());
+    sq_pop();
+  }
+
+  m_stat_batches.fetch_add(1, std::memory_order_relaxed);
+  m_stat_cmds.fetch_add(n, std::memory_order_relaxed);
+  if (n > m_stat_max_batch.load(std::memory_order_relaxed))
+    m_stat_max_batch.store(n, std::memory_order_relaxed);
+  return n;
+}
+
+void zcash_fpga_async::io_thread() {
+  zcash_fpga::wait_policy_t idle = m_zfpga.get_wait_policy(zcash_fpga::FPGA_STATUS);
+  uint64_t idle_start = now_us();
+  uint64_t stall_start = 0;
+
+  for (;;) {
+    bool stop = m_io_stop.load(std::memory_order_acquire);
+    bool busy = false;
+    bool blocked = false;
+
+    for (unsigned int i = 0; i < s_sq_size && sq_front() != nullptr; ) {
+      unsigned int n = io_submit(stop, stall_start);
+      if (n == 0) {
+        blocked = true;
+        break;
+      }
+      i += n;
+      busy = true;
+    }
+
+    int routed = drain();
+    if (routed > 0)
+      busy = true;
+    else if (routed < 0)
+      usleep(1000);  // Don't flood the log while the FPGA is failing
+
+    if (stop && !blocked && sq_front() == nullptr) break;
+
+    if (busy) {
+      idle_start = now_us();
+    } else {
+      uint64_t idle_us = now_us() - idle_start;
+      if (idle_us >= idle.yield_us)
+        usleep(idle.sleep_us);
+      else if (idle_us >= idle.spin_us)
+        sched_yield();
+    }
+  }
+}
+
+int zcash_fpga_async::start_io_thread(int cpu) {
+  if (m_io_running.load(std::memory_order_acquire)) return 0;
+
+  // Set first so poll() stops touching the FPGA before the thread starts draining
+  m_io_running.store(true, std::memory_order_release);
+  m_io_stop.store(false, std::memory_order_release);
+  m_io_thread = std::thread(&zcash_fpga_async::io_thread, this);
+
+  if (cpu >= 0) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if (pthread_setaffinity_np(m_io_thread.native_handle(), sizeof(cpuset), &cpuset) != 0)
+      zlog_warn("zcash_fpga_async: unable to pin I/O thread to cpu %d\n", cpu);
+  }
+  pthread_setname_np(m_io_thread.native_handle(), "zcash_fpga_io");
+
+  return 0;
+}
+
+void zcash_fpga_async::stop_io_thread() {
+  if (!m_io_thread.joinable()) return;
+  m_io_stop.store(true, std::memory_order_release);
+  m_io_thread.join();
+  m_io_running.store(false, std::memory_order_release);
+}
+
+void zcash_fpga_async::set_coalescing(unsigned int max_cmds, unsigned int window_us) {
+  m_coalesce_cmds.store(max_cmds == 0 ? 1 : max_cmds, std::memory_order_relaxed);
+  m_coalesce_us.store(window_us, std::memory_order_relaxed);
+}
+
+zcash_fpga_async::batch_stats_t zcash_fpga_async::get_batch_stats() const {
+  batch_stats_t stats;
+  stats.batches = m_stat_batches.load(std::memory_order_relaxed);
+  stats.cmds = m_stat_cmds.load(std::memory_order_relaxed);
+  stats.max_batch = m_stat_max_batch.load(std::memory_order_relaxed);
+  return stats;
+}
+
+int zcash_fpga_async::call(io_call_t fn, void* ctx) {
+  call_t call;
+  sq_slot_t* slot;
+
+  if (!m_io_running.load(std::memory_order_acquire))
+    return fn(m_zfpga, ctx);
+
+  call.fn = fn;
+  call.ctx = ctx;
+  call.rc = 1;
+  call.done.store(false, std::memory_order_relaxed);
+
+  while ((slot = sq_reserve()) == nullptr)
+    sched_yield();
+  slot->entry = nullptr;
+  slot->call = &call;
+  slot->len = 0;
+  sq_commit(slot);
+
+  while (!call.done.load(std::memory_order_acquire))
+    sched_yield();
+  return call.rc;
+}
+
+bool zcash_fpga_async::future::ready() const {
+  return m_entry != nullptr && state_of(m_entry->state.load(std::memory_order_acquire)) == ENTRY_DONE;
+}
+
+int zcash_fpga_async::future::get(uint8_t* rpl, unsigned int size) {
+  int len;
+  uint64_t start, elapsed_us;
+
+  if (m_entry == nullptr) return -1;
+
+  zcash_fpga::wait_policy_t policy = m_async->m_zfpga.get_wait_policy(m_entry->rpl_cmd);
+  start = now_us();
+  while (!ready()) {
+    // poll() is a no-op while the I/O thread is routing replies
+    if (m_async->poll() < 0) return -1;
+    if (ready()) break;
+
+    elapsed_us = now_us() - start;
+    if (elapsed_us >= policy.timeout_us) {
+      if (m_async->cancel(m_entry, m_entry->seq)) {
+        zlog_error("zcash_fpga_async: timeout waiting for cmd 0x%x index 0x%lx\n",
+                   m_entry->rpl_cmd, (unsigned long)m_entry->index);
+        m_entry = nullptr;
+        return 0;
+      }
+      continue;  // Completed while timing out
+    }
+    if (elapsed_us >= policy.yield_us)
+      usleep(policy.sleep_us);
+    else if (elapsed_us >= policy.spin_us)
+      sched_yield();
+  }
+
+  len = m_entry->rc != 0 ? -1 : (int)m_entry->len;
+  if (len > 0) memcpy(rpl, m_entry->rpl, (unsigned int)len < size ? len : size);
+  m_async->release(m_entry);
+  m_entry = nullptr;
+  return len;
+}
@@ -0,0 +1,249 @@
+//
+//  ZCash FPGA library asynchronous request API.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_ASYNC_H_   /* Include guard */
+#define ZCASH_FPGA_ASYNC_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "zcash_fpga.hpp"
+
+/*
+ * Lets many commands be in flight at once. Every reply from the FPGA is routed by
+ * hdr.cmd and index through a pending table that is allocated once in the constructor,
+ * so there is no heap allocation per request. Completion is either a callback (called
+ * from the thread running poll()) or a future.
+ *
+ * Without the I/O thread, submit() writes to the FPGA directly and the caller drives
+ * poll(), so only one thread may use the object. After start_io_thread() any number of
+ * threads can submit: commands are copied into a lock-free multi-producer ring and the
+ * I/O thread is the only one doing MMIO, writing queued commands and routing replies
+ * (callbacks then run on the I/O thread). Other FPGA register access must go through
+ * call() while it runs.
+ */
+class zcash_fpga_async {
+
+  public:
+    static const unsigned int s_max_pending = 1024;  // Must be a power of 2
+    static const unsigned int s_max_probe = 32;      // Table entries searched per key
+    static const unsigned int s_ring_bytes = 64*1024;
+
+    /*
+     * rc is 0 on success, or 1 if the FPGA ignored the command (FPGA_IGNORE_RPL). rpl is
+     * only valid for the duration of the call.
+     */
+    typedef void (*callback_t)(void* ctx, int rc, const uint8_t* rpl, unsigned int len);
+
+    static const unsigned int s_sq_size = 256;        // Submission ring slots, must be a power of 2
+    static const unsigned int s_sq_cmd_bytes = 1536;  // Largest command (VERIFY_EQUIHASH is 1503 bytes)
+    static const unsigned int s_batch_bytes = 16*1024;
+
+    typedef struct {
+      uint64_t     batches;    // write_stream_batch() calls made by the I/O thread
+      uint64_t     cmds;       // Commands written in those batches
+      unsigned int max_batch;
+    } batch_stats_t;
+
+    /*
+     * Function run on the I/O thread by call()
+     */
+    typedef int (*io_call_t)(zcash_fpga& zfpga, void* ctx);
+
+  private:
+    // An entry's state word holds the state in the low 2 bits and the seq of the request
+    // using it above, so a CAS on a stale request fails once the entry has been reused
+    typedef enum : uint64_t {
+      ENTRY_FREE    = 0,
+      ENTRY_CLAIMED = 1,
+      ENTRY_PENDING = 2,
+      ENTRY_DONE    = 3
+    } entry_state_t;
+
+    typedef struct {
+      io_call_t         fn;
+      void*             ctx;
+      int               rc;
+      std::atomic<bool> done;
+    } call_t;
+
+    typedef struct {
+      std::atomic<uint64_t>  state;
+      zcash_fpga::command_t  rpl_cmd;
+      uint64_t               index;
+      uint64_t               seq;      // Same as in state, for the owner of the entry
+      callback_t             cb;
+      void*                  ctx;
+      int                    rc;
+      unsigned int           len;
+      uint8_t                rpl[STREAM_MAX_RPL_BYTES];
+    } entry_t;
+
+    typedef struct {
+      std::atomic<size_t> seq;
+      entry_t*            entry;      // Command waiting for a reply, or nullptr for a call
+      uint64_t            entry_seq;  // entry->seq when queued, detects a cancelled entry
+      call_t*             call;
+      unsigned int        len;
+      uint64_t            t_us;       // When the command was queued
+      uint8_t             cmd[s_sq_cmd_bytes];
+    } sq_slot_t;
+
+  public:
+    /*
+     * Handle to the reply of one submitted command when no callback is used.
+     */
+    class future {
+      friend class zcash_fpga_async;
+      public:
+        future() : m_async(nullptr), m_entry(nullptr) {}
+        bool valid() const { return m_entry != nullptr; }
+        bool ready() const;
+
+        /*
+         * Waits for the reply (driving poll() when no other thread does), copies it into
+         * rpl and releases the table entry. Returns the reply length, 0 on timeout (the
+         * request is cancelled) or -1 on error / FPGA_IGNORE_RPL.
+         */
+        int get(uint8_t* rpl, unsigned int size);
+
+      private:
+        zcash_fpga_async* m_async;
+        entry_t*          m_entry;
+    };
+
+    zcash_fpga_async(zcash_fpga& zfpga);
+    ~zcash_fpga_async();
+    zcash_fpga_async(zcash_fpga_async const&) = delete;
+    void operator=(zcash_fpga_async const&) = delete;
+
+    /*
+     * Sends a command (header_t followed by the body, as for write_stream()) and
+     * registers for its reply. Returns 0 on success, 1 if the pending table is full, a
+     * request with the same reply command and index is already pending (its reply could
+     * not be told apart) or the write failed.
+     */
+    int submit(uint8_t* cmd, unsigned int len, callback_t cb, void* ctx);
+    int submit(uint8_t* cmd, unsigned int len, future& fut);
+
+    /*
+     * Registers for a BLS12_381_INTERRUPT_RPL with this index (the b field of the
+     * SEND_INTERRUPT instruction), nothing is sent to the FPGA. Fails like submit() when
+     * the index is already expected.
+     */
+    int expect_interrupt(uint32_t index, callback_t cb, void* ctx);
+    int expect_interrupt(uint32_t index, future& fut);
+
+    /*
+     * Drains all waiting replies and routes them. Returns the number of replies
+     * routed or -1 on error. Does nothing (returns 0) while the I/O thread runs.
+     */
+    int poll();
+
+    /*
+     * Starts the thread that owns the FPGA, pinned to cpu when cpu >= 0. Returns 0 on
+     * success. stop_io_thread() writes any commands still queued before returning.
+     */
+    int start_io_thread(int cpu = -1);
+    void stop_io_thread();
+    bool io_thread_running() const { return m_io_running.load(std::memory_order_acquire); }
+
+    /*
+     * Runs fn on the I/O thread (or directly when it is not running) and returns its
+     * result, e.g. for the bls12_381_* register functions.
+     */
+    int call(io_call_t fn, void* ctx);
+
+    /*
+     * Lets the I/O thread write up to max_cmds queued commands with one
+     * write_stream_batch(), holding the oldest for up to window_us while fewer are queued.
+     * The batch is also bounded by the transmit FIFO space. The default (1, 0) writes
+     * every command as soon as it is dequeued. Only applies while the I/O thread runs.
+     */
+    void set_coalescing(unsigned int max_cmds, unsigned int window_us);
+
+    /*
+     * Achieved batch sizes, the average is cmds / batches
+     */
+    batch_stats_t get_batch_stats() const;
+
+    unsigned int in_flight() const { return m_in_flight.load(std::memory_order_relaxed); }
+
+    /*
+     * Reply command and index a request will be answered with
+     */
+    static int expected_reply(const uint8_t* cmd, zcash_fpga::command_t& rpl_cmd, uint64_t& index);
+
+  private:
+    zcash_fpga& m_zfpga;
+
+    std::unique_ptr<entry_t[]> m_table;
+    std::unique_ptr<uint8_t[]> m_ring_buf;
+    zcash_fpga::stream_ring_t m_ring;
+
+    std::atomic<uint64_t> m_seq;
+    std::mutex m_claim_lock;  // Serializes claim() so a duplicate request is always seen
+    std::atomic<unsigned int> m_in_flight;
+
+    // Multi-producer, single (I/O thread) consumer submission ring
+    std::unique_ptr<sq_slot_t[]> m_sq;
+    std::atomic<size_t> m_sq_enqueue_pos;
+    size_t m_sq_dequeue_pos;
+
+    std::thread m_io_thread;
+    std::atomic<bool> m_io_running;
+    std::atomic<bool> m_io_stop;
+
+    std::unique_ptr<uint8_t[]> m_batch;
+    std::atomic<unsigned int> m_coalesce_cmds;
+    std::atomic<unsigned int> m_coalesce_us;
+    std::atomic<uint64_t> m_stat_batches;
+    std::atomic<uint64_t> m_stat_cmds;
+    std::atomic<unsigned int> m_stat_max_batch;
+
+    entry_t* claim(zcash_fpga::command_t rpl_cmd, uint64_t index, callback_t cb, void* ctx);
+    void release(entry_t* entry);
+    bool cancel(entry_t* entry, uint64_t seq);
+    int send(entry_t* entry, uint8_t* cmd, unsigned int len);
+    entry_t* find(zcash_fpga::command_t rpl_cmd, uint64_t index, uint64_t& seq);
+    entry_t* find_oldest(zcash_fpga::command_t rpl_cmd, uint64_t& seq);
+    void complete(entry_t* entry, uint64_t seq, int rc, const uint8_t* rpl, unsigned int len);
+    void route(const uint8_t* rpl, unsigned int len);
+    int drain();
+
+    sq_slot_t* sq_reserve();
+    void sq_commit(sq_slot_t* slot);
+    sq_slot_t* sq_front();
+    sq_slot_t* sq_peek(unsigned int i);
+    void sq_pop();
+    void fail_queued(sq_slot_t* slot);
+    unsigned int io_submit(bool flush, uint64_t& stall_start);
+    void io_thread();
+
+    static unsigned int hash(zcash_fpga::command_t rpl_cmd, uint64_t index);
+    static uint64_t tag(uint64_t seq, entry_state_t state) { return (seq << 2) | state; }
+    static entry_state_t state_of(uint64_t state) { return (entry_state_t)(state & 3); }
+
+}; // zcash_fpga_async
+
+#endif // ZCASH_FPGA_ASYNC_H_
@@ -0,0 +1,86 @@
+//
+//  ZCash FPGA library BLS12_381 typed data slot values.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_BLS12_381_H_   /* Include guard */
+#define ZCASH_FPGA_BLS12_381_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "zcash_fpga.hpp"
+
+/*
+ * A value of one point_type_t as it is laid out over consecutive data slots, e.g.
+ *
+ *   bls12_381_g2_af_t g2;
+ *   g2.set_hex(0, "024aa2b2...");   // x.c0, then x.c1, y.c0, y.c1
+ *   g2.store(zfpga, 66);           // 4 slots, each tagged FP2_AF
+ *
+ * dat[i] is the 48 byte little endian value of slot i (the same order as the payload of
+ * a BLS12_381_INTERRUPT_RPL), the point type is added when storing.
+ */
+template <zcash_fpga::point_type_t PT>
+struct bls12_381_value_t {
+  static const zcash_fpga::point_type_t s_type = PT;
+  static const unsigned int s_slots = zcash_fpga::bls12_381_point_type_size(PT);
+
+  uint8_t dat[s_slots][48];
+
+  bls12_381_value_t() { memset(dat, 0, sizeof(dat)); }
+
+  /*
+   * Sets slot i from a big endian hex string of up to 96 digits. Returns 0 on success.
+   */
+  int set_hex(unsigned int i, const char* hex) {
+    size_t len = strlen(hex);
+    if (i >= s_slots || len > 96) return 1;
+    memset(dat[i], 0, 48);
+    for (size_t j = 0; j < len; j++) {
+      char c = hex[len - 1 - j] | 0x20;
+      unsigned int nibble = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : 16;
+      if (nibble > 15) return 1;
+      dat[i][j/2] |= nibble << (4*(j & 1));
+    }
+    return 0;
+  }
+
+  int store(zcash_fpga& zfpga, unsigned int slot) const {
+    return zfpga.bls12_381_set_data_slots(slot, &dat[0][0], s_slots, PT);
+  }
+
+  /*
+   * Returns 1 on error or if the first slot is not tagged PT
+   */
+  int load(zcash_fpga& zfpga, unsigned int slot) {
+    zcash_fpga::point_type_t pt;
+    if (zfpga.bls12_381_get_data_slots(slot, &dat[0][0], s_slots, pt) != 0) return 1;
+    return pt == PT ? 0 : 1;
+  }
+};
+
+typedef bls12_381_value_t<zcash_fpga::SCALAR> bls12_381_scalar_t;
+typedef bls12_381_value_t<zcash_fpga::FE>     bls12_381_fe_t;
+typedef bls12_381_value_t<zcash_fpga::FE2>    bls12_381_fe2_t;
+typedef bls12_381_value_t<zcash_fpga::FE12>   bls12_381_fe12_t;
+typedef bls12_381_value_t<zcash_fpga::FP_AF>  bls12_381_g1_af_t;
+typedef bls12_381_value_t<zcash_fpga::FP_JB>  bls12_381_g1_jb_t;
+typedef bls12_381_value_t<zcash_fpga::FP2_AF> bls12_381_g2_af_t;
+typedef bls12_381_value_t<zcash_fpga::FP2_JB> bls12_381_g2_jb_t;
+
+#endif // ZCASH_FPGA_BLS12_381_H_
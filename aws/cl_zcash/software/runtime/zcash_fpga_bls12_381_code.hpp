@@ -0,0 +1,159 @@
+//
+//  ZCash FPGA library BLS12_381 instruction sequences.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_BLS12_381_CODE_H_   /* Include guard */
+#define ZCASH_FPGA_BLS12_381_CODE_H_
+
+#include <vector>
+
+#include "zcash_fpga.hpp"
+
+/*
+ * Point arithmetic the coprocessor has no instruction for, built from element ops for
+ * the routines of zcash_fpga_msm, zcash_fpga_bls_batch and zcash_fpga_groth16.
+ *
+ * Elements are w slots (1 for G1, 2 for G2). Element ops take the width and point type
+ * of a, which is always a jacobian point or a temporary here so the results stay tagged
+ * FP_JB / FP2_JB. The addition formulas fail for P + P and with the point at infinity,
+ * callers start their sums at a random point to make that negligible.
+ */
+
+static inline zcash_fpga::bls12_381_inst_t bls12_381_inst(zcash_fpga::bls12_381_code_t code, unsigned int a,
+                                                          unsigned int b, unsigned int c) {
+  zcash_fpga::bls12_381_inst_t i;
+  i.code = code;
+  i.a = a;
+  i.b = b;
+  i.c = c;
+  return i;
+}
+
+static inline void bls12_381_emit(std::vector<zcash_fpga::bls12_381_inst_t>& code, zcash_fpga::bls12_381_code_t op,
+                                  unsigned int a, unsigned int b, unsigned int c) {
+  code.push_back(bls12_381_inst(op, a, b, c));
+}
+
+static inline void bls12_381_copy(std::vector<zcash_fpga::bls12_381_inst_t>& code, unsigned int from,
+                                  unsigned int to, unsigned int n) {
+  for (unsigned int i = 0; i < n; i++)
+    bls12_381_emit(code, zcash_fpga::COPY_REG, from + i, to + i, 0);
+}
+
+// p += q for jacobian p and affine q (madd with Z2 = 1), 18 instructions, 5w temporaries
+static inline void bls12_381_madd(std::vector<zcash_fpga::bls12_381_inst_t>& code, unsigned int w, unsigned int p,
+                                  unsigned int q, unsigned int t) {
+  const unsigned int x1 = p, y1 = p + w, z1 = p + 2*w, x2 = q, y2 = q + w;
+  const unsigned int t0 = t, t1 = t + w, t2 = t + 2*w, t3 = t + 3*w, t4 = t + 4*w;
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, z1, z1, t0);   // Z1^2
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t0, x2, t1);   // U2
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, z1, t0, t2);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t2, y2, t2);   // S2
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, t1, x1, t1);   // H
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, t2, y1, t2);   // r
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t1, t1, t3);   // H^2
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t1, t3, t4);   // H^3
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, x1, t3, t3);   // V
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, z1, t1, z1);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t2, t2, x1);
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, x1, t4, x1);
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, x1, t3, x1);
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, x1, t3, x1);   // r^2 - H^3 - 2V
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, t3, x1, t3);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t2, t3, t3);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, y1, t4, t4);
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, t3, t4, y1);   // r(V - X3) - Y1 H^3
+}
+
+// p += q for jacobian p and q, 23 instructions, 7w temporaries
+static inline void bls12_381_add(std::vector<zcash_fpga::bls12_381_inst_t>& code, unsigned int w, unsigned int p,
+                                 unsigned int q, unsigned int t) {
+  const unsigned int x1 = p, y1 = p + w, z1 = p + 2*w, x2 = q, y2 = q + w, z2 = q + 2*w;
+  const unsigned int t0 = t, t1 = t + w, t2 = t + 2*w, t3 = t + 3*w, t4 = t + 4*w, t5 = t + 5*w, t6 = t + 6*w;
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, z1, z1, t0);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, z2, z2, t1);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, x1, t1, t2);   // U1
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t0, x2, t3);   // U2
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, y1, z2, t4);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t4, t1, t4);   // S1
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, z1, y2, t5);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t5, t0, t5);   // S2
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, z1, z2, t6);
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, t3, t2, t3);   // H
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, t5, t4, t5);   // r
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t3, t3, t0);   // H^2
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t3, t0, t1);   // H^3
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t2, t0, t2);   // V
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t5, t5, x1);
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, x1, t1, x1);
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, x1, t2, x1);
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, x1, t2, x1);   // r^2 - H^3 - 2V
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, t2, x1, t2);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t5, t2, t2);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t4, t1, t4);
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, t2, t4, y1);   // r(V - X3) - S1 H^3
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t6, t3, z1);   // Z1 Z2 H
+}
+
+// p = 2p for jacobian p on y^2 = x^3 + b, 21 instructions, 4w temporaries
+static inline void bls12_381_dbl(std::vector<zcash_fpga::bls12_381_inst_t>& code, unsigned int w, unsigned int p,
+                                 unsigned int t) {
+  const unsigned int x = p, y = p + w, z = p + 2*w;
+  const unsigned int t0 = t, t1 = t + w, t2 = t + 2*w, t3 = t + 3*w;
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, x, x, t0);     // A = X^2
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, y, y, t1);     // B = Y^2
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t1, t1, t2);   // C = B^2
+  bls12_381_emit(code, zcash_fpga::ADD_ELEMENT, x, t1, t1);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t1, t1, t1);
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, t1, t0, t1);
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, t1, t2, t1);
+  bls12_381_emit(code, zcash_fpga::ADD_ELEMENT, t1, t1, t1);   // D = 2((X + B)^2 - A - C)
+  bls12_381_emit(code, zcash_fpga::ADD_ELEMENT, t0, t0, t3);
+  bls12_381_emit(code, zcash_fpga::ADD_ELEMENT, t3, t0, t0);   // E = 3A
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t0, t0, t3);   // E^2
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, y, z, z);
+  bls12_381_emit(code, zcash_fpga::ADD_ELEMENT, z, z, z);      // 2YZ
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, t3, t1, x);
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, x, t1, x);     // E^2 - 2D
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, t1, x, t1);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t0, t1, t1);
+  bls12_381_emit(code, zcash_fpga::ADD_ELEMENT, t2, t2, t2);
+  bls12_381_emit(code, zcash_fpga::ADD_ELEMENT, t2, t2, t2);
+  bls12_381_emit(code, zcash_fpga::ADD_ELEMENT, t2, t2, t2);
+  bls12_381_emit(code, zcash_fpga::SUB_ELEMENT, t1, t2, y);    // E(D - X3) - 8C
+}
+
+// af = (X / Z^2, Y / Z^3) of jacobian p for MILLER_LOOP, 2w temporaries. INV_ELEMENT
+// treats everything that is not FE as FE2, so a G1 Z is first multiplied by one (an FE
+// slot) to be inverted as FE, 6 instructions. G2 needs no one, 5 instructions.
+static inline void bls12_381_to_affine(std::vector<zcash_fpga::bls12_381_inst_t>& code, unsigned int w,
+                                       unsigned int p, unsigned int af, unsigned int one, unsigned int t) {
+  const unsigned int x = p, y = p + w, z = p + 2*w, t0 = t, t1 = t + w;
+  if (w == 1) {
+    bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, one, z, t0);
+    bls12_381_emit(code, zcash_fpga::INV_ELEMENT, t0, t0, 0);
+  } else {
+    bls12_381_emit(code, zcash_fpga::INV_ELEMENT, z, t0, 0);
+  }
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t0, t0, t1);   // Z^-2
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t1, x, af);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t1, t0, t1);   // Z^-3
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, t1, y, af + w);
+}
+
+#endif // ZCASH_FPGA_BLS12_381_CODE_H_
@@ -0,0 +1,237 @@
+#include "zcash_fpga_bls_batch.hpp"
+#include "zcash_fpga_bls12_381_code.hpp"
+#include "zcash_fpga_log.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/rand.h>
+
+// Data slots relative to first_slot
+static const unsigned int s_acc = 0;
+static const unsigned int s_tmp = 12;
+static const unsigned int s_flag = 24;
+static const unsigned int s_neg_g1 = 25;
+static const unsigned int s_one = 27;
+static const unsigned int s_neg_off = 28;  // -R, G2 affine
+static const unsigned int s_sum = 32;      // R + sum r_i * sig_i, G2 jacobian
+static const unsigned int s_pm = 38;       // POINT_MULT result
+static const unsigned int s_t = 44;        // 7 FE2 temporaries
+static const unsigned int s_af = 58;       // Affine point for MILLER_LOOP
+static const unsigned int s_items = 62;
+
+// Per signature, relative to its first slot
+static const unsigned int s_item_size = 11;
+static const unsigned int s_r = 0;
+static const unsigned int s_pk = 1;
+static const unsigned int s_hm = 3;
+static const unsigned int s_sig = 7;
+
+static const unsigned int s_item_insts = 33;
+static const unsigned int s_tail_insts = 31; // Flag jump, madd of -R, to affine, the -g1 MILLER_LOOP, FINAL_EXP, interrupts
+
+// Interrupt indices
+static const unsigned int s_result = 0;
+static const unsigned int s_ack = 1;
+
+zcash_fpga_bls_batch::zcash_fpga_bls_batch(zcash_fpga& zfpga, zcash_fpga_programs& progs, unsigned int first_slot,
+                                           unsigned int last_slot, unsigned int max_items) :
+  m_zfpga(zfpga),
+  m_progs(progs),
+  m_first(first_slot) {
+  char name[64];
+  unsigned int fit, inst_fit, insts;
+
+  if (last_slot == 0 || last_slot > zfpga.bls12_381_get_data_size())
+    last_slot = zfpga.bls12_381_get_data_size();
+  fit = last_slot > first_slot + s_items ? (last_slot - first_slot - s_items) / s_item_size : 0;
+  insts = progs.get_free_slots();
+  inst_fit = insts > s_tail_insts ? (insts - s_tail_insts) / s_item_insts : 0;
+  if (inst_fit < fit) fit = inst_fit;
+  m_max_items = (max_items != 0 && max_items < fit) ? max_items : fit;
+  memset(&m_stats, 0, sizeof(m_stats));
+  if (m_max_items == 0) {
+    zlog_error("zcash_fpga_bls_batch: no room for a signature in data slots %d to %d and %d instruction slots\n",
+               first_slot, last_slot - 1, insts);
+    return;
+  }
+
+  // Registered now so routines added later cannot take the slots it was sized for
+  snprintf(name, sizeof(name), "bls_batch_%u_%u", m_first, m_max_items);
+  m_name = name;
+  if (!progs.contains(m_name)) {
+    std::vector<zcash_fpga::bls12_381_inst_t> code;
+    build(code);
+    if (progs.add(m_name, code) != 0) {
+      zlog_error("zcash_fpga_bls_batch: unable to register %s\n", name);
+      m_max_items = 0;
+    }
+  }
+}
+
+// The routine for m_max_items signatures, entered s_item_insts per signature before the end
+void zcash_fpga_bls_batch::build(std::vector<zcash_fpga::bls12_381_inst_t>& code) const {
+  const unsigned int acc = m_first + s_acc, tmp = m_first + s_tmp, flag = m_first + s_flag;
+  const unsigned int sum = m_first + s_sum, pm = m_first + s_pm, t = m_first + s_t, af = m_first + s_af;
+  unsigned int jump;
+  for (unsigned int j = 0; j < m_max_items; j++) {
+    unsigned int item = m_first + s_items + s_item_size*j;
+    // e(r * pk, H(m)) into the accumulator, r * sig into the G2 sum
+    bls12_381_emit(code, zcash_fpga::POINT_MULT, item + s_r, item + s_pk, pm);
+    bls12_381_to_affine(code, 1, pm, af, m_first + s_one, t);
+    bls12_381_emit(code, zcash_fpga::MILLER_LOOP, af, item + s_hm, tmp);
+    bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, acc, tmp, acc);
+    bls12_381_emit(code, zcash_fpga::POINT_MULT, item + s_r, item + s_sig, pm);
+    bls12_381_add(code, 2, sum, pm, t);
+  }
+  // A non zero flag means more chunks follow, it is cleared by the jump
+  jump = code.size();
+  bls12_381_emit(code, zcash_fpga::JUMP_NONZERO_SUB, 0, flag, 0);
+  bls12_381_madd(code, 2, sum, m_first + s_neg_off, t);
+  bls12_381_to_affine(code, 2, sum, af, 0, t);
+  bls12_381_emit(code, zcash_fpga::MILLER_LOOP, m_first + s_neg_g1, af, tmp);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, acc, tmp, acc);
+  bls12_381_emit(code, zcash_fpga::FINAL_EXP, acc, acc, 0);
+  bls12_381_emit(code, zcash_fpga::SEND_INTERRUPT, acc, s_result, 0);
+  bls12_381_emit(code, zcash_fpga::NOOP_WAIT, 0, 0, 0);
+  code[jump].a = code.size();
+  bls12_381_emit(code, zcash_fpga::SEND_INTERRUPT, flag, s_ack, 0);
+  bls12_381_emit(code, zcash_fpga::NOOP_WAIT, 0, 0, 0);
+}
+
+int zcash_fpga_bls_batch::chunk(const sig_t* sigs, unsigned int k, bool first, bool last, bool& ok) {
+  int rc = 0, read_len;
+  unsigned int entry;
+  uint8_t reply[STREAM_MAX_RPL_BYTES];
+  zcash_fpga::bls12_381_interrupt_rpl_t* rpl = (zcash_fpga::bls12_381_interrupt_rpl_t*)reply;
+  bls12_381_scalar_t flag;
+
+  if (first) {
+    bls12_381_fe12_t one;
+    bls12_381_fe_t one_fe;
+    bls12_381_g1_af_t neg_g1;
+    one.dat[0][0] = 1;
+    rc = one.store(m_zfpga, m_first + s_acc);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    one_fe.dat[0][0] = 1;
+    rc = one_fe.store(m_zfpga, m_first + s_one);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    neg_g1.set_hex(0, "17f1d3a73197d7942695638c4fa9ac0fc3688c4f9774b905a14e3a3f171bac586c55e83ff97a1aeffb3af00adb22c6bb");
+    neg_g1.set_hex(1, "114d1d6855d545a8aa7d76c8cf2e21f267816aef1db507c96655b9d5caac42364e6f38ba0ecb751bad54dcd6b939c2ca");
+    rc = neg_g1.store(m_zfpga, m_first + s_neg_g1);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+
+    // The G2 sum starts at R = s * g2 for a random s so no addition sees the point at
+    // infinity or a doubling, the tail adds -R back
+    bls12_381_scalar_t s;
+    bls12_381_g2_af_t off;
+    bls12_381_g2_jb_t sum;
+    if (RAND_bytes(s.dat[0], 16) != 1) {
+      zlog_error("zcash_fpga_bls_batch: RAND_bytes failed\n");
+      goto out;
+    }
+    s.dat[0][0] |= 1;
+    m_cpu.point_mult(s, zcash_bls12_381_cpu::g2_generator(), off);
+    memcpy(sum.dat, off.dat, sizeof(off.dat));
+    sum.dat[4][0] = 1;
+    rc = sum.store(m_zfpga, m_first + s_sum);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    zcash_bls12_381_cpu::g2_neg(off);
+    rc = off.store(m_zfpga, m_first + s_neg_off);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  }
+  for (unsigned int i = 0; i < k; i++) {
+    unsigned int item = m_first + s_items + s_item_size*(m_max_items - k + i);
+    bls12_381_scalar_t r;
+    // Non zero, the top bits stay clear so r is below the group order
+    if (RAND_bytes(r.dat[0], 16) != 1) {
+      zlog_error("zcash_fpga_bls_batch: RAND_bytes failed\n");
+      goto out;
+    }
+    r.dat[0][0] |= 1;
+    rc = r.store(m_zfpga, item + s_r);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    rc = sigs[i].pk.store(m_zfpga, item + s_pk);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    rc = sigs[i].hm.store(m_zfpga, item + s_hm);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    rc = sigs[i].sig.store(m_zfpga, item + s_sig);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  }
+  flag.dat[0][0] = last ? 0 : 1;
+  rc = flag.store(m_zfpga, m_first + s_flag);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+
+  rc = m_progs.load(m_name, entry);
+  fail_on(rc, out, "ERROR: Unable to load the program!\n");
+  rc = m_zfpga.bls12_381_set_curr_inst_slot(entry + s_item_insts*(m_max_items - k));
+  fail_on(rc, out, "ERROR: Unable to start the program!\n");
+  m_stats.items += k;
+
+  read_len = m_zfpga.read_stream_wait(reply, sizeof(reply), zcash_fpga::BLS12_381_INTERRUPT_RPL);
+  if (read_len <= 0) {
+    zlog_error("zcash_fpga_bls_batch: no interrupt after %d signatures\n", k);
+    goto out;
+  }
+  if (rpl->index != (last ? s_result : s_ack)) {
+    zlog_error("zcash_fpga_bls_batch: unexpected interrupt index %d\n", rpl->index);
+    goto out;
+  }
+  if (last) {
+    bls12_381_fe12_t id;
+    id.dat[0][0] = 1;
+    if ((unsigned int)read_len < sizeof(*rpl) + sizeof(id.dat)) {
+      zlog_error("zcash_fpga_bls_batch: result of %d bytes is not an FE12\n", read_len);
+      goto out;
+    }
+    ok = memcmp(reply + sizeof(*rpl), id.dat, sizeof(id.dat)) == 0;
+  }
+  return 0;
+  out:
+    return 1;
+}
+
+int zcash_fpga_bls_batch::check(const sig_t* sigs, unsigned int n, bool& ok) {
+  unsigned int done = 0, k;
+
+  ok = true;
+  if (n == 0) return 0;
+  if (m_max_items == 0) return 1;
+
+  m_stats.checks++;
+  while (done < n) {
+    k = n - done < m_max_items ? n - done : m_max_items;
+    if (chunk(sigs + done, k, done == 0, done + k == n, ok) != 0) return 1;
+    done += k;
+  }
+  return 0;
+}
+
+int zcash_fpga_bls_batch::bisect(const sig_t* sigs, unsigned int lo, unsigned int hi, bool known_bad,
+                                 std::vector<bool>& valid, bool& all_valid) {
+  bool ok = false, left_valid, right_valid;
+  unsigned int mid;
+
+  if (!known_bad && check(sigs + lo, hi - lo, ok) != 0) return 1;
+  if (ok) {
+    for (unsigned int i = lo; i < hi; i++) valid[i] = true;
+    all_valid = true;
+    return 0;
+  }
+  all_valid = false;
+  if (hi - lo == 1) {
+    valid[lo] = false;
+    m_stats.invalid++;
+    return 0;
+  }
+  mid = lo + (hi - lo) / 2;
+  if (bisect(sigs, lo, mid, false, valid, left_valid) != 0) return 1;
+  return bisect(sigs, mid, hi, left_valid, valid, right_valid);
+}
+
+int zcash_fpga_bls_batch::verify(const sig_t* sigs, unsigned int n, std::vector<bool>& valid) {
+  bool all_valid;
+  valid.assign(n, false);
+  if (n == 0) return 0;
+  return bisect(sigs, 0, n, false, valid, all_valid);
+}
@@ -0,0 +1,113 @@
+//
+//  ZCash FPGA library BLS12_381 batched BLS signature verification.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_BLS_BATCH_H_   /* Include guard */
+#define ZCASH_FPGA_BLS_BATCH_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "zcash_bls12_381_cpu.hpp"
+#include "zcash_fpga.hpp"
+#include "zcash_fpga_bls12_381.hpp"
+#include "zcash_fpga_programs.hpp"
+
+/*
+ * Verifies BLS signatures (public key in G1, signature and message hash in G2) in
+ * batches with a random linear combination, e(pk, H(m)) == e(g1, sig) for all of them
+ * holding (with overwhelming probability) when
+ *
+ *   prod_i e(r_i * pk_i, H(m_i)) * e(r_i * -g1, sig_i) == 1
+ *
+ * for random 128 bit r_i drawn on the host. H(m) is hashed to G2 by the caller.
+ *
+ * The check is computed as prod_i e(r_i * pk_i, H(m_i)) * e(-g1, sum_i r_i * sig_i), so
+ * a batch of n signatures costs n + 1 MILLER_LOOPs and one FINAL_EXP. Each r_i * pk_i is
+ * a POINT_MULT converted back to affine with INV_ELEMENT / MUL_ELEMENT, each r_i * sig_i
+ * a POINT_MULT added into a G2 jacobian sum with element ops (zcash_fpga_bls12_381_code).
+ * The sum starts at a random R = s * g2 computed on the host with zcash_bls12_381_cpu,
+ * so no addition meets the point at infinity or a doubling, and -R is added before the
+ * sum is converted to affine once. The routine needs 33 instruction slots per signature
+ * and 31 more.
+ *
+ * Like zcash_fpga_pairing the code is one resident routine of max_items blocks entered
+ * k blocks from its end, with larger batches run as chunks sharing the accumulator and the G2 sum. A
+ * batch that fails is split in halves until the bad signatures are found, when the left
+ * half passes the right half is known to fail and is split without being checked.
+ *
+ * Data slots from first_slot: the FE12 accumulator (12), the temporary (12), the flag
+ * (1), -g1 (2), one as FE (1), -R (4), the G2 sum (6), the POINT_MULT result (6), seven
+ * FE2 temporaries (14), the affine point (4), then 11 per signature (r, pk, H(m), sig).
+ */
+class zcash_fpga_bls_batch {
+
+  public:
+    typedef struct {
+      bls12_381_g1_af_t pk;
+      bls12_381_g2_af_t hm;   // Message hashed to G2
+      bls12_381_g2_af_t sig;
+    } sig_t;
+
+    typedef struct {
+      uint64_t checks;  // Batches checked on the FPGA, including bisection
+      uint64_t items;   // Signatures weighted on the FPGA
+      uint64_t invalid; // Signatures found invalid
+    } stats_t;
+
+    /*
+     * Uses data slots first_slot to last_slot - 1 (last_slot of 0 is the end of data
+     * memory) and at most max_items signatures per chunk (0 for as many as fit in the data
+     * slots and the registry's free slots). The routine is registered in progs here.
+     */
+    zcash_fpga_bls_batch(zcash_fpga& zfpga, zcash_fpga_programs& progs, unsigned int first_slot = 0,
+                         unsigned int last_slot = 0, unsigned int max_items = 0);
+
+    /*
+     * Sets valid[i] for each of the n signatures. Returns 0 on success or 1 if the FPGA
+     * could not be used.
+     */
+    int verify(const sig_t* sigs, unsigned int n, std::vector<bool>& valid);
+
+    /*
+     * One random linear combination check of all n signatures without bisection.
+     */
+    int check(const sig_t* sigs, unsigned int n, bool& ok);
+
+    unsigned int get_max_items() const { return m_max_items; }
+    stats_t get_stats() const { return m_stats; }
+
+  private:
+    zcash_fpga&          m_zfpga;
+    zcash_fpga_programs& m_progs;
+    unsigned int         m_first;
+    unsigned int         m_max_items;
+    std::string          m_name;
+    stats_t              m_stats;
+    zcash_bls12_381_cpu  m_cpu;      // Computes R
+
+    void build(std::vector<zcash_fpga::bls12_381_inst_t>& code) const;
+    int chunk(const sig_t* sigs, unsigned int k, bool first, bool last, bool& ok);
+    int bisect(const sig_t* sigs, unsigned int lo, unsigned int hi, bool known_bad, std::vector<bool>& valid,
+               bool& all_valid);
+
+}; // zcash_fpga_bls_batch
+
+#endif // ZCASH_FPGA_BLS_BATCH_H_
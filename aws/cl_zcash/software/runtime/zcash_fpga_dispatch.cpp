@@ -0,0 +1,424 @@
+#include "zcash_fpga_dispatch.hpp"
+#include "zcash_fpga_log.hpp"
+#include "zcash_secp256k1_ossl.hpp"
+
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#include <chrono>
+
+// FPGA jobs in flight per device before its reply interval has been measured
+#define FPGA_PROBE_JOBS  64
+// Samples before the hedge percentile is used, and between recalculations
+#define HEDGE_MIN_SAMPLES 100
+#define HEDGE_UPDATE_SAMPLES 64
+// The histogram is halved at this many samples so it follows changes in latency
+#define LAT_DECAY_SAMPLES 16384
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Moving average with weight 1/16 for new samples, 0 is no estimate yet
+static inline uint64_t ewma(uint64_t avg, uint64_t sample) {
+  if (avg == 0) return sample;
+  return avg - avg / 16 + sample / 16;
+}
+
+zcash_fpga_dispatch::zcash_fpga_dispatch(zcash_fpga& zfpga, zcash_fpga_async& async, unsigned int cpu_threads) :
+  m_zfpga(&zfpga),
+  m_async(&async),
+  m_pool(nullptr) {
+  if (!async.io_thread_running())
+    zlog_warn("zcash_fpga_dispatch: the I/O thread is not running, FPGA replies will not be routed\n");
+  start(cpu_threads);
+}
+
+zcash_fpga_dispatch::zcash_fpga_dispatch(zcash_fpga_pool& pool, unsigned int cpu_threads) :
+  m_zfpga(nullptr),
+  m_async(nullptr),
+  m_pool(&pool) {
+  start(cpu_threads);
+}
+
+void zcash_fpga_dispatch::start(unsigned int cpu_threads) {
+  m_jobs.reset(new job_t[s_max_jobs]);
+  m_free.reserve(s_max_jobs);
+  for (unsigned int i = 0; i < s_max_jobs; i++) {
+    m_jobs[i].owner = this;
+    m_free.push_back(&m_jobs[s_max_jobs - 1 - i]);
+  }
+
+  m_in_flight = 0;
+  m_fpga_in_flight = 0;
+  m_cpu_in_flight = 0;
+  m_stop = false;
+
+  m_fpga_base_ns = 0;
+  m_fpga_interval_ns = 0;
+  m_cpu_verify_ns = 0;
+  m_hedge_ns = 0;
+  m_last_fpga_ns = 0;
+  m_fpga_busy = false;
+  memset(m_lat_hist, 0, sizeof(m_lat_hist));
+  m_lat_total = 0;
+  m_lat_since_update = 0;
+  m_hedge_pct = 0.99;
+  m_hedge_max_fraction = 0.05;
+
+  m_stat_fpga_jobs = 0;
+  m_stat_cpu_jobs = 0;
+  m_stat_fpga_failed = 0;
+  m_stat_hedged = 0;
+  m_stat_hedge_wins = 0;
+
+  if (cpu_threads == 0) {
+    cpu_threads = std::thread::hardware_concurrency();
+    cpu_threads = cpu_threads > 1 ? cpu_threads - 1 : 1;
+  }
+  for (unsigned int i = 0; i < cpu_threads; i++)
+    m_threads.push_back(std::thread(&zcash_fpga_dispatch::cpu_thread, this));
+
+  zlog_info("zcash_fpga_dispatch: %d CPU verifier threads, FPGA %s\n", cpu_threads,
+            fpga_capable() ? "enabled" : "not available");
+}
+
+zcash_fpga_dispatch::~zcash_fpga_dispatch() {
+  // Wait for replies to jobs still on the FPGA, their callbacks point at m_jobs
+  uint64_t start = now_ns();
+  while (m_fpga_in_flight.load(std::memory_order_acquire) != 0) {
+    if (now_ns() - start > 1000000000ULL) {
+      zlog_warn("zcash_fpga_dispatch: %d FPGA jobs still in flight at exit\n", m_fpga_in_flight.load());
+      break;
+    }
+    sched_yield();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_cpu_lock);
+    m_stop = true;
+  }
+  m_cpu_cv.notify_all();
+  for (size_t i = 0; i < m_threads.size(); i++)
+    m_threads[i].join();
+}
+
+void zcash_fpga_dispatch::set_hedging(double percentile, double max_fraction) {
+  std::lock_guard<std::mutex> lock(m_stat_lock);
+  m_hedge_pct = percentile;
+  m_hedge_max_fraction = max_fraction;
+  m_lat_since_update = HEDGE_UPDATE_SAMPLES;  // Recalculate on the next reply
+  if (percentile <= 0) m_hedge_ns = 0;
+}
+
+zcash_fpga_dispatch::stats_t zcash_fpga_dispatch::get_stats() {
+  stats_t stats;
+  stats.fpga_jobs = m_stat_fpga_jobs.load();
+  stats.cpu_jobs = m_stat_cpu_jobs.load();
+  stats.fpga_failed = m_stat_fpga_failed.load();
+  stats.hedged = m_stat_hedged.load();
+  stats.hedge_wins = m_stat_hedge_wins.load();
+  stats.fpga_base_ns = m_fpga_base_ns.load();
+  stats.fpga_interval_ns = m_fpga_interval_ns.load();
+  stats.cpu_verify_ns = m_cpu_verify_ns.load();
+  stats.hedge_ns = m_hedge_ns.load();
+  return stats;
+}
+
+bool zcash_fpga_dispatch::fpga_capable() const {
+  uint64_t cap = m_pool != nullptr ? m_pool->get_command_cap() : m_zfpga->m_command_cap;
+  return (cap & zcash_fpga::ENB_VERIFY_SECP256K1_SIG) != 0;
+}
+
+// Compares the estimated completion time of a new job on each path
+bool zcash_fpga_dispatch::prefer_fpga() {
+  unsigned int devices = m_pool != nullptr ? m_pool->size() : 1;
+  unsigned int fpga_q = m_fpga_in_flight.load(std::memory_order_relaxed);
+  unsigned int cpu_q = m_cpu_in_flight.load(std::memory_order_relaxed);
+  uint64_t cpu_ns = m_cpu_verify_ns.load(std::memory_order_relaxed);
+  uint64_t interval_ns = m_fpga_interval_ns.load(std::memory_order_relaxed);
+
+  if (!fpga_capable()) return false;
+  // Leave room in the async pending tables for other commands
+  if (fpga_q >= devices * zcash_fpga_async::s_max_pending / 2) return false;
+  if (m_threads.empty()) return true;
+
+  // Time one verification on the CPU before splitting
+  if (cpu_ns == 0) return cpu_q != 0;
+  if (interval_ns == 0) return fpga_q < devices * FPGA_PROBE_JOBS;
+
+  uint64_t fpga_est = m_fpga_base_ns.load(std::memory_order_relaxed) + fpga_q * interval_ns;
+  uint64_t cpu_est = (cpu_q / m_threads.size() + 1) * cpu_ns;
+  return fpga_est <= cpu_est;
+}
+
+int zcash_fpga_dispatch::verify(const zcash_fpga::verify_secp256k1_sig_t& sig, callback_t cb, void* ctx) {
+  job_t* job;
+
+  {
+    std::unique_lock<std::mutex> lock(m_free_lock);
+    if (m_free.empty()) {
+      // Finished FPGA jobs may still be held by m_fpga_order, reaping takes m_free_lock
+      lock.unlock();
+      reap_fpga_order();
+      lock.lock();
+    }
+    if (m_free.empty()) {
+      zlog_error("zcash_fpga_dispatch: %d jobs already in flight\n", s_max_jobs);
+      return 1;
+    }
+    job = m_free.back();
+    m_free.pop_back();
+  }
+
+  job->sig = sig;
+  job->sig.hdr.cmd = zcash_fpga::VERIFY_SECP256K1_SIG;
+  job->sig.hdr.len = sizeof(job->sig);
+  job->cb = cb;
+  job->ctx = ctx;
+  job->t_ns = now_ns();
+  job->fpga_q = 0;
+  job->done.store(false, std::memory_order_relaxed);
+  job->fpga_done.store(false, std::memory_order_relaxed);
+  job->hedged.store(false, std::memory_order_relaxed);
+  m_in_flight.fetch_add(1, std::memory_order_relaxed);
+
+  if (prefer_fpga() && submit_fpga(job) == 0)
+    return 0;
+
+  if (m_threads.empty()) {
+    m_in_flight.fetch_sub(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(m_free_lock);
+    m_free.push_back(job);
+    return 1;
+  }
+
+  job->refs.store(1, std::memory_order_relaxed);
+  m_stat_cpu_jobs.fetch_add(1, std::memory_order_relaxed);
+  submit_cpu(job);
+  return 0;
+}
+
+int zcash_fpga_dispatch::submit_fpga(job_t* job) {
+  int rc;
+
+  // The reply holds one reference and m_fpga_order the other
+  job->refs.store(2, std::memory_order_relaxed);
+  job->fpga_q = m_fpga_in_flight.fetch_add(1, std::memory_order_acq_rel);
+
+  if (m_pool != nullptr)
+    rc = m_pool->submit((uint8_t*)&job->sig, sizeof(job->sig), fpga_reply, job);
+  else
+    rc = m_async->submit((uint8_t*)&job->sig, sizeof(job->sig), fpga_reply, job);
+
+  if (rc != 0) {
+    m_fpga_in_flight.fetch_sub(1, std::memory_order_acq_rel);
+    return 1;
+  }
+
+  m_stat_fpga_jobs.fetch_add(1, std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lock(m_order_lock);
+  m_fpga_order.push_back(job);
+  return 0;
+}
+
+void zcash_fpga_dispatch::submit_cpu(job_t* job) {
+  m_cpu_in_flight.fetch_add(1, std::memory_order_relaxed);
+  {
+    std::lock_guard<std::mutex> lock(m_cpu_lock);
+    m_cpu_queue.push_back(job);
+  }
+  m_cpu_cv.notify_one();
+}
+
+// Called by the async I/O thread with the FPGA's reply
+void zcash_fpga_dispatch::fpga_reply(void* ctx, int rc, const uint8_t* rpl, unsigned int len) {
+  job_t* job = (job_t*)ctx;
+  zcash_fpga_dispatch* d = job->owner;
+  uint64_t t_ns = now_ns();
+
+  job->fpga_done.store(true, std::memory_order_release);
+
+  if (rc == 0 && len >= sizeof(zcash_fpga::verify_secp256k1_sig_rpl_t)) {
+    const zcash_fpga::verify_secp256k1_sig_rpl_t* r = (const zcash_fpga::verify_secp256k1_sig_rpl_t*)rpl;
+    d->record_fpga(job, t_ns);
+    d->m_fpga_in_flight.fetch_sub(1, std::memory_order_acq_rel);
+    d->finish(job, 0, (uint8_t)r->bm, PATH_FPGA);
+  } else {
+    // Ignored (cmd_cap changed, e.g. after a reset) or failed, run it on the CPU instead
+    d->m_fpga_in_flight.fetch_sub(1, std::memory_order_acq_rel);
+    d->m_stat_fpga_failed.fetch_add(1, std::memory_order_relaxed);
+    if (d->m_threads.empty()) {
+      d->finish(job, 1, 0, PATH_FPGA);
+    } else if (!job->hedged.exchange(true)) {
+      job->refs.fetch_add(1, std::memory_order_relaxed);
+      d->submit_cpu(job);
+    }
+  }
+  d->unref(job);
+  d->reap_fpga_order();
+}
+
+void zcash_fpga_dispatch::finish(job_t* job, int rc, uint8_t bm, path_t path) {
+  if (job->done.exchange(true, std::memory_order_acq_rel)) return;
+  if (path == PATH_CPU && job->hedged.load(std::memory_order_relaxed) &&
+      !job->fpga_done.load(std::memory_order_acquire))
+    m_stat_hedge_wins.fetch_add(1, std::memory_order_relaxed);
+  if (job->cb != nullptr)
+    job->cb(job->ctx, rc, job->sig.index, bm, path);
+  m_in_flight.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void zcash_fpga_dispatch::unref(job_t* job) {
+  if (job->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+  std::lock_guard<std::mutex> lock(m_free_lock);
+  m_free.push_back(job);
+}
+
+unsigned int zcash_fpga_dispatch::lat_bucket(uint64_t ns) {
+  if (ns < 8) return ns;
+  unsigned int e = 63 - __builtin_clzll(ns);
+  return 4*e + ((ns >> (e - 2)) & 3);
+}
+
+uint64_t zcash_fpga_dispatch::lat_bucket_top(unsigned int bucket) {
+  if (bucket < 8) return bucket + 1;
+  unsigned int e = bucket / 4;
+  return (uint64_t)(5 + bucket % 4) << (e - 2);
+}
+
+void zcash_fpga_dispatch::record_fpga(job_t* job, uint64_t t_ns) {
+  uint64_t lat_ns = t_ns - job->t_ns;
+  std::lock_guard<std::mutex> lock(m_stat_lock);
+
+  if (job->fpga_q == 0)
+    m_fpga_base_ns = ewma(m_fpga_base_ns.load(std::memory_order_relaxed), lat_ns);
+  // Only time between replies with no idle gap in between measures throughput
+  if (m_fpga_busy)
+    m_fpga_interval_ns = ewma(m_fpga_interval_ns.load(std::memory_order_relaxed), t_ns - m_last_fpga_ns);
+  m_last_fpga_ns = t_ns;
+  m_fpga_busy = m_fpga_in_flight.load(std::memory_order_relaxed) > 1;
+
+  m_lat_hist[lat_bucket(lat_ns)]++;
+  if (++m_lat_total >= LAT_DECAY_SAMPLES) {
+    m_lat_total = 0;
+    for (unsigned int i = 0; i < s_lat_buckets; i++) {
+      m_lat_hist[i] /= 2;
+      m_lat_total += m_lat_hist[i];
+    }
+  }
+
+  if (++m_lat_since_update < HEDGE_UPDATE_SAMPLES || m_lat_total < HEDGE_MIN_SAMPLES || m_hedge_pct <= 0) return;
+  m_lat_since_update = 0;
+  uint64_t target = (uint64_t)(m_hedge_pct * m_lat_total);
+  uint64_t count = 0;
+  for (unsigned int i = 0; i < s_lat_buckets; i++) {
+    count += m_lat_hist[i];
+    if (count >= target) {
+      m_hedge_ns = lat_bucket_top(i);
+      break;
+    }
+  }
+}
+
+void zcash_fpga_dispatch::record_cpu(uint64_t verify_ns) {
+  std::lock_guard<std::mutex> lock(m_stat_lock);
+  m_cpu_verify_ns = ewma(m_cpu_verify_ns.load(std::memory_order_relaxed), verify_ns);
+}
+
+// Drops m_fpga_order's reference to the finished jobs at its head, m_order_lock must be held
+void zcash_fpga_dispatch::pop_finished() {
+  while (!m_fpga_order.empty() && (m_fpga_order.front()->done.load(std::memory_order_acquire) ||
+                                   m_fpga_order.front()->fpga_done.load(std::memory_order_acquire))) {
+    unref(m_fpga_order.front());
+    m_fpga_order.pop_front();
+  }
+}
+
+// Also called from fpga_reply() and verify(), CPU threads only get to hedge_candidate() when idle
+void zcash_fpga_dispatch::reap_fpga_order() {
+  std::lock_guard<std::mutex> lock(m_order_lock);
+  pop_finished();
+}
+
+// The oldest FPGA job past the hedge threshold, with a reference taken for the CPU
+zcash_fpga_dispatch::job_t* zcash_fpga_dispatch::hedge_candidate() {
+  std::vector<job_t*> finished;
+  job_t* job = nullptr;
+  uint64_t hedge_ns = m_hedge_ns.load(std::memory_order_relaxed);
+  uint64_t t_ns = now_ns();
+
+  {
+    std::lock_guard<std::mutex> lock(m_order_lock);
+    pop_finished();
+
+    if (hedge_ns != 0 && m_stat_hedged.load(std::memory_order_relaxed) + 1 <=
+                         m_hedge_max_fraction * m_stat_fpga_jobs.load(std::memory_order_relaxed)) {
+      for (size_t i = 0; i < m_fpga_order.size(); i++) {
+        job_t* j = m_fpga_order[i];
+        if (t_ns - j->t_ns < hedge_ns) break;  // Jobs behind it are younger
+        if (j->done.load(std::memory_order_acquire) || j->hedged.load(std::memory_order_relaxed)) continue;
+        j->refs.fetch_add(1, std::memory_order_relaxed);
+        if (j->hedged.exchange(true)) {
+          // Its FPGA reply failed over to the CPU meanwhile
+          finished.push_back(j);
+          continue;
+        }
+        m_stat_hedged.fetch_add(1, std::memory_order_relaxed);
+        m_cpu_in_flight.fetch_add(1, std::memory_order_relaxed);
+        job = j;
+        break;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < finished.size(); i++)
+    unref(finished[i]);
+  return job;
+}
+
+void zcash_fpga_dispatch::cpu_thread() {
+  zcash_secp256k1_ossl ossl;
+
+  for (;;) {
+    job_t* job = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(m_cpu_lock);
+      if (!m_cpu_queue.empty()) {
+        job = m_cpu_queue.front();
+        m_cpu_queue.pop_front();
+      } else if (m_stop) {
+        return;
+      }
+    }
+
+    if (job == nullptr)
+      job = hedge_candidate();
+
+    if (job == nullptr) {
+      // Sleep until there is work, waking in time to hedge jobs on the FPGA
+      uint64_t hedge_ns = m_hedge_ns.load(std::memory_order_relaxed);
+      uint64_t wait_us = hedge_ns == 0 || m_fpga_in_flight.load(std::memory_order_relaxed) == 0 ? 1000 :
+                         hedge_ns / 4000;
+      if (wait_us < 20) wait_us = 20;
+      if (wait_us > 1000) wait_us = 1000;
+      std::unique_lock<std::mutex> lock(m_cpu_lock);
+      if (m_cpu_queue.empty() && !m_stop)
+        m_cpu_cv.wait_for(lock, std::chrono::microseconds(wait_us));
+      continue;
+    }
+
+    // A hedged job the FPGA answered while it was queued
+    if (!job->done.load(std::memory_order_acquire)) {
+      uint64_t start = now_ns();
+      uint8_t bm = ossl.verify(job->sig);
+      record_cpu(now_ns() - start);
+      finish(job, 0, bm, PATH_CPU);
+    }
+    m_cpu_in_flight.fetch_sub(1, std::memory_order_relaxed);
+    unref(job);
+  }
+}
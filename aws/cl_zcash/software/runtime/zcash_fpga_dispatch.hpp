@@ -0,0 +1,186 @@
+//
+//  ZCash FPGA library hybrid CPU/FPGA dispatcher.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_DISPATCH_H_   /* Include guard */
+#define ZCASH_FPGA_DISPATCH_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "zcash_fpga.hpp"
+#include "zcash_fpga_async.hpp"
+#include "zcash_fpga_pool.hpp"
+
+/*
+ * Runs VERIFY_SECP256K1_SIG jobs on the FPGA(s) and a pool of CPU verifier threads
+ * (zcash_secp256k1_ossl, so both paths give the same result bitmap).
+ *
+ * Each job goes to the path with the earliest estimated completion: for the FPGA the
+ * measured latency of an idle device plus the queue ahead times the measured interval
+ * between replies while busy, for the CPU the queue ahead divided by the threads times
+ * the measured time of one verification. Jobs only go to the FPGA while m_command_cap
+ * (of any slot, for a pool) has ENB_VERIFY_SECP256K1_SIG, and spill to the CPU when
+ * the submission fails or the FPGA answers with an error.
+ *
+ * Idle CPU threads hedge FPGA jobs that have been waiting longer than a percentile of
+ * the measured FPGA latency (e.g. a slot being reset), up to a fraction of all FPGA
+ * jobs. Whichever path answers first completes the job, the other result is dropped.
+ *
+ * The zcash_fpga_async must have its I/O thread running (zcash_fpga_pool always
+ * does). Callbacks run on the I/O or CPU threads, possibly concurrently.
+ */
+class zcash_fpga_dispatch {
+
+  public:
+    static const unsigned int s_max_jobs = 4096;
+    static const unsigned int s_lat_buckets = 256;   // Log-linear, 4 per power of 2
+
+    typedef enum : uint8_t {
+      PATH_FPGA = 0,
+      PATH_CPU  = 1
+    } path_t;
+
+    /*
+     * rc is 0 when bm is valid. bm uses the bits of zcash_secp256k1_ossl, 0 when the
+     * signature is valid. index is sig.index as submitted.
+     */
+    typedef void (*callback_t)(void* ctx, int rc, uint64_t index, uint8_t bm, path_t path);
+
+    typedef struct {
+      uint64_t fpga_jobs;         // Sent to the FPGA
+      uint64_t cpu_jobs;          // Sent to the CPU
+      uint64_t fpga_failed;       // FPGA errors that were run on the CPU instead
+      uint64_t hedged;            // FPGA jobs also started on the CPU
+      uint64_t hedge_wins;        // Hedged jobs the CPU answered first
+      uint64_t fpga_base_ns;      // FPGA latency when nothing else was in flight
+      uint64_t fpga_interval_ns;  // Time between FPGA replies while busy
+      uint64_t cpu_verify_ns;     // Time of one CPU verification
+      uint64_t hedge_ns;          // Age at which jobs are hedged, 0 until measured
+    } stats_t;
+
+    /*
+     * cpu_threads of 0 uses all CPUs but one (left for the I/O thread)
+     */
+    zcash_fpga_dispatch(zcash_fpga& zfpga, zcash_fpga_async& async, unsigned int cpu_threads = 0);
+    zcash_fpga_dispatch(zcash_fpga_pool& pool, unsigned int cpu_threads = 0);
+    ~zcash_fpga_dispatch();
+    zcash_fpga_dispatch(zcash_fpga_dispatch const&) = delete;
+    void operator=(zcash_fpga_dispatch const&) = delete;
+
+    /*
+     * Queues one verification, sig is copied. Returns 0 on success or 1 if s_max_jobs
+     * are already in flight.
+     */
+    int verify(const zcash_fpga::verify_secp256k1_sig_t& sig, callback_t cb, void* ctx);
+
+    /*
+     * Hedges FPGA jobs older than this percentile (0 to 1, default 0.99) of FPGA
+     * latency, for at most max_fraction (default 0.05) of FPGA jobs. A percentile of 0
+     * turns hedging off.
+     */
+    void set_hedging(double percentile, double max_fraction);
+
+    unsigned int in_flight() const { return m_in_flight.load(std::memory_order_relaxed); }
+    stats_t get_stats();
+
+  private:
+    typedef struct job_s {
+      zcash_fpga_dispatch*      owner;
+      zcash_fpga::verify_secp256k1_sig_t sig;
+      callback_t                cb;
+      void*                     ctx;
+      uint64_t                  t_ns;      // When it was submitted
+      unsigned int              fpga_q;    // FPGA jobs in flight ahead of it
+      std::atomic<unsigned int> refs;      // One per path and one for m_fpga_order
+      std::atomic<bool>         done;
+      std::atomic<bool>         fpga_done; // FPGA reply routed
+      std::atomic<bool>         hedged;    // Also given to the CPU
+    } job_t;
+
+    zcash_fpga*       m_zfpga;
+    zcash_fpga_async* m_async;
+    zcash_fpga_pool*  m_pool;
+
+    std::unique_ptr<job_t[]> m_jobs;
+    std::vector<job_t*> m_free;
+    std::mutex m_free_lock;
+
+    std::atomic<unsigned int> m_in_flight;
+    std::atomic<unsigned int> m_fpga_in_flight;
+    std::atomic<unsigned int> m_cpu_in_flight;  // Queued or running on the CPU
+
+    // CPU verifier threads
+    std::vector<std::thread> m_threads;
+    std::deque<job_t*> m_cpu_queue;
+    std::mutex m_cpu_lock;
+    std::condition_variable m_cpu_cv;
+    bool m_stop;
+
+    // Jobs sent to the FPGA, oldest first, for hedging
+    std::deque<job_t*> m_fpga_order;
+    std::mutex m_order_lock;
+
+    // Path estimates, written under m_stat_lock
+    std::mutex m_stat_lock;
+    std::atomic<uint64_t> m_fpga_base_ns;
+    std::atomic<uint64_t> m_fpga_interval_ns;
+    std::atomic<uint64_t> m_cpu_verify_ns;
+    std::atomic<uint64_t> m_hedge_ns;
+    uint64_t m_last_fpga_ns;
+    bool m_fpga_busy;
+    uint32_t m_lat_hist[s_lat_buckets];
+    uint32_t m_lat_total;
+    uint32_t m_lat_since_update;
+    double m_hedge_pct;
+    double m_hedge_max_fraction;
+
+    std::atomic<uint64_t> m_stat_fpga_jobs;
+    std::atomic<uint64_t> m_stat_cpu_jobs;
+    std::atomic<uint64_t> m_stat_fpga_failed;
+    std::atomic<uint64_t> m_stat_hedged;
+    std::atomic<uint64_t> m_stat_hedge_wins;
+
+    void start(unsigned int cpu_threads);
+    bool fpga_capable() const;
+    bool prefer_fpga();
+    int submit_fpga(job_t* job);
+    void submit_cpu(job_t* job);
+    void pop_finished();
+    void reap_fpga_order();
+    job_t* hedge_candidate();
+    void finish(job_t* job, int rc, uint8_t bm, path_t path);
+    void unref(job_t* job);
+    void record_fpga(job_t* job, uint64_t t_ns);
+    void record_cpu(uint64_t verify_ns);
+    void cpu_thread();
+
+    static void fpga_reply(void* ctx, int rc, const uint8_t* rpl, unsigned int len);
+    static unsigned int lat_bucket(uint64_t ns);
+    static uint64_t lat_bucket_top(unsigned int bucket);
+
+}; // zcash_fpga_dispatch
+
+#endif // ZCASH_FPGA_DISPATCH_H_
@@ -0,0 +1,392 @@
+#include "zcash_fpga_expr.hpp"
+#include "zcash_fpga_log.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+// Ops the coprocessor can run with the result over their first operand
+static bool in_place_ok(zcash_fpga::bls12_381_code_t code) {
+  return code == zcash_fpga::ADD_ELEMENT || code == zcash_fpga::SUB_ELEMENT || code == zcash_fpga::MUL_ELEMENT ||
+         code == zcash_fpga::INV_ELEMENT || code == zcash_fpga::FINAL_EXP;
+}
+
+zcash_fpga_expr::zcash_fpga_expr() : m_error(false) {}
+
+zcash_fpga_expr* zcash_fpga_expr::value_t::expr(const value_t& b, const char* what) const {
+  zcash_fpga_expr* e = m_expr != nullptr ? m_expr : b.m_expr;
+  if (e == nullptr) zlog_error("zcash_fpga_expr: %s of two values without an expression\n", what);
+  return e;
+}
+
+zcash_fpga_expr::value_t zcash_fpga_expr::value_t::operator+(const value_t& b) const {
+  zcash_fpga_expr* e = expr(b, "add");
+  return e != nullptr ? e->add(*this, b) : value_t();
+}
+
+zcash_fpga_expr::value_t zcash_fpga_expr::value_t::operator-(const value_t& b) const {
+  zcash_fpga_expr* e = expr(b, "sub");
+  return e != nullptr ? e->sub(*this, b) : value_t();
+}
+
+zcash_fpga_expr::value_t zcash_fpga_expr::value_t::operator*(const value_t& b) const {
+  zcash_fpga_expr* e = expr(b, "mul");
+  return e != nullptr ? e->mul(*this, b) : value_t();
+}
+
+zcash_fpga::point_type_t zcash_fpga_expr::type(const value_t& v) const {
+  return m_nodes[v.m_id].pt;
+}
+
+bool zcash_fpga_expr::check(const value_t& v, const char* what) {
+  if (v.m_expr == this && v.m_id >= 0) return true;
+  zlog_error("zcash_fpga_expr: %s of a default value, a value from another expression or a failed operation\n", what);
+  m_error = true;
+  return false;
+}
+
+zcash_fpga_expr::value_t zcash_fpga_expr::constant(zcash_fpga::point_type_t pt, const uint8_t* dat) {
+  node_t n;
+  n.code = zcash_fpga::NOOP_WAIT;
+  n.pt = pt;
+  n.args[0] = n.args[1] = -1;
+  n.constant = m_constants.size();
+  n.fixed_slot = -1;
+  m_constants.push_back(std::vector<uint8_t>(dat, dat + zcash_fpga::bls12_381_point_type_size(pt) * 48));
+  m_nodes.push_back(n);
+  return value_t(this, m_nodes.size() - 1);
+}
+
+zcash_fpga_expr::value_t zcash_fpga_expr::slot(unsigned int slot, zcash_fpga::point_type_t pt) {
+  node_t n;
+  n.code = zcash_fpga::NOOP_WAIT;
+  n.pt = pt;
+  n.args[0] = n.args[1] = -1;
+  n.constant = -1;
+  n.fixed_slot = slot;
+  m_nodes.push_back(n);
+  return value_t(this, m_nodes.size() - 1);
+}
+
+zcash_fpga_expr::value_t zcash_fpga_expr::op(zcash_fpga::bls12_381_code_t code, zcash_fpga::point_type_t pt,
+                                             const value_t& a, const value_t& b) {
+  node_t n;
+  std::vector<int> key(3);
+  std::map<std::vector<int>, int>::const_iterator it;
+
+  n.code = code;
+  n.pt = pt;
+  n.args[0] = a.m_id;
+  n.args[1] = b.m_id;
+  n.constant = -1;
+  n.fixed_slot = -1;
+  // Commutative ops are keyed with their operands in order
+  if ((code == zcash_fpga::ADD_ELEMENT || code == zcash_fpga::MUL_ELEMENT) && n.args[1] < n.args[0])
+    std::swap(n.args[0], n.args[1]);
+
+  key[0] = code;
+  key[1] = n.args[0];
+  key[2] = n.args[1];
+  it = m_cse.find(key);
+  if (it != m_cse.end()) return value_t(this, it->second);
+
+  m_nodes.push_back(n);
+  m_cse[key] = m_nodes.size() - 1;
+  return value_t(this, m_nodes.size() - 1);
+}
+
+zcash_fpga_expr::value_t zcash_fpga_expr::add(const value_t& a, const value_t& b) {
+  if (!check(a, "add") || !check(b, "add")) return value_t();
+  if (type(a) != type(b) || (type(a) != zcash_fpga::FE && type(a) != zcash_fpga::FE2)) {
+    zlog_error("zcash_fpga_expr: add of point types %d and %d\n", type(a), type(b));
+    m_error = true;
+    return value_t();
+  }
+  return op(zcash_fpga::ADD_ELEMENT, type(a), a, b);
+}
+
+zcash_fpga_expr::value_t zcash_fpga_expr::sub(const value_t& a, const value_t& b) {
+  if (!check(a, "sub") || !check(b, "sub")) return value_t();
+  if (type(a) != type(b) || (type(a) != zcash_fpga::FE && type(a) != zcash_fpga::FE2)) {
+    zlog_error("zcash_fpga_expr: sub of point types %d and %d\n", type(a), type(b));
+    m_error = true;
+    return value_t();
+  }
+  return op(zcash_fpga::SUB_ELEMENT, type(a), a, b);
+}
+
+zcash_fpga_expr::value_t zcash_fpga_expr::mul(const value_t& a, const value_t& b) {
+  if (!check(a, "mul") || !check(b, "mul")) return value_t();
+  if (type(a) != type(b) || (type(a) != zcash_fpga::FE && type(a) != zcash_fpga::FE2 && type(a) != zcash_fpga::FE12)) {
+    zlog_error("zcash_fpga_expr: mul of point types %d and %d\n", type(a), type(b));
+    m_error = true;
+    return value_t();
+  }
+  return op(zcash_fpga::MUL_ELEMENT, type(a), a, b);
+}
+
+zcash_fpga_expr::value_t zcash_fpga_expr::inv(const value_t& a) {
+  if (!check(a, "inv")) return value_t();
+  if (type(a) != zcash_fpga::FE && type(a) != zcash_fpga::FE2) {
+    zlog_error("zcash_fpga_expr: inv of point type %d\n", type(a));
+    m_error = true;
+    return value_t();
+  }
+  return op(zcash_fpga::INV_ELEMENT, type(a), a, value_t());
+}
+
+zcash_fpga_expr::value_t zcash_fpga_expr::point_mult(const value_t& k, const value_t& p) {
+  if (!check(k, "point_mult") || !check(p, "point_mult")) return value_t();
+  if (type(k) != zcash_fpga::SCALAR || (type(p) != zcash_fpga::FP_AF && type(p) != zcash_fpga::FP2_AF)) {
+    zlog_error("zcash_fpga_expr: point_mult of point types %d and %d\n", type(k), type(p));
+    m_error = true;
+    return value_t();
+  }
+  return op(zcash_fpga::POINT_MULT, type(p) == zcash_fpga::FP_AF ? zcash_fpga::FP_JB : zcash_fpga::FP2_JB, k, p);
+}
+
+zcash_fpga_expr::value_t zcash_fpga_expr::miller_loop(const value_t& p, const value_t& q) {
+  if (!check(p, "miller_loop") || !check(q, "miller_loop")) return value_t();
+  if (type(p) != zcash_fpga::FP_AF || type(q) != zcash_fpga::FP2_AF) {
+    zlog_error("zcash_fpga_expr: miller_loop of point types %d and %d\n", type(p), type(q));
+    m_error = true;
+    return value_t();
+  }
+  return op(zcash_fpga::MILLER_LOOP, zcash_fpga::FE12, p, q);
+}
+
+zcash_fpga_expr::value_t zcash_fpga_expr::ate_pairing(const value_t& p, const value_t& q) {
+  if (!check(p, "ate_pairing") || !check(q, "ate_pairing")) return value_t();
+  if (type(p) != zcash_fpga::FP_AF || type(q) != zcash_fpga::FP2_AF) {
+    zlog_error("zcash_fpga_expr: ate_pairing of point types %d and %d\n", type(p), type(q));
+    m_error = true;
+    return value_t();
+  }
+  return op(zcash_fpga::ATE_PAIRING, zcash_fpga::FE12, p, q);
+}
+
+zcash_fpga_expr::value_t zcash_fpga_expr::final_exp(const value_t& f) {
+  if (!check(f, "final_exp")) return value_t();
+  if (type(f) != zcash_fpga::FE12) {
+    zlog_error("zcash_fpga_expr: final_exp of point type %d\n", type(f));
+    m_error = true;
+    return value_t();
+  }
+  return op(zcash_fpga::FINAL_EXP, zcash_fpga::FE12, f, value_t());
+}
+
+int zcash_fpga_expr::output(const value_t& v) {
+  if (!check(v, "output")) return -1;
+  if (m_outputs.size() > 0xFFFF) {
+    zlog_error("zcash_fpga_expr: more than 65536 outputs\n");
+    m_error = true;
+    return -1;
+  }
+  m_outputs.push_back(v.m_id);
+  return m_outputs.size() - 1;
+}
+
+int zcash_fpga_expr::compile(program_t& prog, unsigned int first_slot, unsigned int last_slot) const {
+  const unsigned int none = ~0U;
+  std::vector<int> order, stack;
+  std::vector<uint8_t> state(m_nodes.size(), 0);   // 0 unvisited, 1 on the stack, 2 ordered
+  std::vector<unsigned int> last_use(m_nodes.size(), none), slot(m_nodes.size(), none);
+  std::vector<std::vector<unsigned int> > sends(m_nodes.size());
+  std::vector<bool> used(last_slot > first_slot ? last_slot - first_slot : 0, false);
+  unsigned int live = 0;
+  zcash_fpga::bls12_381_inst_t inst;
+
+  prog.code.clear();
+  prog.constants.clear();
+  prog.outputs.clear();
+  prog.slots_used = 0;
+
+  if (m_error) {
+    zlog_error("zcash_fpga_expr: not compiling after an error building the expression\n");
+    return 1;
+  }
+
+  // Post order from the outputs, nodes nothing depends on are never visited
+  for (unsigned int i = 0; i < m_outputs.size(); i++) {
+    stack.push_back(m_outputs[i]);
+    while (!stack.empty()) {
+      int n = stack.back();
+      if (state[n] == 2) {
+        stack.pop_back();
+        continue;
+      }
+      if (state[n] == 0) {
+        state[n] = 1;
+        for (int j = 1; j >= 0; j--)
+          if (m_nodes[n].args[j] >= 0 && state[m_nodes[n].args[j]] == 0) stack.push_back(m_nodes[n].args[j]);
+        continue;
+      }
+      state[n] = 2;
+      order.push_back(n);
+      stack.pop_back();
+    }
+    sends[m_outputs[i]].push_back(i);
+    prog.outputs.push_back(m_nodes[m_outputs[i]].pt);
+  }
+
+  // Position of the last instruction reading each node, an output is read by its interrupt
+  for (unsigned int pos = 0; pos < order.size(); pos++) {
+    const node_t& n = m_nodes[order[pos]];
+    for (int j = 0; j < 2; j++)
+      if (n.args[j] >= 0) last_use[n.args[j]] = pos;
+    if (!sends[order[pos]].empty() && last_use[order[pos]] == none) last_use[order[pos]] = pos;
+  }
+
+  for (unsigned int pos = 0; pos < order.size(); pos++) {
+    if (m_nodes[order[pos]].fixed_slot < 0) continue;
+    if ((unsigned int)m_nodes[order[pos]].fixed_slot + zcash_fpga::bls12_381_point_type_size(m_nodes[order[pos]].pt) > first_slot &&
+        (unsigned int)m_nodes[order[pos]].fixed_slot < last_slot) {
+      zlog_error("zcash_fpga_expr: input slot %d is inside the program's slots %d to %d\n",
+                 m_nodes[order[pos]].fixed_slot, first_slot, last_slot - 1);
+      return 1;
+    }
+  }
+
+  // First fit over the slot range, values need consecutive slots
+  auto alloc = [&](unsigned int size) -> unsigned int {
+    for (unsigned int s = 0; s + size <= used.size(); s++) {
+      unsigned int k = 0;
+      while (k < size && !used[s + k]) k++;
+      if (k == size) {
+        std::fill(used.begin() + s, used.begin() + s + size, true);
+        live += size;
+        prog.slots_used = std::max(prog.slots_used, live);
+        return first_slot + s;
+      }
+      s += k;
+    }
+    return none;
+  };
+  auto release = [&](int n) {
+    if (m_nodes[n].fixed_slot >= 0 || slot[n] == none) return;
+    unsigned int size = zcash_fpga::bls12_381_point_type_size(m_nodes[n].pt);
+    std::fill(used.begin() + (slot[n] - first_slot), used.begin() + (slot[n] - first_slot) + size, false);
+    live -= size;
+  };
+  auto send = [&](int n) {
+    for (unsigned int i = 0; i < sends[n].size(); i++) {
+      memset(&inst, 0, sizeof(inst));
+      inst.code = zcash_fpga::SEND_INTERRUPT;
+      inst.a = slot[n];
+      inst.b = sends[n][i];
+      prog.code.push_back(inst);
+    }
+  };
+
+  // Constants and inputs are in place before the program starts
+  for (unsigned int pos = 0; pos < order.size(); pos++) {
+    int n = order[pos];
+    if (m_nodes[n].code != zcash_fpga::NOOP_WAIT) continue;
+    if (m_nodes[n].fixed_slot >= 0) {
+      slot[n] = m_nodes[n].fixed_slot;
+    } else {
+      constant_t c;
+      slot[n] = alloc(zcash_fpga::bls12_381_point_type_size(m_nodes[n].pt));
+      if (slot[n] == none) goto full;
+      c.slot = slot[n];
+      c.point_type = m_nodes[n].pt;
+      c.dat = m_constants[m_nodes[n].constant];
+      prog.constants.push_back(c);
+    }
+    send(n);
+  }
+  for (unsigned int pos = 0; pos < order.size(); pos++) {
+    int n = order[pos];
+    if (m_nodes[n].code == zcash_fpga::NOOP_WAIT && last_use[n] == pos) release(n);
+  }
+
+  for (unsigned int pos = 0; pos < order.size(); pos++) {
+    int n = order[pos];
+    const node_t& node = m_nodes[n];
+    int a = node.args[0], b = node.args[1];
+    bool in_place;
+    if (node.code == zcash_fpga::NOOP_WAIT) continue;
+
+    // Reuse the first operand's slots if it dies here, for commutative ops either one
+    if ((node.code == zcash_fpga::ADD_ELEMENT || node.code == zcash_fpga::MUL_ELEMENT) && b >= 0 &&
+        last_use[b] == pos && m_nodes[b].fixed_slot < 0 && !(last_use[a] == pos && m_nodes[a].fixed_slot < 0))
+      std::swap(a, b);
+    in_place = in_place_ok(node.code) && a != b && last_use[a] == pos && m_nodes[a].fixed_slot < 0 &&
+               m_nodes[a].pt == node.pt;
+    if (in_place) {
+      slot[n] = slot[a];
+    } else {
+      slot[n] = alloc(zcash_fpga::bls12_381_point_type_size(node.pt));
+      if (slot[n] == none) goto full;
+    }
+
+    memset(&inst, 0, sizeof(inst));
+    inst.code = node.code;
+    inst.a = slot[a];
+    if (node.code == zcash_fpga::INV_ELEMENT || node.code == zcash_fpga::FINAL_EXP) {
+      inst.b = slot[n];
+    } else {
+      inst.b = slot[b];
+      inst.c = slot[n];
+    }
+    prog.code.push_back(inst);
+
+    if (!in_place && last_use[a] == pos) release(a);
+    if (b >= 0 && b != a && last_use[b] == pos) release(b);
+    send(n);
+    if (last_use[n] == pos) release(n);
+  }
+
+  memset(&inst, 0, sizeof(inst));
+  inst.code = zcash_fpga::NOOP_WAIT;
+  prog.code.push_back(inst);
+  return 0;
+
+  full:
+    zlog_error("zcash_fpga_expr: values do not fit in data slots %d to %d\n", first_slot, last_slot - 1);
+    return 1;
+}
+
+int zcash_fpga_expr::run(zcash_fpga& zfpga, zcash_fpga_programs& progs, const program_t& prog,
+                         std::vector<std::vector<uint8_t> >& results) {
+  int rc = 0, read_len;
+  unsigned int received = 0;
+  char name[32];
+  uint8_t reply[STREAM_MAX_RPL_BYTES];
+  zcash_fpga::bls12_381_interrupt_rpl_t* rpl = (zcash_fpga::bls12_381_interrupt_rpl_t*)reply;
+
+  for (unsigned int i = 0; i < prog.constants.size(); i++) {
+    const constant_t& c = prog.constants[i];
+    rc = zfpga.bls12_381_set_data_slots(c.slot, c.dat.data(), c.dat.size() / 48, c.point_type);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  }
+
+  // Programs are named by their code so a recompiled expression finds its resident copy
+  snprintf(name, sizeof(name), "expr_%016llx", (unsigned long long)zcash_fpga_programs::hash(0, prog.code));
+  if (!progs.contains(name)) {
+    rc = progs.add(name, prog.code);
+    fail_on(rc, out, "ERROR: Unable to register the program, the registry may be full!\n");
+  }
+  rc = progs.launch(name);
+  fail_on(rc, out, "ERROR: Unable to start the program!\n");
+
+  results.assign(prog.outputs.size(), std::vector<uint8_t>());
+  while (received < prog.outputs.size()) {
+    read_len = zfpga.read_stream_wait(reply, sizeof(reply), zcash_fpga::BLS12_381_INTERRUPT_RPL);
+    if (read_len <= 0) {
+      zlog_error("zcash_fpga_expr: no interrupt, %d of %lu outputs received\n", received, (unsigned long)prog.outputs.size());
+      goto out;
+    }
+    if (rpl->hdr.cmd != zcash_fpga::BLS12_381_INTERRUPT_RPL || (unsigned int)read_len < sizeof(*rpl) ||
+        rpl->index >= prog.outputs.size() || !results[rpl->index].empty()) {
+      zlog_warn("zcash_fpga_expr: dropping reply 0x%x while waiting for outputs\n", rpl->hdr.cmd);
+      continue;
+    }
+    results[rpl->index].assign(reply + sizeof(*rpl), reply + read_len);
+    received++;
+  }
+  return 0;
+  out:
+    return 1;
+}
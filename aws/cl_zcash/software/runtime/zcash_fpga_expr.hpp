@@ -0,0 +1,154 @@
+//
+//  ZCash FPGA library BLS12_381 expression compiler.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_EXPR_H_   /* Include guard */
+#define ZCASH_FPGA_EXPR_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "zcash_fpga.hpp"
+#include "zcash_fpga_programs.hpp"
+
+/*
+ * Builds a graph of BLS12_381 coprocessor operations and compiles it into one program
+ * without jumps:
+ *
+ *   zcash_fpga_expr e;
+ *   zcash_fpga_expr::value_t p = e.constant(zcash_fpga::FP_AF, g1.dat[0]);
+ *   zcash_fpga_expr::value_t q = e.constant(zcash_fpga::FP2_AF, g2.dat[0]);
+ *   e.output(e.final_exp(e.miller_loop(p, q) * e.miller_loop(p, q)));
+ *   e.compile(prog, 16, 64);
+ *
+ * Identical operations on the same operands are built once, operations no output
+ * depends on are not emitted. Data slots are allocated from a range as values are
+ * computed and reused once their last user has run, an operation whose operand dies
+ * with it writes over it in place when the coprocessor allows it, so no COPY_REG is
+ * needed. Outputs are sent with SEND_INTERRUPT as soon as they are computed.
+ *
+ * Operand types follow the RTL: ADD / SUB on FE or FE2, MUL on FE, FE2 or FE12, INV on
+ * FE or FE2, POINT_MULT of a SCALAR and an FP_AF / FP2_AF point (giving FP_JB /
+ * FP2_JB), MILLER_LOOP / ATE_PAIRING of an FP_AF and FP2_AF point and FINAL_EXP, both
+ * giving FE12. A type error is logged and fails compile().
+ */
+class zcash_fpga_expr {
+
+  public:
+    class value_t {
+      public:
+        // A default constructed value belongs to no expression, the operators then give
+        // an invalid value and record the error in the other operand's expression
+        value_t() : m_expr(nullptr), m_id(-1) {}
+        value_t operator+(const value_t& b) const;
+        value_t operator-(const value_t& b) const;
+        value_t operator*(const value_t& b) const;
+        bool valid() const { return m_id >= 0; }
+
+      private:
+        friend class zcash_fpga_expr;
+        value_t(zcash_fpga_expr* expr, int id) : m_expr(expr), m_id(id) {}
+        zcash_fpga_expr* expr(const value_t& b, const char* what) const;
+        zcash_fpga_expr* m_expr;
+        int m_id;
+    };
+
+    typedef struct {
+      unsigned int slot;
+      zcash_fpga::point_type_t point_type;
+      std::vector<uint8_t> dat;   // 48 bytes per slot
+    } constant_t;
+
+    typedef struct {
+      std::vector<zcash_fpga::bls12_381_inst_t> code;  // Ends with NOOP_WAIT
+      std::vector<constant_t> constants;               // Written before each run
+      std::vector<zcash_fpga::point_type_t> outputs;   // Interrupt index i is output i
+      unsigned int slots_used;                         // Most data slots live at once
+    } program_t;
+
+    zcash_fpga_expr();
+
+    /*
+     * A value written to the program's data slots before it runs, dat is
+     * bls12_381_point_type_size(pt) * 48 bytes
+     */
+    value_t constant(zcash_fpga::point_type_t pt, const uint8_t* dat);
+
+    /*
+     * A value already in data slots from slot, read but never written by the program.
+     * It must be outside the range given to compile().
+     */
+    value_t slot(unsigned int slot, zcash_fpga::point_type_t pt);
+
+    value_t add(const value_t& a, const value_t& b);
+    value_t sub(const value_t& a, const value_t& b);
+    value_t mul(const value_t& a, const value_t& b);
+    value_t inv(const value_t& a);
+    value_t point_mult(const value_t& k, const value_t& p);
+    value_t miller_loop(const value_t& p, const value_t& q);
+    value_t ate_pairing(const value_t& p, const value_t& q);
+    value_t final_exp(const value_t& f);
+
+    /*
+     * Sends v to the host when the program runs, returns its interrupt index
+     */
+    int output(const value_t& v);
+
+    /*
+     * Compiles every output into prog using data slots first_slot to last_slot - 1.
+     * Returns 0 on success or 1 on a type error or if the values do not fit.
+     */
+    int compile(program_t& prog, unsigned int first_slot, unsigned int last_slot) const;
+
+    /*
+     * Writes the constants, makes the code resident in progs (named by its hash) and
+     * runs it, results[i] is output i without point type bits. Returns 0 on success.
+     *
+     * Routines cannot be removed from a registry, so each distinct program keeps its
+     * instruction slots in progs. Callers running many different programs should give
+     * them a registry of their own and construct a fresh one over the same slots when
+     * run() fails for lack of room.
+     */
+    static int run(zcash_fpga& zfpga, zcash_fpga_programs& progs, const program_t& prog,
+                   std::vector<std::vector<uint8_t> >& results);
+
+  private:
+    typedef struct {
+      zcash_fpga::bls12_381_code_t code;   // NOOP_WAIT for a constant or fixed slot
+      zcash_fpga::point_type_t pt;
+      int args[2];
+      int constant;                        // Index in m_constants or -1
+      int fixed_slot;                      // Slot of a slot() value or -1
+    } node_t;
+
+    std::vector<node_t> m_nodes;
+    std::vector<std::vector<uint8_t> > m_constants;
+    std::map<std::vector<int>, int> m_cse;  // (code, args) to node
+    std::vector<int> m_outputs;
+    bool m_error;
+
+    value_t op(zcash_fpga::bls12_381_code_t code, zcash_fpga::point_type_t pt, const value_t& a, const value_t& b);
+    zcash_fpga::point_type_t type(const value_t& v) const;
+    bool check(const value_t& v, const char* what);
+
+}; // zcash_fpga_expr
+
+#endif // ZCASH_FPGA_EXPR_H_
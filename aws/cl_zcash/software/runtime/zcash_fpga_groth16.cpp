@@ -0,0 +1,381 @@
+#include "zcash_fpga_groth16.hpp"
+#include "zcash_fpga_bls12_381_code.hpp"
+#include "zcash_fpga_log.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/bn.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+// Data slots relative to first_slot
+static const unsigned int s_acc = 0;
+static const unsigned int s_tmp = 12;
+static const unsigned int s_flag = 24;
+static const unsigned int s_one = 25;
+static const unsigned int s_pm = 26;      // POINT_MULT result
+static const unsigned int s_t = 29;       // 7 FE temporaries
+static const unsigned int s_af = 36;      // Affine point for MILLER_LOOP
+static const unsigned int s_neg_off = 38; // -R, G1 affine
+static const unsigned int s_sum = 40;     // R + sum r_j * C_j, G1 jacobian
+static const unsigned int s_r_sum = 43;
+static const unsigned int s_tag = 44;     // SHA-256 of the key below, written last
+static const unsigned int s_alpha = 45;
+static const unsigned int s_beta = 47;
+static const unsigned int s_gamma = 51;
+static const unsigned int s_delta = 55;
+static const unsigned int s_ic = 59;
+
+// Per proof, relative to its first slot
+static const unsigned int s_proof_size = 9;
+static const unsigned int s_r = 0;
+static const unsigned int s_a = 1;
+static const unsigned int s_b = 3;
+static const unsigned int s_c = 7;
+
+static const unsigned int s_term_insts = 9;
+static const unsigned int s_proof_insts = s_term_insts + 24;  // The A term, then POINT_MULT and add of r * C
+static const unsigned int s_delta_insts = 26;                  // madd of -R, to affine, MILLER_LOOP and MUL
+
+// Interrupt indices
+static const unsigned int s_result = 0;
+static const unsigned int s_ack = 1;
+
+// Order of G1 / G2, scalars are reduced by it
+static const char* s_order = "73eda753299d7d483339d80809a1d80553bda402fffe5bfeffffffff00000001";
+static const char* s_p = "1a0111ea397fe69a4b1ba7b6434bacd764774b84f38512bf6730d2a0f6b0f6241eabfffeb153ffffb9feffffffffaaab";
+
+// -(x, y) of a G2 point, each coefficient of y is p - c unless it is 0
+static void g2_neg(bls12_381_g2_af_t& q) {
+  bls12_381_fe_t p;
+  p.set_hex(0, s_p);
+  for (unsigned int i = 2; i < 4; i++) {
+    uint8_t zero[48] = {0};
+    unsigned int borrow = 0;
+    if (memcmp(q.dat[i], zero, 48) == 0) continue;
+    for (unsigned int j = 0; j < 48; j++) {
+      unsigned int d = p.dat[0][j] - q.dat[i][j] - borrow;
+      q.dat[i][j] = d;
+      borrow = (d >> 8) & 1;
+    }
+  }
+}
+
+zcash_fpga_groth16::zcash_fpga_groth16(zcash_fpga& zfpga, zcash_fpga_programs& progs, const vk_t& vk,
+                                       unsigned int first_slot, unsigned int last_slot, unsigned int max_proofs) :
+  m_zfpga(zfpga),
+  m_progs(progs),
+  m_vk(vk),
+  m_inputs(vk.ic.empty() ? 0 : vk.ic.size() - 1),
+  m_first(first_slot),
+  m_proofs(first_slot + s_ic + 4*m_inputs + 2) {
+  char name[64];
+  unsigned int fit = 0, insts, tail;
+
+  g2_neg(m_vk.beta);
+  g2_neg(m_vk.gamma);
+  g2_neg(m_vk.delta);
+  memset(&m_stats, 0, sizeof(m_stats));
+
+  // The tag names the prepared key, so a key that differs anywhere is rewritten
+  std::vector<uint8_t> key;
+  key.insert(key.end(), &m_vk.alpha.dat[0][0], &m_vk.alpha.dat[0][0] + sizeof(m_vk.alpha.dat));
+  key.insert(key.end(), &m_vk.beta.dat[0][0], &m_vk.beta.dat[0][0] + sizeof(m_vk.beta.dat));
+  key.insert(key.end(), &m_vk.gamma.dat[0][0], &m_vk.gamma.dat[0][0] + sizeof(m_vk.gamma.dat));
+  key.insert(key.end(), &m_vk.delta.dat[0][0], &m_vk.delta.dat[0][0] + sizeof(m_vk.delta.dat));
+  for (unsigned int i = 0; i < m_vk.ic.size(); i++)
+    key.insert(key.end(), &m_vk.ic[i].dat[0][0], &m_vk.ic[i].dat[0][0] + sizeof(m_vk.ic[i].dat));
+  SHA256(key.data(), key.size(), m_tag.dat[0]);
+
+  if (last_slot == 0 || last_slot > zfpga.bls12_381_get_data_size())
+    last_slot = zfpga.bls12_381_get_data_size();
+  if (last_slot > m_proofs) fit = (last_slot - m_proofs) / s_proof_size;
+  // Flag jump, the delta side, alpha and IC_0 terms, n guarded terms, FINAL_EXP and the two interrupts
+  tail = 1 + s_delta_insts + 2*s_term_insts + m_inputs*(s_term_insts + 1) + 5;
+  insts = progs.get_free_slots();
+  if (insts < tail + s_proof_insts * fit) fit = insts > tail ? (insts - tail) / s_proof_insts : 0;
+  m_max_proofs = (max_proofs != 0 && max_proofs < fit) ? max_proofs : fit;
+  if (vk.ic.empty()) m_max_proofs = 0;
+  if (m_max_proofs == 0) {
+    zlog_error("zcash_fpga_groth16: no room for a proof with %d inputs from data slot %d and %d instruction slots\n",
+               m_inputs, first_slot, insts);
+    return;
+  }
+
+  // Registered now so routines added later cannot take the slots it was sized for
+  snprintf(name, sizeof(name), "groth16_%u_%u_%u", m_first, m_inputs, m_max_proofs);
+  m_name = name;
+  if (!progs.contains(m_name)) {
+    std::vector<zcash_fpga::bls12_381_inst_t> code;
+    build(code);
+    if (progs.add(m_name, code) != 0) {
+      zlog_error("zcash_fpga_groth16: unable to register %s\n", name);
+      m_max_proofs = 0;
+    }
+  }
+}
+
+// r * P converted to affine, then one MILLER_LOOP into the accumulator
+void zcash_fpga_groth16::term(std::vector<zcash_fpga::bls12_381_inst_t>& code, unsigned int scalar, unsigned int g1,
+                              unsigned int g2) const {
+  const unsigned int pm = m_first + s_pm, af = m_first + s_af;
+  bls12_381_emit(code, zcash_fpga::POINT_MULT, scalar, g1, pm);
+  bls12_381_to_affine(code, 1, pm, af, m_first + s_one, m_first + s_t);
+  bls12_381_emit(code, zcash_fpga::MILLER_LOOP, af, g2, m_first + s_tmp);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, m_first + s_acc, m_first + s_tmp, m_first + s_acc);
+}
+
+// The routine for m_max_proofs proofs, entered s_proof_insts per proof before the
+// public input terms
+void zcash_fpga_groth16::build(std::vector<zcash_fpga::bls12_381_inst_t>& code) const {
+  const unsigned int sums_slot = m_first + s_ic + 2*(m_inputs + 1), skip_slot = sums_slot + m_inputs;
+  const unsigned int sum = m_first + s_sum, pm = m_first + s_pm, t = m_first + s_t;
+  unsigned int jump;
+  for (unsigned int j = 0; j < m_max_proofs; j++) {
+    unsigned int proof = m_proofs + s_proof_size*j;
+    term(code, proof + s_r, proof + s_a, proof + s_b);
+    bls12_381_emit(code, zcash_fpga::POINT_MULT, proof + s_r, proof + s_c, pm);
+    bls12_381_add(code, 1, sum, pm, t);
+  }
+  // A non zero flag means more chunks follow, it is cleared by the jump
+  jump = code.size();
+  bls12_381_emit(code, zcash_fpga::JUMP_NONZERO_SUB, 0, m_first + s_flag, 0);
+  // e(sum r_j * C_j, -delta) as one MILLER_LOOP
+  bls12_381_madd(code, 1, sum, m_first + s_neg_off, t);
+  bls12_381_to_affine(code, 1, sum, m_first + s_af, m_first + s_one, t);
+  bls12_381_emit(code, zcash_fpga::MILLER_LOOP, m_first + s_af, m_first + s_delta, m_first + s_tmp);
+  bls12_381_emit(code, zcash_fpga::MUL_ELEMENT, m_first + s_acc, m_first + s_tmp, m_first + s_acc);
+  term(code, m_first + s_r_sum, m_first + s_alpha, m_first + s_beta);
+  term(code, m_first + s_r_sum, m_first + s_ic, m_first + s_gamma);
+  // S_i of 0 would give the point at infinity, the term is skipped instead
+  for (unsigned int i = 0; i < m_inputs; i++) {
+    unsigned int skip = code.size();
+    bls12_381_emit(code, zcash_fpga::JUMP_NONZERO_SUB, 0, skip_slot + i, 0);
+    term(code, sums_slot + i, m_first + s_ic + 2*(i + 1), m_first + s_gamma);
+    code[skip].a = code.size();
+  }
+  bls12_381_emit(code, zcash_fpga::FINAL_EXP, m_first + s_acc, m_first + s_acc, 0);
+  bls12_381_emit(code, zcash_fpga::SEND_INTERRUPT, m_first + s_acc, s_result, 0);
+  bls12_381_emit(code, zcash_fpga::NOOP_WAIT, 0, 0, 0);
+  code[jump].a = code.size();
+  bls12_381_emit(code, zcash_fpga::SEND_INTERRUPT, m_first + s_flag, s_ack, 0);
+  bls12_381_emit(code, zcash_fpga::NOOP_WAIT, 0, 0, 0);
+}
+
+int zcash_fpga_groth16::load_vk() {
+  int rc = 0;
+  bls12_381_scalar_t tag, none;
+  bls12_381_fe_t one;
+
+  if (tag.load(m_zfpga, m_first + s_tag) == 0 && memcmp(tag.dat, m_tag.dat, sizeof(tag.dat)) == 0)
+    return 0;
+
+  // The tag is cleared first so a key only partly written is never taken as resident
+  zlog_debug("zcash_fpga_groth16: writing the verifying key to data slot %d\n", m_first + s_alpha);
+  rc = none.store(m_zfpga, m_first + s_tag);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  one.dat[0][0] = 1;
+  rc = one.store(m_zfpga, m_first + s_one);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  for (unsigned int i = 0; i <= m_inputs; i++) {
+    rc = m_vk.ic[i].store(m_zfpga, m_first + s_ic + 2*i);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  }
+  rc = m_vk.alpha.store(m_zfpga, m_first + s_alpha);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  rc = m_vk.beta.store(m_zfpga, m_first + s_beta);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  rc = m_vk.gamma.store(m_zfpga, m_first + s_gamma);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  rc = m_vk.delta.store(m_zfpga, m_first + s_delta);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  rc = m_tag.store(m_zfpga, m_first + s_tag);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  m_stats.vk_uploads++;
+  return 0;
+  out:
+    return 1;
+}
+
+int zcash_fpga_groth16::chunk(const proof_t* proofs, const bls12_381_scalar_t* r, unsigned int k, bool first,
+                              const bls12_381_scalar_t* sums, bool& ok) {
+  int rc = 0, read_len;
+  unsigned int entry;
+  const unsigned int sums_slot = m_first + s_ic + 2*(m_inputs + 1), skip_slot = sums_slot + m_inputs;
+  uint8_t reply[STREAM_MAX_RPL_BYTES];
+  zcash_fpga::bls12_381_interrupt_rpl_t* rpl = (zcash_fpga::bls12_381_interrupt_rpl_t*)reply;
+  bls12_381_scalar_t flag;
+
+  if (first) {
+    bls12_381_fe12_t one;
+    one.dat[0][0] = 1;
+    rc = one.store(m_zfpga, m_first + s_acc);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+
+    // The C sum starts at R = s * g1 for a random s so no addition sees the point at
+    // infinity or a doubling, the tail adds -R back
+    bls12_381_scalar_t s;
+    bls12_381_g1_af_t off;
+    bls12_381_g1_jb_t sum;
+    if (RAND_bytes(s.dat[0], 16) != 1) {
+      zlog_error("zcash_fpga_groth16: RAND_bytes failed\n");
+      goto out;
+    }
+    s.dat[0][0] |= 1;
+    m_cpu.point_mult(s, zcash_bls12_381_cpu::g1_generator(), off);
+    memcpy(sum.dat, off.dat, sizeof(off.dat));
+    sum.dat[2][0] = 1;
+    rc = sum.store(m_zfpga, m_first + s_sum);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    zcash_bls12_381_cpu::g1_neg(off);
+    rc = off.store(m_zfpga, m_first + s_neg_off);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  }
+  for (unsigned int i = 0; i < k; i++) {
+    unsigned int proof = m_proofs + s_proof_size*(m_max_proofs - k + i);
+    rc = r[i].store(m_zfpga, proof + s_r);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    rc = proofs[i].a.store(m_zfpga, proof + s_a);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    rc = proofs[i].b.store(m_zfpga, proof + s_b);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    rc = proofs[i].c.store(m_zfpga, proof + s_c);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  }
+  if (sums) {
+    uint8_t zero[48] = {0};
+    rc = sums[0].store(m_zfpga, m_first + s_r_sum);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    for (unsigned int i = 0; i < m_inputs; i++) {
+      bls12_381_scalar_t skip;
+      skip.dat[0][0] = memcmp(sums[i + 1].dat[0], zero, 48) == 0;
+      rc = sums[i + 1].store(m_zfpga, sums_slot + i);
+      fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+      rc = skip.store(m_zfpga, skip_slot + i);
+      fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    }
+  }
+  flag.dat[0][0] = sums ? 0 : 1;
+  rc = flag.store(m_zfpga, m_first + s_flag);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+
+  rc = m_progs.load(m_name, entry);
+  fail_on(rc, out, "ERROR: Unable to load the program!\n");
+  rc = m_zfpga.bls12_381_set_curr_inst_slot(entry + s_proof_insts*(m_max_proofs - k));
+  fail_on(rc, out, "ERROR: Unable to start the program!\n");
+  m_stats.proofs += k;
+
+  read_len = m_zfpga.read_stream_wait(reply, sizeof(reply), zcash_fpga::BLS12_381_INTERRUPT_RPL);
+  if (read_len <= 0) {
+    zlog_error("zcash_fpga_groth16: no interrupt after %d proofs\n", k);
+    goto out;
+  }
+  if (rpl->index != (sums ? s_result : s_ack)) {
+    zlog_error("zcash_fpga_groth16: unexpected interrupt index %d\n", rpl->index);
+    goto out;
+  }
+  if (sums) {
+    bls12_381_fe12_t id;
+    id.dat[0][0] = 1;
+    if ((unsigned int)read_len < sizeof(*rpl) + sizeof(id.dat)) {
+      zlog_error("zcash_fpga_groth16: result of %d bytes is not an FE12\n", read_len);
+      goto out;
+    }
+    ok = memcmp(reply + sizeof(*rpl), id.dat, sizeof(id.dat)) == 0;
+  }
+  return 0;
+  out:
+    return 1;
+}
+
+int zcash_fpga_groth16::check(const proof_t* proofs, unsigned int n, bool& ok) {
+  int rc = 0;
+  unsigned int done = 0, k;
+  std::vector<bls12_381_scalar_t> r(n), sums(m_inputs + 1);
+  BN_CTX* ctx = NULL;
+  BIGNUM *order = NULL, *x = NULL, *y = NULL;
+  std::vector<BIGNUM*> acc(m_inputs + 1, (BIGNUM*)NULL);
+
+  ok = true;
+  if (n == 0) return 0;
+  if (m_max_proofs == 0) return 1;
+  for (unsigned int j = 0; j < n; j++) {
+    if (proofs[j].inputs.size() != m_inputs) {
+      zlog_error("zcash_fpga_groth16: proof with %lu inputs, the key has %d\n", (unsigned long)proofs[j].inputs.size(),
+                 m_inputs);
+      return 1;
+    }
+  }
+
+  // R = sum r_j and S_i = sum r_j * x_j,i mod the order
+  ctx = BN_CTX_new();
+  order = BN_new();
+  x = BN_new();
+  y = BN_new();
+  if (ctx == NULL || order == NULL || x == NULL || y == NULL || BN_hex2bn(&order, s_order) == 0) goto fail;
+  for (unsigned int i = 0; i <= m_inputs; i++)
+    if ((acc[i] = BN_new()) == NULL) goto fail;
+  for (unsigned int j = 0; j < n; j++) {
+    // Non zero, the top bits stay clear so r is below the order
+    if (RAND_bytes(r[j].dat[0], 16) != 1) goto fail;
+    r[j].dat[0][0] |= 1;
+    if (BN_lebin2bn(r[j].dat[0], 16, x) == NULL || BN_mod_add(acc[0], acc[0], x, order, ctx) != 1) goto fail;
+    for (unsigned int i = 0; i < m_inputs; i++) {
+      if (BN_lebin2bn(proofs[j].inputs[i].dat[0], 48, y) == NULL || BN_mod_mul(y, y, x, order, ctx) != 1 ||
+          BN_mod_add(acc[i + 1], acc[i + 1], y, order, ctx) != 1)
+        goto fail;
+    }
+  }
+  for (unsigned int i = 0; i <= m_inputs; i++)
+    if (BN_bn2lebinpad(acc[i], sums[i].dat[0], 48) != 48) goto fail;
+
+  rc = load_vk();
+  m_stats.checks++;
+  while (rc == 0 && done < n) {
+    k = n - done < m_max_proofs ? n - done : m_max_proofs;
+    rc = chunk(proofs + done, r.data() + done, k, done == 0, done + k == n ? sums.data() : nullptr, ok);
+    done += k;
+  }
+  goto out;
+
+  fail:
+    zlog_error("zcash_fpga_groth16: unable to compute the batch scalars\n");
+    rc = 1;
+  out:
+    for (unsigned int i = 0; i <= m_inputs; i++) BN_free(acc[i]);
+    BN_free(x);
+    BN_free(y);
+    BN_free(order);
+    BN_CTX_free(ctx);
+    return rc;
+}
+
+int zcash_fpga_groth16::bisect(const proof_t* proofs, unsigned int lo, unsigned int hi, bool known_bad,
+                               std::vector<bool>& valid, bool& all_valid) {
+  bool ok = false, left_valid, right_valid;
+  unsigned int mid;
+
+  if (!known_bad && check(proofs + lo, hi - lo, ok) != 0) return 1;
+  if (ok) {
+    for (unsigned int i = lo; i < hi; i++) valid[i] = true;
+    all_valid = true;
+    return 0;
+  }
+  all_valid = false;
+  if (hi - lo == 1) {
+    valid[lo] = false;
+    m_stats.invalid++;
+    return 0;
+  }
+  mid = lo + (hi - lo) / 2;
+  if (bisect(proofs, lo, mid, false, valid, left_valid) != 0) return 1;
+  return bisect(proofs, mid, hi, left_valid, valid, right_valid);
+}
+
+int zcash_fpga_groth16::verify(const proof_t* proofs, unsigned int n, std::vector<bool>& valid) {
+  bool all_valid;
+  valid.assign(n, false);
+  if (n == 0) return 0;
+  return bisect(proofs, 0, n, false, valid, all_valid);
+}
@@ -0,0 +1,140 @@
+//
+//  ZCash FPGA library Groth16 batch verifier.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_GROTH16_H_   /* Include guard */
+#define ZCASH_FPGA_GROTH16_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "zcash_bls12_381_cpu.hpp"
+#include "zcash_fpga.hpp"
+#include "zcash_fpga_bls12_381.hpp"
+#include "zcash_fpga_programs.hpp"
+
+/*
+ * Verifies batches of Groth16 proofs over BLS12_381 (e.g. Sapling spend and output
+ * proofs) against one verifying key. A proof (A, B, C) with public inputs x_1..x_n is
+ * valid when e(A, B) == e(alpha, beta) * e(L, gamma) * e(C, delta) with
+ * L = IC_0 + sum_i x_i * IC_i. With random 128 bit r_j drawn on the host, a batch is
+ * accepted when
+ *
+ *   prod_j e(r_j * A_j, B_j) * e(r_j * C_j, -delta)
+ *     * e(R * alpha, -beta) * e(R * IC_0, -gamma) * prod_i e(S_i * IC_i, -gamma) == 1
+ *
+ * where R = sum_j r_j and S_i = sum_j r_j * x_j,i are reduced mod the group order on the
+ * host, so the public input terms cost n + 2 Miller loops per batch rather than per
+ * proof. The C terms are one e(sum_j r_j * C_j, -delta): each r_j * C_j is a POINT_MULT
+ * added into a G1 jacobian sum with element ops (zcash_fpga_bls12_381_code), started at
+ * a random R = s * g1 from the host like zcash_fpga_bls_batch and converted to affine
+ * once. A batch of m proofs costs m + n + 3 Miller loops, all into one FE12 accumulator
+ * with a single FINAL_EXP. r_j * A_j is a POINT_MULT converted back to affine.
+ *
+ * A, B and C must be on the curve and in the prime order subgroup, as when a proof is
+ * parsed in Zcash, and so must the key. Neither the FPGA nor this class checks them,
+ * and a point of small order can make the combination accept an invalid proof.
+ *
+ * The prepared key (alpha, -beta, -gamma, -delta and IC) stays resident in data slots
+ * under a tag slot holding its SHA-256. The tag is cleared before the key is written
+ * and set after, and each batch reads it back and rewrites the key when it differs. A
+ * routine that overwrites key slots but not the tag is not detected, so keep other
+ * routines out of the key's slots. The routine is a chain of max_proofs blocks entered
+ * k blocks from its end followed by the public input terms, which only the last chunk
+ * of a batch runs. Failing batches are bisected like zcash_fpga_bls_batch.
+ *
+ * Data slots from first_slot: the FE12 accumulator (12), the temporary (12), the flag,
+ * one as FE, the POINT_MULT result (3), seven FE temporaries, the affine point (2), -R
+ * (2), the C sum (3), R, the tag, the key (14 + 2 * (n + 1)), S_1..S_n, n skip flags,
+ * then 9 per proof (r, A, B, C).
+ */
+class zcash_fpga_groth16 {
+
+  public:
+    typedef struct {
+      bls12_381_g1_af_t alpha;
+      bls12_381_g2_af_t beta;
+      bls12_381_g2_af_t gamma;
+      bls12_381_g2_af_t delta;
+      std::vector<bls12_381_g1_af_t> ic;   // n + 1 points for n public inputs
+    } vk_t;
+
+    // Points on the curve and in the subgroup, see above
+    typedef struct {
+      bls12_381_g1_af_t a;
+      bls12_381_g2_af_t b;
+      bls12_381_g1_af_t c;
+      std::vector<bls12_381_scalar_t> inputs;  // n public inputs, little endian mod r
+    } proof_t;
+
+    typedef struct {
+      uint64_t checks;      // Batches checked on the FPGA, including bisection
+      uint64_t proofs;      // Proofs weighted on the FPGA
+      uint64_t invalid;     // Proofs found invalid
+      uint64_t vk_uploads;  // Times the prepared key was written
+    } stats_t;
+
+    /*
+     * Uses data slots first_slot to last_slot - 1 (last_slot of 0 is the end of data
+     * memory) and at most max_proofs proofs per chunk (0 for as many as fit in the data
+     * slots and the registry's free slots). The routine is registered in progs here.
+     */
+    zcash_fpga_groth16(zcash_fpga& zfpga, zcash_fpga_programs& progs, const vk_t& vk, unsigned int first_slot = 0,
+                       unsigned int last_slot = 0, unsigned int max_proofs = 0);
+
+    /*
+     * Sets valid[i] for each of the n proofs. Returns 0 on success or 1 if the FPGA could
+     * not be used or a proof has the wrong number of inputs.
+     */
+    int verify(const proof_t* proofs, unsigned int n, std::vector<bool>& valid);
+
+    /*
+     * One random linear combination check of all n proofs without bisection.
+     */
+    int check(const proof_t* proofs, unsigned int n, bool& ok);
+
+    unsigned int get_max_proofs() const { return m_max_proofs; }
+    stats_t get_stats() const { return m_stats; }
+
+  private:
+    zcash_fpga&          m_zfpga;
+    zcash_fpga_programs& m_progs;
+    vk_t                 m_vk;       // beta, gamma and delta negated
+    bls12_381_scalar_t   m_tag;      // SHA-256 of m_vk
+    unsigned int         m_inputs;
+    unsigned int         m_first;
+    unsigned int         m_proofs;   // First proof slot
+    unsigned int         m_max_proofs;
+    std::string          m_name;
+    stats_t              m_stats;
+    zcash_bls12_381_cpu  m_cpu;      // Computes R
+
+    void build(std::vector<zcash_fpga::bls12_381_inst_t>& code) const;
+    int load_vk();
+    int chunk(const proof_t* proofs, const bls12_381_scalar_t* r, unsigned int k, bool first,
+              const bls12_381_scalar_t* sums, bool& ok);
+    int bisect(const proof_t* proofs, unsigned int lo, unsigned int hi, bool known_bad, std::vector<bool>& valid,
+               bool& all_valid);
+    void term(std::vector<zcash_fpga::bls12_381_inst_t>& code, unsigned int scalar, unsigned int g1,
+              unsigned int g2) const;
+
+}; // zcash_fpga_groth16
+
+#endif // ZCASH_FPGA_GROTH16_H_
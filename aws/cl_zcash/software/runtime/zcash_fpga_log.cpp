@@ -0,0 +1,106 @@
+#include "zcash_fpga_log.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Set once the writer thread has been stopped (static destruction), after
+// which messages are written directly
+static std::atomic<bool> s_log_shutdown(false);
+
+static const char* level_prefix(int level) {
+  switch (level) {
+    case ZCASH_LOG_ERROR: return "ERROR: ";
+    case ZCASH_LOG_WARN:  return "WARNING: ";
+    case ZCASH_LOG_INFO:  return "INFO: ";
+    default:              return "DEBUG: ";
+  }
+}
+
+zcash_fpga_log::zcash_fpga_log() : m_enqueue_pos(0), m_dequeue_pos(0), m_dropped(0), m_stop(false) {
+  for (size_t i = 0; i < s_ring_size; i++)
+    m_ring[i].seq.store(i, std::memory_order_relaxed);
+  m_writer = std::thread(&zcash_fpga_log::writer_thread, this);
+}
+
+zcash_fpga_log::~zcash_fpga_log() {
+  m_stop.store(true, std::memory_order_release);
+  if (m_writer.joinable()) m_writer.join();
+  s_log_shutdown.store(true, std::memory_order_release);
+  if (m_dropped.load() != 0)
+    printf("WARNING: %lu log messages were dropped\n", (unsigned long)m_dropped.load());
+}
+
+zcash_fpga_log& zcash_fpga_log::get_instance() {
+  static zcash_fpga_log instance;
+  return instance;
+}
+
+void zcash_fpga_log::write(int level, const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  if (s_log_shutdown.load(std::memory_order_acquire)) {
+    fputs(level_prefix(level), stdout);
+    vprintf(fmt, args);
+  } else {
+    get_instance().enqueue(level, fmt, args);
+  }
+  va_end(args);
+}
+
+uint64_t zcash_fpga_log::dropped() {
+  return get_instance().m_dropped.load(std::memory_order_relaxed);
+}
+
+bool zcash_fpga_log::enqueue(int level, const char* fmt, va_list args) {
+  entry_t* entry;
+  size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+
+  for (;;) {
+    entry = &m_ring[pos & (s_ring_size - 1)];
+    size_t seq = entry->seq.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      m_dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+
+  size_t len = strlen(level_prefix(level));
+  memcpy(entry->msg, level_prefix(level), len);
+  vsnprintf(entry->msg + len, s_msg_bytes - len, fmt, args);
+  entry->seq.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool zcash_fpga_log::dequeue(char* msg) {
+  entry_t* entry = &m_ring[m_dequeue_pos & (s_ring_size - 1)];
+  if (entry->seq.load(std::memory_order_acquire) != m_dequeue_pos + 1)
+    return false;
+  memcpy(msg, entry->msg, s_msg_bytes);
+  entry->seq.store(m_dequeue_pos + s_ring_size, std::memory_order_release);
+  m_dequeue_pos++;
+  return true;
+}
+
+void zcash_fpga_log::writer_thread() {
+  char msg[s_msg_bytes];
+  struct timespec idle = {0, 1000000};
+
+  for (;;) {
+    bool stop = m_stop.load(std::memory_order_acquire);
+    bool wrote = false;
+    while (dequeue(msg)) {
+      fputs(msg, stdout);
+      wrote = true;
+    }
+    if (wrote) fflush(stdout);
+    if (stop) break;
+    if (!wrote) nanosleep(&idle, NULL);
+  }
+}
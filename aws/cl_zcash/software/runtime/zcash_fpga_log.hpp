@@ -0,0 +1,94 @@
+//
+//  ZCash FPGA library logging.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_LOG_H_   /* Include guard */
+#define ZCASH_FPGA_LOG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+
+#include <atomic>
+#include <thread>
+
+#define ZCASH_LOG_ERROR 1
+#define ZCASH_LOG_WARN  2
+#define ZCASH_LOG_INFO  3
+#define ZCASH_LOG_DEBUG 4
+
+// Messages above this level are removed at compile time (arguments are not evaluated)
+#ifndef ZCASH_LOG_LEVEL
+#define ZCASH_LOG_LEVEL ZCASH_LOG_INFO
+#endif
+
+#define zlog(LEVEL, ...) \
+  do { if ((LEVEL) <= ZCASH_LOG_LEVEL) zcash_fpga_log::write(LEVEL, __VA_ARGS__); } while (0)
+
+#define zlog_error(...) zlog(ZCASH_LOG_ERROR, __VA_ARGS__)
+#define zlog_warn(...)  zlog(ZCASH_LOG_WARN,  __VA_ARGS__)
+#define zlog_info(...)  zlog(ZCASH_LOG_INFO,  __VA_ARGS__)
+#define zlog_debug(...) zlog(ZCASH_LOG_DEBUG, __VA_ARGS__)
+
+/*
+ * Messages are formatted by the caller into a slot of a bounded lock-free ring and
+ * written to stdout by a background thread, so logging never takes the stdout lock or
+ * blocks on I/O in the calling thread. When the ring is full the message is dropped
+ * and counted.
+ */
+class zcash_fpga_log {
+
+  public:
+    static const size_t s_ring_size = 1024;  // Must be a power of 2
+    static const size_t s_msg_bytes = 248;
+
+    static void write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+    /*
+     * Number of messages dropped because the ring was full
+     */
+    static uint64_t dropped();
+
+    zcash_fpga_log(zcash_fpga_log const&) = delete;
+    void operator=(zcash_fpga_log const&) = delete;
+
+  private:
+    typedef struct {
+      std::atomic<size_t> seq;
+      char                msg[s_msg_bytes];
+    } entry_t;
+
+    entry_t m_ring[s_ring_size];
+    std::atomic<size_t> m_enqueue_pos;
+    size_t m_dequeue_pos;
+
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<bool> m_stop;
+    std::thread m_writer;
+
+    static zcash_fpga_log& get_instance();
+    zcash_fpga_log();
+    ~zcash_fpga_log();
+
+    bool enqueue(int level, const char* fmt, va_list args);
+    bool dequeue(char* msg);
+    void writer_thread();
+
+}; // zcash_fpga_log
+
+#endif // ZCASH_FPGA_LOG_H_
@@ -0,0 +1,209 @@
+#include "zcash_fpga_loopback.hpp"
+#include "zcash_fpga_log.hpp"
+
+#include <string.h>
+#include <unistd.h>
+
+#define ISR_RC (1U << 26)
+#define ISR_TC (1U << 27)
+
+zcash_fpga_loopback::zcash_fpga_loopback(uint64_t cmd_cap, bool axi4) :
+  m_cmd_cap(cmd_cap),
+  m_axi4(axi4),
+  m_tx_depth(s_fifo_words),
+  m_isr(0x01D00000),  // Reset complete bits, as read after the FPGA is loaded
+  m_ier(0),
+  m_reply_fd(-1),
+  m_rx_offset(0) {
+  // BLS12_381 configuration registers as in bls12_381_axi_bridge.sv
+  m_regs[BLS12_381_OFFSET + 0x0] = 0x1000;  // INST_AXIL_START
+  m_regs[BLS12_381_OFFSET + 0x4] = 0x2000;  // DATA_AXIL_START
+  m_regs[BLS12_381_OFFSET + 0x8] = 8;       // log2 of data slots
+  m_regs[BLS12_381_OFFSET + 0xC] = 8;       // log2 of instruction slots
+}
+
+unsigned int zcash_fpga_loopback::tx_fifo_words() const {
+  return m_tx.size() / 4;
+}
+
+unsigned int zcash_fpga_loopback::rx_fifo_words() const {
+  unsigned int words = 0;
+  for (size_t i = 0; i < m_rx.size(); i++)
+    words += (m_rx[i].size() + 3) / 4;
+  return words - m_rx_offset / 4;
+}
+
+unsigned int zcash_fpga_loopback::rx_data_words() const {
+  unsigned int words = 0;
+  for (size_t i = 0; i < m_rx.size(); i++)
+    words += (m_rx[i].size() + word_bytes() - 1) / word_bytes();
+  return words - m_rx_offset / word_bytes();
+}
+
+int zcash_fpga_loopback::set_reply_fd(int fd) {
+  m_reply_fd = fd;
+  return 0;
+}
+
+void zcash_fpga_loopback::push_reply(const uint8_t* data, unsigned int len) {
+  uint64_t one = 1;
+  m_rx.push_back(std::vector<uint8_t>(data, data + len));
+  m_isr |= ISR_RC;
+  // The eventfd is non blocking and cannot realistically overflow, a failed write is a lost wake up
+  if (m_reply_fd >= 0 && write(m_reply_fd, &one, sizeof(one)) != sizeof(one))
+    zlog_warn("zcash_fpga_loopback: unable to post the reply eventfd\n");
+}
+
+void zcash_fpga_loopback::consume_rx(unsigned int bytes) {
+  m_rx_offset += bytes;
+  if (m_rx_offset >= m_rx.front().size()) {
+    m_rx.pop_front();
+    m_rx_offset = 0;
+  }
+}
+
+int zcash_fpga_loopback::peek(uint64_t offset, uint32_t* value) {
+  switch (offset) {
+    case AXI_FIFO_OFFSET + 0x0:  *value = m_isr; break;
+    case AXI_FIFO_OFFSET + 0x4:  *value = m_ier; break;
+    case AXI_FIFO_OFFSET + 0xC:  *value = m_tx_depth - tx_fifo_words(); break;    // TDFV
+    case AXI_FIFO_OFFSET + 0x1C: *value = rx_data_words(); break;                 // RDFO
+    case AXI_FIFO_OFFSET + 0x24: *value = m_rx.empty() ? 0 : m_rx.front().size(); break;  // RLR
+    case AXI_FIFO_OFFSET + 0x44: *value = m_axi4 ? (1U << 31) : 0; break;
+    case AXI_FIFO_OFFSET + 0x20: {  // RDFD
+      *value = 0;
+      if (m_rx.empty()) return 1;
+      const std::vector<uint8_t>& pkt = m_rx.front();
+      memcpy(value, &pkt[m_rx_offset], pkt.size() - m_rx_offset < 4 ? pkt.size() - m_rx_offset : 4);
+      consume_rx(4);
+      break;
+    }
+    default: {
+      std::map<uint64_t, uint32_t>::const_iterator it = m_regs.find(offset);
+      *value = it == m_regs.end() ? 0 : it->second;
+      break;
+    }
+  }
+  return 0;
+}
+
+int zcash_fpga_loopback::poke(uint64_t offset, uint32_t value) {
+  switch (offset) {
+    case AXI_FIFO_OFFSET + 0x0:  // ISR, write 1 to clear
+      m_isr &= ~value;
+      break;
+    case AXI_FIFO_OFFSET + 0x4:
+      m_ier = value;
+      break;
+    case AXI_FIFO_OFFSET + 0x10:  // TDFD
+      m_tx.insert(m_tx.end(), (uint8_t*)&value, (uint8_t*)&value + 4);
+      break;
+    case AXI_FIFO_OFFSET + 0x14:  // TLR, the packet is what was written to TDFD since the last TLR
+      if (value > m_tx.size()) {
+        zlog_error("zcash_fpga_loopback: TLR of %d bytes but only %d written\n", value, (unsigned int)m_tx.size());
+        m_tx.clear();
+        return 1;
+      }
+      handle_packet(m_tx.data(), value);
+      m_tx.clear();
+      m_isr |= ISR_TC;
+      break;
+    default:
+      m_regs[offset] = value;
+      break;
+  }
+  return 0;
+}
+
+int zcash_fpga_loopback::write_data(const uint8_t* data, unsigned int len) {
+  unsigned int padded = (len + word_bytes() - 1) & ~(word_bytes() - 1);
+  if (tx_fifo_words() + padded / 4 > m_tx_depth) {
+    zlog_error("zcash_fpga_loopback: transmit FIFO overflow\n");
+    return 1;
+  }
+  m_tx.insert(m_tx.end(), data, data + len);
+  m_tx.resize(m_tx.size() + padded - len, 0);
+  return 0;
+}
+
+int zcash_fpga_loopback::read_data(uint8_t* data, unsigned int len) {
+  if (m_rx.empty() || m_rx.front().size() - m_rx_offset < len) {
+    zlog_error("zcash_fpga_loopback: read of %d bytes past the end of the receive packet\n", len);
+    return 1;
+  }
+  memcpy(data, &m_rx.front()[m_rx_offset], len);
+  consume_rx((len + word_bytes() - 1) & ~(word_bytes() - 1));
+  return 0;
+}
+
+void zcash_fpga_loopback::handle_packet(const uint8_t* data, unsigned int len) {
+  std::vector<uint8_t> rpl;
+  make_reply(data, len, rpl);
+  push_reply(rpl.data(), rpl.size());
+}
+
+// Copies a reply struct into rpl
+template <class rpl_t>
+static inline void put_reply(const rpl_t& r, std::vector<uint8_t>& rpl) {
+  rpl.assign((const uint8_t*)&r, (const uint8_t*)&r + sizeof(r));
+}
+
+void zcash_fpga_loopback::make_reply(const uint8_t* data, unsigned int len, std::vector<uint8_t>& rpl) {
+  const zcash_fpga::header_t* hdr = (const zcash_fpga::header_t*)data;
+  uint64_t index = 0;
+
+  if (len >= sizeof(zcash_fpga::header_t) + sizeof(index))
+    memcpy(&index, data + sizeof(zcash_fpga::header_t), sizeof(index));
+
+  switch (hdr->cmd) {
+    case zcash_fpga::RESET_FPGA: {
+      zcash_fpga::fpga_reset_rpl_t r;
+      r.hdr.cmd = zcash_fpga::RESET_FPGA_RPL;
+      r.hdr.len = sizeof(r);
+      put_reply(r, rpl);
+      return;
+    }
+    case zcash_fpga::FPGA_STATUS: {
+      zcash_fpga::fpga_status_rpl_t r;
+      memset(&r, 0, sizeof(r));
+      r.hdr.cmd = zcash_fpga::FPGA_STATUS_RPL;
+      r.hdr.len = sizeof(r);
+      r.version = 0x010403;
+      r.cmd_cap = m_cmd_cap;
+      put_reply(r, rpl);
+      return;
+    }
+    case zcash_fpga::VERIFY_SECP256K1_SIG:
+      if ((m_cmd_cap & zcash_fpga::ENB_VERIFY_SECP256K1_SIG) != 0) {
+        zcash_fpga::verify_secp256k1_sig_rpl_t r;
+        memset(&r, 0, sizeof(r));
+        r.hdr.cmd = zcash_fpga::VERIFY_SECP256K1_SIG_RPL;
+        r.hdr.len = sizeof(r);
+        r.index = index;
+        put_reply(r, rpl);
+        return;
+      }
+      break;
+    case zcash_fpga::VERIFY_EQUIHASH:
+      if ((m_cmd_cap & (zcash_fpga::ENB_VERIFY_EQUIHASH_200_9 | zcash_fpga::ENB_VERIFY_EQUIHASH_144_5)) != 0) {
+        zcash_fpga::verify_equihash_rpl_t r;
+        memset(&r, 0, sizeof(r));
+        r.hdr.cmd = zcash_fpga::VERIFY_EQUIHASH_RPL;
+        r.hdr.len = sizeof(r);
+        r.index = index;
+        put_reply(r, rpl);
+        return;
+      }
+      break;
+    default:
+      break;
+  }
+
+  // Same as the FPGA for a command it does not support
+  zcash_fpga::fpga_ignore_rpl_t r;
+  r.hdr.cmd = zcash_fpga::FPGA_IGNORE_RPL;
+  r.hdr.len = sizeof(r);
+  r.ignore_hdr = 0;
+  memcpy(&r.ignore_hdr, data, len < sizeof(r.ignore_hdr) ? len : sizeof(r.ignore_hdr));
+  put_reply(r, rpl);
+}
@@ -0,0 +1,106 @@
+//
+//  ZCash FPGA library in-process loopback transport.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_LOOPBACK_H_   /* Include guard */
+#define ZCASH_FPGA_LOOPBACK_H_
+
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "zcash_fpga.hpp"
+#include "zcash_fpga_transport.hpp"
+
+/*
+ * Emulates the AXI FIFO register set (ISR, IER, TDFV, TDFD, TLR, RDFO, RDFD, RLR and the
+ * AXI4 mode bit) in memory so zcash_fpga runs without an FPGA:
+ *
+ *   zcash_fpga zfpga(new zcash_fpga_loopback(zcash_fpga::ENB_VERIFY_SECP256K1_SIG));
+ *
+ * Every packet committed with TLR is passed to handle_packet(). The default answers
+ * FPGA_STATUS and RESET_FPGA and replies to verify commands with a passing result, so
+ * the protocol logic can be tested and benchmarked but nothing is verified. Other
+ * registers read back the last value written. Not thread safe, like the FPGA itself it
+ * is only used from one thread at a time. The reply eventfd of NOTIFY_EVENTFD is posted
+ * as each reply is queued, standing in for the receive complete interrupt.
+ */
+class zcash_fpga_loopback : public zcash_fpga_transport {
+
+  public:
+    static const unsigned int s_fifo_words = 0x1FC;  // TDFV after reset
+
+    zcash_fpga_loopback(uint64_t cmd_cap, bool axi4 = true);
+    virtual ~zcash_fpga_loopback() {}
+
+    int peek(uint64_t offset, uint32_t* value);
+    int poke(uint64_t offset, uint32_t value);
+    int write_data(const uint8_t* data, unsigned int len);
+    int read_data(uint8_t* data, unsigned int len);
+    bool axi4() const { return m_axi4; }
+    int set_reply_fd(int fd);
+
+    uint64_t m_cmd_cap;
+
+  protected:
+    /*
+     * Called with every packet written to the transmit FIFO, the default queues the
+     * reply from make_reply() straight away
+     */
+    virtual void handle_packet(const uint8_t* data, unsigned int len);
+
+    /*
+     * The reply packet for a command
+     */
+    virtual void make_reply(const uint8_t* data, unsigned int len, std::vector<uint8_t>& rpl);
+
+    /*
+     * Queues a reply packet in the receive FIFO
+     */
+    void push_reply(const uint8_t* data, unsigned int len);
+
+    unsigned int word_bytes() const { return m_axi4 ? 8 : 4; }
+
+    // Words held in the transmit FIFO, the loopback consumes packets as soon as they
+    // are committed so this is only the packet being written
+    virtual unsigned int tx_fifo_words() const;
+    virtual unsigned int rx_fifo_words() const;
+
+    // RDFO, receive FIFO occupancy in words of the data interface (64 bit on AXI4)
+    unsigned int rx_data_words() const;
+
+    bool m_axi4;
+    unsigned int m_tx_depth;  // Transmit FIFO size in 32 bit words
+    uint32_t m_isr;
+    uint32_t m_ier;
+    int m_reply_fd;
+
+    std::vector<uint8_t> m_tx;
+    std::deque<std::vector<uint8_t> > m_rx;
+    unsigned int m_rx_offset;  // Bytes of m_rx.front() already read
+
+    std::map<uint64_t, uint32_t> m_regs;
+
+  private:
+    void consume_rx(unsigned int bytes);
+
+}; // zcash_fpga_loopback
+
+#endif // ZCASH_FPGA_LOOPBACK_H_
@@ -0,0 +1,503 @@
+#include "zcash_fpga_msm.hpp"
+#include "zcash_fpga_bls12_381_code.hpp"
+#include "zcash_fpga_log.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/bn.h>
+
+// Data slots relative to first_slot
+static const unsigned int s_cnt = 0;
+static const unsigned int s_rand = 1;   // x, y, z, t
+static const unsigned int s_gen = 5;
+
+// Jacobian points after the generator, in units of 3 elements
+static const unsigned int s_x = 0;      // Start of each bucket sum
+static const unsigned int s_y = 1;      // Start of the running sum
+static const unsigned int s_z = 2;      // Start of the window sum
+static const unsigned int s_total = 3;
+static const unsigned int s_acc = 4;    // Bucket sum
+static const unsigned int s_run = 5;
+static const unsigned int s_sum = 6;
+static const unsigned int s_pm = 7;     // POINT_MULT result
+static const unsigned int s_points = 8;
+static const unsigned int s_temps = 7;
+
+// Working and staging areas: skip, flag, mode, m scalars then m affine points
+static const unsigned int s_skip = 0;
+static const unsigned int s_flag = 1;
+static const unsigned int s_mode = 2;
+static const unsigned int s_area_ctl = 3;
+
+// Interrupt index
+static const unsigned int s_ack = 0;
+
+// Scalars are below the order, so below 2^255
+static const unsigned int s_scalar_bits = 255;
+
+// Cost model in jacobian additions, POINT_MULT in the FPGA is about 100 of them (the
+// same for G1 and G2) and a start of the routine about 2
+static const unsigned int s_mult_cost = 100;
+static const unsigned int s_launch_cost = 2;
+static const unsigned int s_max_window = 16;
+
+static const char* s_order = "73eda753299d7d483339d80809a1d80553bda402fffe5bfeffffffff00000001";
+static const char* s_g1[] = {
+  "17f1d3a73197d7942695638c4fa9ac0fc3688c4f9774b905a14e3a3f171bac586c55e83ff97a1aeffb3af00adb22c6bb",
+  "08b3f481e3aaa0f1a09e30ed741d8ae4fcf5e095d5d00af600db18cb2c04b3edd03cc744a2888ae40caa232946c5e7e1"};
+static const char* s_g2[] = {
+  "024aa2b2f08f0a91260805272dc51051c6e47ad4fa403b02b4510b647ae3d1770bac0326a805bbefd48056c8c121bdb8",
+  "13e02b6052719f607dacd3a088274f65596bd0d09920b61ab5da61bbdc7f5049334cf11213945d57e5ac7d055d042b7e",
+  "0ce5d527727d6e118cc9cdc6da2e351aadfd9baa8cbdd3a76d429a695160d12c923ac9cc3baca289e193548608b82801",
+  "0606c4a02ea734cc32acd2b02bc28b99cb3e287e85a763af267492ab572e99ab3f370d275cec1da1aaa9075ff05f79be"};
+
+zcash_fpga_msm::zcash_fpga_msm(zcash_fpga& zfpga, zcash_fpga_programs& progs, unsigned int first_slot,
+                               unsigned int last_slot, unsigned int max_points, groups_t groups) :
+  m_zfpga(zfpga),
+  m_progs(progs),
+  m_first(first_slot) {
+
+  if (last_slot == 0 || last_slot > zfpga.bls12_381_get_data_size())
+    last_slot = zfpga.bls12_381_get_data_size();
+  memset(&m_stats, 0, sizeof(m_stats));
+
+  // The same number of points per chunk for both groups, as many as fit the data slots
+  // and both routines the registry. When not even one point each fits only G1 is kept.
+  unsigned int m = fit(groups, last_slot, max_points);
+  if (m == 0 && groups == BOTH) {
+    groups = G1;
+    m = fit(groups, last_slot, max_points);
+    zlog_warn("zcash_fpga_msm: the G2 routine does not fit next to the G1 one, only G1 is available\n");
+  }
+  if (m == 0)
+    zlog_error("zcash_fpga_msm: no room for a point in data slots %d to %d and %d instruction slots\n", first_slot,
+               last_slot - 1, progs.get_free_slots());
+
+  // Both routines are registered now so neither can take the other's slots later
+  for (unsigned int g2 = 0; g2 < 2; g2++) {
+    group_t& g = m_group[g2];
+    std::vector<zcash_fpga::bls12_381_inst_t> code;
+    char name[64];
+    g.g2 = g2;
+    g.w = g2 ? 2 : 1;
+    layout(g, (groups & (g2 ? G2 : G1)) ? m : 0);
+    snprintf(name, sizeof(name), "msm_%s_%u_%u", g2 ? "g2" : "g1", m_first, g.m);
+    g.name = name;
+    if (g.m == 0) continue;
+    build(g, code);
+    if (m_progs.contains(g.name)) continue;
+    if (m_progs.add(g.name, code) != 0) {
+      zlog_error("zcash_fpga_msm: unable to register %s\n", name);
+      g.m = 0;
+    }
+  }
+}
+
+// Largest points per chunk for which the chosen groups fit, 0 if none
+unsigned int zcash_fpga_msm::fit(groups_t groups, unsigned int last_slot, unsigned int max_points) {
+  std::vector<zcash_fpga::bls12_381_inst_t> code;
+  unsigned int m = 0, inst, area;
+
+  while (max_points == 0 || m < max_points) {
+    inst = 0;
+    area = 0;
+    for (unsigned int g2 = 0; g2 < 2; g2++) {
+      group_t& g = m_group[g2];
+      if (!(groups & (g2 ? G2 : G1))) continue;
+      g.g2 = g2;
+      g.w = g2 ? 2 : 1;
+      layout(g, m + 1);
+      build(g, code);
+      inst += code.size() + 1;  // With its tag
+      if (g.work + 3*g.area > area) area = g.work + 3*g.area;
+    }
+    if (m_first + area > last_slot || inst > m_progs.get_free_slots() + 1) break;
+    m++;
+  }
+  return m;
+}
+
+void zcash_fpga_msm::layout(group_t& g, unsigned int m) const {
+  g.m = m;
+  g.work = s_gen + 2*g.w + 3*g.w*s_points + g.w*s_temps;
+  g.area = s_area_ctl + m + 2*g.w*m;
+}
+
+void zcash_fpga_msm::build(group_t& g, std::vector<zcash_fpga::bls12_381_inst_t>& code) const {
+  const unsigned int w = g.w, jb = 3*g.w;
+  const unsigned int gen = m_first + s_gen, pts = gen + 2*w, tmp = pts + jb*s_points, work = m_first + g.work;
+  const unsigned int x = pts + jb*s_x, y = pts + jb*s_y, z = pts + jb*s_z, total = pts + jb*s_total;
+  const unsigned int acc = pts + jb*s_acc, run = pts + jb*s_run, sum = pts + jb*s_sum, pm = pts + jb*s_pm;
+  const unsigned int scalars = work + s_area_ctl, points = scalars + g.m;
+  std::vector<unsigned int> to_ack;
+  unsigned int main, pp, h;
+
+  code.clear();
+
+  // Staging area 0 or 1 to the working slots
+  g.o_stage[0] = code.size();
+  bls12_381_copy(code, work + g.area, work, g.area);
+  main = code.size();
+  bls12_381_emit(code, zcash_fpga::JUMP, 0, 0, 0);
+  g.o_stage[1] = code.size();
+  bls12_381_copy(code, work + 2*g.area, work, g.area);
+  code[main].a = code.size();
+
+  // Bucket chain, the first skip points are not used. A non zero flag means more
+  // chunks of this bucket follow, it is cleared by the jump
+  pp = code.size();
+  bls12_381_emit(code, zcash_fpga::JUMP_NONZERO_SUB, 0, work + s_mode, 0);
+  for (unsigned int j = 0; j < g.m; j++) {
+    unsigned int skip = code.size();
+    bls12_381_emit(code, zcash_fpga::JUMP_NONZERO_SUB, 0, work + s_skip, 0);
+    bls12_381_madd(code, w, acc, points + 2*w*j, tmp);
+    code[skip].a = code.size();
+  }
+  to_ack.push_back(code.size());
+  bls12_381_emit(code, zcash_fpga::JUMP_NONZERO_SUB, 0, work + s_flag, 0);
+  bls12_381_add(code, w, run, acc, tmp);
+  bls12_381_add(code, w, sum, run, tmp);
+  bls12_381_copy(code, x, acc, jb);
+  to_ack.push_back(code.size());
+  bls12_381_emit(code, zcash_fpga::JUMP, 0, 0, 0);
+
+  // POINT_MULT chain
+  code[pp].a = code.size();
+  for (unsigned int j = 0; j < g.m; j++) {
+    unsigned int skip = code.size();
+    bls12_381_emit(code, zcash_fpga::JUMP_NONZERO_SUB, 0, work + s_skip, 0);
+    bls12_381_emit(code, zcash_fpga::POINT_MULT, scalars + j, points + 2*w*j, pm);
+    bls12_381_add(code, w, total, pm, tmp);
+    code[skip].a = code.size();
+  }
+  to_ack.push_back(code.size());
+  bls12_381_emit(code, zcash_fpga::JUMP, 0, 0, 0);
+
+  // End of a window, cnt + 1 doublings then the window sum
+  g.o_horner = h = code.size();
+  bls12_381_dbl(code, w, total, tmp);
+  bls12_381_emit(code, zcash_fpga::JUMP_NONZERO_SUB, h, m_first + s_cnt, 0);
+  bls12_381_add(code, w, total, sum, tmp);
+  bls12_381_copy(code, y, run, jb);
+  bls12_381_copy(code, z, sum, jb);
+  to_ack.push_back(code.size());
+  bls12_381_emit(code, zcash_fpga::JUMP, 0, 0, 0);
+
+  // The random starting points, per point only needs the result's
+  g.o_setup = code.size();
+  bls12_381_emit(code, zcash_fpga::POINT_MULT, m_first + s_rand, gen, x);
+  bls12_381_emit(code, zcash_fpga::POINT_MULT, m_first + s_rand + 1, gen, y);
+  bls12_381_emit(code, zcash_fpga::POINT_MULT, m_first + s_rand + 2, gen, z);
+  bls12_381_copy(code, x, acc, jb);
+  bls12_381_copy(code, y, run, jb);
+  bls12_381_copy(code, z, sum, jb);
+  g.o_setup_pp = code.size();
+  bls12_381_emit(code, zcash_fpga::POINT_MULT, m_first + s_rand + 3, gen, total);
+
+  for (unsigned int i = 0; i < to_ack.size(); i++) code[to_ack[i]].a = code.size();
+  bls12_381_emit(code, zcash_fpga::SEND_INTERRUPT, m_first + s_cnt, s_ack, 0);
+  bls12_381_emit(code, zcash_fpga::NOOP_WAIT, 0, 0, 0);
+}
+
+zcash_fpga_msm::strategy_t zcash_fpga_msm::choose(bool g2, unsigned int n, unsigned int& window) const {
+  const unsigned int m = m_group[g2].m ? m_group[g2].m : 1;
+  uint64_t per_point, best = 0;
+
+  // The last POINT_MULT and the setup are common to both
+  per_point = (uint64_t)n * (s_mult_cost + 1) + (uint64_t)(n + m) / m * s_launch_cost;
+  window = 1;
+  for (unsigned int c = 1; c <= s_max_window; c++) {
+    uint64_t windows = (s_scalar_bits + c - 1) / c, buckets = (1ULL << c) - 1;
+    uint64_t cost = windows * (n + 2*buckets + c + 1) + windows * (buckets + n / m + 1) * s_launch_cost +
+                    3 * s_mult_cost;
+    if (c == 1 || cost < best) {
+      best = cost;
+      window = c;
+    }
+  }
+  return best < per_point ? PIPPENGER : PER_POINT;
+}
+
+int zcash_fpga_msm::prepare(const group_t& g, const launch_t& l, const std::vector<const uint8_t*>& points,
+                            const std::vector<bls12_381_scalar_t>& scalars) {
+  int rc = 0;
+  const unsigned int k = l.items.size(), pt_size = 2*g.w*48;
+
+  if (l.stage < 0) {
+    bls12_381_scalar_t cnt;
+    if (l.offset != g.o_horner) return 0;
+    cnt.dat[0][0] = l.cnt;
+    cnt.dat[0][1] = l.cnt >> 8;
+    return cnt.store(m_zfpga, m_first + s_cnt);
+  }
+
+  // Items go at the end of the area, the first m - k are skipped
+  {
+    unsigned int area = m_first + g.work + (1 + l.stage)*g.area;
+    std::vector<uint8_t> ctl((s_area_ctl + g.m)*48, 0), pts(k*pt_size);
+    ctl[s_skip*48] = g.m - k;
+    ctl[s_flag*48] = l.more;
+    ctl[s_mode*48] = l.pp;
+    for (unsigned int i = 0; i < k; i++) {
+      if (l.pp) memcpy(&ctl[(s_area_ctl + g.m - k + i)*48], scalars[l.items[i]].dat[0], 48);
+      memcpy(&pts[i*pt_size], points[l.items[i]], pt_size);
+    }
+    rc = m_zfpga.bls12_381_set_data_slots(area, ctl.data(), l.pp ? s_area_ctl + g.m : s_area_ctl, zcash_fpga::SCALAR);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    if (k > 0) {
+      rc = m_zfpga.bls12_381_set_data_slots(area + s_area_ctl + g.m + 2*g.w*(g.m - k), pts.data(), 2*g.w*k,
+                                            g.g2 ? zcash_fpga::FP2_AF : zcash_fpga::FP_AF);
+      fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    }
+  }
+  return 0;
+  out:
+    return 1;
+}
+
+// Launch i + 1 is written while launch i runs, they use different staging areas
+int zcash_fpga_msm::execute(const group_t& g, const std::vector<launch_t>& launches,
+                            const std::vector<const uint8_t*>& points, const std::vector<bls12_381_scalar_t>& scalars) {
+  int rc = 0, read_len;
+  unsigned int entry;
+  uint8_t reply[STREAM_MAX_RPL_BYTES];
+  zcash_fpga::bls12_381_interrupt_rpl_t* rpl = (zcash_fpga::bls12_381_interrupt_rpl_t*)reply;
+
+  rc = m_progs.load(g.name, entry);
+  fail_on(rc, out, "ERROR: Unable to load the program!\n");
+  rc = prepare(g, launches[0], points, scalars);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+
+  for (unsigned int i = 0; i < launches.size(); i++) {
+    rc = m_zfpga.bls12_381_set_curr_inst_slot(entry + launches[i].offset);
+    fail_on(rc, out, "ERROR: Unable to start the program!\n");
+    m_stats.launches++;
+    if (i + 1 < launches.size()) {
+      rc = prepare(g, launches[i + 1], points, scalars);
+      fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    }
+
+    read_len = m_zfpga.read_stream_wait(reply, sizeof(reply), zcash_fpga::BLS12_381_INTERRUPT_RPL);
+    if (read_len <= 0) {
+      zlog_error("zcash_fpga_msm: no interrupt after launch %d of %lu\n", i, (unsigned long)launches.size());
+      goto out;
+    }
+    if (rpl->index != s_ack) {
+      zlog_error("zcash_fpga_msm: unexpected interrupt index %d\n", rpl->index);
+      goto out;
+    }
+  }
+  return 0;
+  out:
+    return 1;
+}
+
+int zcash_fpga_msm::run(group_t& g, const uint8_t* p, const bls12_381_scalar_t* k, unsigned int n, uint8_t* result,
+                        strategy_t strategy) {
+  int rc = 0;
+  const unsigned int pt_size = 2*g.w*48, jb = 3*g.w;
+  const unsigned int total = m_first + s_gen + 2*g.w + jb*s_total;
+  const zcash_fpga::point_type_t jb_type = g.g2 ? zcash_fpga::FP2_JB : zcash_fpga::FP_JB;
+  std::vector<const uint8_t*> points;
+  std::vector<bls12_381_scalar_t> scalars;
+  std::vector<launch_t> launches;
+  bls12_381_scalar_t rand[4];
+  bls12_381_g2_af_t gen;
+  unsigned int c = 1, stage = 0;
+  zcash_fpga::point_type_t pt;
+  BN_CTX* ctx = NULL;
+  BIGNUM *order = NULL, *v = NULL, *corr = NULL, *e = NULL, *o = NULL, *s = NULL;
+
+  m_stats.calls++;
+  memset(result, 0, jb*48);
+  if (g.m == 0) {
+    zlog_error("zcash_fpga_msm: no %s routine registered\n", g.g2 ? "G2" : "G1");
+    return 1;
+  }
+
+  ctx = BN_CTX_new();
+  order = BN_new();
+  v = BN_new();
+  corr = BN_new();
+  e = BN_new();
+  o = BN_new();
+  s = BN_new();
+  if (ctx == NULL || order == NULL || v == NULL || corr == NULL || e == NULL || o == NULL || s == NULL ||
+      BN_hex2bn(&order, s_order) == 0)
+    goto fail;
+
+  // Scalars mod the order, zero terms dropped
+  for (unsigned int i = 0; i < n; i++) {
+    bls12_381_scalar_t r;
+    uint8_t zero[4*48] = {0};
+    if (memcmp(p + i*pt_size, zero, pt_size) == 0) continue;
+    if (BN_lebin2bn(k[i].dat[0], 48, v) == NULL || BN_nnmod(v, v, order, ctx) != 1) goto fail;
+    if (BN_is_zero(v)) continue;
+    if (BN_bn2lebinpad(v, r.dat[0], 48) != 48) goto fail;
+    points.push_back(p + i*pt_size);
+    scalars.push_back(r);
+  }
+  m_stats.points += points.size();
+  if (points.empty()) goto out;
+
+  if (strategy == AUTO)
+    strategy = choose(g.g2, points.size(), c);
+  else
+    choose(g.g2, points.size(), c);
+  if (strategy == PIPPENGER)
+    m_stats.pippenger++;
+  else
+    m_stats.per_point++;
+
+  // Random x, y, z, t and the scalar of the generator that cancels them
+  for (unsigned int i = 0; i < 4; i++) {
+    do {
+      if (BN_rand_range(v, order) != 1) goto fail;
+    } while (BN_is_zero(v));
+    if (BN_bn2lebinpad(v, rand[i].dat[0], 48) != 48) goto fail;
+  }
+  if (strategy == PIPPENGER) {
+    // Each window sum is off by z + B y + M x (M = B (B + 1) / 2 from the buckets, B the
+    // buckets) and the result by t 2^(c W) + (z + B y + M x) sum_w 2^(c w)
+    const unsigned int windows = (s_scalar_bits + c - 1) / c;
+    const uint64_t buckets = (1ULL << c) - 1;
+    if (BN_lebin2bn(rand[2].dat[0], 48, o) == NULL || BN_lebin2bn(rand[1].dat[0], 48, v) == NULL ||
+        BN_set_word(e, buckets) != 1 || BN_mod_mul(v, v, e, order, ctx) != 1 || BN_mod_add(o, o, v, order, ctx) != 1 ||
+        BN_lebin2bn(rand[0].dat[0], 48, v) == NULL || BN_set_word(e, buckets * (buckets + 1) / 2) != 1 ||
+        BN_mod_mul(v, v, e, order, ctx) != 1 || BN_mod_add(o, o, v, order, ctx) != 1)
+      goto fail;
+    BN_zero(s);
+    for (unsigned int i = 0; i < windows; i++) {
+      if (BN_one(v) != 1 || BN_lshift(v, v, c*i) != 1 || BN_mod_add(s, s, v, order, ctx) != 1) goto fail;
+    }
+    if (BN_mod_mul(corr, o, s, order, ctx) != 1 || BN_one(v) != 1 || BN_lshift(v, v, c*windows) != 1 ||
+        BN_lebin2bn(rand[3].dat[0], 48, e) == NULL || BN_mod_mul(v, v, e, order, ctx) != 1 ||
+        BN_mod_add(corr, corr, v, order, ctx) != 1)
+      goto fail;
+  } else {
+    if (BN_lebin2bn(rand[3].dat[0], 48, corr) == NULL) goto fail;
+  }
+  if (BN_mod_sub(corr, order, corr, order, ctx) != 1) goto fail;
+  if (BN_is_zero(corr)) {
+    zlog_error("zcash_fpga_msm: the random offsets cancel\n");
+    goto fail;
+  }
+  {
+    bls12_381_scalar_t r;
+    if (BN_bn2lebinpad(corr, r.dat[0], 48) != 48) goto fail;
+    for (unsigned int i = 0; i < 2*g.w; i++) gen.set_hex(i, g.g2 ? s_g2[i] : s_g1[i]);
+    points.push_back(&gen.dat[0][0]);
+    scalars.push_back(r);
+  }
+
+  // The count is also the payload of the acknowledge interrupt
+  rc = bls12_381_scalar_t().store(m_zfpga, m_first + s_cnt);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  for (unsigned int i = 0; i < 4; i++) {
+    rc = rand[i].store(m_zfpga, m_first + s_rand + i);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  }
+  rc = m_zfpga.bls12_381_set_data_slots(m_first + s_gen, &gen.dat[0][0], 2*g.w,
+                                        g.g2 ? zcash_fpga::FP2_AF : zcash_fpga::FP_AF);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+
+  {
+    launch_t l;
+    l.offset = strategy == PIPPENGER ? g.o_setup : g.o_setup_pp;
+    l.stage = -1;
+    l.pp = false;
+    l.more = false;
+    l.cnt = 0;
+    launches.push_back(l);
+  }
+
+  if (strategy == PIPPENGER) {
+    // From the top window down, buckets from the top down for the running sum
+    const unsigned int windows = (s_scalar_bits + c - 1) / c;
+    std::vector<std::vector<unsigned int> > buckets(1U << c);
+    for (int wi = windows - 1; wi >= 0; wi--) {
+      for (unsigned int b = 0; b < buckets.size(); b++) buckets[b].clear();
+      for (unsigned int i = 0; i + 1 < points.size(); i++) {
+        unsigned int digit = 0;
+        for (unsigned int j = 0; j < c && c*wi + j < s_scalar_bits; j++) {
+          unsigned int bit = c*wi + j;
+          digit |= ((scalars[i].dat[0][bit / 8] >> (bit % 8)) & 1) << j;
+        }
+        if (digit != 0) buckets[digit].push_back(i);
+      }
+      for (unsigned int b = buckets.size() - 1; b > 0; b--) {
+        unsigned int done = 0;
+        do {
+          launch_t l;
+          unsigned int num = buckets[b].size() - done < g.m ? buckets[b].size() - done : g.m;
+          l.stage = stage++ % 2;
+          l.offset = g.o_stage[l.stage];
+          l.pp = false;
+          l.more = done + num < buckets[b].size();
+          l.cnt = 0;
+          l.items.assign(buckets[b].begin() + done, buckets[b].begin() + done + num);
+          launches.push_back(l);
+          done += num;
+        } while (done < buckets[b].size());
+      }
+      {
+        launch_t l;
+        l.offset = g.o_horner;
+        l.stage = -1;
+        l.pp = false;
+        l.more = false;
+        l.cnt = c - 1;
+        launches.push_back(l);
+      }
+    }
+  }
+
+  // POINT_MULT chain, for Pippenger only the generator
+  for (unsigned int done = strategy == PIPPENGER ? points.size() - 1 : 0; done < points.size();) {
+    launch_t l;
+    unsigned int num = points.size() - done < g.m ? points.size() - done : g.m;
+    l.stage = stage++ % 2;
+    l.offset = g.o_stage[l.stage];
+    l.pp = true;
+    l.more = false;
+    l.cnt = 0;
+    for (unsigned int i = 0; i < num; i++) l.items.push_back(done + i);
+    launches.push_back(l);
+    done += num;
+  }
+
+  rc = execute(g, launches, points, scalars);
+  fail_on(rc, out, "ERROR: Unable to run the program!\n");
+
+  rc = m_zfpga.bls12_381_get_data_slots(total, result, jb, pt);
+  fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
+  if (pt != jb_type) {
+    zlog_error("zcash_fpga_msm: result has point type %d\n", pt);
+    rc = 1;
+  }
+  goto out;
+
+  fail:
+    zlog_error("zcash_fpga_msm: unable to compute the scalars\n");
+    rc = 1;
+  out:
+    BN_free(s);
+    BN_free(o);
+    BN_free(e);
+    BN_free(corr);
+    BN_free(v);
+    BN_free(order);
+    BN_CTX_free(ctx);
+    return rc;
+}
+
+int zcash_fpga_msm::msm(const bls12_381_g1_af_t* p, const bls12_381_scalar_t* k, unsigned int n,
+                        bls12_381_g1_jb_t& result, strategy_t strategy) {
+  return run(m_group[0], &p[0].dat[0][0], k, n, &result.dat[0][0], strategy);
+}
+
+int zcash_fpga_msm::msm(const bls12_381_g2_af_t* p, const bls12_381_scalar_t* k, unsigned int n,
+                        bls12_381_g2_jb_t& result, strategy_t strategy) {
+  return run(m_group[1], &p[0].dat[0][0], k, n, &result.dat[0][0], strategy);
+}
@@ -0,0 +1,151 @@
+//
+//  ZCash FPGA library BLS12_381 multi-scalar multiplication.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_MSM_H_   /* Include guard */
+#define ZCASH_FPGA_MSM_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "zcash_fpga.hpp"
+#include "zcash_fpga_bls12_381.hpp"
+#include "zcash_fpga_programs.hpp"
+
+/*
+ * Computes sum_i k_i * P_i over G1 or G2 on the FPGA, returning the jacobian result
+ * read back once with bls12_381_get_data_slots(). The coprocessor has POINT_MULT but no
+ * point addition, so points are added with jacobian formulas built from element ops.
+ * Two strategies, picked by a cost model of n unless forced:
+ *
+ *   PER_POINT  one POINT_MULT per point, added into an accumulator on the FPGA.
+ *   PIPPENGER  c bit windows with 2^c - 1 buckets. The host takes the digits and sorts
+ *              the points into buckets, the FPGA sums each bucket with mixed additions,
+ *              folds it into the window with the running sum method and combines the
+ *              windows with c doublings each. Only points are uploaded, no scalars.
+ *
+ * Addition formulas fail for P + P and with the point at infinity. Every sum starts at
+ * its own random multiple of the generator instead (the bucket sums, running sum,
+ * window sum and result), which makes those cases negligible for any input, and one
+ * last POINT_MULT of the generator by the scalar that cancels the offsets gives the
+ * result. A result at infinity comes back with Z = 0. Zero scalars (mod the group
+ * order) and all zero points are skipped.
+ *
+ * Points go through the data slots m at a time. The routine is entered from one of two
+ * staging areas, it first copies the staging area to the working slots so the host
+ * can fill the other one with the next chunk while this one runs.
+ *
+ * The routine for a group needs 50 * m + 128 (G1) or 54 * m + 146 (G2) instruction
+ * slots. Both are registered when constructed, with the same m sized so they fit the
+ * registry's free slots together. On the 256 slot instruction memory only one fits, so
+ * when both do not G1 is kept alone, construct with groups G2 for G2.
+ */
+class zcash_fpga_msm {
+
+  public:
+    typedef enum {
+      AUTO,
+      PER_POINT,
+      PIPPENGER
+    } strategy_t;
+
+    typedef enum {
+      G1   = 1,
+      G2   = 2,
+      BOTH = 3
+    } groups_t;
+
+    typedef struct {
+      uint64_t calls;
+      uint64_t points;       // Points with a non zero scalar
+      uint64_t per_point;    // Calls run with each strategy
+      uint64_t pippenger;
+      uint64_t launches;     // Times the routine was started
+    } stats_t;
+
+    /*
+     * Uses data slots first_slot to last_slot - 1 (last_slot of 0 is the end of data
+     * memory) and at most max_points points per chunk (0 for as many as fit), registering
+     * the routines of groups in progs.
+     */
+    zcash_fpga_msm(zcash_fpga& zfpga, zcash_fpga_programs& progs, unsigned int first_slot = 0,
+                   unsigned int last_slot = 0, unsigned int max_points = 0, groups_t groups = BOTH);
+
+    /*
+     * Sets result to sum_i k[i] * p[i]. Returns 0 on success or 1 if the FPGA could not
+     * be used.
+     */
+    int msm(const bls12_381_g1_af_t* p, const bls12_381_scalar_t* k, unsigned int n, bls12_381_g1_jb_t& result,
+            strategy_t strategy = AUTO);
+    int msm(const bls12_381_g2_af_t* p, const bls12_381_scalar_t* k, unsigned int n, bls12_381_g2_jb_t& result,
+            strategy_t strategy = AUTO);
+
+    /*
+     * Strategy AUTO picks for n points, window is set to the Pippenger window bits
+     */
+    strategy_t choose(bool g2, unsigned int n, unsigned int& window) const;
+
+    unsigned int get_max_points(bool g2) const { return m_group[g2].m; }   // 0 when the group is not available
+    stats_t get_stats() const { return m_stats; }
+
+  private:
+    // Layout and routine of one group
+    typedef struct {
+      bool         g2;
+      unsigned int w;        // Slots per element
+      unsigned int m;        // Points per chunk
+      unsigned int work;     // Working slots, followed by the two staging areas
+      unsigned int area;     // Slots per working or staging area
+      unsigned int o_stage[2];
+      unsigned int o_horner;
+      unsigned int o_setup;
+      unsigned int o_setup_pp;
+      std::string  name;
+    } group_t;
+
+    // One start of the routine
+    typedef struct {
+      unsigned int offset;
+      int          stage;    // Staging area written for it, -1 for none
+      bool         pp;       // POINT_MULT chain rather than bucket chain
+      bool         more;     // More chunks follow for this bucket
+      unsigned int cnt;      // Doublings - 1 for the window step
+      std::vector<unsigned int> items;
+    } launch_t;
+
+    zcash_fpga&          m_zfpga;
+    zcash_fpga_programs& m_progs;
+    unsigned int         m_first;
+    group_t              m_group[2];
+    stats_t              m_stats;
+
+    unsigned int fit(groups_t groups, unsigned int last_slot, unsigned int max_points);
+    void layout(group_t& g, unsigned int m) const;
+    void build(group_t& g, std::vector<zcash_fpga::bls12_381_inst_t>& code) const;
+    int run(group_t& g, const uint8_t* p, const bls12_381_scalar_t* k, unsigned int n, uint8_t* result,
+            strategy_t strategy);
+    int execute(const group_t& g, const std::vector<launch_t>& launches, const std::vector<const uint8_t*>& points,
+                const std::vector<bls12_381_scalar_t>& scalars);
+    int prepare(const group_t& g, const launch_t& l, const std::vector<const uint8_t*>& points,
+                const std::vector<bls12_381_scalar_t>& scalars);
+
+}; // zcash_fpga_msm
+
+#endif // ZCASH_FPGA_MSM_H_
@@ -0,0 +1,162 @@
+#include "zcash_fpga_pairing.hpp"
+#include "zcash_fpga_log.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+// Data slots relative to first_slot
+static const unsigned int s_acc = 0;
+static const unsigned int s_tmp = 12;
+static const unsigned int s_flag = 24;
+static const unsigned int s_pairs = 25;
+
+// MILLER_LOOP and MUL_ELEMENT per pair, then the flag jump, FINAL_EXP, two interrupts and their NOOP_WAITs
+static const unsigned int s_pair_insts = 2;
+static const unsigned int s_tail_insts = 6;
+
+// Interrupt indices
+static const unsigned int s_result = 0;
+static const unsigned int s_ack = 1;
+
+zcash_fpga_pairing::zcash_fpga_pairing(zcash_fpga& zfpga, zcash_fpga_programs& progs, unsigned int first_slot,
+                                       unsigned int last_slot, unsigned int max_pairs) :
+  m_zfpga(zfpga),
+  m_progs(progs),
+  m_first(first_slot) {
+  char name[64];
+  unsigned int fit, insts;
+
+  if (last_slot == 0 || last_slot > zfpga.bls12_381_get_data_size())
+    last_slot = zfpga.bls12_381_get_data_size();
+  fit = last_slot > first_slot + s_pairs ? (last_slot - first_slot - s_pairs) / 6 : 0;
+  insts = progs.get_free_slots();
+  if (insts < s_tail_insts + s_pair_insts*fit) fit = insts > s_tail_insts ? (insts - s_tail_insts) / s_pair_insts : 0;
+  m_max_pairs = (max_pairs != 0 && max_pairs < fit) ? max_pairs : fit;
+  if (m_max_pairs == 0) {
+    zlog_error("zcash_fpga_pairing: no room for a pair in data slots %d to %d and %d instruction slots\n", first_slot,
+               last_slot - 1, insts);
+    return;
+  }
+
+  // Registered now so routines added later cannot take the slots it was sized for
+  snprintf(name, sizeof(name), "multi_pairing_%u_%u", m_first, m_max_pairs);
+  m_name = name;
+  if (!progs.contains(m_name)) {
+    std::vector<zcash_fpga::bls12_381_inst_t> code;
+    build(code);
+    if (progs.add(m_name, code) != 0) {
+      zlog_error("zcash_fpga_pairing: unable to register %s\n", name);
+      m_max_pairs = 0;
+    }
+  }
+}
+
+void zcash_fpga_pairing::build(std::vector<zcash_fpga::bls12_381_inst_t>& code) const {
+  unsigned int end = s_pair_insts*m_max_pairs;
+  code.resize(end + s_tail_insts);
+  memset(code.data(), 0, code.size() * sizeof(zcash_fpga::bls12_381_inst_t));
+  for (unsigned int j = 0; j < m_max_pairs; j++) {
+    code[2*j].code = zcash_fpga::MILLER_LOOP;
+    code[2*j].a = m_first + s_pairs + 6*j;
+    code[2*j].b = m_first + s_pairs + 6*j + 2;
+    code[2*j].c = m_first + s_tmp;
+    code[2*j+1].code = zcash_fpga::MUL_ELEMENT;
+    code[2*j+1].a = m_first + s_acc;
+    code[2*j+1].b = m_first + s_tmp;
+    code[2*j+1].c = m_first + s_acc;
+  }
+  // A non zero flag means more chunks follow, it is cleared by the jump
+  code[end].code = zcash_fpga::JUMP_NONZERO_SUB;
+  code[end].a = end + 4;
+  code[end].b = m_first + s_flag;
+  code[end+1].code = zcash_fpga::FINAL_EXP;
+  code[end+1].a = m_first + s_acc;
+  code[end+1].b = m_first + s_acc;
+  code[end+2].code = zcash_fpga::SEND_INTERRUPT;
+  code[end+2].a = m_first + s_acc;
+  code[end+2].b = s_result;
+  code[end+4].code = zcash_fpga::SEND_INTERRUPT;
+  code[end+4].a = m_first + s_flag;
+  code[end+4].b = s_ack;
+}
+
+int zcash_fpga_pairing::chunk(const bls12_381_g1_af_t* p, const bls12_381_g2_af_t* q, unsigned int k, bool first,
+                              bls12_381_fe12_t* result) {
+  int rc = 0, read_len;
+  unsigned int entry;
+  uint8_t reply[STREAM_MAX_RPL_BYTES];
+  zcash_fpga::bls12_381_interrupt_rpl_t* rpl = (zcash_fpga::bls12_381_interrupt_rpl_t*)reply;
+  bls12_381_scalar_t flag;
+
+  if (first) {
+    bls12_381_fe12_t one;
+    one.dat[0][0] = 1;
+    rc = one.store(m_zfpga, m_first + s_acc);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  }
+  for (unsigned int i = 0; i < k; i++) {
+    unsigned int slot = m_first + s_pairs + 6*(m_max_pairs - k + i);
+    rc = p[i].store(m_zfpga, slot);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    rc = q[i].store(m_zfpga, slot + 2);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  }
+  flag.dat[0][0] = result ? 0 : 1;
+  rc = flag.store(m_zfpga, m_first + s_flag);
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+
+  rc = m_progs.load(m_name, entry);
+  fail_on(rc, out, "ERROR: Unable to load the program!\n");
+  rc = m_zfpga.bls12_381_set_curr_inst_slot(entry + s_pair_insts*(m_max_pairs - k));
+  fail_on(rc, out, "ERROR: Unable to start the program!\n");
+
+  read_len = m_zfpga.read_stream_wait(reply, sizeof(reply), zcash_fpga::BLS12_381_INTERRUPT_RPL);
+  if (read_len <= 0) {
+    zlog_error("zcash_fpga_pairing: no interrupt after %d pairs\n", k);
+    goto out;
+  }
+  if (rpl->index != (result ? s_result : s_ack)) {
+    zlog_error("zcash_fpga_pairing: unexpected interrupt index %d\n", rpl->index);
+    goto out;
+  }
+  if (result) {
+    if ((unsigned int)read_len < sizeof(*rpl) + sizeof(result->dat)) {
+      zlog_error("zcash_fpga_pairing: result of %d bytes is not an FE12\n", read_len);
+      goto out;
+    }
+    memcpy(result->dat, reply + sizeof(*rpl), sizeof(result->dat));
+  }
+  return 0;
+  out:
+    return 1;
+}
+
+int zcash_fpga_pairing::multi_pairing(const bls12_381_g1_af_t* p, const bls12_381_g2_af_t* q, unsigned int n,
+                                      bls12_381_fe12_t& result) {
+  unsigned int done = 0, k;
+
+  if (n == 0) {
+    memset(result.dat, 0, sizeof(result.dat));
+    result.dat[0][0] = 1;
+    return 0;
+  }
+  if (m_max_pairs == 0) return 1;
+
+  while (done < n) {
+    k = n - done < m_max_pairs ? n - done : m_max_pairs;
+    if (chunk(p + done, q + done, k, done == 0, done + k == n ? &result : nullptr) != 0) return 1;
+    done += k;
+  }
+  return 0;
+}
+
+int zcash_fpga_pairing::pairing_check(const bls12_381_g1_af_t* p, const bls12_381_g2_af_t* q, unsigned int n,
+                                      bool& one) {
+  bls12_381_fe12_t res, id;
+  id.dat[0][0] = 1;
+  if (multi_pairing(p, q, n, res) != 0) return 1;
+  one = memcmp(res.dat, id.dat, sizeof(res.dat)) == 0;
+  return 0;
+}
@@ -0,0 +1,85 @@
+//
+//  ZCash FPGA library BLS12_381 multi pairing.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_PAIRING_H_   /* Include guard */
+#define ZCASH_FPGA_PAIRING_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "zcash_fpga.hpp"
+#include "zcash_fpga_bls12_381.hpp"
+#include "zcash_fpga_programs.hpp"
+
+/*
+ * Product of pairings e(p[0], q[0]) * .. * e(p[n-1], q[n-1]) with one FINAL_EXP, so each
+ * extra pair costs a MILLER_LOOP and an FE12 MUL_ELEMENT instead of a full pairing.
+ *
+ * One resident routine holds a chain of max_pairs blocks, each a MILLER_LOOP into a
+ * temporary and a MUL_ELEMENT into the accumulator, followed by a JUMP_NONZERO_SUB on a
+ * flag slot choosing between FINAL_EXP and an acknowledge interrupt. For k pairs the
+ * pairs are written to the last k blocks' slots and the routine is started k blocks
+ * from its end. More than max_pairs pairs run as several chunks with the accumulator
+ * kept on the FPGA, only the last applying FINAL_EXP.
+ *
+ * Data slots from first_slot: the FE12 accumulator (12), the temporary (12), the flag
+ * (1), then 6 per pair (FP_AF point then FP2_AF point).
+ */
+class zcash_fpga_pairing {
+
+  public:
+    /*
+     * Uses data slots first_slot to last_slot - 1 (last_slot of 0 is the end of data
+     * memory) and at most max_pairs pairs per chunk (0 for as many as fit in the data
+     * slots and the registry's free slots). The routine is registered in progs here, when
+     * not even one pair fits get_max_pairs() is 0 and every call returns 1.
+     */
+    zcash_fpga_pairing(zcash_fpga& zfpga, zcash_fpga_programs& progs, unsigned int first_slot = 0,
+                       unsigned int last_slot = 0, unsigned int max_pairs = 0);
+
+    /*
+     * result is the product of the n pairings after FINAL_EXP. Returns 0 on success.
+     */
+    int multi_pairing(const bls12_381_g1_af_t* p, const bls12_381_g2_af_t* q, unsigned int n,
+                      bls12_381_fe12_t& result);
+
+    /*
+     * Sets one if the product of the n pairings is the identity of GT, e.g. for
+     * e(a, b) == e(c, d) pass (-a, b), (c, d). Returns 0 on success.
+     */
+    int pairing_check(const bls12_381_g1_af_t* p, const bls12_381_g2_af_t* q, unsigned int n, bool& one);
+
+    unsigned int get_max_pairs() const { return m_max_pairs; }
+
+  private:
+    zcash_fpga&          m_zfpga;
+    zcash_fpga_programs& m_progs;
+    unsigned int         m_first;
+    unsigned int         m_max_pairs;
+    std::string          m_name;
+
+    void build(std::vector<zcash_fpga::bls12_381_inst_t>& code) const;
+    int chunk(const bls12_381_g1_af_t* p, const bls12_381_g2_af_t* q, unsigned int k, bool first,
+              bls12_381_fe12_t* result);
+
+}; // zcash_fpga_pairing
+
+#endif // ZCASH_FPGA_PAIRING_H_
@@ -0,0 +1,173 @@
+#include "zcash_fpga_pool.hpp"
+#include "zcash_fpga_log.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <fpga_pci.h>
+#include <fpga_mgmt.h>
+
+zcash_fpga_pool::zcash_fpga_pool() : m_rr(0) {
+  memset(m_per_node, 0, sizeof(m_per_node));
+}
+
+zcash_fpga_pool::~zcash_fpga_pool() {
+  // Stop every I/O thread before any device is detached
+  for (size_t i = 0; i < m_slots.size(); i++)
+    m_slots[i].async->stop_io_thread();
+}
+
+bool zcash_fpga_pool::slot_loaded(int slot_id) {
+  struct fpga_mgmt_image_info info = {0};
+  if (fpga_mgmt_describe_local_image(slot_id, &info, 0) != 0) return false;
+  return info.status == FPGA_STATUS_LOADED;
+}
+
+// The nth CPU of a node, counting down from the last one so the I/O threads stay off
+// the low numbered CPUs the application is most likely to use
+int zcash_fpga_pool::numa_cpu(int node, unsigned int nth) {
+  char path[64];
+  char list[1024];
+  int cpus[CPU_SETSIZE];
+  int n = 0;
+  FILE* fp;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  fp = fopen(path, "r");
+  if (fp == NULL) return -1;
+  if (fgets(list, sizeof(list), fp) == NULL) list[0] = 0;
+  fclose(fp);
+
+  // Format is e.g. "0-17,36-53"
+  for (char* p = list; *p != 0 && *p != '\n' && n < CPU_SETSIZE; ) {
+    char* end;
+    long lo = strtol(p, &end, 10);
+    long hi = lo;
+    if (end == p) break;
+    if (*end == '-') hi = strtol(end + 1, &end, 10);
+    for (long c = lo; c <= hi && n < CPU_SETSIZE; c++) cpus[n++] = c;
+    p = (*end == ',') ? end + 1 : end;
+  }
+
+  if (n == 0) return -1;
+  return cpus[n - 1 - (nth % n)];
+}
+
+int zcash_fpga_pool::add(zcash_fpga* zfpga, int numa_node, bool pin_numa) {
+  slot_t slot;
+  int rc;
+
+  slot.zfpga.reset(zfpga);
+  if (!zfpga->is_initialized()) {
+    zlog_error("FPGA pool: unable to add an uninitialized FPGA\n");
+    return -1;
+  }
+  slot.async.reset(new zcash_fpga_async(*zfpga));
+  slot.numa_node = numa_node;
+  slot.cpu = -1;
+  if (pin_numa && numa_node >= 0)
+    slot.cpu = numa_cpu(numa_node, m_per_node[numa_node % FPGA_SLOT_MAX]++);
+
+  rc = slot.async->start_io_thread(slot.cpu);
+  fail_on(rc, out, "ERROR: Unable to start I/O thread for pool slot %d", (int)m_slots.size());
+
+  zlog_info("FPGA pool slot %d: cmd_cap 0x%lx, NUMA node %d, I/O thread on cpu %d\n",
+            (int)m_slots.size(), (unsigned long)zfpga->m_command_cap, slot.numa_node, slot.cpu);
+  m_slots.push_back(std::move(slot));
+  return m_slots.size() - 1;
+  out:
+    return -1;
+}
+
+int zcash_fpga_pool::init(bool pin_numa) {
+  int rc;
+
+  if (!m_slots.empty()) {
+    zlog_info("FPGA pool already initialized, skipping initialization\n");
+    return m_slots.size();
+  }
+
+  rc = fpga_mgmt_init();
+  fail_on(rc, out, "Unable to initialize the fpga_mgmt library");
+
+  for (int slot_id = 0; slot_id < FPGA_SLOT_MAX; slot_id++) {
+    if (!slot_loaded(slot_id)) continue;
+
+    zcash_fpga* zfpga = new zcash_fpga(slot_id);
+    if (!zfpga->is_initialized()) {
+      zlog_warn("Skipping slot %d, unable to initialize FPGA\n", slot_id);
+      delete zfpga;
+      continue;
+    }
+    rc = add(zfpga, zfpga->get_numa_node(), pin_numa) < 0;
+    fail_on(rc, out, "ERROR: Unable to add slot %d to the pool", slot_id);
+  }
+
+  if (m_slots.empty())
+    zlog_warn("FPGA pool found no loaded slots\n");
+
+  return m_slots.size();
+  out:
+    return -1;
+}
+
+uint64_t zcash_fpga_pool::get_command_cap() const {
+  uint64_t cap = 0;
+  for (size_t i = 0; i < m_slots.size(); i++)
+    cap |= m_slots[i].zfpga->m_command_cap;
+  return cap;
+}
+
+uint64_t zcash_fpga_pool::required_cap(const uint8_t* cmd) {
+  const zcash_fpga::header_t* hdr = (const zcash_fpga::header_t*)cmd;
+  switch (hdr->cmd) {
+    case zcash_fpga::VERIFY_EQUIHASH:
+      return hdr->len == sizeof(zcash_fpga::verify_equihash_t) ? zcash_fpga::ENB_VERIFY_EQUIHASH_200_9 :
+                                                  zcash_fpga::ENB_VERIFY_EQUIHASH_144_5;
+    case zcash_fpga::VERIFY_SECP256K1_SIG:
+      return zcash_fpga::ENB_VERIFY_SECP256K1_SIG;
+    default:
+      return 0;
+  }
+}
+
+int zcash_fpga_pool::pick(uint64_t cap) {
+  unsigned int n = m_slots.size();
+  unsigned int best_load = UINT_MAX;
+  int best = -1;
+
+  if (n == 0) return -1;
+
+  // Start at a rotating slot so equally loaded slots share the work
+  unsigned int start = m_rr.fetch_add(1, std::memory_order_relaxed);
+  for (unsigned int i = 0; i < n; i++) {
+    unsigned int s = (start + i) % n;
+    if ((m_slots[s].zfpga->m_command_cap & cap) != cap) continue;
+    unsigned int load = m_slots[s].async->in_flight();
+    if (load < best_load) {
+      best_load = load;
+      best = s;
+    }
+  }
+  return best;
+}
+
+int zcash_fpga_pool::submit(uint8_t* cmd, unsigned int len, zcash_fpga_async::callback_t cb, void* ctx) {
+  int s = pick(required_cap(cmd));
+  if (s < 0) {
+    zlog_error("No FPGA in the pool supports command 0x%x\n", ((zcash_fpga::header_t*)cmd)->cmd);
+    return 1;
+  }
+  return m_slots[s].async->submit(cmd, len, cb, ctx);
+}
+
+int zcash_fpga_pool::submit(uint8_t* cmd, unsigned int len, zcash_fpga_async::future& fut) {
+  int s = pick(required_cap(cmd));
+  if (s < 0) {
+    zlog_error("No FPGA in the pool supports command 0x%x\n", ((zcash_fpga::header_t*)cmd)->cmd);
+    return 1;
+  }
+  return m_slots[s].async->submit(cmd, len, fut);
+}
@@ -0,0 +1,106 @@
+//
+//  ZCash FPGA library device pool.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_POOL_H_   /* Include guard */
+#define ZCASH_FPGA_POOL_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "zcash_fpga.hpp"
+#include "zcash_fpga_async.hpp"
+
+/*
+ * Attaches every slot that has the zcash AFI loaded (e.g. all 8 on a f1.16xlarge), each
+ * with its own zcash_fpga_async and I/O thread pinned to a CPU on the NUMA node of the
+ * slot's PCIe device. Commands go to the slot with the fewest requests in flight among
+ * those whose cmd_cap supports them.
+ */
+class zcash_fpga_pool {
+
+  public:
+    zcash_fpga_pool();
+    ~zcash_fpga_pool();
+    zcash_fpga_pool(zcash_fpga_pool const&) = delete;
+    void operator=(zcash_fpga_pool const&) = delete;
+
+    /*
+     * Scans all slots and attaches the loaded ones, starting an I/O thread for each
+     * (pinned when pin_numa is set and sysfs reports a node). Returns the number of
+     * slots attached or -1 on error.
+     */
+    int init(bool pin_numa = true);
+
+    /*
+     * Adds an initialized device (e.g. on a zcash_fpga_sim transport) on numa_node (-1
+     * if unknown) as the next slot and starts its I/O thread like init(). The pool takes
+     * ownership. Returns the index of the slot or -1 on error.
+     */
+    int add(zcash_fpga* zfpga, int numa_node, bool pin_numa = true);
+
+    unsigned int size() const { return m_slots.size(); }
+    zcash_fpga& device(unsigned int i) { return *m_slots[i].zfpga; }
+    zcash_fpga_async& async(unsigned int i) { return *m_slots[i].async; }
+    int numa_node(unsigned int i) const { return m_slots[i].numa_node; }
+    int io_cpu(unsigned int i) const { return m_slots[i].cpu; }
+
+    /*
+     * OR of the capability registers of all attached slots
+     */
+    uint64_t get_command_cap() const;
+
+    /*
+     * Capability needed to run a command, 0 if every slot can run it
+     */
+    static uint64_t required_cap(const uint8_t* cmd);
+
+    /*
+     * Least loaded slot with all bits of cap set, -1 if no slot has them. Use this to
+     * place BLS12_381 programs, which are run through device(i) / async(i).call().
+     */
+    int pick(uint64_t cap);
+
+    /*
+     * Sends the command to the least loaded capable slot. Indexes only need to be unique
+     * per slot, but the caller does not know the slot so keep them unique in the pool.
+     */
+    int submit(uint8_t* cmd, unsigned int len, zcash_fpga_async::callback_t cb, void* ctx);
+    int submit(uint8_t* cmd, unsigned int len, zcash_fpga_async::future& fut);
+
+  private:
+    typedef struct {
+      std::unique_ptr<zcash_fpga>       zfpga;
+      std::unique_ptr<zcash_fpga_async> async;
+      int                               numa_node;
+      int                               cpu;
+    } slot_t;
+
+    std::vector<slot_t> m_slots;
+    std::atomic<unsigned int> m_rr;
+    unsigned int m_per_node[FPGA_SLOT_MAX];  // I/O threads pinned per NUMA node
+
+    static bool slot_loaded(int slot_id);
+    static int numa_cpu(int node, unsigned int nth);
+
+}; // zcash_fpga_pool
+
+#endif // ZCASH_FPGA_POOL_H_
@@ -0,0 +1,122 @@
+#include "zcash_fpga_programs.hpp"
+#include "zcash_fpga_log.hpp"
+
+#include <string.h>
+
+static bool is_jump(zcash_fpga::bls12_381_code_t code) {
+  return code == zcash_fpga::JUMP || code == zcash_fpga::JUMP_IF_EQ || code == zcash_fpga::JUMP_NONZERO_SUB;
+}
+
+zcash_fpga_programs::zcash_fpga_programs(zcash_fpga& zfpga, unsigned int first_slot, unsigned int last_slot) :
+  m_zfpga(zfpga),
+  m_first(first_slot),
+  m_last(last_slot),
+  m_next(first_slot) {
+
+  if (m_last == 0 || m_last > zfpga.bls12_381_get_inst_size())
+    m_last = zfpga.bls12_381_get_inst_size();
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+// FNV-1a over the slot and the 7 byte instructions
+uint64_t zcash_fpga_programs::hash(unsigned int slot, const std::vector<zcash_fpga::bls12_381_inst_t>& code) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const uint8_t* p = (const uint8_t*)code.data();
+  for (unsigned int i = 0; i < 4; i++) {
+    h ^= (slot >> (8*i)) & 0xFF;
+    h *= 0x100000001b3ULL;
+  }
+  for (size_t i = 0; i < code.size() * sizeof(zcash_fpga::bls12_381_inst_t); i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+int zcash_fpga_programs::add(const std::string& name, const std::vector<zcash_fpga::bls12_381_inst_t>& code) {
+  routine_t r;
+  uint64_t h;
+
+  if (m_routines.count(name) != 0) {
+    zlog_error("zcash_fpga_programs: routine %s is already registered\n", name.c_str());
+    return 1;
+  }
+  if (code.empty() || m_next >= m_last || code.size() > m_last - m_next - 1) {
+    zlog_error("zcash_fpga_programs: routine %s (%lu instructions) does not fit, %d slots free\n", name.c_str(),
+               (unsigned long)code.size(), m_next < m_last ? m_last - m_next : 0);
+    return 1;
+  }
+
+  r.tag_slot = m_next;
+  r.code = code;
+  for (unsigned int i = 0; i < r.code.size(); i++) {
+    if (!is_jump(r.code[i].code)) continue;
+    if (r.code[i].a >= r.code.size()) {
+      zlog_error("zcash_fpga_programs: routine %s jumps to %d from %d, outside the routine\n", name.c_str(), r.code[i].a, i);
+      return 1;
+    }
+    r.code[i].a += r.tag_slot + 1;
+  }
+
+  // Never all zero, so memory that was reset does not match
+  h = hash(r.tag_slot, r.code) | 1;
+  r.tag.code = zcash_fpga::NOOP_WAIT;
+  r.tag.a = h;
+  r.tag.b = h >> 16;
+  r.tag.c = h >> 32;
+
+  m_next += r.code.size() + 1;
+  zlog_debug("zcash_fpga_programs: %s at instruction slot %d, %lu instructions\n", name.c_str(), r.tag_slot + 1,
+             (unsigned long)r.code.size());
+  m_routines[name] = r;
+  return 0;
+}
+
+int zcash_fpga_programs::load(const std::string& name, unsigned int& entry) {
+  int rc = 0;
+  unsigned int pc;
+  zcash_fpga::bls12_381_inst_t tag, park;
+  std::map<std::string, routine_t>::const_iterator it = m_routines.find(name);
+
+  if (it == m_routines.end()) {
+    zlog_error("zcash_fpga_programs: no routine %s\n", name.c_str());
+    return 1;
+  }
+  const routine_t& r = it->second;
+  m_stats.loads++;
+
+  rc = m_zfpga.bls12_381_get_inst_slot(r.tag_slot, tag);
+  fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
+
+  if (memcmp(&tag, &r.tag, sizeof(tag)) != 0) {
+    zlog_debug("zcash_fpga_programs: uploading %s\n", name.c_str());
+    // The coprocessor starts an instruction written under its parked PC, so a PC left
+    // inside the routine by an earlier program is first parked on a plain tag
+    rc = m_zfpga.bls12_381_get_curr_inst_slot(pc);
+    fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
+    if (pc > r.tag_slot && pc <= r.tag_slot + r.code.size()) {
+      memset(&park, 0, sizeof(park));
+      rc = m_zfpga.bls12_381_set_inst_slot(r.tag_slot, park);
+      fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+      rc = m_zfpga.bls12_381_set_curr_inst_slot(r.tag_slot);
+      fail_on(rc, out, "ERROR: Unable to park the instruction pointer!\n");
+    }
+    rc = m_zfpga.bls12_381_set_inst_slots(r.tag_slot + 1, r.code.data(), r.code.size());
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    rc = m_zfpga.bls12_381_set_inst_slot(r.tag_slot, r.tag);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    m_stats.uploads++;
+    m_stats.inst_uploaded += r.code.size() + 1;
+  }
+
+  entry = r.tag_slot + 1;
+  return 0;
+  out:
+    return 1;
+}
+
+int zcash_fpga_programs::launch(const std::string& name) {
+  unsigned int entry;
+  if (load(name, entry) != 0) return 1;
+  return m_zfpga.bls12_381_set_curr_inst_slot(entry) == 0 ? 0 : 1;
+}
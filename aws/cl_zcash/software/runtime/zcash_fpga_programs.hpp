@@ -0,0 +1,108 @@
+//
+//  ZCash FPGA library BLS12_381 program registry.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_PROGRAMS_H_   /* Include guard */
+#define ZCASH_FPGA_PROGRAMS_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "zcash_fpga.hpp"
+
+/*
+ * Named BLS12_381 coprocessor routines kept resident in instruction memory.
+ *
+ * Routines are placed one after the other from first_slot in the order they are added,
+ * so a process adding the same routines gets the same layout. Jump targets (a of JUMP,
+ * JUMP_IF_EQ and JUMP_NONZERO_SUB) are given relative to the routine and relocated.
+ * Each routine is preceded by a NOOP_WAIT tag instruction holding 48 bits of a hash of
+ * its relocated code, which also stops a routine running into the next one.
+ *
+ * load() reads the tag (one instruction slot) and only uploads the routine, in one
+ * register range with the tag written last, when it does not match, e.g. after
+ * bls12_381_reset_memory() or on a new FPGA image. An instruction written under the
+ * parked PC starts running, so a PC inside the routine is moved to its tag first. The
+ * slots from first_slot belong to the registry, other writes there are not detected.
+ */
+class zcash_fpga_programs {
+
+  public:
+    typedef struct {
+      uint64_t loads;          // load() / launch() calls
+      uint64_t uploads;        // Routines written to the FPGA
+      uint64_t inst_uploaded;  // Instruction slots written, including tags
+    } stats_t;
+
+    /*
+     * Uses instruction slots first_slot to last_slot - 1, last_slot of 0 is the end of
+     * instruction memory.
+     */
+    zcash_fpga_programs(zcash_fpga& zfpga, unsigned int first_slot = 0, unsigned int last_slot = 0);
+
+    /*
+     * Registers a routine, it is not uploaded until it is loaded. Returns 0 on success or
+     * 1 if the name is taken, it does not fit or a jump target is outside it.
+     */
+    int add(const std::string& name, const std::vector<zcash_fpga::bls12_381_inst_t>& code);
+
+    /*
+     * Makes the routine resident and sets entry to its first instruction slot. Returns 0
+     * on success.
+     */
+    int load(const std::string& name, unsigned int& entry);
+
+    /*
+     * load() then starts it with bls12_381_set_curr_inst_slot()
+     */
+    int launch(const std::string& name);
+
+    bool contains(const std::string& name) const { return m_routines.count(name) != 0; }
+
+    /*
+     * Instructions the next routine can have, after its tag
+     */
+    unsigned int get_free_slots() const { return m_last > m_next + 1 ? m_last - m_next - 1 : 0; }
+    stats_t get_stats() const { return m_stats; }
+
+    /*
+     * FNV-1a of code as placed at slot, usable to name generated routines
+     */
+    static uint64_t hash(unsigned int slot, const std::vector<zcash_fpga::bls12_381_inst_t>& code);
+
+  private:
+    typedef struct {
+      unsigned int tag_slot;   // Entry is tag_slot + 1
+      zcash_fpga::bls12_381_inst_t tag;
+      std::vector<zcash_fpga::bls12_381_inst_t> code;  // Relocated
+    } routine_t;
+
+    zcash_fpga&  m_zfpga;
+    unsigned int m_first;
+    unsigned int m_last;
+    unsigned int m_next;
+
+    std::map<std::string, routine_t> m_routines;
+    stats_t m_stats;
+
+}; // zcash_fpga_programs
+
+#endif // ZCASH_FPGA_PROGRAMS_H_
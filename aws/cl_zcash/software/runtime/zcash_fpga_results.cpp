@@ -0,0 +1,168 @@
+#include "zcash_fpga_results.hpp"
+#include "zcash_fpga_log.hpp"
+
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Slots per value of each size class
+static const unsigned int s_class_slots[] = {1, 2, 3, 4, 6, 12};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Bytes per buffer of a class, whole cache lines
+static unsigned int class_bytes(unsigned int cls) {
+  return (s_class_slots[cls] * 48 + zcash_fpga_results::s_line_bytes - 1) & ~(zcash_fpga_results::s_line_bytes - 1);
+}
+
+zcash_fpga_results::zcash_fpga_results(zcash_fpga& zfpga, unsigned int per_type) :
+  m_zfpga(zfpga),
+  m_results(new result_t[s_classes * per_type]),
+  m_current(nullptr) {
+
+  size_t bytes = 0;
+  uint8_t* base;
+  result_t* r = m_results.get();
+
+  for (unsigned int c = 0; c < s_classes; c++)
+    bytes += (size_t)class_bytes(c) * per_type;
+  m_mem.reset(new uint8_t[bytes + s_line_bytes]);
+  base = (uint8_t*)(((uintptr_t)m_mem.get() + s_line_bytes - 1) & ~(uintptr_t)(s_line_bytes - 1));
+
+  for (unsigned int c = 0; c < s_classes; c++) {
+    m_free[c] = nullptr;
+    m_free_cnt[c] = per_type;
+    for (unsigned int i = 0; i < per_type; i++, r++) {
+      memset(r, 0, sizeof(*r));
+      r->dat = base;
+      r->size = s_class_slots[c] * 48;
+      r->cls = c;
+      r->next = m_free[c];
+      m_free[c] = r;
+      base += class_bytes(c);
+    }
+  }
+  for (unsigned int i = 0; i < s_max_pending; i++)
+    m_route[i] = nullptr;
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+unsigned int zcash_fpga_results::type_class(zcash_fpga::point_type_t pt) {
+  unsigned int slots = zcash_fpga::bls12_381_point_type_size(pt);
+  unsigned int c = 0;
+  while (s_class_slots[c] < slots) c++;
+  return c;
+}
+
+unsigned int zcash_fpga_results::available(zcash_fpga::point_type_t pt) const {
+  return m_free_cnt[type_class(pt)];
+}
+
+zcash_fpga_results::result_t* zcash_fpga_results::expect(uint32_t index, zcash_fpga::point_type_t pt, callback_t cb,
+                                                         void* ctx) {
+  unsigned int c = type_class(pt);
+  result_t* r = m_free[c];
+
+  if (m_route[index & (s_max_pending - 1)] != nullptr) {
+    zlog_error("zcash_fpga_results: interrupt index %d is already expected\n", index);
+    return nullptr;
+  }
+  if (r == nullptr) {
+    m_stats.exhausted++;
+    return nullptr;
+  }
+  m_free[c] = r->next;
+  m_free_cnt[c]--;
+
+  r->len = 0;
+  r->index = index;
+  r->pt = pt;
+  r->ready = false;
+  r->rc = 0;
+  r->cb = cb;
+  r->ctx = ctx;
+  r->next = nullptr;
+  m_route[index & (s_max_pending - 1)] = r;
+  return r;
+}
+
+void zcash_fpga_results::release(result_t* r) {
+  if (r == nullptr) return;
+  if (m_route[r->index & (s_max_pending - 1)] == r)
+    m_route[r->index & (s_max_pending - 1)] = nullptr;
+  r->next = m_free[r->cls];
+  m_free[r->cls] = r;
+  m_free_cnt[r->cls]++;
+}
+
+// Picks the buffer for the payload once the reply header is read
+uint8_t* zcash_fpga_results::route(void* ctx, const uint8_t* head, unsigned int len) {
+  zcash_fpga_results* self = (zcash_fpga_results*)ctx;
+  const zcash_fpga::bls12_381_interrupt_rpl_t* rpl = (const zcash_fpga::bls12_381_interrupt_rpl_t*)head;
+  result_t* r = self->m_route[rpl->index & (s_max_pending - 1)];
+
+  if (rpl->hdr.cmd != zcash_fpga::BLS12_381_INTERRUPT_RPL || r == nullptr || r->index != rpl->index) return nullptr;
+  self->m_current = r;
+  r->pt = rpl->data_type;
+  r->len = len - sizeof(*rpl);
+  if (r->len > r->size) {
+    zlog_error("zcash_fpga_results: interrupt %d payload of %d bytes does not fit its %d byte buffer\n", r->index,
+               r->len, r->size);
+    r->rc = 1;
+    r->len = 0;
+    return nullptr;
+  }
+  return r->dat;
+}
+
+int zcash_fpga_results::poll() {
+  uint8_t head[sizeof(zcash_fpga::bls12_381_interrupt_rpl_t)];
+  const zcash_fpga::bls12_381_interrupt_rpl_t* rpl = (const zcash_fpga::bls12_381_interrupt_rpl_t*)head;
+  result_t* r;
+  int routed = 0, read_len;
+
+  for (;;) {
+    m_current = nullptr;
+    read_len = m_zfpga.read_stream_routed(head, sizeof(head), &route, this);
+    if (read_len <= 0) return read_len < 0 ? -1 : routed;
+    r = m_current;
+    if (r == nullptr) {
+      zlog_warn("zcash_fpga_results: dropped reply 0x%x (index %d) nobody expects\n", rpl->hdr.cmd,
+                read_len >= (int)sizeof(head) ? rpl->index : 0);
+      m_stats.dropped++;
+      continue;
+    }
+    m_route[r->index & (s_max_pending - 1)] = nullptr;
+    r->ready = true;
+    m_stats.routed++;
+    routed++;
+    if (r->cb != nullptr) r->cb(r->ctx, *r);
+  }
+}
+
+int zcash_fpga_results::wait(result_t& r) {
+  const zcash_fpga::wait_policy_t policy = m_zfpga.get_wait_policy(zcash_fpga::BLS12_381_INTERRUPT_RPL);
+  uint64_t start = now_ns();
+  uint64_t elapsed_us;
+
+  while (!r.ready) {
+    if (poll() < 0) return 1;
+    if (r.ready) break;
+
+    elapsed_us = (now_ns() - start) / 1000;
+    if (elapsed_us >= policy.timeout_us) {
+      zlog_error("zcash_fpga_results: timed out waiting for interrupt %d\n", r.index);
+      return 1;
+    }
+    if (elapsed_us >= policy.yield_us)
+      usleep(policy.sleep_us);
+    else if (elapsed_us >= policy.spin_us)
+      sched_yield();
+  }
+  return 0;
+}
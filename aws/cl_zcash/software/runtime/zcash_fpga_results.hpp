@@ -0,0 +1,122 @@
+//
+//  ZCash FPGA library BLS12_381 result pool and interrupt router.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_RESULTS_H_   /* Include guard */
+#define ZCASH_FPGA_RESULTS_H_
+
+#include <stdint.h>
+
+#include <memory>
+
+#include "zcash_fpga.hpp"
+
+/*
+ * Receives BLS12_381_INTERRUPT_RPL payloads straight into caller visible buffers. All
+ * buffers are allocated in the constructor, per_type for each value size (1, 2, 3, 4, 6
+ * and 12 slots), 64 byte aligned and padded to whole cache lines.
+ *
+ * expect() takes a buffer for the point type the SEND_INTERRUPT will return and routes
+ * the interrupt with that index to it. poll() reads each reply header, looks the index
+ * up and has read_stream_routed() put the payload in the buffer, then marks the result
+ * ready and calls its callback. release() gives the buffer back.
+ *
+ * The router owns the reply stream while results are expected: replies that are not an
+ * expected interrupt are logged and dropped. Not thread safe, like zcash_fpga itself.
+ */
+class zcash_fpga_results {
+
+  public:
+    static const unsigned int s_max_pending = 256;  // Must be a power of 2
+    static const unsigned int s_line_bytes = 64;
+
+    typedef struct result_s {
+      uint8_t*                 dat;    // Payload, 48 bytes per slot little endian
+      unsigned int             size;   // Capacity of dat in bytes
+      unsigned int             len;    // Payload bytes received
+      uint32_t                 index;
+      zcash_fpga::point_type_t pt;     // data_type of the reply
+      bool                     ready;
+      int                      rc;     // 0, or 1 if the payload did not fit and was dropped
+
+      // Owned by the router
+      unsigned int             cls;
+      void                     (*cb)(void* ctx, struct result_s& r);
+      void*                    ctx;
+      struct result_s*         next;
+    } result_t;
+
+    /*
+     * Called from poll() once the payload is in r.dat
+     */
+    typedef void (*callback_t)(void* ctx, result_t& r);
+
+    typedef struct {
+      uint64_t routed;
+      uint64_t dropped;     // Replies with no result expecting them
+      uint64_t exhausted;   // expect() calls that found no free buffer
+    } stats_t;
+
+    zcash_fpga_results(zcash_fpga& zfpga, unsigned int per_type = 16);
+    zcash_fpga_results(zcash_fpga_results const&) = delete;
+    void operator=(zcash_fpga_results const&) = delete;
+
+    /*
+     * Takes a buffer for a value of type pt and routes the interrupt with this index
+     * (the b field of SEND_INTERRUPT) to it. Returns nullptr when no buffer is free or
+     * the index (mod s_max_pending) is already expected.
+     */
+    result_t* expect(uint32_t index, zcash_fpga::point_type_t pt, callback_t cb = nullptr, void* ctx = nullptr);
+
+    /*
+     * Routes all waiting replies. Returns the number routed or -1 on error.
+     */
+    int poll();
+
+    /*
+     * Polls with the BLS12_381_INTERRUPT_RPL wait policy until r is ready. Returns 0 when
+     * ready, 1 on timeout or error.
+     */
+    int wait(result_t& r);
+
+    /*
+     * Returns the buffer to the pool, a result not yet ready stops being expected
+     */
+    void release(result_t* r);
+
+    unsigned int available(zcash_fpga::point_type_t pt) const;
+    stats_t get_stats() const { return m_stats; }
+
+  private:
+    static const unsigned int s_classes = 6;
+
+    zcash_fpga&                  m_zfpga;
+    std::unique_ptr<uint8_t[]>   m_mem;
+    std::unique_ptr<result_t[]>  m_results;
+    result_t*                    m_free[s_classes];
+    unsigned int                 m_free_cnt[s_classes];
+    result_t*                    m_route[s_max_pending];
+    result_t*                    m_current;   // Result the packet being read goes to
+    stats_t                      m_stats;
+
+    static unsigned int type_class(zcash_fpga::point_type_t pt);
+    static uint8_t* route(void* ctx, const uint8_t* head, unsigned int len);
+
+}; // zcash_fpga_results
+
+#endif // ZCASH_FPGA_RESULTS_H_
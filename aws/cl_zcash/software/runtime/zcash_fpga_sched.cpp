@@ -0,0 +1,187 @@
+#include "zcash_fpga_sched.hpp"
+#include "zcash_fpga_log.hpp"
+
+#include <string.h>
+#include <time.h>
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Which of a, b and c are data slots, and if a is a jump target. Returns false for
+// codes a job may not use: NOOP_WAIT, and SEND_INTERRUPT as the scheduler reads the
+// next interrupt as the job's result.
+static bool operands(zcash_fpga::bls12_381_code_t code, bool& a, bool& b, bool& c, bool& jump) {
+  a = b = c = jump = false;
+  switch (code) {
+    case zcash_fpga::COPY_REG:         a = b = true; break;
+    case zcash_fpga::JUMP:             jump = true; break;
+    case zcash_fpga::JUMP_IF_EQ:       jump = b = c = true; break;
+    case zcash_fpga::JUMP_NONZERO_SUB: jump = b = true; break;
+    case zcash_fpga::INV_ELEMENT:
+    case zcash_fpga::FINAL_EXP:        a = b = true; break;
+    case zcash_fpga::SUB_ELEMENT:
+    case zcash_fpga::ADD_ELEMENT:
+    case zcash_fpga::MUL_ELEMENT:
+    case zcash_fpga::POINT_MULT:
+    case zcash_fpga::MILLER_LOOP:
+    case zcash_fpga::ATE_PAIRING:      a = b = c = true; break;
+    default:                           return false;
+  }
+  return true;
+}
+
+zcash_fpga_sched::zcash_fpga_sched(zcash_fpga& zfpga, unsigned int regions, unsigned int first_inst,
+                                   unsigned int last_inst, unsigned int first_data, unsigned int last_data) :
+  m_zfpga(zfpga),
+  m_regions(regions < 2 ? 2 : regions),
+  m_first_inst(first_inst),
+  m_first_data(first_data) {
+
+  if (last_inst == 0 || last_inst > zfpga.bls12_381_get_inst_size())
+    last_inst = zfpga.bls12_381_get_inst_size();
+  if (last_data == 0 || last_data > zfpga.bls12_381_get_data_size())
+    last_data = zfpga.bls12_381_get_data_size();
+  // The last instruction slot is where the PC waits while region 0 is first written
+  m_inst_size = last_inst > first_inst + 1 ? (last_inst - first_inst - 1) / m_regions : 0;
+  m_park = m_first_inst + m_regions * m_inst_size;
+  m_data_size = last_data > first_data ? (last_data - first_data) / m_regions : 0;
+  if (m_inst_size < 3 || m_data_size == 0)
+    zlog_error("zcash_fpga_sched: no room for %d regions in instruction slots %d to %d, data slots %d to %d\n",
+               m_regions, first_inst, last_inst - 1, first_data, last_data - 1);
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+int zcash_fpga_sched::check(const job_t& job) const {
+  if (job.code.size() + 2 > m_inst_size) {
+    zlog_error("zcash_fpga_sched: job of %lu instructions, regions have %d\n", (unsigned long)job.code.size(),
+               m_inst_size - 2);
+    return 1;
+  }
+  if (job.result_slot >= m_data_size) {
+    zlog_error("zcash_fpga_sched: result slot %d outside the region of %d data slots\n", job.result_slot, m_data_size);
+    return 1;
+  }
+  for (unsigned int i = 0; i < job.code.size(); i++) {
+    const zcash_fpga::bls12_381_inst_t& in = job.code[i];
+    bool a, b, c, jump;
+    if (!operands(in.code, a, b, c, jump)) {
+      zlog_error("zcash_fpga_sched: instruction %d has code 0x%x, not allowed in a job\n", i, in.code);
+      return 1;
+    }
+    if ((a && in.a >= m_data_size) || (b && in.b >= m_data_size) || (c && in.c >= m_data_size) ||
+        (jump && in.a >= job.code.size())) {
+      zlog_error("zcash_fpga_sched: instruction %d has an operand outside the region\n", i);
+      return 1;
+    }
+  }
+  for (unsigned int i = 0; i < job.inputs.size(); i++) {
+    const input_t& in = job.inputs[i];
+    if (in.dat.size() % 48 != 0 || in.slot + in.dat.size() / 48 > m_data_size) {
+      zlog_error("zcash_fpga_sched: input %d of %lu bytes at slot %d does not fit the region\n", i,
+                 (unsigned long)in.dat.size(), in.slot);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int zcash_fpga_sched::upload(const job_t& job, unsigned int region, unsigned int index) {
+  int rc = 0;
+  const unsigned int data = m_first_data + region * m_data_size, first = m_first_inst + region * m_inst_size;
+  std::vector<zcash_fpga::bls12_381_inst_t> code(job.code);
+
+  for (unsigned int i = 0; i < job.inputs.size(); i++) {
+    const input_t& in = job.inputs[i];
+    if (in.dat.empty()) continue;
+    rc = m_zfpga.bls12_381_set_data_slots(data + in.slot, in.dat.data(), in.dat.size() / 48, in.pt);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  }
+
+  for (unsigned int i = 0; i < code.size(); i++) {
+    bool a, b, c, jump;
+    operands(code[i].code, a, b, c, jump);
+    if (a) code[i].a += data;
+    if (jump) code[i].a += first;
+    if (b) code[i].b += data;
+    if (c) code[i].c += data;
+  }
+  code.resize(code.size() + 2);
+  code[code.size() - 2].code = zcash_fpga::SEND_INTERRUPT;
+  code[code.size() - 2].a = data + job.result_slot;
+  code[code.size() - 2].b = index;
+  code[code.size() - 2].c = 0;
+  memset(&code.back(), 0, sizeof(code.back()));
+  rc = m_zfpga.bls12_381_set_inst_slots(first, code.data(), code.size());
+  fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  return 0;
+  out:
+    return 1;
+}
+
+int zcash_fpga_sched::run(const job_t* jobs, unsigned int n, std::vector<std::vector<uint8_t> >& results) {
+  int rc = 0, read_len;
+  unsigned int uploaded = 0, pc = 0;
+  uint64_t t0, wait_ns = 0;
+  uint8_t reply[STREAM_MAX_RPL_BYTES];
+  zcash_fpga::bls12_381_interrupt_rpl_t* rpl = (zcash_fpga::bls12_381_interrupt_rpl_t*)reply;
+
+  results.assign(n, std::vector<uint8_t>());
+  if (n == 0) return 0;
+  if (m_inst_size < 3 || m_data_size == 0) return 1;
+  for (unsigned int i = 0; i < n; i++)
+    if (check(jobs[i]) != 0) return 1;
+
+  // The coprocessor keeps reading the NOOP_WAIT it stopped at, code written over it
+  // would start running
+  rc = m_zfpga.bls12_381_get_curr_inst_slot(pc);
+  fail_on(rc, out, "ERROR: Unable to read from FPGA!\n");
+  if (pc >= m_first_inst && pc < m_first_inst + m_inst_size) {
+    zcash_fpga::bls12_381_inst_t noop;
+    memset(&noop, 0, sizeof(noop));
+    rc = m_zfpga.bls12_381_set_inst_slot(m_park, noop);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+    rc = m_zfpga.bls12_381_set_curr_inst_slot(m_park);
+    fail_on(rc, out, "ERROR: Unable to write to FPGA!\n");
+  }
+
+  t0 = now_ns();
+  rc = upload(jobs[0], 0, 0);
+  fail_on(rc, out, "ERROR: Unable to upload the job!\n");
+  uploaded = 1;
+  m_stats.upload_ns += now_ns() - t0;
+
+  for (unsigned int i = 0; i < n; i++) {
+    rc = m_zfpga.bls12_381_set_curr_inst_slot(m_first_inst + (i % m_regions) * m_inst_size);
+    fail_on(rc, out, "ERROR: Unable to start the job!\n");
+
+    // The regions of jobs before i are free, job i's is not
+    t0 = now_ns();
+    while (uploaded < n && uploaded < i + m_regions) {
+      rc = upload(jobs[uploaded], uploaded % m_regions, uploaded & 0xFFFF);
+      fail_on(rc, out, "ERROR: Unable to upload the job!\n");
+      uploaded++;
+    }
+    t0 = now_ns() - t0;
+    m_stats.upload_ns += t0;
+    m_stats.overlap_ns += t0;
+
+    read_len = m_zfpga.read_stream_wait(reply, sizeof(reply), zcash_fpga::BLS12_381_INTERRUPT_RPL, &wait_ns);
+    m_stats.wait_ns += wait_ns;
+    if (read_len <= 0) {
+      zlog_error("zcash_fpga_sched: no interrupt from job %d\n", i);
+      goto out;
+    }
+    if (rpl->index != (i & 0xFFFF) || (unsigned int)read_len < sizeof(*rpl)) {
+      zlog_error("zcash_fpga_sched: unexpected interrupt index %d for job %d\n", rpl->index, i);
+      goto out;
+    }
+    results[i].assign(reply + sizeof(*rpl), reply + read_len);
+    m_stats.jobs++;
+  }
+  return 0;
+  out:
+    return 1;
+}
@@ -0,0 +1,104 @@
+//
+//  ZCash FPGA library BLS12_381 double buffered job scheduler.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_SCHED_H_   /* Include guard */
+#define ZCASH_FPGA_SCHED_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "zcash_fpga.hpp"
+
+/*
+ * Runs BLS12_381 coprocessor jobs back to back with the host staging the next ones
+ * while the current one executes. The instruction and data slots given are split into
+ * regions regions (at least 2), job i goes to region i % regions:
+ *
+ *   upload job 0, start it
+ *   upload jobs 1 .. regions - 1
+ *   wait for job 0, start job 1, upload job regions into region 0, wait for job 1, ...
+ *
+ * so every upload but the first overlaps the execution of an earlier job. A job's code
+ * and input slots are numbered from 0 in its region and relocated (data operands and
+ * jump targets), it must not contain NOOP_WAIT or SEND_INTERRUPT. The scheduler
+ * appends SEND_INTERRUPT of result_slot and NOOP_WAIT, the interrupt payload (the
+ * slots of result_slot's point type) is the job's result.
+ *
+ * Only the first slot of an operand is checked to be in the region, values spanning
+ * several slots (e.g. FE12) have to fit by construction. The last instruction slot is
+ * kept for a NOOP_WAIT to move the PC to before writing region 0, the coprocessor
+ * re-reads the instruction it waits at and would start code written over it.
+ */
+class zcash_fpga_sched {
+
+  public:
+    typedef struct {
+      unsigned int               slot;  // Relative to the region
+      zcash_fpga::point_type_t   pt;
+      std::vector<uint8_t>       dat;   // 48 bytes per slot, little endian
+    } input_t;
+
+    typedef struct {
+      std::vector<zcash_fpga::bls12_381_inst_t> code;
+      std::vector<input_t>                      inputs;
+      unsigned int                              result_slot;
+    } job_t;
+
+    typedef struct {
+      uint64_t jobs;
+      uint64_t upload_ns;    // Host time writing inputs and code
+      uint64_t overlap_ns;   // Part of upload_ns spent while an earlier job was running
+      uint64_t wait_ns;      // Host time waiting for results
+    } stats_t;
+
+    /*
+     * Uses instruction slots first_inst to last_inst - 1 and data slots first_data to
+     * last_data - 1, a last slot of 0 is the end of that memory.
+     */
+    zcash_fpga_sched(zcash_fpga& zfpga, unsigned int regions = 2, unsigned int first_inst = 0,
+                     unsigned int last_inst = 0, unsigned int first_data = 0, unsigned int last_data = 0);
+
+    /*
+     * Runs the n jobs in order, results[i] is the interrupt payload of job i. Returns 0
+     * on success or 1 if a job does not fit a region or the FPGA could not be used.
+     */
+    int run(const job_t* jobs, unsigned int n, std::vector<std::vector<uint8_t> >& results);
+
+    unsigned int get_regions() const { return m_regions; }
+    unsigned int get_inst_slots() const { return m_inst_size; }   // Per region, with the two appended
+    unsigned int get_data_slots() const { return m_data_size; }   // Per region
+    stats_t get_stats() const { return m_stats; }
+
+  private:
+    zcash_fpga&  m_zfpga;
+    unsigned int m_regions;
+    unsigned int m_first_inst;
+    unsigned int m_first_data;
+    unsigned int m_inst_size;
+    unsigned int m_data_size;
+    unsigned int m_park;
+    stats_t      m_stats;
+
+    int check(const job_t& job) const;
+    int upload(const job_t& job, unsigned int region, unsigned int index);
+
+}; // zcash_fpga_sched
+
+#endif // ZCASH_FPGA_SCHED_H_
@@ -0,0 +1,763 @@
+#include "zcash_fpga_sim.hpp"
+#include "zcash_fpga_log.hpp"
+
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+// Offsets in the BLS12_381 register map, see bls12_381_axi_bridge.sv
+#define BLS_INST_START 0x1000
+#define BLS_DATA_START 0x2000
+
+static const char* s_bls12_381_p =
+  "1a0111ea397fe69a4b1ba7b6434bacd764774b84f38512bf6730d2a0f6b0f6241eabfffeb153ffffb9feffffffffaaab";
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Stands in for the time the CPU is stalled on an MMIO access
+static inline void spin_ns(uint64_t ns) {
+  if (ns == 0) return;
+  uint64_t end = now_ns() + ns;
+  while (now_ns() < end);
+}
+
+/*
+ * Fp2 = Fp[u]/(u^2 + 1) over the BLS12_381 prime, Fp elements are used with c1 = 0.
+ * Only what POINT_MULT and the element ops need, speed is not a goal.
+ */
+struct fp2_t {
+  BIGNUM* c0;
+  BIGNUM* c1;
+  fp2_t() : c0(BN_new()), c1(BN_new()) {}
+  ~fp2_t() { BN_free(c0); BN_free(c1); }
+  fp2_t(fp2_t const&) = delete;
+  void operator=(fp2_t const&) = delete;
+};
+
+static void fp2_copy(fp2_t& r, const fp2_t& a) {
+  BN_copy(r.c0, a.c0);
+  BN_copy(r.c1, a.c1);
+}
+
+static void fp2_add(fp2_t& r, const fp2_t& a, const fp2_t& b, const BIGNUM* p, BN_CTX* ctx) {
+  BN_mod_add(r.c0, a.c0, b.c0, p, ctx);
+  BN_mod_add(r.c1, a.c1, b.c1, p, ctx);
+}
+
+static void fp2_sub(fp2_t& r, const fp2_t& a, const fp2_t& b, const BIGNUM* p, BN_CTX* ctx) {
+  BN_mod_sub(r.c0, a.c0, b.c0, p, ctx);
+  BN_mod_sub(r.c1, a.c1, b.c1, p, ctx);
+}
+
+// (a0 + a1.u)(b0 + b1.u) = (a0.b0 - a1.b1) + (a0.b1 + a1.b0).u, r may alias a or b
+static void fp2_mul(fp2_t& r, const fp2_t& a, const fp2_t& b, const BIGNUM* p, BN_CTX* ctx) {
+  BN_CTX_start(ctx);
+  BIGNUM* t0 = BN_CTX_get(ctx);
+  BIGNUM* t1 = BN_CTX_get(ctx);
+  BIGNUM* t2 = BN_CTX_get(ctx);
+  BN_mod_mul(t0, a.c0, b.c0, p, ctx);
+  BN_mod_mul(t1, a.c1, b.c1, p, ctx);
+  BN_mod_mul(t2, a.c0, b.c1, p, ctx);
+  BN_mod_mul(r.c1, a.c1, b.c0, p, ctx);
+  BN_mod_add(r.c1, r.c1, t2, p, ctx);
+  BN_mod_sub(r.c0, t0, t1, p, ctx);
+  BN_CTX_end(ctx);
+}
+
+// 1/(a0 + a1.u) = (a0 - a1.u)/(a0^2 + a1^2), the inverse of 0 is 0
+static void fp2_inv(fp2_t& r, const fp2_t& a, const BIGNUM* p, BN_CTX* ctx) {
+  BN_CTX_start(ctx);
+  BIGNUM* n = BN_CTX_get(ctx);
+  BIGNUM* t = BN_CTX_get(ctx);
+  BN_mod_sqr(n, a.c0, p, ctx);
+  BN_mod_sqr(t, a.c1, p, ctx);
+  BN_mod_add(n, n, t, p, ctx);
+  if (BN_is_zero(n) || BN_mod_inverse(n, n, p, ctx) == NULL) {
+    BN_zero(r.c0);
+    BN_zero(r.c1);
+  } else {
+    BN_mod_mul(r.c0, a.c0, n, p, ctx);
+    BN_mod_mul(r.c1, a.c1, n, p, ctx);
+    BN_mod_sub(r.c1, p, r.c1, p, ctx);
+  }
+  BN_CTX_end(ctx);
+}
+
+static bool fp2_eq(const fp2_t& a, const fp2_t& b) {
+  return BN_cmp(a.c0, b.c0) == 0 && BN_cmp(a.c1, b.c1) == 0;
+}
+
+// Affine point on E(Fp) or E'(Fp2), both y^2 = x^3 + b so b is not needed
+struct af_point_t {
+  fp2_t x;
+  fp2_t y;
+  bool  inf;
+  af_point_t() : inf(true) {}
+};
+
+static void point_dbl(af_point_t& r, const BIGNUM* p, BN_CTX* ctx) {
+  if (r.inf) return;
+  if (BN_is_zero(r.y.c0) && BN_is_zero(r.y.c1)) {
+    r.inf = true;
+    return;
+  }
+  fp2_t l, t;
+  // l = 3x^2 / 2y
+  fp2_mul(l, r.x, r.x, p, ctx);
+  fp2_add(t, l, l, p, ctx);
+  fp2_add(l, t, l, p, ctx);
+  fp2_add(t, r.y, r.y, p, ctx);
+  fp2_inv(t, t, p, ctx);
+  fp2_mul(l, l, t, p, ctx);
+  // x3 = l^2 - 2x, y3 = l(x - x3) - y
+  fp2_mul(t, l, l, p, ctx);
+  fp2_sub(t, t, r.x, p, ctx);
+  fp2_sub(t, t, r.x, p, ctx);
+  fp2_sub(r.x, r.x, t, p, ctx);
+  fp2_mul(r.x, l, r.x, p, ctx);
+  fp2_sub(r.y, r.x, r.y, p, ctx);
+  fp2_copy(r.x, t);
+}
+
+static void point_add(af_point_t& r, const af_point_t& a, const BIGNUM* p, BN_CTX* ctx) {
+  if (a.inf) return;
+  if (r.inf) {
+    fp2_copy(r.x, a.x);
+    fp2_copy(r.y, a.y);
+    r.inf = false;
+    return;
+  }
+  if (fp2_eq(r.x, a.x)) {
+    if (fp2_eq(r.y, a.y))
+      point_dbl(r, p, ctx);
+    else
+      r.inf = true;
+    return;
+  }
+  fp2_t l, t;
+  // l = (y2 - y1) / (x2 - x1)
+  fp2_sub(l, a.y, r.y, p, ctx);
+  fp2_sub(t, a.x, r.x, p, ctx);
+  fp2_inv(t, t, p, ctx);
+  fp2_mul(l, l, t, p, ctx);
+  // x3 = l^2 - x1 - x2, y3 = l(x1 - x3) - y1
+  fp2_mul(t, l, l, p, ctx);
+  fp2_sub(t, t, r.x, p, ctx);
+  fp2_sub(t, t, a.x, p, ctx);
+  fp2_sub(r.x, r.x, t, p, ctx);
+  fp2_mul(r.x, l, r.x, p, ctx);
+  fp2_sub(r.y, r.x, r.y, p, ctx);
+  fp2_copy(r.x, t);
+}
+
+static void point_mult(af_point_t& r, const BIGNUM* k, const af_point_t& a, const BIGNUM* p, BN_CTX* ctx) {
+  r.inf = true;
+  for (int i = BN_num_bits(k) - 1; i >= 0; i--) {
+    point_dbl(r, p, ctx);
+    if (BN_is_bit_set(k, i)) point_add(r, a, p, ctx);
+  }
+}
+
+static bool is_fp2_type(zcash_fpga::point_type_t pt) {
+  return pt == zcash_fpga::FE2 || pt == zcash_fpga::FP2_AF || pt == zcash_fpga::FP2_JB;
+}
+
+zcash_fpga_sim::model_t zcash_fpga_sim::default_model() {
+  model_t m;
+  m.tx_fifo_words = s_fifo_words;
+  m.rx_fifo_words = s_fifo_words;
+  m.mmio_read_ns = 1000;
+  m.mmio_write_ns = 100;
+  m.wc_line_ns = 25;
+  m.status_ns = 1000;
+  m.secp256k1_ns = 100000;
+  m.equihash_ns = 50000;
+  m.bls12_381_ctl_ns = 4 * s_clk_ns;
+  m.bls12_381_add_ns = 8 * s_clk_ns;
+  m.bls12_381_mul_ns = 30 * s_clk_ns;
+  m.bls12_381_inv_ns = 5000 * s_clk_ns;
+  m.bls12_381_point_mult_ns = 400000;
+  m.bls12_381_pairing_ns = 1000000;
+  return m;
+}
+
+zcash_fpga_sim::zcash_fpga_sim(uint64_t cmd_cap, const model_t& model, bool axi4) :
+  zcash_fpga_loopback(cmd_cap, axi4),
+  m_model(model),
+  m_stop(false),
+  m_cmd_words(0),
+  m_rx_blocked(false),
+  m_bls_pc(0),
+  m_bls_new_pc(-1),
+  m_bls_cycles(0),
+  m_bls_chain(false) {
+  m_tx_depth = model.tx_fifo_words;
+  memset(m_engine_free, 0, sizeof(m_engine_free));
+  memset(m_bls_inst, 0, sizeof(m_bls_inst));
+  memset(m_bls_data, 0, sizeof(m_bls_data));
+  m_bls_exec.busy = false;
+  m_bls_exec.done_ns = 0;
+  m_bls_exec.next_pc = 0;
+
+  m_bn_ctx = BN_CTX_new();
+  m_p = NULL;
+  BN_hex2bn(&m_p, s_bls12_381_p);
+
+  m_device = std::thread(&zcash_fpga_sim::device_thread, this);
+}
+
+zcash_fpga_sim::~zcash_fpga_sim() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_cv.notify_one();
+  m_device.join();
+  BN_free(m_p);
+  BN_CTX_free(m_bn_ctx);
+}
+
+unsigned int zcash_fpga_sim::tx_fifo_words() const {
+  return m_tx.size() / 4 + m_cmd_words;
+}
+
+int zcash_fpga_sim::peek(uint64_t offset, uint32_t* value) {
+  int rc = 0;
+  spin_ns(m_model.mmio_read_ns);
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (is_bls(offset)) {
+    bls_peek(offset, value);
+    return 0;
+  }
+  rc = zcash_fpga_loopback::peek(offset, value);
+  if (offset == AXI_FIFO_RDFD_OFFSET && m_rx_blocked) m_cv.notify_one();
+  return rc;
+}
+
+int zcash_fpga_sim::poke(uint64_t offset, uint32_t value) {
+  spin_ns(m_model.mmio_write_ns);
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (is_bls(offset)) {
+    bls_poke(offset, value);
+    m_cv.notify_one();
+    return 0;
+  }
+  return zcash_fpga_loopback::poke(offset, value);
+}
+
+// Same cost per word as peek / poke, but the device thread is only woken once per range
+int zcash_fpga_sim::write_regs(uint64_t offset, const uint32_t* data, unsigned int words) {
+  if (!is_bls(offset)) return zcash_fpga_transport::write_regs(offset, data, words);
+  spin_ns((uint64_t)m_model.mmio_write_ns * words);
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (unsigned int i = 0; i < words; i++)
+    bls_poke(offset + 4*i, data[i]);
+  m_cv.notify_one();
+  return 0;
+}
+
+int zcash_fpga_sim::read_regs(uint64_t offset, uint32_t* data, unsigned int words) {
+  if (!is_bls(offset)) return zcash_fpga_transport::read_regs(offset, data, words);
+  spin_ns((uint64_t)m_model.mmio_read_ns * words);
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (unsigned int i = 0; i < words; i++)
+    bls_peek(offset + 4*i, &data[i]);
+  return 0;
+}
+
+int zcash_fpga_sim::write_data(const uint8_t* data, unsigned int len) {
+  spin_ns((uint64_t)m_model.mmio_write_ns * ((len + word_bytes() - 1) / word_bytes()));
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return zcash_fpga_loopback::write_data(data, len);
+}
+
+int zcash_fpga_sim::write_data_burst(const uint8_t* data, unsigned int len) {
+  if (!m_axi4) return write_data(data, len);
+  spin_ns((uint64_t)m_model.wc_line_ns * ((len + 63) / 64));
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return zcash_fpga_loopback::write_data(data, len);
+}
+
+int zcash_fpga_sim::read_data(uint8_t* data, unsigned int len) {
+  int rc = 0;
+  spin_ns((uint64_t)m_model.mmio_read_ns * ((len + word_bytes() - 1) / word_bytes()));
+  std::lock_guard<std::mutex> lock(m_mutex);
+  rc = zcash_fpga_loopback::read_data(data, len);
+  if (m_rx_blocked) m_cv.notify_one();
+  return rc;
+}
+
+// The device thread posts it from deliver()
+int zcash_fpga_sim::set_reply_fd(int fd) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return zcash_fpga_loopback::set_reply_fd(fd);
+}
+
+// Called with m_mutex held from the TLR write
+void zcash_fpga_sim::handle_packet(const uint8_t* data, unsigned int len) {
+  cmd_t cmd;
+  cmd.data.assign(data, data + len);
+  cmd.words = m_tx.size() / 4;
+  m_cmd_words += cmd.words;
+  m_cmds.push_back(std::move(cmd));
+  m_cv.notify_one();
+}
+
+void zcash_fpga_sim::make_reply(const uint8_t* data, unsigned int len, std::vector<uint8_t>& rpl) {
+  const zcash_fpga::header_t* hdr = (const zcash_fpga::header_t*)data;
+
+  if (hdr->cmd == zcash_fpga::VERIFY_SECP256K1_SIG &&
+      (m_cmd_cap & zcash_fpga::ENB_VERIFY_SECP256K1_SIG) != 0 &&
+      len >= sizeof(zcash_fpga::verify_secp256k1_sig_t)) {
+    const zcash_fpga::verify_secp256k1_sig_t* sig = (const zcash_fpga::verify_secp256k1_sig_t*)data;
+    zcash_fpga::verify_secp256k1_sig_rpl_t r;
+    uint64_t cycles = m_model.secp256k1_ns / s_clk_ns;
+    memset(&r, 0, sizeof(r));
+    r.hdr.cmd = zcash_fpga::VERIFY_SECP256K1_SIG_RPL;
+    r.hdr.len = sizeof(r);
+    r.index = sig->index;
+
+    std::string key((const char*)sig->s, sizeof(*sig) - offsetof(zcash_fpga::verify_secp256k1_sig_t, s));
+    std::unordered_map<std::string, uint8_t>::const_iterator it = m_secp256k1_bm.find(key);
+    if (it != m_secp256k1_bm.end()) {
+      r.bm = (zcash_fpga::secp256k1_ver_t)it->second;
+    } else {
+      r.bm = (zcash_fpga::secp256k1_ver_t)m_secp256k1.verify(*sig);
+      if (m_secp256k1_bm.size() >= 4096) m_secp256k1_bm.clear();
+      m_secp256k1_bm[key] = r.bm;
+    }
+    r.cycle_cnt = cycles > 0xFFFF ? 0xFFFF : cycles;
+    rpl.assign((const uint8_t*)&r, (const uint8_t*)&r + sizeof(r));
+    return;
+  }
+
+  if (hdr->cmd == zcash_fpga::VERIFY_EQUIHASH &&
+      (m_cmd_cap & zcash_fpga::ENB_VERIFY_EQUIHASH_200_9) != 0 &&
+      len >= sizeof(zcash_fpga::verify_equihash_t)) {
+    const zcash_fpga::verify_equihash_t* eq = (const zcash_fpga::verify_equihash_t*)data;
+    zcash_fpga::verify_equihash_rpl_t r;
+    memset(&r, 0, sizeof(r));
+    r.hdr.cmd = zcash_fpga::VERIFY_EQUIHASH_RPL;
+    r.hdr.len = sizeof(r);
+    r.index = eq->index;
+
+    std::string key((const char*)&eq->cblockheader_sol, zcash_equihash_cpu<200,9>::s_block_bytes);
+    std::unordered_map<std::string, uint8_t>::const_iterator it = m_equihash_bm.find(key);
+    if (it != m_equihash_bm.end()) {
+      r.bm = (zcash_fpga::equihash_bm_t)it->second;
+    } else {
+      r.bm = (zcash_fpga::equihash_bm_t)m_equihash.verify((const uint8_t*)&eq->cblockheader_sol);
+      if (m_equihash_bm.size() >= 4096) m_equihash_bm.clear();
+      m_equihash_bm[key] = r.bm;
+    }
+    rpl.assign((const uint8_t*)&r, (const uint8_t*)&r + sizeof(r));
+    return;
+  }
+
+  zcash_fpga_loopback::make_reply(data, len, rpl);
+}
+
+unsigned int zcash_fpga_sim::engine(const cmd_t& cmd) const {
+  switch (((const zcash_fpga::header_t*)cmd.data.data())->cmd) {
+    case zcash_fpga::VERIFY_SECP256K1_SIG:
+      return (m_cmd_cap & zcash_fpga::ENB_VERIFY_SECP256K1_SIG) != 0 ? ENGINE_SECP256K1 : ENGINE_CTL;
+    case zcash_fpga::VERIFY_EQUIHASH:
+      return (m_cmd_cap & (zcash_fpga::ENB_VERIFY_EQUIHASH_200_9 | zcash_fpga::ENB_VERIFY_EQUIHASH_144_5)) != 0 ?
+             ENGINE_EQUIHASH : ENGINE_CTL;
+    default:
+      return ENGINE_CTL;
+  }
+}
+
+uint64_t zcash_fpga_sim::service_ns(const cmd_t& cmd) const {
+  switch (engine(cmd)) {
+    case ENGINE_SECP256K1: return m_model.secp256k1_ns;
+    case ENGINE_EQUIHASH:  return m_model.equihash_ns;
+    default:               return m_model.status_ns;
+  }
+}
+
+// Moves replies that are ready into the receive FIFO while there is room
+void zcash_fpga_sim::deliver(uint64_t now) {
+  m_rx_blocked = false;
+  while (!m_pending.empty() && m_pending.begin()->first <= now) {
+    const std::vector<uint8_t>& rpl = m_pending.begin()->second;
+    if (rx_fifo_words() + (rpl.size() + 3) / 4 > m_model.rx_fifo_words) {
+      m_rx_blocked = true;
+      return;
+    }
+    push_reply(rpl.data(), rpl.size());
+    m_pending.erase(m_pending.begin());
+  }
+}
+
+void zcash_fpga_sim::device_thread() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  while (!m_stop) {
+    uint64_t now = now_ns();
+    uint64_t next = UINT64_MAX;
+
+    // Packets leave the transmit FIFO in order, the head waits for its engine
+    while (!m_cmds.empty()) {
+      unsigned int e = engine(m_cmds.front());
+      if (m_engine_free[e] > now) {
+        next = m_engine_free[e];
+        break;
+      }
+      cmd_t cmd = std::move(m_cmds.front());
+      m_cmds.pop_front();
+      m_cmd_words -= cmd.words;
+      m_engine_free[e] = now + service_ns(cmd);
+      uint64_t ready = m_engine_free[e];
+
+      // Verification can take a while, let the host keep writing
+      std::vector<uint8_t> rpl;
+      lock.unlock();
+      make_reply(cmd.data.data(), cmd.data.size(), rpl);
+      lock.lock();
+      m_pending.insert(std::make_pair(ready, std::move(rpl)));
+      if (m_stop) return;
+    }
+
+    if ((m_cmd_cap & zcash_fpga::ENB_BLS12_381) != 0)
+      bls_run(now, next);
+
+    deliver(now_ns());
+    if (!m_rx_blocked && !m_pending.empty() && m_pending.begin()->first < next)
+      next = m_pending.begin()->first;
+
+    now = now_ns();
+    if (next == UINT64_MAX) {
+      m_cv.wait(lock);
+    } else if (next > now + 100000) {
+      // Sleeps overshoot, wake early and spin the rest
+      m_cv.wait_for(lock, std::chrono::nanoseconds(next - now - 50000));
+    } else {
+      // Also when more is due now, so the host is not locked out
+      lock.unlock();
+      do {
+        sched_yield();
+      } while (now_ns() < next);
+      lock.lock();
+    }
+  }
+}
+
+bool zcash_fpga_sim::is_bls(uint64_t offset) const {
+  return offset >= BLS12_381_OFFSET && offset < BLS12_381_OFFSET + BLS_DATA_START + s_bls_slots * 64;
+}
+
+void zcash_fpga_sim::bls_peek(uint64_t offset, uint32_t* value) {
+  uint64_t a = offset - BLS12_381_OFFSET;
+  *value = 0;
+  if (a < BLS_INST_START) {
+    switch (a) {
+      case 0x0:  *value = BLS_INST_START; break;
+      case 0x4:  *value = BLS_DATA_START; break;
+      case 0x8:  *value = 8; break;
+      case 0xC:  *value = 8; break;
+      case 0x10: *value = m_bls_pc; break;
+      case 0x14: *value = m_bls_cycles; break;
+      default:   *value = 0xbeef; break;
+    }
+  } else if (a < BLS_DATA_START) {
+    a -= BLS_INST_START;
+    if (a / 8 < s_bls_slots && a % 8 <= 4) memcpy(value, &m_bls_inst[a / 8][a % 8], 4);
+  } else {
+    a -= BLS_DATA_START;
+    if (a % 64 <= 44) memcpy(value, &m_bls_data[a / 64][a % 64], 4);
+  }
+}
+
+void zcash_fpga_sim::bls_poke(uint64_t offset, uint32_t value) {
+  uint64_t a = offset - BLS12_381_OFFSET;
+  if (a < BLS_INST_START) {
+    if (a == 0x0) {
+      if (value & 1) memset(m_bls_inst, 0, sizeof(m_bls_inst));
+      if (value & 2) memset(m_bls_data, 0, sizeof(m_bls_data));
+    } else if (a == 0x10) {
+      // Taken when the current instruction finishes, like new_inst_pt_val_l
+      if (m_bls_exec.busy) {
+        m_bls_new_pc = value % s_bls_slots;
+      } else {
+        m_bls_pc = value % s_bls_slots;
+        m_bls_chain = false;
+      }
+    }
+  } else if (a < BLS_DATA_START) {
+    a -= BLS_INST_START;
+    if (a / 8 < s_bls_slots && a % 8 <= 4) memcpy(&m_bls_inst[a / 8][a % 8], &value, 4);
+  } else {
+    a -= BLS_DATA_START;
+    if (a % 64 <= 44) memcpy(&m_bls_data[a / 64][a % 64], &value, 4);
+  }
+}
+
+zcash_fpga::point_type_t zcash_fpga_sim::bls_type(unsigned int slot) const {
+  return (zcash_fpga::point_type_t)(m_bls_data[slot % s_bls_slots][47] >> 5);
+}
+
+void zcash_fpga_sim::bls_get(unsigned int slot, BIGNUM* bn) const {
+  uint8_t dat[48];
+  memcpy(dat, m_bls_data[slot % s_bls_slots], 48);
+  dat[47] &= 0x1F;
+  BN_lebin2bn(dat, 48, bn);
+}
+
+// Staged in m_bls_exec until the instruction finishes
+void zcash_fpga_sim::bls_put(unsigned int slot, zcash_fpga::point_type_t pt, const BIGNUM* bn) {
+  std::vector<uint8_t> dat(48, 0);
+  BN_bn2lebinpad(bn, dat.data(), 48);
+  dat[47] = (dat[47] & 0x1F) | (pt << 5);
+  m_bls_exec.writes.push_back(std::make_pair(slot % s_bls_slots, std::move(dat)));
+}
+
+void zcash_fpga_sim::bls_get_slots(unsigned int slot, uint8_t* dat, unsigned int n) const {
+  for (unsigned int i = 0; i < n; i++) {
+    memcpy(dat + 48*i, m_bls_data[(slot + i) % s_bls_slots], 48);
+    dat[48*i + 47] &= 0x1F;
+  }
+}
+
+void zcash_fpga_sim::bls_put_slots(unsigned int slot, zcash_fpga::point_type_t pt, const uint8_t* dat,
+                                   unsigned int n) {
+  for (unsigned int i = 0; i < n; i++) {
+    std::vector<uint8_t> d(dat + 48*i, dat + 48*(i + 1));
+    d[47] = (d[47] & 0x1F) | (pt << 5);
+    m_bls_exec.writes.push_back(std::make_pair((slot + i) % s_bls_slots, std::move(d)));
+  }
+}
+
+void zcash_fpga_sim::bls_commit() {
+  for (size_t i = 0; i < m_bls_exec.writes.size(); i++)
+    memcpy(m_bls_data[m_bls_exec.writes[i].first], m_bls_exec.writes[i].second.data(), 48);
+  if (!m_bls_exec.interrupt.empty())
+    m_pending.insert(std::make_pair(m_bls_exec.done_ns, std::move(m_bls_exec.interrupt)));
+  m_bls_exec.writes.clear();
+  m_bls_exec.interrupt.clear();
+  m_bls_exec.busy = false;
+
+  m_bls_pc = m_bls_new_pc >= 0 ? m_bls_new_pc : m_bls_exec.next_pc;
+  m_bls_chain = m_bls_new_pc < 0;
+  m_bls_new_pc = -1;
+}
+
+// Runs the program until a NOOP_WAIT or an instruction that is still in progress
+void zcash_fpga_sim::bls_run(uint64_t now, uint64_t& next) {
+  // Bounded so a program that loops forever still lets the host in
+  for (unsigned int n = 0; n < 4096; n++) {
+    if (m_bls_exec.busy) {
+      if (m_bls_exec.done_ns > now) {
+        if (m_bls_exec.done_ns < next) next = m_bls_exec.done_ns;
+        return;
+      }
+      bls_commit();
+    }
+
+    zcash_fpga::bls12_381_inst_t inst;
+    memcpy(&inst, m_bls_inst[m_bls_pc], sizeof(inst));
+    if (inst.code == zcash_fpga::NOOP_WAIT) {
+      m_bls_chain = false;
+      return;
+    }
+
+    uint64_t start = m_bls_chain ? m_bls_exec.done_ns : now;
+    m_bls_exec.next_pc = (m_bls_pc + 1) % s_bls_slots;
+    m_bls_exec.done_ns = start + bls_execute(inst);
+    m_bls_exec.busy = true;
+
+    // Computing took longer than the model, give the host a chance to see the
+    // instruction in progress before it finishes
+    if (m_bls_exec.done_ns <= now_ns()) break;
+  }
+  next = now;
+}
+
+// Computes the result of one instruction into m_bls_exec and returns its run time
+uint64_t zcash_fpga_sim::bls_execute(const zcash_fpga::bls12_381_inst_t& inst) {
+  zcash_fpga::point_type_t pt = bls_type(inst.a);
+  unsigned int width = is_fp2_type(pt) ? 2 : 1;
+  uint64_t t = m_model.bls12_381_ctl_ns;
+  BN_CTX* ctx = m_bn_ctx;
+
+  BN_CTX_start(ctx);
+  BIGNUM* x = BN_CTX_get(ctx);
+  BIGNUM* y = BN_CTX_get(ctx);
+
+  switch (inst.code) {
+    case zcash_fpga::COPY_REG:
+      m_bls_exec.writes.push_back(std::make_pair(inst.b % s_bls_slots,
+        std::vector<uint8_t>(m_bls_data[inst.a % s_bls_slots], m_bls_data[inst.a % s_bls_slots] + 48)));
+      break;
+    case zcash_fpga::JUMP:
+      m_bls_exec.next_pc = inst.a % s_bls_slots;
+      break;
+    case zcash_fpga::JUMP_IF_EQ:
+      // Only the low 64 bits are compared
+      if (memcmp(m_bls_data[inst.b % s_bls_slots], m_bls_data[inst.c % s_bls_slots], 8) == 0)
+        m_bls_exec.next_pc = inst.a % s_bls_slots;
+      break;
+    case zcash_fpga::JUMP_NONZERO_SUB: {
+      uint64_t v;
+      memcpy(&v, m_bls_data[inst.b % s_bls_slots], 8);
+      if (v != 0) {
+        std::vector<uint8_t> dat(m_bls_data[inst.b % s_bls_slots], m_bls_data[inst.b % s_bls_slots] + 48);
+        v--;
+        memcpy(dat.data(), &v, 8);
+        m_bls_exec.writes.push_back(std::make_pair(inst.b % s_bls_slots, std::move(dat)));
+        m_bls_exec.next_pc = inst.a % s_bls_slots;
+      }
+      break;
+    }
+    case zcash_fpga::SEND_INTERRUPT: {
+      // bls12_381_interrupt_rpl_t then the slots without their point type bits
+      zcash_fpga::bls12_381_interrupt_rpl_t r;
+      unsigned int size = zcash_fpga::bls12_381_point_type_size(pt);
+      memset(&r, 0, sizeof(r));
+      r.hdr.cmd = zcash_fpga::BLS12_381_INTERRUPT_RPL;
+      r.hdr.len = sizeof(r);
+      r.index = inst.b;
+      r.data_type = pt;
+      m_bls_exec.interrupt.assign((const uint8_t*)&r, (const uint8_t*)&r + sizeof(r));
+      for (unsigned int i = 0; i < size; i++) {
+        const uint8_t* dat = m_bls_data[(inst.a + i) % s_bls_slots];
+        m_bls_exec.interrupt.insert(m_bls_exec.interrupt.end(), dat, dat + 48);
+        m_bls_exec.interrupt.back() &= 0x1F;
+      }
+      break;
+    }
+    case zcash_fpga::ADD_ELEMENT:
+    case zcash_fpga::SUB_ELEMENT:
+      for (unsigned int i = 0; i < width; i++) {
+        bls_get(inst.a + i, x);
+        bls_get(inst.b + i, y);
+        if (inst.code == zcash_fpga::ADD_ELEMENT)
+          BN_mod_add(x, x, y, m_p, ctx);
+        else
+          BN_mod_sub(x, x, y, m_p, ctx);
+        bls_put(inst.c + i, pt, x);
+      }
+      t = (uint64_t)m_model.bls12_381_add_ns * width;
+      break;
+    case zcash_fpga::MUL_ELEMENT:
+    case zcash_fpga::INV_ELEMENT: {
+      if (pt == zcash_fpga::FE12 && inst.code == zcash_fpga::MUL_ELEMENT) {
+        bls12_381_fe12_t a, b;
+        bls_get_slots(inst.a, &a.dat[0][0], a.s_slots);
+        bls_get_slots(inst.b, &b.dat[0][0], b.s_slots);
+        m_bls_cpu.fe12_mul(a, b, a);
+        bls_put_slots(inst.c, pt, &a.dat[0][0], a.s_slots);
+        t = (uint64_t)m_model.bls12_381_mul_ns * 54;
+        break;
+      }
+      // INV_ELEMENT treats everything that is not FE as FE2, like the RTL
+      if (inst.code == zcash_fpga::INV_ELEMENT) width = pt == zcash_fpga::FE ? 1 : 2;
+      fp2_t a, b;
+      bls_get(inst.a, a.c0);
+      BN_zero(a.c1);
+      if (width == 2) bls_get(inst.a + 1, a.c1);
+      if (inst.code == zcash_fpga::MUL_ELEMENT) {
+        bls_get(inst.b, b.c0);
+        BN_zero(b.c1);
+        if (width == 2) bls_get(inst.b + 1, b.c1);
+        fp2_mul(a, a, b, m_p, ctx);
+        t = (uint64_t)m_model.bls12_381_mul_ns * (width == 2 ? 3 : 1);
+        bls_put(inst.c, pt, a.c0);
+        if (width == 2) bls_put(inst.c + 1, pt, a.c1);
+      } else {
+        fp2_inv(a, a, m_p, ctx);
+        t = (uint64_t)m_model.bls12_381_inv_ns * width;
+        bls_put(inst.b, pt, a.c0);
+        if (width == 2) bls_put(inst.b + 1, pt, a.c1);
+      }
+      break;
+    }
+    case zcash_fpga::POINT_MULT: {
+      // Scalar in slot a, affine point in b, jacobian result (Z = 1) in c
+      zcash_fpga::point_type_t ppt = bls_type(inst.b);
+      bool g2 = ppt != zcash_fpga::FP_AF;
+      af_point_t p, r;
+      bls_get(inst.a, x);
+      if (g2) {
+        bls_get(inst.b, p.x.c0);
+        bls_get(inst.b + 1, p.x.c1);
+        bls_get(inst.b + 2, p.y.c0);
+        bls_get(inst.b + 3, p.y.c1);
+      } else {
+        bls_get(inst.b, p.x.c0);
+        bls_get(inst.b + 1, p.y.c0);
+        BN_zero(p.x.c1);
+        BN_zero(p.y.c1);
+      }
+      p.inf = false;
+      point_mult(r, x, p, m_p, ctx);
+
+      // The point at infinity has Z = 0
+      if (r.inf) {
+        BN_zero(r.x.c0);
+        BN_zero(r.x.c1);
+        BN_zero(r.y.c0);
+        BN_zero(r.y.c1);
+      }
+      if (r.inf)
+        BN_zero(y);
+      else
+        BN_one(y);
+      if (g2) {
+        bls_put(inst.c,     zcash_fpga::FP2_JB, r.x.c0);
+        bls_put(inst.c + 1, zcash_fpga::FP2_JB, r.x.c1);
+        bls_put(inst.c + 2, zcash_fpga::FP2_JB, r.y.c0);
+        bls_put(inst.c + 3, zcash_fpga::FP2_JB, r.y.c1);
+        bls_put(inst.c + 4, zcash_fpga::FP2_JB, y);
+        BN_zero(y);
+        bls_put(inst.c + 5, zcash_fpga::FP2_JB, y);
+        t = (uint64_t)m_model.bls12_381_point_mult_ns * 3;
+      } else {
+        bls_put(inst.c,     zcash_fpga::FP_JB, r.x.c0);
+        bls_put(inst.c + 1, zcash_fpga::FP_JB, r.y.c0);
+        bls_put(inst.c + 2, zcash_fpga::FP_JB, y);
+        t = m_model.bls12_381_point_mult_ns;
+      }
+      break;
+    }
+    case zcash_fpga::MILLER_LOOP:
+    case zcash_fpga::ATE_PAIRING: {
+      // G1 affine point in slot a, G2 affine point in b, FE12 result in c
+      bls12_381_g1_af_t p;
+      bls12_381_g2_af_t q;
+      bls12_381_fe12_t f;
+      bls_get_slots(inst.a, &p.dat[0][0], p.s_slots);
+      bls_get_slots(inst.b, &q.dat[0][0], q.s_slots);
+      if (inst.code == zcash_fpga::MILLER_LOOP)
+        m_bls_cpu.miller_loop(p, q, f);
+      else
+        m_bls_cpu.ate_pairing(p, q, f);
+      bls_put_slots(inst.c, zcash_fpga::FE12, &f.dat[0][0], f.s_slots);
+      t = m_model.bls12_381_pairing_ns;
+      break;
+    }
+    case zcash_fpga::FINAL_EXP: {
+      // FE12 in slot a, result in b
+      bls12_381_fe12_t f;
+      bls_get_slots(inst.a, &f.dat[0][0], f.s_slots);
+      m_bls_cpu.final_exp(f, f);
+      bls_put_slots(inst.b, zcash_fpga::FE12, &f.dat[0][0], f.s_slots);
+      t = m_model.bls12_381_pairing_ns;
+      break;
+    }
+    default:
+      break;
+  }
+
+  BN_CTX_end(ctx);
+
+  // Control flow instructions leave the count of the last operation
+  if (inst.code >= zcash_fpga::SUB_ELEMENT) m_bls_cycles = t / s_clk_ns;
+  return t;
+}
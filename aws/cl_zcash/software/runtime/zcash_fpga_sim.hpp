@@ -0,0 +1,179 @@
+//
+//  ZCash FPGA library simulated device.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_SIM_H_   /* Include guard */
+#define ZCASH_FPGA_SIM_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <openssl/bn.h>
+
+#include "zcash_bls12_381_cpu.hpp"
+#include "zcash_equihash_cpu.hpp"
+#include "zcash_fpga_loopback.hpp"
+#include "zcash_secp256k1_ossl.hpp"
+
+/*
+ * Software model of the FPGA behind the AXI FIFO, for benchmarks and CI without an F1
+ * instance:
+ *
+ *   zcash_fpga zfpga(new zcash_fpga_sim(zcash_fpga::ENB_VERIFY_SECP256K1_SIG | zcash_fpga::ENB_BLS12_381));
+ *
+ * A device thread takes committed packets out of the transmit FIFO in order, each one
+ * once the engine for its command is free, and makes the reply visible in RDFO / RLR
+ * when its service time has passed and the receive FIFO has room. TDFV counts the
+ * packets still waiting, so a slow engine back-pressures the host like the FPGA does.
+ * A reply reaching the receive FIFO posts the NOTIFY_EVENTFD eventfd, like the receive
+ * complete interrupt would.
+ *
+ * VERIFY_SECP256K1_SIG is verified with OpenSSL and replies with the real bitmap, the
+ * result is cached so a benchmark resending one signature does not measure OpenSSL.
+ * VERIFY_EQUIHASH for (200,9) is checked with zcash_equihash_cpu and cached the same
+ * way, (144,5) is only timed and always passes. The BLS12_381 register map (config,
+ * instruction and data slots) is emulated and the program runs from the current
+ * instruction pointer until a NOOP_WAIT, including SEND_INTERRUPT replies. Element
+ * ops and POINT_MULT are computed, MILLER_LOOP / FINAL_EXP / ATE_PAIRING and FE12
+ * MUL_ELEMENT with zcash_bls12_381_cpu, so a pairing check fails like on the FPGA.
+ *
+ * All times are wall clock and every MMIO access busy-waits for its modelled cost, so
+ * host side overhead shows up as it would on hardware.
+ */
+class zcash_fpga_sim : public zcash_fpga_loopback {
+
+  public:
+    // Costs in ns. The defaults are estimates, measure the build being modelled (e.g.
+    // with bench_stream and bls12_381_get_last_cycle_cnt()) and override them.
+    typedef struct {
+      unsigned int tx_fifo_words;            // TDFV after reset, 32 bit words
+      unsigned int rx_fifo_words;            // Replies wait in the device while the receive FIFO is full
+      unsigned int mmio_read_ns;             // Each peek, and each word of read_data()
+      unsigned int mmio_write_ns;            // Each poke, and each word of write_data()
+      unsigned int wc_line_ns;               // Each 64 byte line of write_data_burst() on AXI4
+      unsigned int status_ns;                // FPGA_STATUS, RESET_FPGA and ignored commands
+      unsigned int secp256k1_ns;
+      unsigned int equihash_ns;
+      unsigned int bls12_381_ctl_ns;         // COPY_REG, JUMP*, SEND_INTERRUPT
+      unsigned int bls12_381_add_ns;         // ADD_ELEMENT / SUB_ELEMENT, doubled for Fp2
+      unsigned int bls12_381_mul_ns;         // MUL_ELEMENT, tripled for Fp2
+      unsigned int bls12_381_inv_ns;         // INV_ELEMENT, doubled for Fp2
+      unsigned int bls12_381_point_mult_ns;  // POINT_MULT on G1, tripled on G2
+      unsigned int bls12_381_pairing_ns;     // MILLER_LOOP, FINAL_EXP and ATE_PAIRING
+    } model_t;
+
+    static model_t default_model();
+
+    zcash_fpga_sim(uint64_t cmd_cap, const model_t& model = default_model(), bool axi4 = true);
+    ~zcash_fpga_sim();
+
+    int peek(uint64_t offset, uint32_t* value);
+    int poke(uint64_t offset, uint32_t value);
+    int write_regs(uint64_t offset, const uint32_t* data, unsigned int words);
+    int read_regs(uint64_t offset, uint32_t* data, unsigned int words);
+    int write_data(const uint8_t* data, unsigned int len);
+    int write_data_burst(const uint8_t* data, unsigned int len);
+    int read_data(uint8_t* data, unsigned int len);
+    int set_reply_fd(int fd);
+
+  protected:
+    void handle_packet(const uint8_t* data, unsigned int len);
+    void make_reply(const uint8_t* data, unsigned int len, std::vector<uint8_t>& rpl);
+    unsigned int tx_fifo_words() const;
+
+  private:
+    static const unsigned int s_bls_slots = 256;     // 1 << 8 instruction and data slots
+    static const unsigned int s_clk_ns = 8;          // 125 MHz interface clock, for cycle counts
+
+    // Engines that run one command at a time, the control path replies in order
+    enum { ENGINE_CTL = 0, ENGINE_SECP256K1 = 1, ENGINE_EQUIHASH = 2, ENGINE_NUM = 3 };
+
+    typedef struct {
+      std::vector<uint8_t> data;
+      unsigned int         words;  // Padded size held in the transmit FIFO
+    } cmd_t;
+
+    // An instruction whose result is written when its time is up
+    typedef struct {
+      bool                 busy;
+      uint64_t             done_ns;
+      unsigned int         next_pc;
+      std::vector<std::pair<unsigned int, std::vector<uint8_t> > > writes;  // Data slot, 48 bytes
+      std::vector<uint8_t> interrupt;                                       // Reply packet if any
+    } bls_exec_t;
+
+    model_t m_model;
+
+    std::mutex              m_mutex;
+    std::condition_variable m_cv;
+    std::thread             m_device;
+    bool                    m_stop;
+
+    std::deque<cmd_t>  m_cmds;          // Committed packets still in the transmit FIFO
+    unsigned int       m_cmd_words;
+    uint64_t           m_engine_free[ENGINE_NUM];
+    std::multimap<uint64_t, std::vector<uint8_t> > m_pending;  // Replies by ready time
+    bool               m_rx_blocked;
+
+    // BLS12_381 coprocessor
+    uint8_t      m_bls_inst[s_bls_slots][8];
+    uint8_t      m_bls_data[s_bls_slots][48];  // Point type in the top 3 bits of byte 47
+    unsigned int m_bls_pc;
+    int          m_bls_new_pc;                 // Written while an instruction was running
+    uint32_t     m_bls_cycles;
+    bool         m_bls_chain;                  // Next instruction starts when the last one finished
+    bls_exec_t   m_bls_exec;
+
+    // Only used by the device thread
+    zcash_secp256k1_ossl m_secp256k1;
+    std::unordered_map<std::string, uint8_t> m_secp256k1_bm;  // Bitmap by signature, without the index
+    zcash_equihash_cpu<200,9> m_equihash;
+    std::unordered_map<std::string, uint8_t> m_equihash_bm;   // Bitmap by header and solution
+    zcash_bls12_381_cpu  m_bls_cpu;
+    BN_CTX*              m_bn_ctx;
+    BIGNUM*              m_p;
+
+    void device_thread();
+    unsigned int engine(const cmd_t& cmd) const;
+    uint64_t service_ns(const cmd_t& cmd) const;
+    void deliver(uint64_t now);
+
+    bool is_bls(uint64_t offset) const;
+    void bls_peek(uint64_t offset, uint32_t* value);
+    void bls_poke(uint64_t offset, uint32_t value);
+    void bls_run(uint64_t now, uint64_t& next);
+    uint64_t bls_execute(const zcash_fpga::bls12_381_inst_t& inst);
+    void bls_commit();
+
+    zcash_fpga::point_type_t bls_type(unsigned int slot) const;
+    void bls_get(unsigned int slot, BIGNUM* bn) const;
+    void bls_put(unsigned int slot, zcash_fpga::point_type_t pt, const BIGNUM* bn);
+    void bls_get_slots(unsigned int slot, uint8_t* dat, unsigned int n) const;
+    void bls_put_slots(unsigned int slot, zcash_fpga::point_type_t pt, const uint8_t* dat, unsigned int n);
+
+}; // zcash_fpga_sim
+
+#endif // ZCASH_FPGA_SIM_H_
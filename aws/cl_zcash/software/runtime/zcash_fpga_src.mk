@@ -0,0 +1,28 @@
+# Runtime library sources, included by the Makefile and every makefile_* so a new module
+# is only listed once. sh_dpi_tasks.c comes from the SDK.
+
+LIB_SRC = zcash_fpga.cpp \
+          zcash_fpga_log.cpp \
+          zcash_fpga_async.cpp \
+          zcash_fpga_pool.cpp \
+          zcash_fpga_transport.cpp \
+          zcash_fpga_loopback.cpp \
+          zcash_fpga_sim.cpp \
+          zcash_secp256k1_ossl.cpp \
+          zcash_fpga_dispatch.cpp \
+          zcash_equihash_cpu.cpp \
+          zcash_bls12_381_cpu.cpp \
+          zcash_equihash_stream.cpp \
+          zcash_fpga_programs.cpp \
+          zcash_fpga_expr.cpp \
+          zcash_fpga_pairing.cpp \
+          zcash_fpga_bls_batch.cpp \
+          zcash_fpga_groth16.cpp \
+          zcash_fpga_msm.cpp \
+          zcash_fpga_sched.cpp \
+          zcash_fpga_results.cpp \
+          ${SDK_DIR}/userspace/utils/sh_dpi_tasks.c
+
+# Equihash test vectors shared with the RTL testbenches, as an absolute path so
+# test_zcash and bench_equihash find them from any working directory
+EQUIHASH_DATA_DIR := $(abspath $(dir $(lastword $(MAKEFILE_LIST)))../../../../zcash_fpga/src/data)/
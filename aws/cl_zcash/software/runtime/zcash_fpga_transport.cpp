@@ -0,0 +1,41 @@
+#include "zcash_fpga_transport.hpp"
+#include "zcash_fpga_log.hpp"
+
+#include <utils/lcd.h>
+
+zcash_fpga_transport* zcash_fpga_transport::open_pci(int slot_id) {
+  pci_bar_handle_t bar0 = PCI_BAR_HANDLE_INIT;
+  pci_bar_handle_t bar4 = PCI_BAR_HANDLE_INIT;
+  uint8_t* wc = nullptr;
+  uint32_t rdata;
+  int rc;
+
+  // We need to attach to the FPGA BAR0 (OCL) and BAR4 (PCIS)
+  rc = fpga_pci_attach(slot_id, FPGA_APP_PF, APP_PF_BAR0, 0, &bar0);
+  fail_on(rc, out, "ERROR: Unable to attach to the AFI BAR0 on slot id %d", slot_id);
+
+  rc = fpga_pci_attach(slot_id, FPGA_APP_PF, APP_PF_BAR4, BURST_CAPABLE, &bar4);
+  fail_on(rc, out, "ERROR: Unable to attach to the AFI BAR4 on slot id %d", slot_id);
+
+  // Check if we have AXI4 mode enabled or not
+  rc = fpga_pci_peek(bar0, AXI_FIFO_OFFSET + 0x44ULL, &rdata);
+  fail_on(rc, out, "ERROR: Unable to read from FPGA!");
+
+  if (((1U << 31) & rdata) == 0)
+    return new zcash_fpga_pci_transport<zcash_fpga_axil_stream>(bar0, bar4, nullptr);
+
+  // BAR4 is attached write-combined, so get the TDFD window address for burst writes
+  rc = fpga_pci_get_address(bar4, AXI4_TDFD_OFFSET, AXI4_FIFO_WINDOW, (void**)&wc);
+  if (rc) {
+    zlog_warn("Unable to map BAR4 TDFD window, write_stream_burst() will use write_stream()\n");
+    wc = nullptr;
+  }
+  return new zcash_fpga_pci_transport<zcash_fpga_axi4_stream>(bar0, bar4, wc);
+
+  out:
+    if (bar0 >= 0 && fpga_pci_detach(bar0) != 0)
+      zlog_error("Failure while detaching bar0 from the fpga.\n");
+    if (bar4 >= 0 && fpga_pci_detach(bar4) != 0)
+      zlog_error("Failure while detaching bar4 from the fpga.\n");
+    return nullptr;
+}
@@ -0,0 +1,246 @@
+//
+//  ZCash FPGA library transport layer.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_FPGA_TRANSPORT_H_   /* Include guard */
+#define ZCASH_FPGA_TRANSPORT_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <fpga_pci.h>
+
+#define AXI_FIFO_OFFSET       UINT64_C(0x0)
+
+// AXI FIFO data registers on the AXI-Lite (OCL BAR0) interface
+#define AXI_FIFO_TDFD_OFFSET  (AXI_FIFO_OFFSET + UINT64_C(0x10))
+#define AXI_FIFO_RDFD_OFFSET  (AXI_FIFO_OFFSET + UINT64_C(0x20))
+
+// AXI4 (PCIS on BAR4) data interface of the AXI FIFO, the address inside each window is ignored
+#define AXI4_TDFD_OFFSET      UINT64_C(0x0)
+#define AXI4_RDFD_OFFSET      UINT64_C(0x1000)
+#define AXI4_FIFO_WINDOW      UINT64_C(0x1000)
+
+/*
+ * All access zcash_fpga makes to the FPGA. Registers (AXI FIFO control, BLS12_381
+ * slots) are on the AXI-Lite interface, packet data goes through the AXI FIFO data
+ * registers of whichever interface the FIFO was built with. Calls are per register or
+ * per packet, never per word.
+ */
+class zcash_fpga_transport {
+
+  public:
+    virtual ~zcash_fpga_transport() {}
+
+    virtual int peek(uint64_t offset, uint32_t* value) = 0;
+    virtual int poke(uint64_t offset, uint32_t value) = 0;
+
+    /*
+     * Writes / reads words consecutive registers from offset, e.g. a BLS12_381 data slot.
+     * AXI-Lite only takes single word accesses, so this saves the call per word rather
+     * than MMIO transactions.
+     */
+    virtual int write_regs(uint64_t offset, const uint32_t* data, unsigned int words) {
+      for (unsigned int i = 0; i < words; i++)
+        if (poke(offset + 4*i, data[i]) != 0) return 1;
+      return 0;
+    }
+    virtual int read_regs(uint64_t offset, uint32_t* data, unsigned int words) {
+      for (unsigned int i = 0; i < words; i++)
+        if (peek(offset + 4*i, &data[i]) != 0) return 1;
+      return 0;
+    }
+
+    /*
+     * Writes len bytes of a packet to TDFD (rounded up to whole FIFO words), the caller
+     * commits it by writing TLR. write_data_burst() may use a write-combined mapping.
+     */
+    virtual int write_data(const uint8_t* data, unsigned int len) = 0;
+    virtual int write_data_burst(const uint8_t* data, unsigned int len) { return write_data(data, len); }
+
+    /*
+     * Reads exactly len bytes of the current receive packet from RDFD
+     */
+    virtual int read_data(uint8_t* data, unsigned int len) = 0;
+
+    /*
+     * True when the FIFO data path is AXI4 (64-bit words)
+     */
+    virtual bool axi4() const = 0;
+
+    /*
+     * A transport with no interrupt of its own (loopback, simulator) writes 1 to the
+     * eventfd fd each time it queues a reply in the receive FIFO, -1 stops it. Returns 1
+     * when the transport cannot, enable_reply_notify(NOTIFY_EVENTFD) then fails.
+     */
+    virtual int set_reply_fd(int fd) { (void)fd; return 1; }
+
+    /*
+     * Attaches to BAR0 and BAR4 of the slot and returns the PCI transport specialized for
+     * the FIFO's data interface, or nullptr on error.
+     */
+    static zcash_fpga_transport* open_pci(int slot_id);
+};
+
+/*
+ * Data path policies for zcash_fpga_pci_transport, selected once at attach so the word
+ * loops have no mode branch.
+ */
+struct zcash_fpga_axil_stream {
+  static const bool s_axi4 = false;
+
+  static inline int write(pci_bar_handle_t bar0, pci_bar_handle_t bar4, const uint8_t* data, unsigned int len) {
+    uint32_t word;
+    (void)bar4;
+    for (unsigned int i = 0; i < len; i += 4) {
+      word = 0;
+      memcpy(&word, &data[i], len - i < 4 ? len - i : 4);
+      if (fpga_pci_poke(bar0, AXI_FIFO_TDFD_OFFSET, word) != 0) return 1;
+    }
+    return 0;
+  }
+
+  static inline int read(pci_bar_handle_t bar0, pci_bar_handle_t bar4, uint8_t* data, unsigned int len) {
+    uint32_t word;
+    (void)bar4;
+    for (unsigned int i = 0; i < len; i += 4) {
+      if (fpga_pci_peek(bar0, AXI_FIFO_RDFD_OFFSET, &word) != 0) return 1;
+      memcpy(&data[i], &word, len - i < 4 ? len - i : 4);
+    }
+    return 0;
+  }
+};
+
+struct zcash_fpga_axi4_stream {
+  static const bool s_axi4 = true;
+
+  static inline int write(pci_bar_handle_t bar0, pci_bar_handle_t bar4, const uint8_t* data, unsigned int len) {
+    uint64_t word;
+    (void)bar0;
+    for (unsigned int i = 0; i < len; i += 8) {
+      word = 0;
+      memcpy(&word, &data[i], len - i < 8 ? len - i : 8);
+      if (fpga_pci_poke64(bar4, AXI4_TDFD_OFFSET, word) != 0) return 1;
+    }
+    return 0;
+  }
+
+  static inline int read(pci_bar_handle_t bar0, pci_bar_handle_t bar4, uint8_t* data, unsigned int len) {
+    uint64_t word;
+    (void)bar0;
+    for (unsigned int i = 0; i < len; i += 8) {
+      if (fpga_pci_peek64(bar4, AXI4_RDFD_OFFSET, &word) != 0) return 1;
+      memcpy(&data[i], &word, len - i < 8 ? len - i : 8);
+    }
+    return 0;
+  }
+};
+
+// Copy a packet into the write-combined TDFD window. The FIFO ignores the address inside the
+// window, so the WC buffers must reach it in order: each full 64 byte line is fenced before
+// the next is started, and the words of a partial line (which may be flushed as separate
+// writes) are fenced one by one. The last fence also posts the data before the TLR commit.
+// dst is the start of the window, so lines are 64 byte aligned.
+static inline void pcis_wc_copy(uint8_t* dst, const uint8_t* src, unsigned int len) {
+  unsigned int i = 0;
+  uint64_t tail;
+#if defined(__SSE2__) && defined(__x86_64__)
+  for (; i + 64 <= len; i += 64) {
+    _mm_stream_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+    _mm_stream_si128((__m128i*)(dst + i + 16), _mm_loadu_si128((const __m128i*)(src + i + 16)));
+    _mm_stream_si128((__m128i*)(dst + i + 32), _mm_loadu_si128((const __m128i*)(src + i + 32)));
+    _mm_stream_si128((__m128i*)(dst + i + 48), _mm_loadu_si128((const __m128i*)(src + i + 48)));
+    _mm_sfence();
+  }
+  for (; i < len; i += 8) {
+    tail = 0;
+    memcpy(&tail, &src[i], len - i < 8 ? len - i : 8);
+    _mm_stream_si64((long long*)(dst + i), (long long)tail);
+    _mm_sfence();
+  }
+#else
+  for (; i < len; i += 8) {
+    tail = 0;
+    memcpy(&tail, &src[i], len - i < 8 ? len - i : 8);
+    *(volatile uint64_t*)(dst + i) = tail;
+    __sync_synchronize();
+  }
+#endif
+}
+
+/*
+ * Transport over the AWS FPGA PCI library. Owns the BAR handles, wc is the write-combined
+ * mapping of the BAR4 TDFD window (nullptr if it could not be mapped).
+ */
+template <class stream_if>
+class zcash_fpga_pci_transport : public zcash_fpga_transport {
+
+  public:
+    zcash_fpga_pci_transport(pci_bar_handle_t bar0, pci_bar_handle_t bar4, uint8_t* wc) :
+      m_bar0(bar0), m_bar4(bar4), m_wc(wc) {}
+
+    ~zcash_fpga_pci_transport() {
+      fpga_pci_detach(m_bar0);
+      fpga_pci_detach(m_bar4);
+    }
+
+    int peek(uint64_t offset, uint32_t* value) { return fpga_pci_peek(m_bar0, offset, value); }
+    int poke(uint64_t offset, uint32_t value) { return fpga_pci_poke(m_bar0, offset, value); }
+
+    int write_regs(uint64_t offset, const uint32_t* data, unsigned int words) {
+      return fpga_pci_write_burst(m_bar0, offset, (uint32_t*)data, words);
+    }
+
+    // Loads straight from the BAR0 mapping, one bounds check for the range
+    int read_regs(uint64_t offset, uint32_t* data, unsigned int words) {
+      volatile uint32_t* regs;
+      if (fpga_pci_get_address(m_bar0, offset, words * 4, (void**)&regs) != 0)
+        return zcash_fpga_transport::read_regs(offset, data, words);
+      for (unsigned int i = 0; i < words; i++)
+        data[i] = regs[i];
+      return 0;
+    }
+
+    int write_data(const uint8_t* data, unsigned int len) {
+      return stream_if::write(m_bar0, m_bar4, data, len);
+    }
+
+    int write_data_burst(const uint8_t* data, unsigned int len) {
+      if (!stream_if::s_axi4 || m_wc == nullptr || len > AXI4_FIFO_WINDOW)
+        return stream_if::write(m_bar0, m_bar4, data, len);
+      pcis_wc_copy(m_wc, data, len);
+      return 0;
+    }
+
+    int read_data(uint8_t* data, unsigned int len) {
+      return stream_if::read(m_bar0, m_bar4, data, len);
+    }
+
+    bool axi4() const { return stream_if::s_axi4; }
+
+  private:
+    pci_bar_handle_t m_bar0;
+    pci_bar_handle_t m_bar4;
+    uint8_t*         m_wc;
+};
+
+#endif // ZCASH_FPGA_TRANSPORT_H_
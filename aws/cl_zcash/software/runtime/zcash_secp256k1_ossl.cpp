@@ -0,0 +1,79 @@
+#include "zcash_secp256k1_ossl.hpp"
+
+#include <stddef.h>
+
+#include <openssl/obj_mac.h>
+
+zcash_secp256k1_ossl::zcash_secp256k1_ossl() {
+  m_group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+  m_ctx = BN_CTX_new();
+  m_n = BN_new();
+  EC_GROUP_get_order(m_group, m_n, m_ctx);
+}
+
+zcash_secp256k1_ossl::~zcash_secp256k1_ossl() {
+  BN_free(m_n);
+  BN_CTX_free(m_ctx);
+  EC_GROUP_free(m_group);
+}
+
+// Fields of the command are 256 bit little endian integers
+#define SIG_FIELD(sig, f) ((const unsigned char*)&(sig) + offsetof(zcash_fpga::verify_secp256k1_sig_t, f))
+
+static inline BIGNUM* le256_to_bn(const unsigned char* v, BIGNUM* bn) {
+  return BN_lebin2bn(v, 32, bn);
+}
+
+uint8_t zcash_secp256k1_ossl::verify(const zcash_fpga::verify_secp256k1_sig_t& sig) {
+  uint8_t bm = 0;
+  EC_POINT* Q = EC_POINT_new(m_group);
+  EC_POINT* X = EC_POINT_new(m_group);
+
+  BN_CTX_start(m_ctx);
+  BIGNUM* r  = le256_to_bn(SIG_FIELD(sig, r), BN_CTX_get(m_ctx));
+  BIGNUM* s  = le256_to_bn(SIG_FIELD(sig, s), BN_CTX_get(m_ctx));
+  BIGNUM* e  = le256_to_bn(SIG_FIELD(sig, hash), BN_CTX_get(m_ctx));
+  BIGNUM* qx = le256_to_bn(SIG_FIELD(sig, Qx), BN_CTX_get(m_ctx));
+  BIGNUM* qy = le256_to_bn(SIG_FIELD(sig, Qy), BN_CTX_get(m_ctx));
+  BIGNUM* w  = BN_CTX_get(m_ctx);
+  BIGNUM* u1 = BN_CTX_get(m_ctx);
+  BIGNUM* u2 = BN_CTX_get(m_ctx);
+  BIGNUM* x  = BN_CTX_get(m_ctx);
+
+  if (Q == NULL || X == NULL || x == NULL) {
+    bm = FAILED_SIG_VER;
+    goto out;
+  }
+
+  // r and s must be in [1, n-1]
+  if (BN_is_zero(r) || BN_cmp(r, m_n) >= 0) bm |= OUT_OF_RANGE_R;
+  if (BN_is_zero(s) || BN_cmp(s, m_n) >= 0) bm |= OUT_OF_RANGE_S;
+  if (bm != 0) goto out;
+
+  // X = (e/s)G + (r/s)Q, valid if X.x == r mod n. A public key that is not on the curve
+  // can never verify.
+  if (EC_POINT_set_affine_coordinates(m_group, Q, qx, qy, m_ctx) != 1 ||
+      BN_mod_inverse(w, s, m_n, m_ctx) == NULL ||
+      BN_mod_mul(u1, e, w, m_n, m_ctx) != 1 ||
+      BN_mod_mul(u2, r, w, m_n, m_ctx) != 1 ||
+      EC_POINT_mul(m_group, X, u1, Q, u2, m_ctx) != 1) {
+    bm = FAILED_SIG_VER;
+    goto out;
+  }
+
+  if (EC_POINT_is_at_infinity(m_group, X)) {
+    bm = X_INFINITY_POINT;
+    goto out;
+  }
+
+  if (EC_POINT_get_affine_coordinates(m_group, X, x, NULL, m_ctx) != 1 ||
+      BN_nnmod(x, x, m_n, m_ctx) != 1 ||
+      BN_cmp(x, r) != 0)
+    bm = FAILED_SIG_VER;
+
+  out:
+    BN_CTX_end(m_ctx);
+    EC_POINT_free(X);
+    EC_POINT_free(Q);
+    return bm;
+}
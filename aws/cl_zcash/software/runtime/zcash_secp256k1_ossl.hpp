@@ -0,0 +1,63 @@
+//
+//  ZCash FPGA library secp256k1 signature verification on the CPU.
+//
+//  Copyright (C) 2019  Benjamin Devlin and Zcash Foundation
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+#ifndef ZCASH_SECP256K1_OSSL_H_   /* Include guard */
+#define ZCASH_SECP256K1_OSSL_H_
+
+#include <stdint.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+
+#include "zcash_fpga.hpp"
+
+/*
+ * Verifies a VERIFY_SECP256K1_SIG command with OpenSSL the same way the FPGA core does
+ * and returns the result bitmap of verify_secp256k1_sig_rpl_t, 0 when the signature is
+ * valid. The bits are those of secp256k1_ver_t in secp256k1_pkg.sv (LSB first), the
+ * enum in zcash_fpga.hpp lists the same flags in the opposite order.
+ *
+ * Holds its own BN_CTX so use one verifier per thread.
+ */
+class zcash_secp256k1_ossl {
+
+  public:
+    enum : uint8_t {
+      OUT_OF_RANGE_R   = 1 << 0,
+      OUT_OF_RANGE_S   = 1 << 1,
+      X_INFINITY_POINT = 1 << 2,
+      FAILED_SIG_VER   = 1 << 3,
+      TIMEOUT_FAIL     = 1 << 4
+    };
+
+    zcash_secp256k1_ossl();
+    ~zcash_secp256k1_ossl();
+    zcash_secp256k1_ossl(zcash_secp256k1_ossl const&) = delete;
+    void operator=(zcash_secp256k1_ossl const&) = delete;
+
+    uint8_t verify(const zcash_fpga::verify_secp256k1_sig_t& sig);
+
+  private:
+    EC_GROUP* m_group;
+    BN_CTX*   m_ctx;
+    BIGNUM*   m_n;
+
+}; // zcash_secp256k1_ossl
+
+#endif // ZCASH_SECP256K1_OSSL_H_